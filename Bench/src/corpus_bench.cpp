@@ -0,0 +1,136 @@
+#include "pch.h"
+#include "corpus_bench.h"
+#include "pe/portable_executable.h"
+#include "protector.h"
+#include "utils/file_io.h"
+#include "utils/stopwatch.h"
+#include "utils/string_utils.h"
+
+#include <Psapi.h>
+
+#pragma comment( lib, "psapi.lib" )
+
+namespace {
+
+std::vector<std::wstring> GetCorpusFiles( const std::wstring& directory ) {
+  std::vector<std::wstring> files;
+
+  WIN32_FIND_DATAW find_data;
+
+  const auto find_handle =
+      FindFirstFileW( ( directory + L"\\*" ).c_str(), &find_data );
+
+  if ( find_handle == INVALID_HANDLE_VALUE )
+    throw std::runtime_error( "Unable to open the corpus directory" );
+
+  do {
+    const std::wstring filename = find_data.cFileName;
+
+    const auto extension_position = filename.find_last_of( L'.' );
+
+    if ( extension_position == std::wstring::npos )
+      continue;
+
+    const auto extension = filename.substr( extension_position );
+
+    if ( _wcsicmp( extension.c_str(), L".exe" ) == 0 ||
+         _wcsicmp( extension.c_str(), L".dll" ) == 0 ) {
+      files.push_back( directory + L"\\" + filename );
+    }
+  } while ( FindNextFileW( find_handle, &find_data ) );
+
+  FindClose( find_handle );
+
+  std::sort( files.begin(), files.end() );
+
+  return files;
+}
+
+size_t GetPeakWorkingSetSize() {
+  PROCESS_MEMORY_COUNTERS memory_counters{};
+
+  GetProcessMemoryInfo( GetCurrentProcess(), &memory_counters,
+                        sizeof( memory_counters ) );
+
+  return memory_counters.PeakWorkingSetSize;
+}
+
+}  // namespace
+
+void corpus_bench::Run( const std::wstring& corpus_directory,
+                        const uint32_t iterations ) {
+  const auto files = GetCorpusFiles( corpus_directory );
+
+  // Read once like the batch mode does, it is not part of what we measure
+  const auto interpreter_pe = protector::ReadInterpreterPe();
+
+  printf( "%-32s %4s %10s %10s %10s %10s %10s\n", "file", "kind", "size kb",
+          "best ms", "mb/s", "virt", "peak mb" );
+
+  double total_milliseconds = 0;
+  uint64_t total_bytes = 0;
+
+  for ( const auto& file : files ) {
+    const fileio::MappedFile mapped_file( file );
+
+    const PeView pe_view( mapped_file.GetData(), mapped_file.GetSize() );
+
+    const auto filename = string_utils::WideToAnsi(
+        file.substr( file.find_last_of( L'\\' ) + 1 ) );
+
+    if ( !pe_view.IsValid() ) {
+      printf( "%-32s not a valid PE\n", filename.c_str() );
+      continue;
+    }
+
+    const auto characteristics =
+        pe_view.GetNtHeaders()->FileHeader.Characteristics;
+
+    const bool is_dll = ( characteristics & IMAGE_FILE_DLL ) != 0;
+
+    double best_milliseconds = 0;
+
+    ProtectionReport report;
+
+    try {
+      for ( uint32_t i = 0; i < iterations; ++i ) {
+        report = ProtectionReport();
+
+        Stopwatch stopwatch;
+        stopwatch.Start();
+
+        protector::Protect( pe::Open( pe_view ), interpreter_pe, {}, &report );
+
+        stopwatch.Stop();
+
+        const auto milliseconds = stopwatch.GetElapsedMilliseconds();
+
+        if ( i == 0 || milliseconds < best_milliseconds )
+          best_milliseconds = milliseconds;
+      }
+    } catch ( const std::exception& ex ) {
+      printf( "%-32s failed: %s\n", filename.c_str(), ex.what() );
+      continue;
+    }
+
+    const auto megabytes_per_second =
+        ( pe_view.GetSize() / ( 1024.0 * 1024.0 ) ) /
+        ( best_milliseconds / 1000.0 );
+
+    // The peak of the whole process, it only grows with the largest input
+    printf( "%-32s %4s %10.1f %10.1f %10.2f %10u %10.1f\n", filename.c_str(),
+            is_dll ? "dll" : "exe", pe_view.GetSize() / 1024.0,
+            best_milliseconds, megabytes_per_second,
+            report.virtualized_instruction_count,
+            GetPeakWorkingSetSize() / ( 1024.0 * 1024.0 ) );
+
+    total_milliseconds += best_milliseconds;
+    total_bytes += pe_view.GetSize();
+  }
+
+  if ( total_milliseconds > 0 ) {
+    printf( "total %.1f ms, %.2f mb/s\n", total_milliseconds,
+            ( total_bytes / ( 1024.0 * 1024.0 ) ) /
+                ( total_milliseconds / 1000.0 ) );
+  }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+namespace corpus_bench {
+
+// Protects every .exe and .dll of the directory one after another and prints
+// the time, the throughput and the peak memory of each. Nothing is written
+// to disk, only the protection itself is measured.
+void Run( const std::wstring& corpus_directory, const uint32_t iterations );
+
+}  // namespace corpus_bench
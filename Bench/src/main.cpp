@@ -0,0 +1,77 @@
+#include "pch.h"
+
+#include "corpus_bench.h"
+#include "opcode_bench.h"
+#include "thread_bench.h"
+
+#include "utils/console_log.h"
+#include "utils/random.h"
+
+#pragma comment( lib, "capstone.lib" )
+
+void PrintUsage() {
+  console::Print( "Bench.exe --corpus <directory> [--iterations N]" );
+  console::Print( "Bench.exe --opcodes [--iterations N]" );
+  console::Print( "Bench.exe --threads [--iterations N]" );
+}
+
+int main( int argc, char* argv[] ) {
+  try {
+    rng::Seed( static_cast<uint64_t>( time( 0 ) ) );
+
+    std::wstring corpus_directory;
+    std::wstring kernel_results_path;
+    std::wstring thread_results_path;
+    bool run_opcodes = false;
+    bool run_threads = false;
+
+    // Set once a mode is picked, the corpus defaults to a few runs and the
+    // kernels to enough calls for the rdtsc overhead to disappear
+    uint32_t iterations = 0;
+
+    for ( int i = 1; i < argc; ++i ) {
+      const std::string argument = argv[ i ];
+
+      if ( argument == "--corpus" && i + 1 < argc ) {
+        const std::string directory = argv[ ++i ];
+        corpus_directory = std::wstring( directory.begin(), directory.end() );
+      } else if ( argument == "--opcodes" ) {
+        run_opcodes = true;
+      } else if ( argument == "--threads" ) {
+        run_threads = true;
+      } else if ( argument == "--run-threads" && i + 1 < argc ) {
+        const std::string results_path = argv[ ++i ];
+        thread_results_path =
+            std::wstring( results_path.begin(), results_path.end() );
+      } else if ( argument == "--run-kernels" && i + 1 < argc ) {
+        const std::string results_path = argv[ ++i ];
+        kernel_results_path =
+            std::wstring( results_path.begin(), results_path.end() );
+      } else if ( argument == "--iterations" && i + 1 < argc ) {
+        iterations = static_cast<uint32_t>( std::stoul( argv[ ++i ] ) );
+      }
+    }
+
+    if ( !kernel_results_path.empty() ) {
+      opcode_bench::RunKernels( kernel_results_path,
+                                iterations ? iterations : 100000 );
+    } else if ( !thread_results_path.empty() ) {
+      thread_bench::RunThreads( thread_results_path,
+                                iterations ? iterations : 2000 );
+    } else if ( run_opcodes ) {
+      opcode_bench::Run( iterations ? iterations : 100000 );
+    } else if ( run_threads ) {
+      thread_bench::Run( iterations ? iterations : 2000 );
+    } else if ( !corpus_directory.empty() ) {
+      corpus_bench::Run( corpus_directory, iterations ? iterations : 3 );
+    } else {
+      PrintUsage();
+      return 1;
+    }
+  } catch ( const std::exception& ex ) {
+    console::Print( ex.what() );
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,144 @@
+#include "pch.h"
+#include "opcode_bench.h"
+#include "opcode_kernels.h"
+#include "protected_copy.h"
+#include "opcode_cost_table.h"
+
+#include <intrin.h>
+
+namespace {
+
+constexpr uint32_t kRepetitions = 7;
+
+// The best of a few repetitions in cycles per call, the best one has the
+// least noise from interrupts and the scheduler
+std::vector<double> MeasureKernels( const uint32_t iterations ) {
+  std::vector<double> cycles_per_call;
+
+  BenchData data{};
+
+  for ( const auto& kernel : opcode_kernels::GetKernels() ) {
+    uint64_t best_cycles = ULLONG_MAX;
+
+    for ( uint32_t repetition = 0; repetition < kRepetitions; ++repetition ) {
+      uintptr_t value = repetition;
+
+      const auto begin = __rdtsc();
+
+      for ( uint32_t i = 0; i < iterations; ++i )
+        value += kernel.kernel( &data, value );
+
+      const auto elapsed = __rdtsc() - begin;
+
+      // Keep the result alive so the loop is not thrown away
+      data.values[ 0 ] ^= value;
+
+      best_cycles = ( std::min )( best_cycles, elapsed );
+    }
+
+    cycles_per_call.push_back( static_cast<double>( best_cycles ) /
+                               iterations );
+  }
+
+  return cycles_per_call;
+}
+
+void WritePolicy( const std::wstring& policy_path ) {
+  std::ofstream policy_file( policy_path );
+
+  if ( !policy_file )
+    throw std::runtime_error( "Unable to write the bench policy" );
+
+  policy_file << "default exclude\n";
+  policy_file << "include rva 0x" << std::hex
+              << opcode_kernels::GetKernelsBeginRva() << "-0x"
+              << opcode_kernels::GetKernelsEndRva() << "\n";
+}
+
+std::vector<double> ReadResults( const std::wstring& results_path ) {
+  std::ifstream results_file( results_path );
+
+  if ( !results_file )
+    throw std::runtime_error( "Unable to read the protected bench results" );
+
+  std::vector<double> cycles_per_call;
+
+  double cycles = 0;
+
+  while ( results_file >> cycles )
+    cycles_per_call.push_back( cycles );
+
+  if ( cycles_per_call.size() != opcode_kernels::GetKernels().size() )
+    throw std::runtime_error( "The protected bench results are incomplete" );
+
+  return cycles_per_call;
+}
+
+}  // namespace
+
+void opcode_bench::Run( const uint32_t iterations ) {
+  const auto native_cycles = MeasureKernels( iterations );
+
+  const auto directory = protected_copy::GetOwnDirectory();
+
+  const auto policy_path = directory + L"bench.policy";
+  const auto protected_filename = directory + L"Bench Protected.exe";
+  const auto results_path = directory + L"bench_results.txt";
+
+  WritePolicy( policy_path );
+
+  protector::ProtectorOptions options;
+  options.policy_path = policy_path;
+
+  protected_copy::Write( protected_filename, options );
+
+  protected_copy::Run( protected_filename,
+                       L"--run-kernels \"" + results_path +
+                           L"\" --iterations " +
+                           std::to_wstring( iterations ) );
+
+  const auto virtualized_cycles = ReadResults( results_path );
+
+  printf( "%-26s %12s %12s %10s\n", "kernel", "native", "virtualized",
+          "ratio" );
+
+  const auto& kernels = opcode_kernels::GetKernels();
+
+  opcode_cost_table::CostTable cost_table;
+
+  for ( size_t i = 0; i < kernels.size(); ++i ) {
+    // The empty kernel is the cost of the call, it is taken off the others
+    const auto native = native_cycles[ i ] - ( i ? native_cycles[ 0 ] : 0 );
+    const auto virtualized =
+        virtualized_cycles[ i ] - ( i ? virtualized_cycles[ 0 ] : 0 );
+
+    printf( "%-26s %12.1f %12.1f %10.1f\n", kernels[ i ].name,
+            native_cycles[ i ], virtualized_cycles[ i ],
+            native > 0 ? virtualized / native : 0.0 );
+
+    const auto vm_opcode = static_cast<uint32_t>( kernels[ i ].vm_opcode );
+
+    if ( kernels[ i ].vm_opcode != VmOpcodes::NO_OPCODE ) {
+      cost_table.opcode_cycles[ vm_opcode ] =
+          ( std::max )( virtualized - native, 0.0 );
+    }
+  }
+
+  const auto cost_table_path = directory + L"opcode_costs.txt";
+
+  if ( !opcode_cost_table::Write( cost_table_path, cost_table ) )
+    throw std::runtime_error( "Unable to write the opcode cost table" );
+}
+
+void opcode_bench::RunKernels( const std::wstring& results_path,
+                               const uint32_t iterations ) {
+  const auto cycles_per_call = MeasureKernels( iterations );
+
+  std::ofstream results_file( results_path );
+
+  if ( !results_file )
+    throw std::runtime_error( "Unable to write the bench results" );
+
+  for ( const auto cycles : cycles_per_call )
+    results_file << cycles << "\n";
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+namespace opcode_bench {
+
+// Measures the kernels natively, then protects a copy of this executable with
+// only the kernels virtualized and runs it to measure them again. Prints the
+// cycles per call of both and the slowdown of each handler. The difference is
+// written to opcode_costs.txt for the dry run of the protector.
+void Run( const uint32_t iterations );
+
+// What the protected copy runs, writes one line of cycles per kernel
+void RunKernels( const std::wstring& results_path, const uint32_t iterations );
+
+}  // namespace opcode_bench
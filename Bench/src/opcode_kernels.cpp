@@ -0,0 +1,138 @@
+#include "pch.h"
+#include "opcode_kernels.h"
+
+namespace {
+
+volatile uintptr_t bench_global_value = 0x1000;
+
+}  // namespace
+
+// The linker sorts the .text$ groups by name and merges them into .text, the
+// kernels always end up between the two markers
+#pragma code_seg( ".text$bench_a" )
+
+__declspec( noinline ) void KernelsBegin() {
+  bench_global_value = 0;
+}
+
+#pragma code_seg( ".text$bench_b" )
+
+__declspec( noinline ) uintptr_t Empty( BenchData*, uintptr_t value ) {
+  return value;
+}
+
+// mov eax, imm
+__declspec( noinline ) uintptr_t MovRegisterImmediate( BenchData*,
+                                                       uintptr_t ) {
+  return 0x7F3A19C4;
+}
+
+// mov eax, dword ptr [imm] on x86, rip relative on x64
+__declspec( noinline ) uintptr_t MovRegisterMemoryImmediate( BenchData*,
+                                                             uintptr_t ) {
+  return bench_global_value;
+}
+
+// mov eax, dword ptr [ecx + 0x8]
+__declspec( noinline ) uintptr_t MovRegisterMemoryRegOffset( BenchData* data,
+                                                             uintptr_t ) {
+  return data->values[ 2 ];
+}
+
+// mov dword ptr [ecx + 0x4], edx
+__declspec( noinline ) uintptr_t MovMemoryRegOffsetReg( BenchData* data,
+                                                        uintptr_t value ) {
+  data->values[ 1 ] = value;
+  return 0;
+}
+
+// mov dword ptr [ecx + 0xc], imm
+__declspec( noinline ) uintptr_t MovMemoryRegOffsetImm( BenchData* data,
+                                                        uintptr_t ) {
+  data->values[ 3 ] = 0x1234;
+  return 0;
+}
+
+// xor eax, imm
+__declspec( noinline ) uintptr_t AluRegisterImmediate( BenchData*,
+                                                       uintptr_t value ) {
+  return value ^ 0x5A5A5A5A;
+}
+
+// add eax, dword ptr [ecx]
+__declspec( noinline ) uintptr_t AluRegisterMemoryRegOffset( BenchData* data,
+                                                             uintptr_t value ) {
+  return value + data->values[ 0 ];
+}
+
+// sub dword ptr [ecx + 0x4], edx
+__declspec( noinline ) uintptr_t AluMemoryRegOffsetReg( BenchData* data,
+                                                        uintptr_t value ) {
+  data->values[ 1 ] -= value;
+  return 0;
+}
+
+// cmp dword ptr [ecx + 0x8], 0 and a jcc on it
+__declspec( noinline ) uintptr_t AluMemoryRegOffsetImmJcc( BenchData* data,
+                                                           uintptr_t ) {
+  if ( data->values[ 2 ] == 0 )
+    return 1;
+
+  return 2;
+}
+
+__declspec( noinline ) uintptr_t Callee( uintptr_t value ) {
+  return value + 1;
+}
+
+// push imm and call imm on x86, a mov and call imm on x64
+__declspec( noinline ) uintptr_t CallImmediate( BenchData*, uintptr_t ) {
+  return Callee( 0x40 );
+}
+
+#pragma code_seg( ".text$bench_c" )
+
+__declspec( noinline ) void KernelsEnd() {
+  bench_global_value = 1;
+}
+
+#pragma code_seg()
+
+const std::vector<OpcodeKernel>& opcode_kernels::GetKernels() {
+  static const std::vector<OpcodeKernel> kernels = {
+      { "empty", Empty, VmOpcodes::NO_OPCODE },
+      { "mov reg, imm", MovRegisterImmediate,
+        VmOpcodes::MOV_REGISTER_IMMEDIATE },
+      { "mov reg, [imm]", MovRegisterMemoryImmediate,
+        VmOpcodes::MOV_REGISTER_MEMORY_IMMEDIATE },
+      { "mov reg, [reg+off]", MovRegisterMemoryRegOffset,
+        VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET },
+      { "mov [reg+off], reg", MovMemoryRegOffsetReg,
+        VmOpcodes::MOV_MEMORY_REG_OFFSET_REG },
+      { "mov [reg+off], imm", MovMemoryRegOffsetImm,
+        VmOpcodes::MOV_MEMORY_REG_OFFSET_IMM },
+      { "alu reg, imm", AluRegisterImmediate,
+        VmOpcodes::ALU_REGISTER_IMMEDIATE },
+      { "alu reg, [reg+off]", AluRegisterMemoryRegOffset,
+        VmOpcodes::ALU_REGISTER_MEMORY_REG_OFFSET },
+      { "alu [reg+off], reg", AluMemoryRegOffsetReg,
+        VmOpcodes::ALU_MEMORY_REG_OFFSET_REG },
+      // The cmp is in the same block, the entry is only paid once
+      { "cmp [reg+off], imm; jcc", AluMemoryRegOffsetImmJcc,
+        VmOpcodes::JCC_IMM },
+      { "call imm", CallImmediate, VmOpcodes::CALL_IMMEDIATE } };
+
+  return kernels;
+}
+
+uint32_t opcode_kernels::GetKernelsBeginRva() {
+  return static_cast<uint32_t>( reinterpret_cast<uintptr_t>( KernelsBegin ) -
+                                reinterpret_cast<uintptr_t>(
+                                    GetModuleHandleW( nullptr ) ) );
+}
+
+uint32_t opcode_kernels::GetKernelsEndRva() {
+  return static_cast<uint32_t>( reinterpret_cast<uintptr_t>( KernelsEnd ) -
+                                reinterpret_cast<uintptr_t>(
+                                    GetModuleHandleW( nullptr ) ) );
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "../../Interpreter/src/main.h"
+
+struct BenchData {
+  uintptr_t values[ 4 ];
+};
+
+using tOpcodeKernel = uintptr_t ( * )( BenchData* data, uintptr_t value );
+
+// Each kernel is written so that the compiler emits the instruction form of a
+// VmOpcodes handler, the log of the protector shows what it actually became
+struct OpcodeKernel {
+  const char* name;
+  tOpcodeKernel kernel;
+
+  // The site that the cost of the kernel is calibrated for, NO_OPCODE for
+  // the empty one
+  VmOpcodes vm_opcode;
+};
+
+namespace opcode_kernels {
+
+// The first one is empty, it is the cost of the call itself
+const std::vector<OpcodeKernel>& GetKernels();
+
+// All of the kernels are in between, the protected bench only virtualizes
+// that range. Only valid in a build without incremental linking, otherwise
+// the function addresses are the ones of the thunks.
+uint32_t GetKernelsBeginRva();
+uint32_t GetKernelsEndRva();
+
+}  // namespace opcode_kernels
@@ -0,0 +1,56 @@
+#include "pch.h"
+#include "protected_copy.h"
+#include "pe/portable_executable.h"
+#include "utils/file_io.h"
+
+std::wstring protected_copy::GetOwnFilename() {
+  wchar_t filename[ MAX_PATH ];
+
+  if ( GetModuleFileNameW( nullptr, filename, MAX_PATH ) == 0 )
+    throw std::runtime_error( "Unable to get the filename of the bench" );
+
+  return filename;
+}
+
+std::wstring protected_copy::GetOwnDirectory() {
+  const auto own_filename = GetOwnFilename();
+
+  return own_filename.substr( 0, own_filename.find_last_of( L'\\' ) + 1 );
+}
+
+void protected_copy::Write( const std::wstring& filename,
+                            const protector::ProtectorOptions& options ) {
+  const fileio::MappedFile own_file( GetOwnFilename() );
+
+  auto protected_pe = protector::Protect(
+      pe::Open( PeView( own_file.GetData(), own_file.GetSize() ) ), options );
+
+  if ( !fileio::WriteFileData( filename, protected_pe.GetPeData() ) )
+    throw std::runtime_error( "Unable to write the protected bench" );
+}
+
+void protected_copy::Run( const std::wstring& filename,
+                          const std::wstring& arguments ) {
+  std::wstring command_line = L"\"" + filename + L"\" " + arguments;
+
+  STARTUPINFOW startup_info{};
+  startup_info.cb = sizeof( startup_info );
+
+  PROCESS_INFORMATION process_info{};
+
+  if ( !CreateProcessW( nullptr, &command_line[ 0 ], nullptr, nullptr, FALSE,
+                        0, nullptr, nullptr, &startup_info, &process_info ) ) {
+    throw std::runtime_error( "Unable to start the protected bench" );
+  }
+
+  WaitForSingleObject( process_info.hProcess, INFINITE );
+
+  DWORD exit_code = 0;
+  GetExitCodeProcess( process_info.hProcess, &exit_code );
+
+  CloseHandle( process_info.hThread );
+  CloseHandle( process_info.hProcess );
+
+  if ( exit_code != 0 )
+    throw std::runtime_error( "The protected bench did not exit cleanly" );
+}
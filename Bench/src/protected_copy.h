@@ -0,0 +1,21 @@
+#pragma once
+
+#include "protector.h"
+
+// The benches that compare the native run of this executable to a run of a
+// protected copy of itself
+namespace protected_copy {
+
+std::wstring GetOwnFilename();
+
+// The directory of this executable including the trailing backslash
+std::wstring GetOwnDirectory();
+
+// Protects this executable with the options and writes it to filename
+void Write( const std::wstring& filename,
+            const protector::ProtectorOptions& options );
+
+// Runs the protected copy with the arguments and waits for it to exit
+void Run( const std::wstring& filename, const std::wstring& arguments );
+
+}  // namespace protected_copy
@@ -0,0 +1,105 @@
+#include "pch.h"
+#include "thread_bench.h"
+#include "protected_copy.h"
+
+namespace {
+
+constexpr uint32_t kRepetitions = 5;
+
+DWORD WINAPI EmptyThread( LPVOID ) {
+  return 0;
+}
+
+// The best of a few repetitions in microseconds per thread, each thread is
+// waited for before the next one is created so only one is alive at a time
+double MeasureThreads( const uint32_t iterations ) {
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency( &frequency );
+
+  double best_microseconds = 0;
+
+  for ( uint32_t repetition = 0; repetition < kRepetitions; ++repetition ) {
+    LARGE_INTEGER begin;
+    QueryPerformanceCounter( &begin );
+
+    for ( uint32_t i = 0; i < iterations; ++i ) {
+      const auto thread_handle =
+          CreateThread( nullptr, 0, EmptyThread, nullptr, 0, nullptr );
+
+      if ( !thread_handle )
+        throw std::runtime_error( "Unable to create a bench thread" );
+
+      WaitForSingleObject( thread_handle, INFINITE );
+      CloseHandle( thread_handle );
+    }
+
+    LARGE_INTEGER end;
+    QueryPerformanceCounter( &end );
+
+    const auto microseconds =
+        static_cast<double>( end.QuadPart - begin.QuadPart ) * 1000000.0 /
+        frequency.QuadPart / iterations;
+
+    if ( repetition == 0 || microseconds < best_microseconds )
+      best_microseconds = microseconds;
+  }
+
+  return best_microseconds;
+}
+
+}  // namespace
+
+void thread_bench::Run( const uint32_t iterations ) {
+  const auto native_microseconds = MeasureThreads( iterations );
+
+  const auto directory = protected_copy::GetOwnDirectory();
+
+  const auto policy_path = directory + L"thread_bench.policy";
+  const auto protected_filename = directory + L"Bench Protected Threads.exe";
+  const auto results_path = directory + L"thread_bench_results.txt";
+
+  {
+    std::ofstream policy_file( policy_path );
+
+    if ( !policy_file )
+      throw std::runtime_error( "Unable to write the bench policy" );
+
+    // Only the thread events are measured, not the virtualized code
+    policy_file << "default exclude\n";
+  }
+
+  protector::ProtectorOptions options;
+  options.policy_path = policy_path;
+
+  protected_copy::Write( protected_filename, options );
+
+  protected_copy::Run( protected_filename,
+                       L"--run-threads \"" + results_path +
+                           L"\" --iterations " +
+                           std::to_wstring( iterations ) );
+
+  std::ifstream results_file( results_path );
+
+  double protected_microseconds = 0;
+
+  if ( !( results_file >> protected_microseconds ) )
+    throw std::runtime_error( "Unable to read the protected bench results" );
+
+  printf( "%-12s %14s\n", "", "us per thread" );
+  printf( "%-12s %14.2f\n", "native", native_microseconds );
+  printf( "%-12s %14.2f\n", "protected", protected_microseconds );
+  printf( "%-12s %14.2f\n", "overhead",
+          protected_microseconds - native_microseconds );
+}
+
+void thread_bench::RunThreads( const std::wstring& results_path,
+                               const uint32_t iterations ) {
+  const auto microseconds = MeasureThreads( iterations );
+
+  std::ofstream results_file( results_path );
+
+  if ( !results_file )
+    throw std::runtime_error( "Unable to write the bench results" );
+
+  results_file << microseconds << "\n";
+}
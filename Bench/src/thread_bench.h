@@ -0,0 +1,13 @@
+#pragma once
+
+namespace thread_bench {
+
+// Measures creating and exiting threads natively, then in a protected copy of
+// this executable where every thread event goes through the TLS callbacks of
+// the interpreter. Nothing of the bench itself is virtualized.
+void Run( const uint32_t iterations );
+
+// What the protected copy runs, writes the microseconds per thread
+void RunThreads( const std::wstring& results_path, const uint32_t iterations );
+
+}  // namespace thread_bench
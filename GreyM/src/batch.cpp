@@ -0,0 +1,330 @@
+#include "pch.h"
+#include "batch.h"
+#include "pe/portable_executable.h"
+#include "utils/file_io.h"
+#include "utils/file_log.h"
+#include "utils/stopwatch.h"
+#include "utils/string_utils.h"
+#include "utils/random.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+struct BatchFileResult {
+  bool succeeded = false;
+  std::string error;
+  double elapsed_milliseconds = 0;
+
+  // The estimate of a dry run, printed on the line of the file
+  std::string cost_estimate;
+};
+
+bool IsDirectory( const std::wstring& path ) {
+  const auto attributes = GetFileAttributesW( path.c_str() );
+
+  return attributes != INVALID_FILE_ATTRIBUTES &&
+         ( attributes & FILE_ATTRIBUTE_DIRECTORY );
+}
+
+std::wstring GetFileName( const std::wstring& path ) {
+  const auto separator = path.find_last_of( L"\\/" );
+
+  if ( separator == std::wstring::npos )
+    return path;
+
+  return path.substr( separator + 1 );
+}
+
+bool HasExtension( const std::wstring& filename,
+                   const std::wstring& extension ) {
+  if ( filename.size() < extension.size() )
+    return false;
+
+  return _wcsicmp( filename.c_str() + filename.size() - extension.size(),
+                   extension.c_str() ) == 0;
+}
+
+std::vector<std::wstring> GetInputFiles( const std::wstring& input_path ) {
+  std::vector<std::wstring> input_files;
+
+  if ( IsDirectory( input_path ) ) {
+    WIN32_FIND_DATAW find_data;
+
+    const auto find_handle =
+        FindFirstFileW( ( input_path + L"\\*" ).c_str(), &find_data );
+
+    if ( find_handle == INVALID_HANDLE_VALUE )
+      return input_files;
+
+    do {
+      if ( find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+        continue;
+
+      const std::wstring filename = find_data.cFileName;
+
+      if ( HasExtension( filename, L".exe" ) ||
+           HasExtension( filename, L".dll" ) ) {
+        input_files.push_back( input_path + L"\\" + filename );
+      }
+    } while ( FindNextFileW( find_handle, &find_data ) );
+
+    FindClose( find_handle );
+
+    // The directory order is up to the file system
+    std::sort( input_files.begin(), input_files.end() );
+
+    return input_files;
+  }
+
+  std::wifstream input_list( input_path );
+
+  if ( !input_list.is_open() ) {
+    throw std::runtime_error( "Unable to open the input list " +
+                              string_utils::WideToAnsi( input_path ) );
+  }
+
+  std::wstring line;
+
+  while ( std::getline( input_list, line ) ) {
+    // Lists written on windows end their lines with \r\n
+    if ( !line.empty() && line.back() == L'\r' )
+      line.pop_back();
+
+    if ( !line.empty() )
+      input_files.push_back( line );
+  }
+
+  return input_files;
+}
+
+// The outputs, reports, caches and site tables of a file are named after it,
+// two inputs with the same name would overwrite each other's
+void CheckUniqueFileNames( const std::vector<std::wstring>& input_files ) {
+  // first: the lowercase file name, second: the input that has it
+  std::unordered_map<std::wstring, std::wstring> input_file_names;
+
+  for ( const auto& input_file : input_files ) {
+    auto filename = GetFileName( input_file );
+
+    // The file system does not care about the case
+    std::transform( filename.begin(), filename.end(), filename.begin(),
+                    []( const wchar_t c ) {
+                      return static_cast<wchar_t>( towlower( c ) );
+                    } );
+
+    const auto inserted = input_file_names.emplace( filename, input_file );
+
+    if ( !inserted.second ) {
+      throw std::runtime_error(
+          "The inputs " + string_utils::WideToAnsi( inserted.first->second ) +
+          " and " + string_utils::WideToAnsi( input_file ) +
+          " have the same file name" );
+    }
+  }
+}
+
+// One line for the result of the file, the sections grow by the bytes
+std::string FormatCostEstimate(
+    const ProtectionReport::CostEstimate& cost_estimate ) {
+  const auto growth = cost_estimate.vm_loader_section_growth +
+                      cost_estimate.virtualized_code_section_growth +
+                      cost_estimate.vm_bytecode_section_growth +
+                      cost_estimate.profile_section_growth +
+                      cost_estimate.reloc_section_growth;
+
+  double cycles_per_execution = 0;
+
+  for ( const auto& site : cost_estimate.sites )
+    cycles_per_execution += site.cycles_per_execution;
+
+  char cost_estimate_text[ 128 ];
+
+  if ( cost_estimate.calibrated ) {
+    sprintf_s( cost_estimate_text, "%u sites, +%I64u bytes, %.1f cycles",
+               static_cast<uint32_t>( cost_estimate.sites.size() ), growth,
+               cycles_per_execution );
+  } else {
+    sprintf_s( cost_estimate_text, "%u sites, +%I64u bytes",
+               static_cast<uint32_t>( cost_estimate.sites.size() ), growth );
+  }
+
+  return cost_estimate_text;
+}
+
+// Returns the estimate of a dry run, empty otherwise
+std::string ProtectFile(
+    const std::wstring& input_file,
+    const batch::BatchOptions& batch_options,
+    const PortableExecutable& interpreter_pe,
+    const protector::ProtectorOptions& protector_options ) {
+  const auto filename = GetFileName( input_file );
+
+  auto file_options = protector_options;
+
+  if ( !protector_options.analysis_cache_path.empty() ) {
+    file_options.analysis_cache_path =
+        protector_options.analysis_cache_path + L"\\" + filename + L".analysis";
+  }
+
+  if ( !protector_options.telemetry_site_table_path.empty() ) {
+    file_options.telemetry_site_table_path =
+        protector_options.telemetry_site_table_path + L"\\" + filename +
+        L".sites";
+  }
+
+  const fileio::MappedFile input_mapped_file( input_file );
+
+  const PeView input_view( input_mapped_file.GetData(),
+                           input_mapped_file.GetSize() );
+
+  if ( !input_view.IsValid() )
+    throw std::runtime_error( "The PE is not valid" );
+
+  const bool wants_report = !batch_options.report_directory.empty();
+
+  ProtectionReport report;
+
+  // The estimate of a dry run is printed and written to the report
+  const auto protected_pe = protector::Protect(
+      pe::Open( input_view ), interpreter_pe, file_options,
+      wants_report || file_options.dry_run ? &report : nullptr );
+
+  bool written = file_options.dry_run;
+
+  if ( !file_options.dry_run ) {
+    ScopedReportPhase phase( wants_report ? &report : nullptr, "write_out" );
+    written = fileio::WriteFileData(
+        batch_options.output_directory + L"\\" + filename,
+        protected_pe.GetPeData() );
+  }
+
+  if ( !written )
+    throw std::runtime_error( "Unable to write the output file" );
+
+  if ( wants_report &&
+       !protection_report::WriteJson(
+           batch_options.report_directory + L"\\" + filename + L".json",
+           report ) ) {
+    throw std::runtime_error( "Unable to write the report" );
+  }
+
+  return file_options.dry_run ? FormatCostEstimate( report.cost_estimate )
+                              : std::string();
+}
+
+}  // namespace
+
+uint32_t batch::Run( const BatchOptions& batch_options,
+                     const protector::ProtectorOptions& protector_options ) {
+  const auto input_files = GetInputFiles( batch_options.input_path );
+
+  CheckUniqueFileNames( input_files );
+
+  if ( !IsDirectory( batch_options.output_directory ) &&
+       !CreateDirectoryW( batch_options.output_directory.c_str(), NULL ) ) {
+    throw std::runtime_error(
+        "Unable to create the output directory " +
+        string_utils::WideToAnsi( batch_options.output_directory ) );
+  }
+
+  if ( !batch_options.report_directory.empty() &&
+       !IsDirectory( batch_options.report_directory ) &&
+       !CreateDirectoryW( batch_options.report_directory.c_str(), NULL ) ) {
+    throw std::runtime_error(
+        "Unable to create the report directory " +
+        string_utils::WideToAnsi( batch_options.report_directory ) );
+  }
+
+  // Read once, each file gets a copy relocated to its own image base
+  const auto interpreter_pe = protector::ReadInterpreterPe();
+
+  uint32_t worker_count = batch_options.worker_count;
+
+  if ( worker_count == 0 )
+    worker_count = std::thread::hardware_concurrency();
+
+  // hardware_concurrency is allowed to return 0 if it does not know
+  worker_count = ( std::max )( worker_count, 1u );
+  worker_count = ( std::min )( worker_count,
+                               static_cast<uint32_t>( input_files.size() ) );
+
+  std::vector<BatchFileResult> results( input_files.size() );
+
+  std::atomic<size_t> next_file_index = 0;
+
+  std::mutex print_mutex;
+
+  std::vector<std::thread> workers;
+
+  // Drawn from the --seed of the main thread
+  const auto base_seed = rng::NextU64();
+
+  for ( uint32_t i = 0; i < worker_count; ++i ) {
+    workers.emplace_back( [&]() {
+      for ( ;; ) {
+        const auto file_index = next_file_index++;
+
+        if ( file_index >= input_files.size() )
+          break;
+
+        const auto& input_file = input_files[ file_index ];
+        auto& result = results[ file_index ];
+
+        // Seeded for each file instead of each worker, which worker takes a
+        // file is up to the scheduling
+        rng::Seed( rng::DeriveSeed( base_seed, file_index ) );
+
+        Stopwatch stopwatch;
+        stopwatch.Start();
+
+        try {
+          result.cost_estimate = ProtectFile( input_file, batch_options,
+                                              interpreter_pe,
+                                              protector_options );
+
+          result.succeeded = true;
+        } catch ( const std::exception& ex ) {
+          result.error = ex.what();
+        } catch ( ... ) {
+          result.error = "Unknown error";
+        }
+
+        stopwatch.Stop();
+
+        result.elapsed_milliseconds = stopwatch.GetElapsedMilliseconds();
+
+        std::lock_guard<std::mutex> lock( print_mutex );
+
+        printf( "[%s] %s %.1f ms %s%s\n", result.succeeded ? " OK " : "FAIL",
+                string_utils::WideToAnsi( input_file ).c_str(),
+                result.elapsed_milliseconds, result.error.c_str(),
+                result.cost_estimate.c_str() );
+      }
+    } );
+  }
+
+  for ( auto& worker : workers )
+    worker.join();
+
+  uint32_t failed_count = 0;
+  double total_milliseconds = 0;
+
+  for ( const auto& result : results ) {
+    if ( !result.succeeded )
+      ++failed_count;
+
+    total_milliseconds += result.elapsed_milliseconds;
+  }
+
+  printf( "Protected %u of %u files, %.1f ms spent in total\n",
+          static_cast<uint32_t>( input_files.size() ) - failed_count,
+          static_cast<uint32_t>( input_files.size() ), total_milliseconds );
+
+  // The log is written in the background, the process exits right after
+  file_log::Flush();
+
+  return failed_count;
+}
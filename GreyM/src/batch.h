@@ -0,0 +1,31 @@
+#pragma once
+
+#include "protector.h"
+
+namespace batch {
+
+struct BatchOptions {
+  // A directory whose .exe and .dll files are protected, or a text file with
+  // a path on each line
+  std::wstring input_path;
+  std::wstring output_directory;
+
+  // 0 uses a worker for each core
+  uint32_t worker_count = 0;
+
+  // Gets a <filename>.json protection report for each file if set
+  std::wstring report_directory;
+};
+
+// Protects every input file on a pool of workers and prints a line with the
+// result and the time for each of them. The interpreter is only read once.
+// In batch mode the analysis cache and telemetry site table paths of the
+// protector options are directories, each file gets its own in there. The
+// files are named after the input, so two inputs with the same file name are
+// rejected before anything is protected. Every file is seeded from the seed
+// and its index in the inputs, any worker count gives the same output files.
+// Returns the number of files that failed.
+uint32_t Run( const BatchOptions& batch_options,
+              const protector::ProtectorOptions& protector_options );
+
+}  // namespace batch
@@ -0,0 +1,132 @@
+#include "pch.h"
+#include "analysis_cache.h"
+#include "../utils/file_io.h"
+
+namespace {
+
+// A cache of the x86 build is no use to the x64 one and the other way around
+#ifdef _WIN64
+constexpr uint32_t kAnalysisCacheMagic = 0x3436414D;  // "MA64"
+#else
+constexpr uint32_t kAnalysisCacheMagic = 0x3233414D;  // "MA32"
+#endif
+
+// Bump it when the disassembler finds something different for the same image
+constexpr uint32_t kAnalysisCacheVersion = 1;
+
+struct AnalysisCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t image_hash;
+  uint32_t instruction_count;
+  uint32_t data_range_count;
+};
+
+// The instructions are stored without the padding of CachedInstruction
+constexpr size_t kCachedInstructionSize =
+    sizeof( uint32_t ) + sizeof( uint8_t );
+
+template <typename T>
+void AppendValue( std::vector<uint8_t>* buf, const T& value ) {
+  const auto value_ptr = reinterpret_cast<const uint8_t*>( &value );
+  buf->insert( buf->end(), value_ptr, value_ptr + sizeof( T ) );
+}
+
+template <typename T>
+T ReadValue( const uint8_t* data ) {
+  T value;
+  memcpy( &value, data, sizeof( T ) );
+  return value;
+}
+
+}  // namespace
+
+uint64_t analysis_cache::HashImage( const uint8_t* data, const size_t size ) {
+  uint64_t hash = 0xCBF29CE484222325;
+
+  for ( size_t i = 0; i < size; ++i ) {
+    hash ^= data[ i ];
+    hash *= 0x100000001B3;
+  }
+
+  return hash;
+}
+
+bool analysis_cache::Read( const std::wstring& filename,
+                           const uint64_t image_hash,
+                           AnalysisCache* cache ) {
+  // The first run has no cache yet, that is not an error
+  if ( GetFileAttributesW( filename.c_str() ) == INVALID_FILE_ATTRIBUTES )
+    return false;
+
+  const auto cache_data = fileio::ReadBinaryFile( filename );
+
+  if ( cache_data.size() < sizeof( AnalysisCacheHeader ) )
+    return false;
+
+  const auto header = ReadValue<AnalysisCacheHeader>( cache_data.data() );
+
+  if ( header.magic != kAnalysisCacheMagic ||
+       header.version != kAnalysisCacheVersion ||
+       header.image_hash != image_hash )
+    return false;
+
+  const size_t expected_size =
+      sizeof( AnalysisCacheHeader ) +
+      header.instruction_count * kCachedInstructionSize +
+      header.data_range_count * sizeof( CachedDataRange );
+
+  if ( cache_data.size() != expected_size )
+    throw std::runtime_error( "The analysis cache is corrupt" );
+
+  const uint8_t* data = cache_data.data() + sizeof( AnalysisCacheHeader );
+
+  cache->image_hash = header.image_hash;
+
+  cache->instructions.resize( header.instruction_count );
+
+  for ( auto& instruction : cache->instructions ) {
+    instruction.rva = ReadValue<uint32_t>( data );
+    instruction.size = ReadValue<uint8_t>( data + sizeof( uint32_t ) );
+
+    data += kCachedInstructionSize;
+  }
+
+  cache->data_ranges.resize( header.data_range_count );
+
+  for ( auto& data_range : cache->data_ranges ) {
+    data_range = ReadValue<CachedDataRange>( data );
+
+    data += sizeof( CachedDataRange );
+  }
+
+  return true;
+}
+
+bool analysis_cache::Write( const std::wstring& filename,
+                            const AnalysisCache& cache ) {
+  AnalysisCacheHeader header;
+  header.magic = kAnalysisCacheMagic;
+  header.version = kAnalysisCacheVersion;
+  header.image_hash = cache.image_hash;
+  header.instruction_count = static_cast<uint32_t>( cache.instructions.size() );
+  header.data_range_count = static_cast<uint32_t>( cache.data_ranges.size() );
+
+  std::vector<uint8_t> cache_data;
+
+  cache_data.reserve( sizeof( AnalysisCacheHeader ) +
+                      cache.instructions.size() * kCachedInstructionSize +
+                      cache.data_ranges.size() * sizeof( CachedDataRange ) );
+
+  AppendValue( &cache_data, header );
+
+  for ( const auto& instruction : cache.instructions ) {
+    AppendValue( &cache_data, instruction.rva );
+    AppendValue( &cache_data, instruction.size );
+  }
+
+  for ( const auto& data_range : cache.data_ranges )
+    AppendValue( &cache_data, data_range );
+
+  return fileio::WriteFileData( filename, cache_data );
+}
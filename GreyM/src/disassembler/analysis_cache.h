@@ -0,0 +1,37 @@
+#pragma once
+
+struct CachedInstruction {
+  uint32_t rva;
+  uint8_t size;
+};
+
+struct CachedDataRange {
+  uint32_t begin_rva;
+  uint32_t end_rva;
+};
+
+// What the disassembler found out about an image. Protecting the same image
+// again with another seed or policy can skip the disassembly with it.
+struct AnalysisCache {
+  uint64_t image_hash = 0;
+
+  // Sorted by the rva, the instructions inside of the data ranges such as
+  // jump tables are already left out
+  std::vector<CachedInstruction> instructions;
+  std::vector<CachedDataRange> data_ranges;
+};
+
+namespace analysis_cache {
+
+// FNV-1a over the whole image
+uint64_t HashImage( const uint8_t* data, const size_t size );
+
+// Returns false if there is no cache, or if it was made for another image or
+// by another version of the cache format
+bool Read( const std::wstring& filename,
+           const uint64_t image_hash,
+           AnalysisCache* cache );
+
+bool Write( const std::wstring& filename, const AnalysisCache& cache );
+
+}  // namespace analysis_cache
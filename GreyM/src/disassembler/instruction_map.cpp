@@ -0,0 +1,50 @@
+#include "pch.h"
+#include "instruction_map.h"
+
+bool AddressBitmap::Insert( const uintptr_t address ) {
+  if ( !IsWithinRange( address ) )
+    return outside_addresses_.insert( address ).second;
+
+  const auto offset = address - begin_address_;
+
+  if ( bits_[ offset ] )
+    return false;
+
+  bits_[ offset ] = true;
+
+  return true;
+}
+
+bool AddressBitmap::Contains( const uintptr_t address ) const {
+  if ( !IsWithinRange( address ) )
+    return outside_addresses_.find( address ) != outside_addresses_.end();
+
+  return bits_[ address - begin_address_ ];
+}
+
+void InstructionMap::Insert( const uintptr_t address,
+                             const SmallInstructionData& data ) {
+  const bool is_within_range =
+      address >= begin_address_ &&
+      address - begin_address_ < instruction_sizes_.size();
+
+  if ( !is_within_range ) {
+    outside_instructions_.insert( std::make_pair( address, data ) );
+    return;
+  }
+
+  instruction_sizes_[ address - begin_address_ ] =
+      static_cast<uint8_t>( data.instruction_size_ );
+}
+
+bool InstructionMap::Contains( const uintptr_t address ) const {
+  const bool is_within_range =
+      address >= begin_address_ &&
+      address - begin_address_ < instruction_sizes_.size();
+
+  if ( !is_within_range )
+    return outside_instructions_.find( address ) !=
+           outside_instructions_.end();
+
+  return instruction_sizes_[ address - begin_address_ ] != 0;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+struct SmallInstructionData {
+ public:
+  SmallInstructionData( uint16_t instruction_size, const uint8_t* code )
+      : instruction_size_( instruction_size ), code_ptr_( code ) {}
+
+  uint16_t instruction_size_;
+  const uint8_t* code_ptr_;
+};
+
+// A set of addresses, one bit for each address of the range it was sized to.
+// Addresses outside of the range are kept in a regular set, those are rare
+// since the range is the .text section.
+class AddressBitmap {
+ public:
+  AddressBitmap() : begin_address_( 0 ) {}
+  AddressBitmap( const uintptr_t begin_address, const size_t size )
+      : begin_address_( begin_address ), bits_( size, false ) {}
+
+  // Returns false if the address was already in the set
+  bool Insert( const uintptr_t address );
+
+  bool Contains( const uintptr_t address ) const;
+
+ private:
+  bool IsWithinRange( const uintptr_t address ) const {
+    return address >= begin_address_ &&
+           address - begin_address_ < bits_.size();
+  }
+
+  uintptr_t begin_address_;
+  std::vector<bool> bits_;
+
+  std::unordered_set<uintptr_t> outside_addresses_;
+};
+
+// The disassembled instructions, the instruction size is stored for each
+// offset of the section and 0 means no instruction starts there. The code of an
+// instruction is found through the offset, so it is not stored either.
+class InstructionMap {
+ public:
+  InstructionMap() : begin_address_( 0 ), begin_code_( nullptr ) {}
+  InstructionMap( const uintptr_t begin_address,
+                  const size_t size,
+                  const uint8_t* begin_code )
+      : begin_address_( begin_address ),
+        begin_code_( begin_code ),
+        instruction_sizes_( size, 0 ) {}
+
+  void Insert( const uintptr_t address, const SmallInstructionData& data );
+
+  bool Contains( const uintptr_t address ) const;
+
+  // TFunc: void callback(const uintptr_t address,
+  //                      const SmallInstructionData& data)
+  // Called for every instruction that starts within [begin_address,
+  // end_address), in order of the address within the range
+  template <typename TFunc>
+  void EachInstructionStartingWithin( const uintptr_t begin_address,
+                                      const uintptr_t end_address,
+                                      const TFunc& callback ) const;
+
+ private:
+  uintptr_t begin_address_;
+  const uint8_t* begin_code_;
+
+  // x86 instructions are at most 15 bytes, a byte is plenty
+  std::vector<uint8_t> instruction_sizes_;
+
+  std::unordered_map<uintptr_t, SmallInstructionData> outside_instructions_;
+};
+
+template <typename TFunc>
+void InstructionMap::EachInstructionStartingWithin(
+    const uintptr_t begin_address,
+    const uintptr_t end_address,
+    const TFunc& callback ) const {
+  const uintptr_t range_end_address =
+      begin_address_ + instruction_sizes_.size();
+
+  for ( auto address = ( std::max )( begin_address, begin_address_ );
+        address < ( std::min )( end_address, range_end_address ); ++address ) {
+    const auto offset = address - begin_address_;
+    const auto instruction_size = instruction_sizes_[ offset ];
+
+    if ( instruction_size != 0 ) {
+      const SmallInstructionData ins_data( instruction_size,
+                                           begin_code_ + offset );
+
+      callback( address, ins_data );
+    }
+  }
+
+  // Those are only outside of the .text section, there are never many
+  for ( const auto& instruction : outside_instructions_ ) {
+    if ( instruction.first >= begin_address &&
+         instruction.first < end_address ) {
+      callback( instruction.first, instruction.second );
+    }
+  }
+}
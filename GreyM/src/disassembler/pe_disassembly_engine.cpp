@@ -1,8 +1,268 @@
 #include "pch.h"
 #include "pe_disassembly_engine.h"
+#include "../pe/peutils.h"
 #include "../utils/defer.h"
 
-PeDisassemblyEngine::PeDisassemblyEngine( const PortableExecutable pe )
+#include <atomic>
+#include <deque>
+#include <emmintrin.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+constexpr size_t kAddressSetShardCount = 64;
+
+// An address set split into shards with a lock each, the workers are rarely
+// on the same shard at the same time
+class ConcurrentAddressSet {
+ public:
+  // Returns false if the address was already in the set
+  bool Insert( const uint64_t address ) {
+    auto& shard = shards_[ address % kAddressSetShardCount ];
+
+    std::lock_guard<std::mutex> lock( shard.mutex );
+
+    return shard.addresses.insert( address ).second;
+  }
+
+ private:
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_set<uint64_t> addresses;
+  };
+
+  std::array<Shard, kAddressSetShardCount> shards_;
+};
+
+// The instructions ParseInstruction needs the detail of to know where to go
+// next, it looks at the movs and pushes for pointers to functions as well
+bool IsTraversalInstruction( const unsigned int instruction_id ) {
+  switch ( instruction_id ) {
+    case x86_insn::X86_INS_JAE:
+    case x86_insn::X86_INS_JA:
+    case x86_insn::X86_INS_JBE:
+    case x86_insn::X86_INS_JB:
+    case x86_insn::X86_INS_JCXZ:
+    case x86_insn::X86_INS_JECXZ:
+    case x86_insn::X86_INS_JE:
+    case x86_insn::X86_INS_JGE:
+    case x86_insn::X86_INS_JG:
+    case x86_insn::X86_INS_JLE:
+    case x86_insn::X86_INS_JL:
+    case x86_insn::X86_INS_JNE:
+    case x86_insn::X86_INS_JNO:
+    case x86_insn::X86_INS_JNP:
+    case x86_insn::X86_INS_JNS:
+    case x86_insn::X86_INS_JO:
+    case x86_insn::X86_INS_JP:
+    case x86_insn::X86_INS_JRCXZ:
+    case x86_insn::X86_INS_JS:
+    case x86_insn::X86_INS_JMP:
+    case x86_insn::X86_INS_LJMP:
+    case x86_insn::X86_INS_LOOP:
+    case x86_insn::X86_INS_LOOPE:
+    case x86_insn::X86_INS_LOOPNE:
+    case x86_insn::X86_INS_CALL:
+    case x86_insn::X86_INS_LCALL:
+    case x86_insn::X86_INS_RET:
+    case x86_insn::X86_INS_RETF:
+    case x86_insn::X86_INS_RETFQ:
+    case x86_insn::X86_INS_IRET:
+    case x86_insn::X86_INS_IRETD:
+    case x86_insn::X86_INS_IRETQ:
+    case x86_insn::X86_INS_INT:
+    case x86_insn::X86_INS_INT1:
+    case x86_insn::X86_INS_INT3:
+    case x86_insn::X86_INS_INTO:
+    case x86_insn::X86_INS_SYSCALL:
+    case x86_insn::X86_INS_SYSENTER:
+    case x86_insn::X86_INS_MOV:
+    case x86_insn::X86_INS_PUSH:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Collects the offset into the range of every pointer sized value that points
+// into it. SSE2 throws out 16 bytes of values at a time without a branch,
+// most of .rdata is strings and constants.
+std::vector<uint32_t> GetPointersIntoRange( const uint8_t* data,
+                                            const size_t size,
+                                            const uintptr_t range_begin,
+                                            const uint32_t range_size ) {
+  std::vector<uint32_t> offsets;
+
+  size_t i = 0;
+
+  // The compare is signed, flipping the sign bit of both sides makes it an
+  // unsigned one
+  const auto sign_bit = _mm_set1_epi32( static_cast<int>( 0x80000000 ) );
+  const auto biased_range_size =
+      _mm_set1_epi32( static_cast<int>( range_size ^ 0x80000000 ) );
+
+#ifdef _WIN64
+  const auto begin = _mm_set1_epi64x( static_cast<int64_t>( range_begin ) );
+#else
+  const auto begin = _mm_set1_epi32( static_cast<int>( range_begin ) );
+#endif
+
+  for ( ; i + sizeof( __m128i ) <= size; i += sizeof( __m128i ) ) {
+    const auto values =
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( data + i ) );
+
+#ifdef _WIN64
+    const auto value_offsets = _mm_sub_epi64( values, begin );
+#else
+    const auto value_offsets = _mm_sub_epi32( values, begin );
+#endif
+
+    const auto low_within = _mm_cmplt_epi32(
+        _mm_xor_si128( value_offsets, sign_bit ), biased_range_size );
+
+    int mask = _mm_movemask_ps( _mm_castsi128_ps( low_within ) );
+
+#ifdef _WIN64
+    // A 64 bit offset is only within if the high half is zero as well, the
+    // mask keeps a bit for the low half of each value
+    const auto high_zero =
+        _mm_cmpeq_epi32( value_offsets, _mm_setzero_si128() );
+
+    mask &= ( _mm_movemask_ps( _mm_castsi128_ps( high_zero ) ) >> 1 ) & 0x5;
+#endif
+
+    if ( mask == 0 )
+      continue;
+
+    for ( size_t j = 0; j < sizeof( __m128i ); j += sizeof( uintptr_t ) ) {
+      if ( mask & ( 1 << ( j / sizeof( uint32_t ) ) ) ) {
+        offsets.push_back( static_cast<uint32_t>(
+            *reinterpret_cast<const uintptr_t*>( data + i + j ) -
+            range_begin ) );
+      }
+    }
+  }
+
+  for ( ; i + sizeof( uintptr_t ) <= size; i += sizeof( uintptr_t ) ) {
+    const auto value_offset =
+        *reinterpret_cast<const uintptr_t*>( data + i ) - range_begin;
+
+    if ( value_offset < range_size )
+      offsets.push_back( static_cast<uint32_t>( value_offset ) );
+  }
+
+  return offsets;
+}
+
+// The functions of .pdata that are within the section, sorted by their begin
+std::vector<AddressRange> GetExceptionDirectoryFunctions(
+    const PeView& pe,
+    const SectionHeaders& section_headers,
+    const IMAGE_SECTION_HEADER& text_section_header ) {
+  std::vector<AddressRange> functions;
+
+#ifdef _WIN64
+  const auto& exception_directory =
+      pe.GetNtHeaders()
+          ->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXCEPTION ];
+
+  if ( exception_directory.VirtualAddress == 0 ||
+       exception_directory.Size == 0 ) {
+    return functions;
+  }
+
+  const auto exception_directory_offset =
+      section_headers.RvaToFileOffset( exception_directory.VirtualAddress );
+
+  if ( exception_directory_offset == 0 ||
+       exception_directory_offset + exception_directory.Size > pe.GetSize() ) {
+    return functions;
+  }
+
+  const auto runtime_functions =
+      reinterpret_cast<const IMAGE_RUNTIME_FUNCTION_ENTRY*>(
+          pe.GetPeImagePtr() + exception_directory_offset );
+
+  const auto runtime_function_count =
+      exception_directory.Size / sizeof( IMAGE_RUNTIME_FUNCTION_ENTRY );
+
+  functions.reserve( runtime_function_count );
+
+  for ( size_t i = 0; i < runtime_function_count; ++i ) {
+    const auto& runtime_function = runtime_functions[ i ];
+
+    if ( runtime_function.BeginAddress >= runtime_function.EndAddress ||
+         !section::IsRvaWithinSection( text_section_header,
+                                       runtime_function.BeginAddress ) ) {
+      continue;
+    }
+
+    AddressRange function;
+    function.begin_address = runtime_function.BeginAddress;
+    function.end_address = runtime_function.EndAddress;
+
+    functions.push_back( function );
+  }
+
+  // The loader requires it sorted already, do not count on it
+  std::sort( functions.begin(), functions.end(),
+             []( const AddressRange& lhs, const AddressRange& rhs ) {
+               return lhs.begin_address < rhs.begin_address;
+             } );
+#endif
+
+  return functions;
+}
+
+}  // namespace
+
+struct ParallelDisassemblyState {
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<DisassemblyPoint> disassembly_points;
+  };
+
+  ParallelDisassemblyState( const uint32_t worker_count )
+      : work_queues( worker_count ) {}
+
+  // One per worker, the owner works on the back and the others steal from
+  // the front
+  std::vector<WorkQueue> work_queues;
+
+  ConcurrentAddressSet disassembly_points_cache;
+  ConcurrentAddressSet disassembled_instructions;
+
+  // Disassembly points that were added but not finished by a worker yet, the
+  // disassembly is done once it reaches 0
+  std::atomic<uint64_t> pending_disassembly_point_count = 0;
+
+  // Set when a worker threw, the others stop at their next point
+  std::atomic<bool> aborted = false;
+};
+
+PeDisassemblyEngine::PeDisassemblyEngine( const PeView& pe )
+    : PeDisassemblyEngine( pe, nullptr, 0 ) {
+  const auto text_section_begin_address =
+      pe_text_section_header_->VirtualAddress;
+  const auto text_section_size = pe_text_section_header_->SizeOfRawData;
+
+  disassembly_points_cache_ =
+      AddressBitmap( text_section_begin_address, text_section_size );
+
+  disassembled_instructions_ = InstructionMap(
+      text_section_begin_address, text_section_size,
+      pe_.GetPeImagePtr() + pe_text_section_header_->PointerToRawData );
+
+  invalidated_instructions_ =
+      AddressBitmap( text_section_begin_address, text_section_size );
+}
+
+PeDisassemblyEngine::PeDisassemblyEngine(
+    const PeView& pe,
+    ParallelDisassemblyState* parallel_state,
+    const uint32_t worker_index )
     : pe_( pe ),
       disassembler_handle_( 0 ),
       code_( 0 ),
@@ -12,7 +272,25 @@ PeDisassemblyEngine::PeDisassemblyEngine( const PortableExecutable pe )
       address_( 0 ),
       pe_section_headers_( pe_.GetSectionHeaders() ),
       pe_text_section_header_( pe_section_headers_.FromName( ".text" ) ),
-      pe_image_base_( pe_.GetNtHeaders()->OptionalHeader.ImageBase ) {
+      pe_image_base_( pe_.GetNtHeaders()->OptionalHeader.ImageBase ),
+      pe_entrypoint_rva_(
+          pe_.GetNtHeaders()->OptionalHeader.AddressOfEntryPoint ),
+      pe_tls_callback_list_( pe_.GetTlsCallbacklist() ),
+      parallel_state_( parallel_state ),
+      worker_index_( worker_index ),
+      has_parallel_disassembly_point_( false ),
+      seed_from_exception_directory_( false ),
+      lightweight_disassembler_handle_( 0 ),
+      instruction_needs_detail_( nullptr ),
+      sweep_end_rva_( UINTPTR_MAX ),
+      invalid_instruction_callback_( nullptr ),
+      callback_data_( nullptr ) {
+  // The code is read straight out of the view
+  peutils::CheckSectionRawData( *pe_text_section_header_, pe_.GetSize() );
+
+  exception_directory_functions_ = GetExceptionDirectoryFunctions(
+      pe_, pe_section_headers_, *pe_text_section_header_ );
+
 #ifdef _WIN64
   const cs_mode mode = cs_mode::CS_MODE_64;
 #else
@@ -33,6 +311,61 @@ PeDisassemblyEngine::PeDisassemblyEngine( const PortableExecutable pe )
     throw std::runtime_error( "cs_option failed with error code " +
                               std::to_string( cs_status ) );
   }
+
+  // Detail is off by default
+  const cs_err lightweight_cs_status =
+      cs_open( CS_ARCH_X86, mode, &lightweight_disassembler_handle_ );
+
+  if ( lightweight_cs_status != cs_err::CS_ERR_OK ) {
+    cs_close( &disassembler_handle_ );
+    throw std::runtime_error( "cs_open failed with error code " +
+                              std::to_string( lightweight_cs_status ) );
+  }
+}
+
+PeDisassemblyEngine::~PeDisassemblyEngine() {
+  cs_close( &disassembler_handle_ );
+  cs_close( &lightweight_disassembler_handle_ );
+}
+
+void PeDisassemblyEngine::SetTwoTierDecoding(
+    const tInstructionNeedsDetail& instruction_needs_detail ) {
+  instruction_needs_detail_ = instruction_needs_detail;
+}
+
+const cs_insn* PeDisassemblyEngine::DecodeInstruction(
+    const uint8_t** code,
+    size_t* code_size,
+    uint64_t* address,
+    cs_insn* instruction_buffer,
+    cs_insn* lightweight_instruction_buffer ) {
+  if ( instruction_needs_detail_ ) {
+    const auto instruction_code = *code;
+    const auto instruction_code_size = *code_size;
+    const auto instruction_address = *address;
+
+    if ( !cs_disasm_iter( lightweight_disassembler_handle_, code, code_size,
+                          address, lightweight_instruction_buffer ) ) {
+      return nullptr;
+    }
+
+    const auto id = lightweight_instruction_buffer->id;
+
+    if ( !IsTraversalInstruction( id ) && !instruction_needs_detail_( id ) )
+      return lightweight_instruction_buffer;
+
+    // Decode it again from the same place, this time with the detail
+    *code = instruction_code;
+    *code_size = instruction_code_size;
+    *address = instruction_address;
+  }
+
+  if ( !cs_disasm_iter( disassembler_handle_, code, code_size, address,
+                        instruction_buffer ) ) {
+    return nullptr;
+  }
+
+  return instruction_buffer;
 }
 
 void PeDisassemblyEngine::DisassembleFromEntrypoint(
@@ -40,8 +373,7 @@ void PeDisassemblyEngine::DisassembleFromEntrypoint(
     const tDisassemblingInvalidInstructionCallback&
         invalid_instruction_callback,
     void* data ) {
-  const auto entrypoint_rva =
-      pe_.GetNtHeaders()->OptionalHeader.AddressOfEntryPoint;
+  const auto entrypoint_rva = pe_entrypoint_rva_;
   const auto entrypoint_offset =
       pe_section_headers_.RvaToFileOffset( entrypoint_rva );
 
@@ -55,6 +387,9 @@ void PeDisassemblyEngine::DisassembleFromEntrypoint(
 
   ParseTlsCallbacks();
 
+  if ( seed_from_exception_directory_ )
+    ParseExceptionDirectory();
+
   BeginDisassembling( disassembly_callback, invalid_instruction_callback,
                       data );
 }
@@ -65,6 +400,12 @@ void PeDisassemblyEngine::SetDisassemblyPoint(
   code_ = disasm_point.code;
   address_ = disasm_point.rva;
   code_buf_size_ = disasm_buffer_size;
+
+  UpdateSweepEnd();
+}
+
+void PeDisassemblyEngine::SetSeedFromExceptionDirectory( const bool seed ) {
+  seed_from_exception_directory_ = seed;
 }
 
 bool IsGuaranteedJump( const cs_insn& instruction ) {
@@ -329,30 +670,127 @@ void PeDisassemblyEngine::ParseJumpTable( const cs_insn& instruction,
 
   jump_table_address_range.end_address = operand_rva + i;
 
-  data_ranges_.push_back( jump_table_address_range );
+  data_ranges_.Insert( jump_table_address_range );
+
+  // switch tables can be read in the wrong order, meaning we may already have
+  // disassembled the data part of the jump table before knowing it is one
+  InvalidateInstructionsWithin( jump_table_address_range );
+}
+
+void AddressRangeSet::Insert( const AddressRange& range ) {
+  if ( range.begin_address >= range.end_address )
+    return;
+
+  auto begin_address = range.begin_address;
+  auto end_address = range.end_address;
+
+  // The first range that could touch the new one is the one before it
+  auto it = ranges_.upper_bound( begin_address );
+
+  if ( it != ranges_.begin() && std::prev( it )->second >= begin_address )
+    --it;
+
+  // Swallow every range that overlaps or touches the new one
+  while ( it != ranges_.end() && it->first <= end_address ) {
+    begin_address = ( std::min )( begin_address, it->first );
+    end_address = ( std::max )( end_address, it->second );
+    it = ranges_.erase( it );
+  }
+
+  ranges_.emplace( begin_address, end_address );
+}
+
+void AddressRangeSet::Insert( const AddressRangeSet& ranges ) {
+  for ( const auto& range : ranges.ranges_ )
+    Insert( AddressRange{ range.first, range.second } );
+}
+
+bool AddressRangeSet::Contains( const uint64_t address ) const {
+  return Overlaps( address, address + 1 );
+}
+
+bool AddressRangeSet::Overlaps( const uint64_t begin_address,
+                                const uint64_t end_address ) const {
+  // The last range that begins before the end
+  auto it = ranges_.lower_bound( static_cast<uintptr_t>( end_address ) );
+
+  if ( it == ranges_.begin() )
+    return false;
+
+  --it;
+
+  return it->second > begin_address;
+}
+
+std::vector<AddressRange> AddressRangeSet::GetRanges() const {
+  std::vector<AddressRange> ranges;
+
+  ranges.reserve( ranges_.size() );
+
+  for ( const auto& range : ranges_ )
+    ranges.push_back( AddressRange{ range.first, range.second } );
+
+  return ranges;
 }
 
 // checks if the current address that is being disassembled is within a part
 // of data within the code section, example a jump table
 bool PeDisassemblyEngine::IsAddressWithinDataSectionOfCode(
-    const uint64_t address ) {
-  for ( const auto& range : data_ranges_ ) {
-    // if the current address is within a data section of the .text
-    // section example a jump table
-    if ( address >= range.begin_address && address < range.end_address ) {
+    const uint64_t address ) const {
+  return data_ranges_.Contains( address );
+}
+
+void PeDisassemblyEngine::InvalidateInstructionsWithin(
+    const AddressRange& range ) {
+  // the workers of a parallel disassembly filter at the end instead
+  if ( !invalid_instruction_callback_ )
+    return;
+
+  // x86 instructions are at most 15 bytes, nothing starting before that can
+  // reach into the range
+  constexpr uintptr_t kMaxInstructionSize = 15;
+
+  const auto search_begin_address =
+      range.begin_address > kMaxInstructionSize
+          ? range.begin_address - kMaxInstructionSize
+          : 0;
+
+  disassembled_instructions_.EachInstructionStartingWithin(
+      search_begin_address, range.end_address,
+      [&]( const uintptr_t address, const SmallInstructionData& ins_data ) {
+        if ( address + ins_data.instruction_size_ <= range.begin_address )
+          return;
+
+        if ( !invalidated_instructions_.Insert( address ) )
+          return;
+
+        invalid_instruction_callback_( address, ins_data, callback_data_ );
+      } );
+}
+
+bool PeDisassemblyEngine::IsFunction( const DisassemblyPoint& disasm_point ) {
+  // No need to guess for the ones the compiler told us about
+  if ( seed_from_exception_directory_ ) {
+    const auto function = FindExceptionDirectoryFunction( disasm_point.rva );
+
+    if ( function && function->begin_address == disasm_point.rva )
       return true;
-    }
   }
 
-  return false;
-};
+  const auto verdict_it = is_function_verdicts_.find( disasm_point.rva );
+
+  if ( verdict_it != is_function_verdicts_.end() )
+    return verdict_it->second;
 
-bool PeDisassemblyEngine::IsFunction( const DisassemblyPoint& disasm_point ) {
 #ifdef _WIN64
-  return IsFunctionX64( disasm_point );
+  const bool is_function = IsFunctionX64( disasm_point );
 #else
-  return IsFunctionX86( disasm_point, 0 );
+  const bool is_function = IsFunctionX86( disasm_point, 0 );
 #endif
+
+  is_function_verdicts_.insert( { disasm_point.rva, is_function } );
+
+  return is_function;
 }
 
 // Returns true whether or not the instructions are the pattern:
@@ -884,6 +1322,10 @@ bool PeDisassemblyEngine::IsFunctionX64Prolog(
 
 DisassemblyAction PeDisassemblyEngine::ParseInstruction(
     const cs_insn& instruction ) {
+  // Decoded without the detail, so nothing that changes where we go
+  if ( !instruction.detail )
+    return DisassemblyAction::NextInstruction;
+
   const bool is_ret = cs_insn_group( disassembler_handle_, &instruction,
                                      cs_group_type::CS_GRP_RET );
   const bool is_interrupt = cs_insn_group( disassembler_handle_, &instruction,
@@ -1082,6 +1524,50 @@ DisassemblyAction PeDisassemblyEngine::ParseInstruction(
 }
 
 bool PeDisassemblyEngine::ContinueFromDisassemblyPoints() {
+  if ( parallel_state_ ) {
+    auto& pending_count = parallel_state_->pending_disassembly_point_count;
+
+    // The point we were on is done, the points it found were counted before
+    if ( has_parallel_disassembly_point_ ) {
+      --pending_count;
+      has_parallel_disassembly_point_ = false;
+    }
+
+    DisassemblyPoint next_disasm_point;
+
+    while ( !PopParallelDisassemblyPoint( &next_disasm_point ) ) {
+      // Nobody is working on a point that could still add more
+      if ( pending_count == 0 || parallel_state_->aborted )
+        return false;
+
+      std::this_thread::yield();
+    }
+
+    has_parallel_disassembly_point_ = true;
+
+    code_ = next_disasm_point.code;
+    address_ = next_disasm_point.rva;
+
+    // Do not depend on the points that came before, otherwise the result
+    // would depend on the order the workers took them in
+    current_code_index_ = 0;
+    code_buf_size_ = 0;
+
+    const auto section_header =
+        pe_section_headers_.FromRva( next_disasm_point.rva );
+
+    if ( section_header && next_disasm_point.rva <
+                               section_header->VirtualAddress +
+                                   section_header->SizeOfRawData ) {
+      code_buf_size_ = section_header->VirtualAddress +
+                       section_header->SizeOfRawData - next_disasm_point.rva;
+    }
+
+    UpdateSweepEnd();
+
+    return true;
+  }
+
   if ( disassembly_points_.empty() ) {
     return false;
   }
@@ -1093,9 +1579,24 @@ bool PeDisassemblyEngine::ContinueFromDisassemblyPoints() {
 
   disassembly_points_.pop_back();
 
+  UpdateSweepEnd();
+
   return true;
 }
 
+void PeDisassemblyEngine::UpdateSweepEnd() {
+  sweep_end_rva_ = UINTPTR_MAX;
+
+  if ( !seed_from_exception_directory_ )
+    return;
+
+  const auto function =
+      FindExceptionDirectoryFunction( static_cast<uintptr_t>( address_ ) );
+
+  if ( function )
+    sweep_end_rva_ = function->end_address;
+}
+
 void PeDisassemblyEngine::ParseRDataSection() {
   const auto rdata_section_header = pe_section_headers_.FromName( ".rdata" );
 
@@ -1103,55 +1604,52 @@ void PeDisassemblyEngine::ParseRDataSection() {
     throw std::runtime_error( ".rdata was not found" );
   }
 
-  const auto pe_image_ptr = pe_.GetPeImagePtr();
-
-  auto rdata_ptr = pe_image_ptr + rdata_section_header->PointerToRawData;
+  peutils::CheckSectionRawData( *rdata_section_header, pe_.GetSize() );
 
-  const auto rdata_end = rdata_ptr + rdata_section_header->SizeOfRawData;
+  const auto pe_image_ptr = pe_.GetPeImagePtr();
 
-  for ( ; rdata_ptr < rdata_end; rdata_ptr += sizeof( uintptr_t ) ) {
-    const auto value = *reinterpret_cast<const uintptr_t*>( rdata_ptr );
+  const auto text_rva = pe_text_section_header_->VirtualAddress;
 
-    if ( value == 0 ) {
-      continue;
-    }
+  // Only the values that point into .text come out of there
+  auto text_offsets = GetPointersIntoRange(
+      pe_image_ptr + rdata_section_header->PointerToRawData,
+      rdata_section_header->SizeOfRawData, pe_image_base_ + text_rva,
+      pe_text_section_header_->Misc.VirtualSize );
 
-    // We subtract the image base to check whether or not it is a valid RVA value
-    const auto value_rva = value - pe_image_base_;
+  // A function is in every vtable of the classes that inherit it, check it
+  // once
+  std::sort( text_offsets.begin(), text_offsets.end() );
+  text_offsets.erase( std::unique( text_offsets.begin(), text_offsets.end() ),
+                      text_offsets.end() );
 
-    // Is the rva valid and within the .text section?
-    if ( section::IsRvaWithinSection( *pe_text_section_header_, value_rva ) ) {
-      const auto value_file_offset =
-          pe_section_headers_.RvaToFileOffset( value_rva );
+  for ( const auto text_offset : text_offsets ) {
+    const uintptr_t value_rva = text_rva + text_offset;
 
-      if ( value_file_offset == 0 ) {
-        continue;
-      }
+    const auto value_file_offset =
+        pe_section_headers_.RvaToFileOffset( value_rva );
 
-      const auto value_destination_ptr = pe_image_ptr + value_file_offset;
+    if ( value_file_offset == 0 ) {
+      continue;
+    }
 
-      DisassemblyPoint disasm_point;
-      {
-        disasm_point.code = value_destination_ptr;
-        disasm_point.rva = value_rva;
-      }
+    DisassemblyPoint disasm_point;
+    {
+      disasm_point.code = pe_image_ptr + value_file_offset;
+      disasm_point.rva = value_rva;
+    }
 
-      if ( IsFunction( disasm_point ) ) {
-        AddDisassemblyPoint( disasm_point );
-      }
+    if ( IsFunction( disasm_point ) ) {
+      AddDisassemblyPoint( disasm_point );
     }
   }
 }
 
 void PeDisassemblyEngine::ParseTlsCallbacks() {
-  const auto nt_headers = pe_.GetNtHeaders();
-  const auto image_base = nt_headers->OptionalHeader.ImageBase;
-
-  const auto sections = pe_.GetSectionHeaders();
+  const auto image_base = pe_image_base_;
 
-  auto tls_callback_list = pe_.GetTlsCallbacklist();
+  const auto& sections = pe_section_headers_;
 
-  for ( const auto callback : tls_callback_list ) {
+  for ( const auto callback : pe_tls_callback_list_ ) {
     DisassemblyPoint disasm_point;
 
     const auto rva = callback - image_base;
@@ -1165,15 +1663,64 @@ void PeDisassemblyEngine::ParseTlsCallbacks() {
   }
 }
 
+void PeDisassemblyEngine::ParseExceptionDirectory() {
+  const auto pe_image_ptr = pe_.GetPeImagePtr();
+
+  const auto text_rva = pe_text_section_header_->VirtualAddress;
+  const auto text_code =
+      pe_image_ptr + pe_text_section_header_->PointerToRawData;
+
+  for ( const auto& function : exception_directory_functions_ ) {
+    // The part of .text without raw data is not code
+    if ( function.begin_address - text_rva >=
+         pe_text_section_header_->SizeOfRawData ) {
+      continue;
+    }
+
+    DisassemblyPoint disasm_point;
+    disasm_point.code = text_code + ( function.begin_address - text_rva );
+    disasm_point.rva = function.begin_address;
+
+    AddDisassemblyPoint( disasm_point );
+  }
+}
+
+const AddressRange* PeDisassemblyEngine::FindExceptionDirectoryFunction(
+    const uintptr_t rva ) const {
+  auto it = std::upper_bound(
+      exception_directory_functions_.begin(),
+      exception_directory_functions_.end(), rva,
+      []( const uintptr_t rva, const AddressRange& function ) {
+        return rva < function.begin_address;
+      } );
+
+  if ( it == exception_directory_functions_.begin() )
+    return nullptr;
+
+  --it;
+
+  return rva < it->end_address ? &*it : nullptr;
+}
+
 void PeDisassemblyEngine::AddDisassemblyPoint(
     const DisassemblyPoint& disasm_point ) {
-  const bool exists = disassembly_points_cache_.find( disasm_point.rva ) !=
-                      disassembly_points_cache_.end();
+  if ( parallel_state_ ) {
+    if ( !parallel_state_->disassembly_points_cache.Insert( disasm_point.rva ) )
+      return;
 
-  if ( !exists ) {
-    disassembly_points_.push_back( disasm_point );
-    disassembly_points_cache_.insert( disasm_point.rva );
+    ++parallel_state_->pending_disassembly_point_count;
+
+    auto& work_queue = parallel_state_->work_queues[ worker_index_ ];
+
+    std::lock_guard<std::mutex> lock( work_queue.mutex );
+
+    work_queue.disassembly_points.push_back( disasm_point );
+
+    return;
   }
+
+  if ( disassembly_points_cache_.Insert( disasm_point.rva ) )
+    disassembly_points_.push_back( disasm_point );
 }
 
 void PeDisassemblyEngine::BeginDisassembling(
@@ -1183,9 +1730,20 @@ void PeDisassemblyEngine::BeginDisassembling(
     void* data ) {
   bool finished = false;
 
+  // ParseJumpTable invalidates the instructions it finds out were data
+  invalid_instruction_callback_ = invalid_instruction_callback;
+  callback_data_ = data;
+
+  Defer( {
+    invalid_instruction_callback_ = nullptr;
+    callback_data_ = nullptr;
+  } );
+
   // allocate memory for one instruction and use this memory for all instruction
   // to increase performance
-  cs_insn* instruction = cs_malloc( disassembler_handle_ );
+  cs_insn* instruction_buffer = cs_malloc( disassembler_handle_ );
+  cs_insn* lightweight_instruction_buffer =
+      cs_malloc( lightweight_disassembler_handle_ );
 
   while ( !finished ) {
     // are we outside the buffer?
@@ -1201,9 +1759,11 @@ void PeDisassemblyEngine::BeginDisassembling(
     // when disassembling an instruction
     current_instruction_code_ = code_;
 
-    // has the instruction already been disassembled?
-    if ( ( disassembled_instructions_.find( static_cast<uintptr_t>(
-               address_ ) ) != disassembled_instructions_.end() ) ||
+    // has the instruction already been disassembled? or did the sweep run
+    // past the end of the function?
+    if ( address_ >= sweep_end_rva_ ||
+         disassembled_instructions_.Contains(
+             static_cast<uintptr_t>( address_ ) ) ||
          IsAddressWithinDataSectionOfCode( address_ ) ) {
       // continue disassembling instructions from the saved redirection
       // instructions
@@ -1215,8 +1775,11 @@ void PeDisassemblyEngine::BeginDisassembling(
       continue;
     }
 
-    if ( !cs_disasm_iter( disassembler_handle_, &code_, &code_buf_size_,
-                          &address_, instruction ) ) {
+    const auto instruction = DecodeInstruction(
+        &code_, &code_buf_size_, &address_, instruction_buffer,
+        lightweight_instruction_buffer );
+
+    if ( !instruction ) {
       // If the instruction is invalid, just continue like normal but continue
       // on an instruction from the disassembly points
       // At the end of the disassembling, we fix the invalid instructions
@@ -1231,6 +1794,17 @@ void PeDisassemblyEngine::BeginDisassembling(
 
     current_code_index_ += instruction->size;
 
+    // the instruction runs into a known jump table, so it is not code either
+    if ( data_ranges_.Overlaps( instruction->address,
+                                instruction->address + instruction->size ) ) {
+      if ( !ContinueFromDisassemblyPoints() ) {
+        finished = true;
+        break;
+      }
+
+      continue;
+    }
+
     // try virtualize it
     // parse it to further see if should continue disassembly
     disassembly_callback( *instruction, current_instruction_code_, data );
@@ -1257,73 +1831,289 @@ void PeDisassemblyEngine::BeginDisassembling(
 
     SmallInstructionData dick( instruction->size, current_instruction_code_ );
 
-    disassembled_instructions_.insert( std::make_pair(
-        static_cast<uintptr_t>( instruction->address ), dick ) );
+    disassembled_instructions_.Insert(
+        static_cast<uintptr_t>( instruction->address ), dick );
   }
 
-  // when finished
-  // go through the each disassembled_instructions_ entry and check if the
-  // address is inside the ranges of data
-  // if true, replace the (jmp) bytes with the original_pe bytes to remove the
-  // virtualization
-
-  std::unordered_set<uint64_t> already_invalidated_instruction_addresses_;
-
-  // we do this because switch tables can be read in wrong order, meaning
-  // reaching and disassembling the data part of jump table before know it is
-  // actually a jump table
-  for ( const auto& ins : disassembled_instructions_ ) {
-    const bool already_invalidated =
-        already_invalidated_instruction_addresses_.find( ins.first ) !=
-        already_invalidated_instruction_addresses_.end();
-
-    // Go through each disassembled instruction and check if it is within a data
-    // section of the code, such as a jump table
-    if ( IsAddressWithinDataSectionOfCode( ins.first ) &&
-         !already_invalidated ) {
-      invalid_instruction_callback( ins.first, ins.second, data );
-      already_invalidated_instruction_addresses_.insert( ins.first );
-
-      DisassemblyPoint disasm_point;
-      disasm_point.code = ins.second.code_ptr_;
-      disasm_point.rva = ins.first;
-
-      SetDisassemblyPoint( disasm_point,
-                           pe_text_section_header_->SizeOfRawData );
-
-      const auto InvalidInstructionCallback =
-          [&]( const uint64_t address, const SmallInstructionData ins_data ) {
-            // dont know what to do here
-            assert( false );
-          };
-
-      const auto EachInstructionCallback = [&]( const cs_insn& instruction,
-                                                const uint8_t* code ) {
-        const bool already_invalidated2 =
-            already_invalidated_instruction_addresses_.find( ins.first ) !=
-            already_invalidated_instruction_addresses_.end();
-
-        // if instruction has not already been invalidated
-        if ( !already_invalidated2 ) {
-          // Call original invalid instruction callback
-          invalid_instruction_callback( ins.first, ins.second, data );
-        }
-      };
+  cs_free( instruction_buffer, 1 );
+  cs_free( lightweight_instruction_buffer, 1 );
+}
+
+bool PeDisassemblyEngine::PopParallelDisassemblyPoint(
+    DisassemblyPoint* disasm_point ) {
+  auto& work_queues = parallel_state_->work_queues;
+
+  {
+    auto& own_queue = work_queues[ worker_index_ ];
+
+    std::lock_guard<std::mutex> lock( own_queue.mutex );
+
+    if ( !own_queue.disassembly_points.empty() ) {
+      *disasm_point = own_queue.disassembly_points.back();
+      own_queue.disassembly_points.pop_back();
+      return true;
+    }
+  }
+
+  for ( size_t i = 1; i < work_queues.size(); ++i ) {
+    auto& victim_queue =
+        work_queues[ ( worker_index_ + i ) % work_queues.size() ];
+
+    std::lock_guard<std::mutex> lock( victim_queue.mutex );
+
+    if ( !victim_queue.disassembly_points.empty() ) {
+      *disasm_point = victim_queue.disassembly_points.front();
+      victim_queue.disassembly_points.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void PeDisassemblyEngine::DisassembleParallelWorker() {
+  cs_insn* instruction_buffer = cs_malloc( disassembler_handle_ );
+  Defer( { cs_free( instruction_buffer, 1 ); } );
+
+  cs_insn* lightweight_instruction_buffer =
+      cs_malloc( lightweight_disassembler_handle_ );
+  Defer( { cs_free( lightweight_instruction_buffer, 1 ); } );
+
+  while ( !parallel_state_->aborted && ContinueFromDisassemblyPoints() ) {
+    for ( ;; ) {
+      // save the code pointer because capstone modifies it to next
+      // instruction when disassembling an instruction
+      current_instruction_code_ = code_;
 
-      // Clear the cache so the disassembler acts like its the first time
-      // disassembling the code
-      disassembly_points_cache_.clear();
+      if ( address_ >= sweep_end_rva_ )
+        break;
+
+      // Another worker already went down this path
+      if ( !parallel_state_->disassembled_instructions.Insert( address_ ) )
+        break;
+
+      const auto instruction = DecodeInstruction(
+          &code_, &code_buf_size_, &address_, instruction_buffer,
+          lightweight_instruction_buffer );
+
+      if ( !instruction )
+        break;
 
-      // Disassemble from the point of the invalid instruction to identify what
-      // more wrong instructions the disassembler thought was real code
-      // Then for all the so called "valid" instruction, turn invalid by calling
-      // the original invalid callback for original caller
-      BeginDisassemblingMinimal( EachInstructionCallback,
-                                 InvalidInstructionCallback );
+      parallel_instructions_.push_back( std::make_pair(
+          static_cast<uintptr_t>( instruction->address ),
+          SmallInstructionData( instruction->size,
+                                current_instruction_code_ ) ) );
 
-      already_invalidated_instruction_addresses_.insert( ins.first );
+      if ( ParseInstruction( *instruction ) ==
+           DisassemblyAction::NextDisassemblyPoint )
+        break;
     }
   }
+}
+
+void PeDisassemblyEngine::DisassembleFromEntrypointParallel(
+    const tDisassemblingCallback& disassembly_callback,
+    void* data,
+    uint32_t worker_count ) {
+  if ( worker_count == 0 )
+    worker_count = std::thread::hardware_concurrency();
+
+  // hardware_concurrency is allowed to return 0 if it does not know
+  if ( worker_count == 0 )
+    worker_count = 1;
+
+  ParallelDisassemblyState state( worker_count );
+
+  // Seed the queue of the first worker the same way the serial version does
+  {
+    parallel_state_ = &state;
+    worker_index_ = 0;
+
+    Defer( { parallel_state_ = nullptr; } );
+
+    DisassemblyPoint disasm_point;
+    disasm_point.code =
+        pe_.GetPeImagePtr() +
+        pe_section_headers_.RvaToFileOffset( pe_entrypoint_rva_ );
+    disasm_point.rva = pe_entrypoint_rva_;
+
+    SetDisassemblyPoint( disasm_point,
+                         pe_text_section_header_->SizeOfRawData );
+
+    AddDisassemblyPoint( disasm_point );
+
+    ParseRDataSection();
+
+    ParseTlsCallbacks();
+
+    if ( seed_from_exception_directory_ )
+      ParseExceptionDirectory();
+  }
+
+  std::vector<std::unique_ptr<PeDisassemblyEngine>> workers;
+
+  for ( uint32_t i = 0; i < worker_count; ++i ) {
+    workers.push_back( std::unique_ptr<PeDisassemblyEngine>(
+        new PeDisassemblyEngine( pe_, &state, i ) ) );
+
+    workers.back()->seed_from_exception_directory_ =
+        seed_from_exception_directory_;
+    workers.back()->instruction_needs_detail_ = instruction_needs_detail_;
+  }
+
+  std::vector<std::exception_ptr> worker_exceptions( worker_count );
+
+  std::vector<std::thread> threads;
+
+  for ( uint32_t i = 0; i < worker_count; ++i ) {
+    threads.emplace_back( [&, i]() {
+      try {
+        workers[ i ]->DisassembleParallelWorker();
+      } catch ( ... ) {
+        worker_exceptions[ i ] = std::current_exception();
+
+        // Let the others finish instead of waiting on our points forever
+        state.aborted = true;
+      }
+    } );
+  }
+
+  for ( auto& thread : threads )
+    thread.join();
+
+  for ( const auto& worker_exception : worker_exceptions ) {
+    if ( worker_exception )
+      std::rethrow_exception( worker_exception );
+  }
+
+  // Put the results together sorted by address, the order the workers found
+  // them in must not matter
+  std::vector<std::pair<uintptr_t, SmallInstructionData>> instructions;
+
+  for ( const auto& worker : workers ) {
+    instructions.insert( instructions.end(),
+                         worker->parallel_instructions_.begin(),
+                         worker->parallel_instructions_.end() );
+
+    data_ranges_.Insert( worker->data_ranges_ );
+  }
+
+  std::sort( instructions.begin(), instructions.end(),
+             []( const auto& lhs, const auto& rhs ) {
+               return lhs.first < rhs.first;
+             } );
 
-  cs_free( instruction, 1 );
-}
\ No newline at end of file
+  cs_insn* instruction_buffer = cs_malloc( disassembler_handle_ );
+  Defer( { cs_free( instruction_buffer, 1 ); } );
+
+  cs_insn* lightweight_instruction_buffer =
+      cs_malloc( lightweight_disassembler_handle_ );
+  Defer( { cs_free( lightweight_instruction_buffer, 1 ); } );
+
+  for ( const auto& ins : instructions ) {
+    // A jump table that was read as code before it was known to be one
+    if ( data_ranges_.Overlaps(
+             ins.first, ins.first + ins.second.instruction_size_ ) )
+      continue;
+
+    const uint8_t* code = ins.second.code_ptr_;
+    size_t code_size = ins.second.instruction_size_;
+    uint64_t address = ins.first;
+
+    // The workers only kept the size, decode it again for the callback
+    const auto instruction =
+        DecodeInstruction( &code, &code_size, &address, instruction_buffer,
+                           lightweight_instruction_buffer );
+
+    if ( !instruction )
+      continue;
+
+    disassembled_instructions_.Insert( ins.first, ins.second );
+
+    disassembly_callback( *instruction, ins.second.code_ptr_, data );
+  }
+}
+
+void PeDisassemblyEngine::DisassembleFromCache(
+    const AnalysisCache& cache,
+    const tDisassemblingCallback& disassembly_callback,
+    void* data ) {
+  for ( const auto& data_range : cache.data_ranges ) {
+    data_ranges_.Insert(
+        AddressRange{ data_range.begin_rva, data_range.end_rva } );
+  }
+
+  cs_insn* instruction_buffer = cs_malloc( disassembler_handle_ );
+  Defer( { cs_free( instruction_buffer, 1 ); } );
+
+  cs_insn* lightweight_instruction_buffer =
+      cs_malloc( lightweight_disassembler_handle_ );
+  Defer( { cs_free( lightweight_instruction_buffer, 1 ); } );
+
+  for ( const auto& cached_instruction : cache.instructions ) {
+    const auto file_offset =
+        pe_section_headers_.RvaToFileOffset( cached_instruction.rva );
+
+    if ( file_offset == 0 ||
+         file_offset + cached_instruction.size > pe_.GetSize() ) {
+      throw std::runtime_error( "The analysis cache does not match the PE" );
+    }
+
+    const uint8_t* code = pe_.GetPeImagePtr() + file_offset;
+    const uint8_t* instruction_code = code;
+    size_t code_size = cached_instruction.size;
+    uint64_t address = cached_instruction.rva;
+
+    const auto instruction =
+        DecodeInstruction( &code, &code_size, &address, instruction_buffer,
+                           lightweight_instruction_buffer );
+
+    if ( !instruction || instruction->size != cached_instruction.size ) {
+      throw std::runtime_error( "The analysis cache does not match the PE" );
+    }
+
+    disassembled_instructions_.Insert(
+        cached_instruction.rva,
+        SmallInstructionData( instruction->size, instruction_code ) );
+
+    disassembly_callback( *instruction, instruction_code, data );
+  }
+}
+
+AnalysisCache PeDisassemblyEngine::CreateAnalysisCache(
+    const uint64_t image_hash ) const {
+  AnalysisCache cache;
+
+  cache.image_hash = image_hash;
+
+  disassembled_instructions_.EachInstructionStartingWithin(
+      0, UINTPTR_MAX,
+      [&]( const uintptr_t address, const SmallInstructionData& ins_data ) {
+        if ( data_ranges_.Overlaps( address,
+                                    address + ins_data.instruction_size_ ) )
+          return;
+
+        CachedInstruction cached_instruction;
+        cached_instruction.rva = static_cast<uint32_t>( address );
+        cached_instruction.size =
+            static_cast<uint8_t>( ins_data.instruction_size_ );
+
+        cache.instructions.push_back( cached_instruction );
+      } );
+
+  // The ones outside of .text do not come in order
+  std::sort( cache.instructions.begin(), cache.instructions.end(),
+             []( const CachedInstruction& lhs, const CachedInstruction& rhs ) {
+               return lhs.rva < rhs.rva;
+             } );
+
+  for ( const auto& range : data_ranges_.GetRanges() ) {
+    CachedDataRange cached_data_range;
+    cached_data_range.begin_rva = static_cast<uint32_t>( range.begin_address );
+    cached_data_range.end_rva = static_cast<uint32_t>( range.end_address );
+
+    cache.data_ranges.push_back( cached_data_range );
+  }
+
+  return cache;
+}
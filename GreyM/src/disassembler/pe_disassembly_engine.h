@@ -1,20 +1,18 @@
 #pragma once
 
 #include "../pe/portable_executable.h"
+#include "instruction_map.h"
+#include "analysis_cache.h"
 
-struct SmallInstructionData {
- public:
-  SmallInstructionData( uint16_t instruction_size, const uint8_t* code )
-      : instruction_size_( instruction_size ), code_ptr_( code ) {}
-
-  uint16_t instruction_size_;
-  const uint8_t* code_ptr_;
-};
-
+// With two tier decoding, the detail of the instruction is null unless it was
+// one that needs it
 using tDisassemblingCallback = void ( * )( const cs_insn& instruction,
                                            const uint8_t* code,
                                            void* data );
 
+// Tells from the id alone if the caller needs the detail of the instruction
+using tInstructionNeedsDetail = bool ( * )( const unsigned int instruction_id );
+
 using tDisassemblingInvalidInstructionCallback =
     void ( * )( const uint64_t address,
                 const SmallInstructionData ins_data,
@@ -37,14 +35,45 @@ struct DisassemblyPoint {
   }
 };
 
+// Shared between the workers of a parallel disassembly
+struct ParallelDisassemblyState;
+
 struct AddressRange {
   uintptr_t begin_address;
   uintptr_t end_address;
 };
 
+// Sorted ranges that do not overlap, overlapping or touching ranges are
+// merged when inserted so a lookup is a single binary search
+class AddressRangeSet {
+ public:
+  void Insert( const AddressRange& range );
+  void Insert( const AddressRangeSet& ranges );
+
+  bool Contains( const uint64_t address ) const;
+
+  // Whether or not any part of [begin_address, end_address) is in the set
+  bool Overlaps( const uint64_t begin_address,
+                 const uint64_t end_address ) const;
+
+  std::vector<AddressRange> GetRanges() const;
+
+ private:
+  // key: begin address, value: end address
+  std::map<uintptr_t, uintptr_t> ranges_;
+};
+
 class PeDisassemblyEngine {
  public:
-  PeDisassemblyEngine( const PortableExecutable pe );
+  // The view is borrowed, the image data has to outlive the engine. The entry
+  // point and the tls callbacks are read right away, so the caller is free to
+  // patch the headers afterwards.
+  PeDisassemblyEngine( const PeView& pe );
+  ~PeDisassemblyEngine();
+
+  // Owns the capstone handle
+  PeDisassemblyEngine( const PeDisassemblyEngine& ) = delete;
+  PeDisassemblyEngine& operator=( const PeDisassemblyEngine& ) = delete;
 
   void DisassembleFromEntrypoint(
       const tDisassemblingCallback& disassembly_callback,
@@ -52,6 +81,37 @@ class PeDisassemblyEngine {
           invalid_instruction_callback,
       void* data );
 
+  // Disassembles with a worker per core, each with its own capstone handle.
+  // The callback is only called once every worker is done, in the order of
+  // the addresses, so the result is the same for any worker count.
+  // Instructions that turn out to be inside of data such as a jump table are
+  // left out instead of going through an invalid instruction callback.
+  void DisassembleFromEntrypointParallel(
+      const tDisassemblingCallback& disassembly_callback,
+      void* data,
+      uint32_t worker_count = 0 );
+
+  // Calls the callback for the instructions of a cache made from the same
+  // image instead of disassembling it, in the order of the addresses
+  void DisassembleFromCache( const AnalysisCache& cache,
+                             const tDisassemblingCallback& disassembly_callback,
+                             void* data );
+
+  // What the last disassembly found, without the instructions that turned out
+  // to be data
+  AnalysisCache CreateAnalysisCache( const uint64_t image_hash ) const;
+
+  // x64 only, every function of the exception directory becomes a
+  // disassembly point and the sweep from a point inside of one of them stops
+  // at its end. The prolog heuristics are skipped for those functions.
+  void SetSeedFromExceptionDirectory( const bool seed );
+
+  // Decodes everything without the capstone detail first, only the control
+  // flow instructions and the ones the callback says it needs are decoded
+  // again with it. nullptr decodes everything with the detail.
+  void SetTwoTierDecoding(
+      const tInstructionNeedsDetail& instruction_needs_detail );
+
   void AddDisassemblyPoint( const DisassemblyPoint& disasm_point );
 
   void BeginDisassembling( const tDisassemblingCallback& disassembly_callback,
@@ -62,15 +122,33 @@ class PeDisassemblyEngine {
   void SetDisassemblyPoint( const DisassemblyPoint& disasm_point,
                             const size_t disasm_buffer_size );
 
- private:
-  // Only used for internal use for the invalid instruction checking part
-  template <typename TFunc = tDisassemblingCallback,
-            typename TFunc2 = tDisassemblingInvalidInstructionCallback>
-  void BeginDisassemblingMinimal( const TFunc& disassembly_callback,
-                                  const TFunc2& invalid_instruction_callback );
-
-  bool IsAddressWithinDataSectionOfCode( const uint64_t address );
+  // The function of the exception directory the rva is in, nullptr if none
+  const AddressRange* FindExceptionDirectoryFunction(
+      const uintptr_t rva ) const;
 
+ private:
+  // The engines of the workers do not get the maps sized to the .text section,
+  // they only keep a list of what they disassembled
+  PeDisassemblyEngine( const PeView& pe,
+                       ParallelDisassemblyState* parallel_state,
+                       const uint32_t worker_index );
+
+  bool IsAddressWithinDataSectionOfCode( const uint64_t address ) const;
+
+  // Advances the code, size and address like cs_disasm_iter, returns one of
+  // the two buffers or nullptr if the instruction is invalid
+  const cs_insn* DecodeInstruction( const uint8_t** code,
+                                    size_t* code_size,
+                                    uint64_t* address,
+                                    cs_insn* instruction_buffer,
+                                    cs_insn* lightweight_instruction_buffer );
+
+  // Calls the invalid instruction callback for every instruction disassembled
+  // so far that overlaps the range, done as soon as a jump table is found
+  void InvalidateInstructionsWithin( const AddressRange& range );
+
+  // The verdicts are kept, the same function is asked about from every
+  // reference to it
   bool IsFunction( const DisassemblyPoint& disasm_point );
   bool IsFunctionX86( const DisassemblyPoint& disasm_point,
                       int recursion_counter );
@@ -108,11 +186,27 @@ class PeDisassemblyEngine {
   // Adds each of the TLS callback to the disassembly points
   void ParseTlsCallbacks();
 
+  // Adds the begin of each function of the exception directory
+  void ParseExceptionDirectory();
+
+  // Where the sweep from the current point has to stop
+  void UpdateSweepEnd();
+
+  // Runs on the thread of a single worker until no worker has points left
+  void DisassembleParallelWorker();
+
+  // Takes from the back of our own queue or steals from the front of another
+  bool PopParallelDisassemblyPoint( DisassemblyPoint* disasm_point );
+
  private:
-  const PortableExecutable pe_;
+  const PeView pe_;
 
   csh disassembler_handle_;
 
+  // Without the detail, only used for two tier decoding
+  csh lightweight_disassembler_handle_;
+  tInstructionNeedsDetail instruction_needs_detail_;
+
   const uint8_t* code_;
   uint32_t current_code_index_;
 
@@ -125,90 +219,50 @@ class PeDisassemblyEngine {
   std::vector<DisassemblyPoint> disassembly_points_;
 
   // keeps track of each disassembly point that was added to avoid duplicates
-  std::unordered_set<uint64_t> disassembly_points_cache_;
+  AddressBitmap disassembly_points_cache_;
 
   // keeps track of all disassembled instructions to avoid disassembling them
-  // again
-  // first: address, second: instruction size
-  std::unordered_map<uintptr_t, SmallInstructionData>
-      disassembled_instructions_;
+  // again, indexed by the offset in the .text section
+  InstructionMap disassembled_instructions_;
+
+  // the instructions that were already passed to the invalid callback
+  AddressBitmap invalidated_instructions_;
+
+  // what a worker of a parallel disassembly found, no address is in there
+  // more than once because the workers share a set of disassembled addresses
+  std::vector<std::pair<uintptr_t, SmallInstructionData>>
+      parallel_instructions_;
+
+  // what IsFunction said about each rva so far
+  std::unordered_map<uintptr_t, bool> is_function_verdicts_;
 
   // represents an area/range that is data and not code
   // example: jump table, that is data and not code
-  std::vector<AddressRange> data_ranges_;
+  AddressRangeSet data_ranges_;
+
+  // Sorted by the begin, read from .pdata on x64 and empty on x86
+  std::vector<AddressRange> exception_directory_functions_;
+  bool seed_from_exception_directory_;
+
+  // The end of the function the current point is in when seeding from the
+  // exception directory, otherwise the sweep is not bounded
+  uintptr_t sweep_end_rva_;
+
+  // Only set while BeginDisassembling runs
+  tDisassemblingInvalidInstructionCallback invalid_instruction_callback_;
+  void* callback_data_;
 
   const uintptr_t pe_image_base_;
 
   const SectionHeaders pe_section_headers_;
   const IMAGE_SECTION_HEADER* pe_text_section_header_;
-};
 
-template <typename TFunc, typename TFunc2>
-void PeDisassemblyEngine::BeginDisassemblingMinimal(
-    const TFunc& disassembly_callback,
-    const TFunc2& invalid_instruction_callback ) {
-  bool finished = false;
-
-  // allocate memory for one instruction and use this memory for all instruction
-  // to increate performance
-  cs_insn* instruction = cs_malloc( disassembler_handle_ );
-
-  while ( !finished ) {
-    // are we outside the buffer?
-    if ( ( code_buf_size_ - current_code_index_ ) <= 0 ) {
-      // try to continue from the saved disassembly points
-      if ( !ContinueFromDisassemblyPoints() ) {
-        finished = true;
-        break;
-      }
-    }
-
-    // save the code pointer because capstone modifies it to next instruction
-    // when disassembling an instruction
-    current_instruction_code_ = code_;
-
-    if ( !cs_disasm_iter( disassembler_handle_, &code_, &code_buf_size_,
-                          &address_, instruction ) ) {
-      // failed to disassemble instruction
-      // stop disassembly and continue on another address on the stack / set
-      // this usually means that we've reached an invalid instruction, meaning
-      // parsing of the instruction flow has been incorrect
-      // assert( false );
-      // continue disassembling instructions from the saved redirection
-      // instructions
-
-      if ( !ContinueFromDisassemblyPoints() ) {
-        finished = true;
-        break;
-      }
-
-      continue;
-    }
-
-    current_code_index_ += instruction->size;
-
-    // try virtualize it
-    // parse it to further see if should continue disassembly
-    disassembly_callback( *instruction, current_instruction_code_ );
-
-    const auto next_disasm_action = ParseInstruction( *instruction );
-
-    // returns the next instruction to disassemble
-    switch ( next_disasm_action ) {
-      case DisassemblyAction::NextInstruction: {
-        // we do not need to change the code or address values because capstone
-        // does it for us
-      } break;
-
-      case DisassemblyAction::NextDisassemblyPoint: {
-        if ( !ContinueFromDisassemblyPoints() ) {
-          finished = true;
-          break;
-        }
-      } break;
-      default:
-        assert( false );
-        break;
-    }
-  }
-}
\ No newline at end of file
+  // Read on construction, the protector rewrites both in the headers
+  const uint32_t pe_entrypoint_rva_;
+  const std::vector<uintptr_t> pe_tls_callback_list_;
+
+  // Only set on the engines of the workers of a parallel disassembly
+  ParallelDisassemblyState* parallel_state_;
+  uint32_t worker_index_;
+  bool has_parallel_disassembly_point_;
+};
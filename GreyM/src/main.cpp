@@ -3,14 +3,97 @@
 #include "pe/portable_executable.h"
 #include "utils/file_io.h"
 #include "protector.h"
+#include "batch.h"
 
 #include "utils/console_log.h"
+#include "utils/file_log.h"
+#include "utils/random.h"
+
+#include "../../Interpreter/src/main.h"
 
 #pragma comment( lib, "capstone.lib" )
 
+// Prints a .vmstartup file written by a ENABLE_STARTUP_BENCHMARK build
+void PrintStartupBenchmark( const std::wstring& path ) {
+  const auto data = fileio::ReadBinaryFile( path );
+
+  if ( data.size() < sizeof( VmStartupBenchmark ) ) {
+    console::Print( "Unable to read the startup benchmark." );
+    return;
+  }
+
+  const auto startup_benchmark =
+      reinterpret_cast<const VmStartupBenchmark*>( data.data() );
+
+  const char* stage_names[] = { "first tls callback", "imports fixed",
+                                "tls callbacks done", "before entrypoint",
+                                "integrity checked",  "real entrypoint" };
+
+  static_assert( _countof( stage_names ) ==
+                     static_cast<uint32_t>( VmStartupStage::COUNT ),
+                 "Every startup stage needs a name" );
+
+  uint64_t previous_time = 0;
+
+  for ( uint32_t i = 0; i < startup_benchmark->stage_count &&
+                        i < _countof( stage_names );
+        ++i ) {
+    const auto stage_time = startup_benchmark->stage_times[ i ];
+
+    // In 100 nanoseconds, printed in microseconds
+    console::Print( "%-20s %10.1f us (+%.1f us)", stage_names[ i ],
+                    stage_time / 10.0, ( stage_time - previous_time ) / 10.0 );
+
+    previous_time = stage_time;
+  }
+
+  console::Print( "api resolution       %10I64u cycles",
+                  startup_benchmark->api_resolution_cycles );
+  console::Print( "api cache            %10I64u cycles",
+                  startup_benchmark->api_cache_cycles );
+}
+
+// The totals of a dry run, the report has the estimate of every site
+void PrintCostEstimate( const ProtectionReport::CostEstimate& cost_estimate ) {
+  console::Print( "vm loader section   +%I64u bytes",
+                  cost_estimate.vm_loader_section_growth );
+  console::Print( "vm code section     +%I64u bytes",
+                  cost_estimate.virtualized_code_section_growth );
+  console::Print( "vm bytecode section +%I64u bytes",
+                  cost_estimate.vm_bytecode_section_growth );
+  console::Print( "reloc section       +%I64u bytes",
+                  cost_estimate.reloc_section_growth );
+
+  double cycles_per_execution = 0;
+  double profiled_cycles = 0;
+
+  for ( const auto& site : cost_estimate.sites ) {
+    cycles_per_execution += site.cycles_per_execution;
+    profiled_cycles += site.cycles_per_execution * site.execution_count;
+  }
+
+  console::Print( "%u sites in %u functions",
+                  static_cast<uint32_t>( cost_estimate.sites.size() ),
+                  static_cast<uint32_t>( cost_estimate.functions.size() ) );
+
+  if ( !cost_estimate.calibrated ) {
+    console::Print( "No opcode cost table, pass --opcode-costs for cycles" );
+    return;
+  }
+
+  console::Print( "%.1f cycles for one execution of every site",
+                  cycles_per_execution );
+
+  if ( profiled_cycles > 0 )
+    console::Print( "%.0f cycles for the profiled run", profiled_cycles );
+}
+
 int main( int argc, char* argv[] ) {
+  bool is_batch_mode = false;
+
   try {
-    srand( static_cast<unsigned int>( time( 0 ) ) );
+    // Replaced by --seed, a build with the same seed is the same
+    uint64_t seed = static_cast<uint64_t>( time( 0 ) );
 
     const std::string current_dir = argv[ 0 ];
 
@@ -20,24 +103,141 @@ int main( int argc, char* argv[] ) {
     const std::wstring parent_dir_wide =
         std::wstring( parent_dir.begin(), parent_dir.end() );
 
-    const auto target_file_data = fileio::ReadBinaryFile(
-        parent_dir_wide + TEXT( "Test Executable.exe" ) );
+    if ( argc == 3 && std::string( argv[ 1 ] ) == "--startup-report" ) {
+      const std::string startup_path = argv[ 2 ];
+      PrintStartupBenchmark(
+          std::wstring( startup_path.begin(), startup_path.end() ) );
+      return 0;
+    }
 
-    if ( target_file_data.empty() ) {
-      console::Print( "Unable to open the target file." );
-      std::cin.get();
-      return -1;
+    protector::ProtectorOptions options;
+
+    batch::BatchOptions batch_options;
+
+    // A JSON report of the phases, a directory of them in batch mode
+    std::wstring report_path;
+
+    // Known up front, a bad argument before --batch must not wait for a key
+    for ( int i = 1; i < argc; ++i ) {
+      if ( std::string( argv[ i ] ) == "--batch" )
+        is_batch_mode = true;
+    }
+
+    for ( int i = 1; i < argc; ++i ) {
+      const std::string argument = argv[ i ];
+
+      if ( argument == "--batch" && i + 2 < argc ) {
+        const std::string input_path = argv[ ++i ];
+        const std::string output_directory = argv[ ++i ];
+        batch_options.input_path =
+            std::wstring( input_path.begin(), input_path.end() );
+        batch_options.output_directory =
+            std::wstring( output_directory.begin(), output_directory.end() );
+      } else if ( argument == "--jobs" && i + 1 < argc ) {
+        batch_options.worker_count =
+            static_cast<uint32_t>( std::stoul( argv[ ++i ] ) );
+      } else if ( argument == "--instrument" ) {
+        options.instrument_virtualized_code = true;
+      } else if ( argument == "--profile" && i + 1 < argc ) {
+        const std::string profile_path = argv[ ++i ];
+        options.profile_path =
+            std::wstring( profile_path.begin(), profile_path.end() );
+      } else if ( argument == "--hot-threshold" && i + 1 < argc ) {
+        options.hot_site_threshold = std::stoull( argv[ ++i ] );
+      } else if ( argument == "--adaptive-threshold" && i + 1 < argc ) {
+        options.adaptive_devirtualization_threshold =
+            std::stoull( argv[ ++i ] );
+      } else if ( argument == "--anti-debug-interval" && i + 1 < argc ) {
+        options.anti_debug_poll_interval_ms =
+            static_cast<uint32_t>( std::stoul( argv[ ++i ] ) );
+      } else if ( argument == "--anti-debug-jitter" && i + 1 < argc ) {
+        options.anti_debug_poll_jitter_ms =
+            static_cast<uint32_t>( std::stoul( argv[ ++i ] ) );
+      } else if ( argument == "--telemetry-sites" && i + 1 < argc ) {
+        const std::string site_table_path = argv[ ++i ];
+        options.telemetry_site_table_path =
+            std::wstring( site_table_path.begin(), site_table_path.end() );
+      } else if ( argument == "--disassembly-workers" && i + 1 < argc ) {
+        options.disassembly_worker_count =
+            static_cast<uint32_t>( std::stoul( argv[ ++i ] ) );
+      } else if ( argument == "--no-pdata-seeding" ) {
+        options.seed_from_exception_directory = false;
+      } else if ( argument == "--full-decoding" ) {
+        options.two_tier_decoding = false;
+      } else if ( argument == "--analysis-cache" && i + 1 < argc ) {
+        const std::string analysis_cache_path = argv[ ++i ];
+        options.analysis_cache_path = std::wstring(
+            analysis_cache_path.begin(), analysis_cache_path.end() );
+      } else if ( argument == "--obfuscate-rtti" ) {
+        options.obfuscate_rtti = true;
+      } else if ( argument == "--dry-run" ) {
+        options.dry_run = true;
+      } else if ( argument == "--opcode-costs" && i + 1 < argc ) {
+        const std::string cost_table_path = argv[ ++i ];
+        options.opcode_cost_table_path =
+            std::wstring( cost_table_path.begin(), cost_table_path.end() );
+      } else if ( argument == "--report" && i + 1 < argc ) {
+        const std::string report_argument = argv[ ++i ];
+        report_path =
+            std::wstring( report_argument.begin(), report_argument.end() );
+      } else if ( argument == "--seed" && i + 1 < argc ) {
+        seed = std::stoull( argv[ ++i ], nullptr, 0 );
+      } else if ( argument == "--policy" && i + 1 < argc ) {
+        const std::string policy_path = argv[ ++i ];
+        options.policy_path =
+            std::wstring( policy_path.begin(), policy_path.end() );
+      } else {
+        throw std::runtime_error( "Unknown argument " + argument +
+                                  " or it is missing its value" );
+      }
     }
 
-    auto target_pe = pe::Open( target_file_data );
+    rng::Seed( seed );
+
+    // No pauses in batch mode, it runs on the build machines
+    if ( is_batch_mode ) {
+      batch_options.report_directory = report_path;
+      return batch::Run( batch_options, options ) == 0 ? 0 : 1;
+    }
+
+    // Map the target instead of reading it, the view is checked before we
+    // copy anything out of it
+    const fileio::MappedFile target_file(
+        parent_dir_wide + TEXT( "Test Executable.exe" ) );
+
+    const PeView target_view( target_file.GetData(), target_file.GetSize() );
+
+    if ( target_view.IsValid() ) {
+      auto target_pe = pe::Open( target_view );
 
-    if ( target_pe.IsValid() ) {
-      const auto new_protected_pe = protector::Protect( target_pe );
-      if ( !fileio::WriteFileData(
-               parent_dir_wide + TEXT( "Test Executable Out.exe" ),
-               new_protected_pe.GetPeData() ) ) {
+      ProtectionReport report;
+
+      // A dry run has nothing to write but the estimate
+      const bool wants_report = !report_path.empty() || options.dry_run;
+
+      const auto new_protected_pe = protector::Protect(
+          std::move( target_pe ), options, wants_report ? &report : nullptr );
+
+      bool written = options.dry_run;
+
+      if ( options.dry_run ) {
+        PrintCostEstimate( report.cost_estimate );
+      } else {
+        ScopedReportPhase phase( report_path.empty() ? nullptr : &report,
+                                 "write_out" );
+        written = fileio::WriteFileData(
+            parent_dir_wide + TEXT( "Test Executable Out.exe" ),
+            new_protected_pe.GetPeData() );
+      }
+
+      if ( !written ) {
         console::Print( "Unable to write output file" );
       }
+
+      if ( !report_path.empty() &&
+           !protection_report::WriteJson( report_path, report ) ) {
+        console::Print( "Unable to write the report" );
+      }
     } else {
       console::Print( "The PE is not valid." );
       std::cin.get();
@@ -46,8 +246,18 @@ int main( int argc, char* argv[] ) {
 
   } catch ( std::exception ex ) {
     console::Print( ex.what() );
+
+    file_log::Flush();
+
+    if ( !is_batch_mode )
+      std::cin.get();
+
+    return -1;
   }
 
+  // The log is written in the background, have it on disk while we wait
+  file_log::Flush();
+
   std::cin.get();
 
   return 0;
@@ -0,0 +1,81 @@
+#include "pch.h"
+#include "opcode_cost_table.h"
+#include "utils/string_utils.h"
+
+namespace opcode_cost_table {
+
+CostTable Load( const std::wstring& filename ) {
+  std::ifstream file( filename );
+
+  if ( !file.is_open() ) {
+    throw std::runtime_error( "Unable to open opcode cost table " +
+                              string_utils::WideToAnsi( filename ) );
+  }
+
+  CostTable cost_table;
+
+  std::string line;
+  int line_number = 0;
+
+  while ( std::getline( file, line ) ) {
+    ++line_number;
+
+    std::istringstream line_stream( line );
+
+    std::string vm_opcode;
+
+    if ( !( line_stream >> vm_opcode ) || vm_opcode[ 0 ] == '#' ) {
+      continue;
+    }
+
+    double cycles = 0;
+
+    if ( !( line_stream >> cycles ) ) {
+      throw std::runtime_error( "Opcode cost table line " +
+                                std::to_string( line_number ) +
+                                ": expected an opcode and the cycles" );
+    }
+
+    cost_table.opcode_cycles[ static_cast<uint32_t>(
+        std::stoul( vm_opcode, nullptr, 16 ) ) ] = cycles;
+  }
+
+  return cost_table;
+}
+
+bool Write( const std::wstring& filename, const CostTable& cost_table ) {
+  std::ofstream file( filename );
+
+  if ( !file.is_open() )
+    return false;
+
+  file << "# <VmOpcodes> <cycles per execution>\n";
+
+  for ( const auto& opcode_cycles : cost_table.opcode_cycles ) {
+    file << "0x" << std::hex << std::uppercase << opcode_cycles.first
+         << std::dec << " " << opcode_cycles.second << "\n";
+  }
+
+  return static_cast<bool>( file );
+}
+
+double GetCycles( const CostTable& cost_table, const VmOpcodes vm_opcode ) {
+  const auto& opcode_cycles = cost_table.opcode_cycles;
+
+  const auto it = opcode_cycles.find( static_cast<uint32_t>( vm_opcode ) );
+
+  if ( it != opcode_cycles.end() )
+    return it->second;
+
+  if ( opcode_cycles.empty() )
+    return 0;
+
+  double total_cycles = 0;
+
+  for ( const auto& cycles : opcode_cycles )
+    total_cycles += cycles.second;
+
+  return total_cycles / opcode_cycles.size();
+}
+
+}  // namespace opcode_cost_table
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "../../Interpreter/src/main.h"
+
+/*
+  The cycles that a virtualized site costs over the native instruction, per
+  VmOpcodes. Bench.exe --opcodes calibrates it and writes one per line:
+
+    # comment
+    <VmOpcodes in hex> <cycles>
+
+  Each opcode is measured as a block of its own, the entry and the exit are
+  part of the cycles. Inside of a bigger block it is cheaper than that.
+*/
+namespace opcode_cost_table {
+
+struct CostTable {
+  // first: VmOpcodes, second: cycles per execution
+  std::unordered_map<uint32_t, double> opcode_cycles;
+};
+
+CostTable Load( const std::wstring& filename );
+
+bool Write( const std::wstring& filename, const CostTable& cost_table );
+
+// The opcodes the bench has no kernel for cost the average of the others,
+// nothing costs anything with an empty table
+double GetCycles( const CostTable& cost_table, const VmOpcodes vm_opcode );
+
+}  // namespace opcode_cost_table
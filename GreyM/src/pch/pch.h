@@ -9,12 +9,14 @@
 #include <assert.h>
 #include <unordered_set>
 #include <set>
+#include <map>
 #include <unordered_map>
 #include <initializer_list>
 #include <algorithm>
 #include <ctime>
 #include <array>
 #include <fstream>
+#include <sstream>
 #include <functional>
 
 #include "capstone/capstone.h"
\ No newline at end of file
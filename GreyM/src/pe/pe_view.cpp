@@ -0,0 +1,265 @@
+#include "pch.h"
+#include "pe_view.h"
+#include "peutils.h"
+
+std::string SectionView::GetName() const {
+  // The name is not null terminated if it takes all of the 8 characters
+  const auto name = reinterpret_cast<const char*>( section_header_->Name );
+
+  return std::string( name, strnlen( name, sizeof( section_header_->Name ) ) );
+}
+
+const IMAGE_SECTION_HEADER& SectionView::GetSectionHeader() const {
+  return *section_header_;
+}
+
+const uint8_t* SectionView::GetData() const {
+  return data_;
+}
+
+uint32_t SectionView::GetSize() const {
+  return section_header_->SizeOfRawData;
+}
+
+PeView::PeView( const uint8_t* pe_data, const size_t size )
+    : pe_data_( pe_data ),
+      size_( size ),
+      nt_headers_( nullptr ),
+      dos_headers_( nullptr ) {
+  if ( size_ < sizeof( IMAGE_DOS_HEADER ) )
+    return;
+
+  dos_headers_ = reinterpret_cast<const IMAGE_DOS_HEADER*>( pe_data_ );
+
+  // Do not read the nt headers outside of the view on a truncated file
+  if ( dos_headers_->e_lfanew < 0 ||
+       static_cast<size_t>( dos_headers_->e_lfanew ) +
+               sizeof( IMAGE_NT_HEADERS ) >
+           size_ )
+    return;
+
+  nt_headers_ = peutils::GetNtHeaders( const_cast<uint8_t*>( pe_data_ ) );
+}
+
+bool PeView::IsValid() const {
+  if ( !dos_headers_ || !nt_headers_ )
+    return false;
+
+  if ( dos_headers_->e_magic != IMAGE_DOS_SIGNATURE )
+    return false;
+
+  if ( nt_headers_->Signature != IMAGE_NT_SIGNATURE )
+    return false;
+
+  return true;
+}
+
+SectionHeaders PeView::GetSectionHeaders() const {
+  const auto first_section = IMAGE_FIRST_SECTION( nt_headers_ );
+  const auto section_count = nt_headers_->FileHeader.NumberOfSections;
+
+  std::vector<IMAGE_SECTION_HEADER*> section_headers;
+
+  section_headers.reserve( section_count );
+
+  // SectionHeaders only hands out mutable headers, we never write through them
+  for ( int i = 0; i < section_count; ++i ) {
+    section_headers.push_back(
+        const_cast<IMAGE_SECTION_HEADER*>( &first_section[ i ] ) );
+  }
+
+  return SectionHeaders( section_headers );
+}
+
+std::vector<SectionView> PeView::GetSections() const {
+  const auto first_section = IMAGE_FIRST_SECTION( nt_headers_ );
+  const auto section_count = nt_headers_->FileHeader.NumberOfSections;
+
+  std::vector<SectionView> sections;
+
+  sections.reserve( section_count );
+
+  for ( int i = 0; i < section_count; ++i ) {
+    peutils::CheckSectionRawData( first_section[ i ], size_ );
+
+    sections.push_back( SectionView( &first_section[ i ], pe_data_ ) );
+  }
+
+  return sections;
+}
+
+Section PeView::MaterializeSection(
+    const IMAGE_SECTION_HEADER* section_header ) const {
+  peutils::CheckSectionRawData( *section_header, size_ );
+
+  return Section( *section_header, pe_data_ );
+}
+
+std::vector<Import> PeView::GetImports() const {
+  std::vector<Import> imports;
+
+  const auto pe_data_ptr = pe_data_;
+
+  const auto& import_directory =
+      nt_headers_->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_IMPORT ];
+
+  // is there an import directory?
+  if ( !import_directory.VirtualAddress )
+    return {};
+
+  auto sections = GetSectionHeaders();
+
+  // For each import desc
+  for ( auto import_descriptor =
+            reinterpret_cast<const IMAGE_IMPORT_DESCRIPTOR*>(
+                pe_data_ptr +
+                sections.RvaToFileOffset( import_directory.VirtualAddress ) );
+        import_descriptor->Name; ++import_descriptor ) {
+    // Read the function associated dll name
+    const auto associated_dll_name = reinterpret_cast<const char*>(
+        pe_data_ptr + sections.RvaToFileOffset( import_descriptor->Name ) );
+
+    // Since we are only looking for a function from a specific DLL, check if
+    // the DLL name is the one we want that contains the function we want to
+    // hook to avoid going though every import desc.
+    auto original_thunk = reinterpret_cast<const IMAGE_THUNK_DATA*>(
+        pe_data_ptr +
+        sections.RvaToFileOffset( import_descriptor->OriginalFirstThunk ) );
+
+    uint32_t function_address = import_descriptor->FirstThunk;
+
+    // For each import thunk
+    for ( ; original_thunk->u1.AddressOfData;
+          ++original_thunk,
+          function_address += sizeof( IMAGE_THUNK_DATA ) ) {
+      assert( original_thunk );
+
+      const bool by_ordinal =
+          IMAGE_SNAP_BY_ORDINAL( original_thunk->u1.Ordinal );
+
+      if ( by_ordinal ) {
+        const auto ordinal = IMAGE_ORDINAL( original_thunk->u1.Ordinal );
+
+        assert( ordinal );
+
+        // It has no name, the slot is redirected like any other
+        Import import;
+        import.associated_module = associated_dll_name;
+        import.function_addr_rva = function_address;
+        import.function_name = "";
+        import.ordinal = true;
+
+        imports.push_back( import );
+      } else {
+        // Read the import info in that thunk
+        const auto import_name = reinterpret_cast<const IMAGE_IMPORT_BY_NAME*>(
+            pe_data_ptr +
+            sections.RvaToFileOffset( original_thunk->u1.AddressOfData ) );
+
+        Import import;
+        {
+          import.associated_module = associated_dll_name;
+          import.function_addr_rva = function_address;
+          import.function_name = import_name->Name;
+          import.ordinal = false;
+        }
+
+        imports.push_back( import );
+      }
+    }
+  }
+
+  return imports;
+}
+
+std::vector<uintptr_t> PeView::GetTlsCallbacklist() const {
+  std::vector<uintptr_t> tls_callback_list;
+
+  const auto& tls_data_directory =
+      nt_headers_->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_TLS ];
+
+  const bool has_tls_directory = tls_data_directory.Size != 0;
+
+  auto sections = GetSectionHeaders();
+
+  if ( has_tls_directory ) {
+    assert( sizeof( IMAGE_TLS_DIRECTORY ) == tls_data_directory.Size );
+
+    const auto image_base = nt_headers_->OptionalHeader.ImageBase;
+
+    const auto tls_dir_file_offset =
+        sections.RvaToFileOffset( tls_data_directory.VirtualAddress );
+
+    auto tls_directory = reinterpret_cast<const IMAGE_TLS_DIRECTORY*>(
+        pe_data_ + tls_dir_file_offset );
+
+    if ( tls_directory->AddressOfCallBacks ) {
+      auto callback_list_start_offset = sections.RvaToFileOffset(
+          tls_directory->AddressOfCallBacks - image_base );
+
+      auto callback_list_ptr = reinterpret_cast<const uintptr_t*>(
+          pe_data_ + callback_list_start_offset );
+
+      for ( ; *callback_list_ptr; callback_list_ptr++ ) {
+        tls_callback_list.push_back( *callback_list_ptr );
+      }
+    }
+  }
+
+  return tls_callback_list;
+}
+
+std::vector<Export> PeView::GetExports() const {
+  std::vector<Export> exports;
+
+  const auto& export_directory =
+      nt_headers_->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXPORT ];
+
+  // Is there an export directory?
+  if ( !export_directory.VirtualAddress )
+    return {};
+
+  auto sections = GetSectionHeaders();
+
+  const auto pe_data_ptr = pe_data_;
+
+  const auto exports_dir = reinterpret_cast<const IMAGE_EXPORT_DIRECTORY*>(
+      pe_data_ptr +
+      sections.RvaToFileOffset( export_directory.VirtualAddress ) );
+
+  const auto names = reinterpret_cast<const uint32_t*>(
+      pe_data_ptr + sections.RvaToFileOffset( exports_dir->AddressOfNames ) );
+  const auto ordinals = reinterpret_cast<const uint16_t*>(
+      pe_data_ptr +
+      sections.RvaToFileOffset( exports_dir->AddressOfNameOrdinals ) );
+  const auto addresses = reinterpret_cast<const uint32_t*>(
+      pe_data_ptr +
+      sections.RvaToFileOffset( exports_dir->AddressOfFunctions ) );
+
+  for ( uint32_t i = 0; i < exports_dir->NumberOfNames; ++i ) {
+    const auto function_name = reinterpret_cast<const char*>(
+        pe_data_ptr + sections.RvaToFileOffset( names[ i ] ) );
+
+    const uint32_t function_addr = addresses[ ordinals[ i ] ];
+
+    Export e;
+    e.function_name = function_name;
+    e.function_addr_rva = function_addr;
+
+    exports.push_back( e );
+  }
+
+  return exports;
+}
+
+const uint8_t* PeView::GetPeImagePtr() const {
+  return pe_data_;
+}
+
+size_t PeView::GetSize() const {
+  return size_;
+}
+
+const IMAGE_NT_HEADERS* PeView::GetNtHeaders() const {
+  return nt_headers_;
+}
\ No newline at end of file
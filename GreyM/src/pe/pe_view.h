@@ -0,0 +1,131 @@
+#pragma once
+
+#include "section.h"
+#include "section_headers.h"
+
+struct Export {
+  std::string function_name;
+  uint32_t function_addr_rva;
+};
+
+struct Import {
+  std::string associated_module;
+  std::string function_name;
+  DWORD function_addr_rva;
+  bool ordinal;
+};
+
+struct Relocation {
+  WORD offset : 12;
+  WORD type : 4;
+};
+
+using EachRelocationCallback_t = void ( * )( IMAGE_BASE_RELOCATION* reloc_block,
+                                             uintptr_t rva,
+                                             Relocation* reloc );
+
+using EachRelocationConstCallback_t =
+    void ( * )( const IMAGE_BASE_RELOCATION* reloc_block,
+                const uintptr_t rva,
+                const Relocation* reloc );
+
+// A borrowed pointer to the raw data of a section inside of a PeView
+class SectionView {
+ public:
+  SectionView( const IMAGE_SECTION_HEADER* section_header,
+               const uint8_t* pe_data )
+      : section_header_( section_header ),
+        data_( pe_data + section_header->PointerToRawData ) {}
+
+  std::string GetName() const;
+
+  const IMAGE_SECTION_HEADER& GetSectionHeader() const;
+
+  const uint8_t* GetData() const;
+  uint32_t GetSize() const;
+
+ private:
+  const IMAGE_SECTION_HEADER* section_header_;
+  const uint8_t* data_;
+};
+
+// A read-only pe that does not own its data, the data can be a file mapping
+// or the buffer of a PortableExecutable. The data must outlive the view.
+class PeView {
+ public:
+  PeView( const uint8_t* pe_data, const size_t size );
+
+  // Check whether or not the PE is valid throug the headers
+  bool IsValid() const;
+
+  SectionHeaders GetSectionHeaders() const;
+
+  std::vector<SectionView> GetSections() const;
+
+  // Copies only that section out of the view, use it for the sections that
+  // are going to be modified
+  Section MaterializeSection(
+      const IMAGE_SECTION_HEADER* section_header ) const;
+
+  std::vector<Import> GetImports() const;
+
+  std::vector<Export> GetExports() const;
+
+  std::vector<uintptr_t> GetTlsCallbacklist() const;
+
+  // TFuncConst: void callback(const IMAGE_BASE_RELOCATION *reloc_block,
+  //                      const uintptr_t rva, const Relocation* reloc)
+  template <typename TFuncConst = EachRelocationConstCallback_t>
+  void EachRelocationConst( const TFuncConst& callback ) const;
+
+  const uint8_t* GetPeImagePtr() const;
+  size_t GetSize() const;
+
+  const IMAGE_NT_HEADERS* GetNtHeaders() const;
+
+ private:
+  const uint8_t* pe_data_;
+  size_t size_;
+
+  const IMAGE_NT_HEADERS* nt_headers_;
+  const IMAGE_DOS_HEADER* dos_headers_;
+};
+
+template <typename TFuncConst>
+void PeView::EachRelocationConst( const TFuncConst& callback ) const {
+  const auto sections = GetSectionHeaders();
+
+  const auto& reloc_directory =
+      nt_headers_->OptionalHeader
+          .DataDirectory[ IMAGE_DIRECTORY_ENTRY_BASERELOC ];
+
+  auto reloc_block = reinterpret_cast<const IMAGE_BASE_RELOCATION*>(
+      pe_data_ + sections.RvaToFileOffset( reloc_directory.VirtualAddress ) );
+
+  uint32_t relocation_size_read = 0;
+
+  // Iterate each relocation block
+  while ( relocation_size_read < reloc_directory.Size ) {
+    const DWORD reloc_list_count =
+        ( reloc_block->SizeOfBlock - sizeof( IMAGE_BASE_RELOCATION ) ) /
+        sizeof( WORD );
+
+    const auto reloc_list = reinterpret_cast<const WORD*>(
+        reinterpret_cast<size_t>( reloc_block ) +
+        sizeof( IMAGE_BASE_RELOCATION ) );
+
+    for ( size_t i = 0; i < reloc_list_count; ++i ) {
+      const auto reloc =
+          reinterpret_cast<const Relocation*>( &reloc_list[ i ] );
+
+      const uintptr_t rva = reloc->offset + reloc_block->VirtualAddress;
+
+      callback( reloc_block, rva, reloc );
+    }
+
+    relocation_size_read += reloc_block->SizeOfBlock;
+
+    reloc_block = reinterpret_cast<const IMAGE_BASE_RELOCATION*>(
+        reinterpret_cast<size_t>( reloc_block ) + reloc_block->SizeOfBlock );
+  }
+}
@@ -30,4 +30,21 @@ IMAGE_NT_HEADERS* GetNtHeaders( uint8_t* data ) {
   return nt_headers;
 }
 
+void CheckSectionRawData( const IMAGE_SECTION_HEADER& section_header,
+                          const size_t file_size ) {
+  // Written this way to not overflow on a huge SizeOfRawData
+  if ( section_header.PointerToRawData <= file_size &&
+       section_header.SizeOfRawData <=
+           file_size - section_header.PointerToRawData ) {
+    return;
+  }
+
+  const auto name = reinterpret_cast<const char*>( section_header.Name );
+
+  throw std::runtime_error(
+      "The raw data of the section " +
+      std::string( name, strnlen( name, sizeof( section_header.Name ) ) ) +
+      " is outside of the file" );
+}
+
 }  // namespace peutils
\ No newline at end of file
@@ -8,4 +8,8 @@ uintptr_t AlignDown( const uintptr_t value, const uintptr_t alignment );
 IMAGE_DOS_HEADER* GetDosHeader( uint8_t* data );
 IMAGE_NT_HEADERS* GetNtHeaders( uint8_t* data );
 
+// Throws if the raw data of the section does not fit inside of the file
+void CheckSectionRawData( const IMAGE_SECTION_HEADER& section_header,
+                          const size_t file_size );
+
 }  // namespace peutils
\ No newline at end of file
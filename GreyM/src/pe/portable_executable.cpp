@@ -2,73 +2,106 @@
 #include "portable_executable.h"
 #include "peutils.h"
 
-PortableExecutable pe::Open( const std::vector<uint8_t>& pe_data ) {
-  return PortableExecutable( pe_data );
+namespace {
+
+// Per thread, the batch mode protects several files at the same time
+thread_local uint64_t copied_byte_count = 0;
+
+}  // namespace
+
+void pe::AddCopiedByteCount( const size_t size ) {
+  copied_byte_count += size;
 }
 
-PortableExecutable pe::Build( const std::vector<uint8_t>& header,
-                              const std::vector<Section>& sections ) {
-  std::vector<uint8_t> pe_data;
+void pe::ResetCopiedByteCount() {
+  copied_byte_count = 0;
+}
 
-  uint32_t section_data_size = 0;
+uint64_t pe::GetCopiedByteCount() {
+  return copied_byte_count;
+}
 
-  for ( const auto& section : sections )
-    section_data_size += section.data_.size();
+PortableExecutable pe::Open( const std::vector<uint8_t>& pe_data ) {
+  return PortableExecutable( pe_data );
+}
 
-  // Reserve all required memory to avoid memory performance footprint
-  pe_data.reserve( header.size() + section_data_size );
+PortableExecutable pe::Open( const PeView& pe_view ) {
+  pe::AddCopiedByteCount( pe_view.GetSize() );
 
-  // Append the header
-  pe_data.insert( pe_data.begin(), header.begin(), header.end() );
+  // A single copy straight out of the view into the buffer we own
+  return PortableExecutable( std::vector<uint8_t>(
+      pe_view.GetPeImagePtr(), pe_view.GetPeImagePtr() + pe_view.GetSize() ) );
+}
 
-  const auto nt_headers = *peutils::GetNtHeaders( &pe_data[ 0 ] );
+PortableExecutable pe::Build( const std::vector<uint8_t>& header,
+                              std::vector<Section>&& sections ) {
+  const auto nt_headers =
+      *peutils::GetNtHeaders( const_cast<uint8_t*>( header.data() ) );
 
-  auto sections_copy = sections;
+  // Lay out every section header first, that way we know the final size of
+  // the file and can write each section straight into its place
+  size_t pe_data_size = header.size();
 
-  for ( size_t i = 0; i < sections_copy.size(); ++i ) {
-    auto& section = sections_copy[ i ];
+  for ( size_t i = 0; i < sections.size(); ++i ) {
+    auto& section_header = sections[ i ].section_header_;
+    const auto& section_data = sections[ i ].data_;
 
     // If there is no initial data specified by the section headers
-    if ( !section.section_header_.PointerToRawData ) {
+    if ( !section_header.PointerToRawData ) {
       // Check if the user has added data manually on the section
-      if ( section.data_.size() > 0 ) {
+      if ( section_data.size() > 0 ) {
         // Ensure that we do not go out of bounds
         assert( ( i - 1 ) > 0 );
 
-        const auto raw_data_offset = peutils::AlignUp(
-            pe_data.size(), nt_headers.OptionalHeader.FileAlignment );
-
-        // Insert padding data before the real code
-        pe_data.insert( pe_data.end(), raw_data_offset - pe_data.size(), 0xCC );
-
-        // They must be equal to each other, if not, something very bad occured
-        assert( pe_data.size() == raw_data_offset );
-
         // Set the PointerToRawData appropriately
-        section.section_header_.PointerToRawData = raw_data_offset;
+        section_header.PointerToRawData = static_cast<DWORD>(
+            peutils::AlignUp( pe_data_size,
+                              nt_headers.OptionalHeader.FileAlignment ) );
 
         // If it is the first section, there is no previous section to add on top
         if ( i == 0 ) {
-          section.section_header_.VirtualAddress =
+          section_header.VirtualAddress =
               peutils::AlignUp( nt_headers.OptionalHeader.SizeOfHeaders,
                                 nt_headers.OptionalHeader.SectionAlignment );
         } else {
-          const auto& previous_section = sections_copy[ i - 1 ];
+          const auto& previous_section_header =
+              sections[ i - 1 ].section_header_;
 
-          section.section_header_.VirtualAddress = peutils::AlignUp(
-              previous_section.section_header_.VirtualAddress +
-                  previous_section.section_header_.Misc.VirtualSize,
+          section_header.VirtualAddress = peutils::AlignUp(
+              previous_section_header.VirtualAddress +
+                  previous_section_header.Misc.VirtualSize,
               nt_headers.OptionalHeader.SectionAlignment );
         }
       }
     }
 
-    // Get an updated version of nt header, because when we insert data into
-    // pe_data above, the buffer gets reallocated at another address
-    const auto nt_headers2 = peutils::GetNtHeaders( pe_data.data() );
+    if ( section_data.size() > 0 ) {
+      // Ensure that the section data is aligned with the pointer to raw data
+      // in the section header
+      assert( pe_data_size <= section_header.PointerToRawData );
+      assert( section_data.size() <= section_header.SizeOfRawData );
+
+      pe_data_size =
+          section_header.PointerToRawData + section_header.SizeOfRawData;
+    }
+  }
+
+  // Allocate the whole file once, the gaps between the sections and the
+  // alignment at the end of each section are filled with int3
+  std::vector<uint8_t> pe_data( pe_data_size, 0xCC );
+
+  memcpy( pe_data.data(), header.data(), header.size() );
+
+  pe::AddCopiedByteCount( pe_data_size );
+
+  const auto new_nt_headers = peutils::GetNtHeaders( pe_data.data() );
+
+  for ( size_t i = 0; i < sections.size(); ++i ) {
+    auto& section = sections[ i ];
 
     // Update the section header in the pe header
-    const auto current_section_header = IMAGE_FIRST_SECTION( nt_headers2 ) + i;
+    const auto current_section_header =
+        IMAGE_FIRST_SECTION( new_nt_headers ) + i;
 
     const auto end_ptr_dest_that_will_be_overwritten =
         reinterpret_cast<uintptr_t>( current_section_header ) -
@@ -78,7 +111,7 @@ PortableExecutable pe::Build( const std::vector<uint8_t>& header,
     // If the section headers are being written outside of the header size
     // That means it would overwrite data into the next section, usually .text section
     if ( end_ptr_dest_that_will_be_overwritten >
-         nt_headers2->OptionalHeader.SizeOfHeaders ) {
+         new_nt_headers->OptionalHeader.SizeOfHeaders ) {
       throw std::runtime_error( "The section header " + section.GetName() +
                                 " does not fit inside of the header." );
     }
@@ -88,37 +121,33 @@ PortableExecutable pe::Build( const std::vector<uint8_t>& header,
 
     // If there is data in section, add it to the PE
     if ( section.data_.size() > 0 ) {
-      // Ensure that the section data is aligned with the pointer to raw data in the section header
-      assert( pe_data.size() == section.section_header_.PointerToRawData );
+      memcpy( &pe_data[ section.section_header_.PointerToRawData ],
+              section.data_.data(), section.data_.size() );
 
-      pe_data.insert( pe_data.end(), section.data_.begin(),
-                      section.data_.end() );
-
-      // Insert padding data at the end to fill the entire section due to
-      // alignment
-      pe_data.insert(
-          pe_data.end(),
-          section.section_header_.SizeOfRawData - section.data_.size(), 0xCC );
+      // We own the sections, release the data as soon as it is written
+      // to keep the peak memory usage down on big images
+      std::vector<uint8_t>().swap( section.data_ );
     }
   }
 
-  const auto new_pe = PortableExecutable( pe_data );
-
-  auto& last_section = sections_copy[ sections_copy.size() - 1 ];
+  const auto& last_section_header = sections.back().section_header_;
 
   // Adjusts the nt header for the sections
-  new_pe.nt_headers_->FileHeader.NumberOfSections =
-      static_cast<WORD>( sections_copy.size() );
+  new_nt_headers->FileHeader.NumberOfSections =
+      static_cast<WORD>( sections.size() );
 
-  new_pe.nt_headers_->OptionalHeader.SizeOfImage =
-      last_section.section_header_.VirtualAddress +
-      last_section.section_header_.Misc.VirtualSize;
+  new_nt_headers->OptionalHeader.SizeOfImage =
+      last_section_header.VirtualAddress +
+      last_section_header.Misc.VirtualSize;
 
-  return new_pe;
+  // Hand the buffer over, the constructor takes it as is
+  return PortableExecutable( std::move( pe_data ) );
 }
 
 PortableExecutable::PortableExecutable( const std::vector<uint8_t>& pe_data )
     : nt_headers_( nullptr ), dos_headers_( nullptr ) {
+  pe::AddCopiedByteCount( pe_data.size() );
+
   pe_data_ = pe_data;
 
   const auto pe_data_ptr = &pe_data_[ 0 ];
@@ -128,6 +157,22 @@ PortableExecutable::PortableExecutable( const std::vector<uint8_t>& pe_data )
   nt_headers_ = peutils::GetNtHeaders( pe_data_ptr );
 }
 
+PortableExecutable::PortableExecutable( std::vector<uint8_t>&& pe_data )
+    : nt_headers_( nullptr ), dos_headers_( nullptr ) {
+  pe_data_ = std::move( pe_data );
+
+  const auto pe_data_ptr = &pe_data_[ 0 ];
+
+  dos_headers_ = reinterpret_cast<IMAGE_DOS_HEADER*>( pe_data_ptr );
+
+  nt_headers_ = peutils::GetNtHeaders( pe_data_ptr );
+}
+
+PortableExecutable::PortableExecutable( PortableExecutable&& rhs )
+    : dos_headers_( nullptr ), nt_headers_( nullptr ) {
+  *this = std::move( rhs );
+}
+
 PortableExecutable::PortableExecutable( const PortableExecutable& rhs )
     : dos_headers_( nullptr ), nt_headers_( nullptr ) {
   *this = rhs;
@@ -144,6 +189,8 @@ PortableExecutable::PortableExecutable( const PortableExecutable& rhs )
 
 PortableExecutable& PortableExecutable::operator=(
     const PortableExecutable& rhs ) {
+  pe::AddCopiedByteCount( rhs.pe_data_.size() );
+
   pe_data_ = rhs.pe_data_;
 
   const auto pe_data_ptr = &pe_data_[ 0 ];
@@ -155,6 +202,19 @@ PortableExecutable& PortableExecutable::operator=(
   return *this;
 }
 
+PortableExecutable& PortableExecutable::operator=( PortableExecutable&& rhs ) {
+  // Moving the vector keeps the buffer, so the header pointers stay valid
+  pe_data_ = std::move( rhs.pe_data_ );
+
+  dos_headers_ = rhs.dos_headers_;
+  nt_headers_ = rhs.nt_headers_;
+
+  rhs.dos_headers_ = nullptr;
+  rhs.nt_headers_ = nullptr;
+
+  return *this;
+}
+
 bool PortableExecutable::IsValid() const {
   if ( !dos_headers_ || !nt_headers_ )
     return false;
@@ -186,7 +246,9 @@ std::vector<Section> PortableExecutable::CopySectionsDeep() const {
 
 Section PortableExecutable::CopySectionDeep(
     const IMAGE_SECTION_HEADER* section_header ) const {
-  return Section( *section_header, pe_data_ );
+  peutils::CheckSectionRawData( *section_header, pe_data_.size() );
+
+  return Section( *section_header, pe_data_.data() );
 }
 
 SectionHeaders PortableExecutable::GetSectionHeaders() const {
@@ -205,166 +267,19 @@ SectionHeaders PortableExecutable::GetSectionHeaders() const {
 }
 
 std::vector<Import> PortableExecutable::GetImports() const {
-  std::vector<Import> imports;
-
-  const auto pe_data_ptr = const_cast<uint8_t*>( &pe_data_[ 0 ] );
-
-  const auto& import_directory =
-      nt_headers_->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_IMPORT ];
-
-  // is there an import directory?
-  if ( !import_directory.VirtualAddress )
-    return {};
-
-  auto sections = GetSectionHeaders();
-
-  // For each import desc
-  for ( auto import_descriptor = reinterpret_cast<IMAGE_IMPORT_DESCRIPTOR*>(
-            pe_data_ptr +
-            sections.RvaToFileOffset( import_directory.VirtualAddress ) );
-        import_descriptor->Name; ++import_descriptor ) {
-    // Read the function associated dll name
-    const auto associated_dll_name = reinterpret_cast<const char*>(
-        pe_data_ptr + sections.RvaToFileOffset( import_descriptor->Name ) );
-
-    // Since we are only looking for a function from a specific DLL, check if
-    // the DLL name is the one we want that contains the function we want to
-    // hook to avoid going though every import desc.
-    auto original_thunk = reinterpret_cast<IMAGE_THUNK_DATA*>(
-        pe_data_ptr +
-        sections.RvaToFileOffset( import_descriptor->OriginalFirstThunk ) );
-
-    uint32_t function_address = import_descriptor->FirstThunk;
-
-    // For each import thunk
-    for ( ; original_thunk->u1.AddressOfData;
-          ++original_thunk,
-          function_address += sizeof( import_descriptor->FirstThunk ) ) {
-      assert( original_thunk );
-
-      const bool by_ordinal =
-          IMAGE_SNAP_BY_ORDINAL( original_thunk->u1.Ordinal );
-
-      if ( by_ordinal ) {
-        const auto ordinal = IMAGE_ORDINAL( original_thunk->u1.Ordinal );
-
-        assert( ordinal );
-
-        /*
-          NOTE: (TODO)
-          Because we currently do not use the imports in any important way.
-          We only care about how many there are.
-          Do not care out handling the ordinal properly now.
-          Fo that shi bruhh
-        */
-
-        Import import;
-        import.associated_module = "";
-        import.function_addr_rva = 0;
-        import.function_name = "";
-        import.ordinal = true;
-
-        imports.push_back( import );
-      } else {
-        // Read the import info in that thunk
-        const auto import_name = reinterpret_cast<IMAGE_IMPORT_BY_NAME*>(
-            pe_data_ptr +
-            sections.RvaToFileOffset( original_thunk->u1.AddressOfData ) );
-
-        Import import;
-        {
-          import.associated_module = associated_dll_name;
-          import.function_addr_rva = function_address;
-          import.function_name = import_name->Name;
-          import.ordinal = false;
-        }
-
-        imports.push_back( import );
-      }
-    }
-  }
-
-  return imports;
+  return GetView().GetImports();
 }
 
 std::vector<uintptr_t> PortableExecutable::GetTlsCallbacklist() const {
-  std::vector<uintptr_t> tls_callback_list;
-
-  const auto& tls_data_directory =
-      nt_headers_->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_TLS ];
-
-  const bool has_tls_directory = tls_data_directory.Size != 0;
-
-  auto sections = GetSectionHeaders();
-
-  if ( has_tls_directory ) {
-    assert( sizeof( IMAGE_TLS_DIRECTORY ) == tls_data_directory.Size );
-
-    const auto image_base = nt_headers_->OptionalHeader.ImageBase;
-
-    const auto tls_dir_file_offset =
-        sections.RvaToFileOffset( tls_data_directory.VirtualAddress );
-
-    auto tls_directory = reinterpret_cast<const IMAGE_TLS_DIRECTORY*>(
-        pe_data_.data() + tls_dir_file_offset );
-
-    if ( tls_directory->AddressOfCallBacks ) {
-      auto callback_list_start_offset = sections.RvaToFileOffset(
-          tls_directory->AddressOfCallBacks - image_base );
-
-      auto callback_list_ptr = reinterpret_cast<const uintptr_t*>(
-          pe_data_.data() + callback_list_start_offset );
-
-      for ( ; *callback_list_ptr; callback_list_ptr++ ) {
-        tls_callback_list.push_back( *callback_list_ptr );
-      }
-    }
-  }
-
-  return tls_callback_list;
+  return GetView().GetTlsCallbacklist();
 }
 
 std::vector<Export> PortableExecutable::GetExports() const {
-  std::vector<Export> exports;
-
-  const auto& export_directory =
-      nt_headers_->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXPORT ];
-
-  // Is there an export directory?
-  if ( !export_directory.VirtualAddress )
-    return {};
-
-  auto sections = GetSectionHeaders();
-
-  const auto pe_data_ptr = const_cast<uint8_t*>( &pe_data_[ 0 ] );
-
-  const auto exports_dir = reinterpret_cast<IMAGE_EXPORT_DIRECTORY*>(
-      pe_data_ptr +
-      sections.RvaToFileOffset( export_directory.VirtualAddress ) );
-
-  const auto names = reinterpret_cast<uint32_t*>(
-      pe_data_ptr + sections.RvaToFileOffset( exports_dir->AddressOfNames ) );
-  const auto ordinals = reinterpret_cast<uint16_t*>(
-      pe_data_ptr +
-      sections.RvaToFileOffset( exports_dir->AddressOfNameOrdinals ) );
-  const auto addresses = reinterpret_cast<uint32_t*>(
-      pe_data_ptr +
-      sections.RvaToFileOffset( exports_dir->AddressOfFunctions ) );
-
-  for ( uint32_t i = 0; i < exports_dir->NumberOfNames; ++i ) {
-    const auto function_name = reinterpret_cast<const char*>(
-        pe_data_ptr + sections.RvaToFileOffset( names[ i ] ) );
-
-    const uint32_t function_addr = addresses[ ordinals[ i ] ];
-
-    Export e;
-    e.function_name = function_name;
-    e.function_addr_rva = function_addr;
-
-    exports.push_back( e );
-  }
+  return GetView().GetExports();
+}
 
-  return exports;
+PeView PortableExecutable::GetView() const {
+  return PeView( pe_data_.data(), pe_data_.size() );
 }
 
 void PortableExecutable::DisableASLR() {
@@ -390,6 +305,19 @@ void PortableExecutable::Relocate( const uintptr_t new_image_base_address ) {
   } );
 }
 
+RelocationIndex PortableExecutable::CreateRelocationIndex() {
+  std::vector<RelocationIndex::Entry> entries;
+
+  EachRelocation( [&]( IMAGE_BASE_RELOCATION* reloc_block, uintptr_t rva,
+                       Relocation* reloc ) {
+    if ( reloc->type != IMAGE_REL_BASED_ABSOLUTE ) {
+      entries.push_back( RelocationIndex::Entry{ rva, reloc } );
+    }
+  } );
+
+  return RelocationIndex( std::move( entries ) );
+}
+
 std::vector<uint8_t> PortableExecutable::CopyHeaderData() const {
   return std::vector<uint8_t>(
       pe_data_.begin(),
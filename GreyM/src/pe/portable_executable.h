@@ -2,46 +2,31 @@
 
 #include "section.h"
 #include "section_headers.h"
+#include "pe_view.h"
+#include "relocation_index.h"
 
 class PortableExecutable;
 
 namespace pe {
 
 PortableExecutable Open( const std::vector<uint8_t>& pe_data );
+PortableExecutable Open( const PeView& pe_view );
 PortableExecutable Build( const std::vector<uint8_t>& header,
-                          const std::vector<Section>& sections );
+                          std::vector<Section>&& sections );
 
-}  // namespace pe
-
-struct Export {
-  std::string function_name;
-  uint32_t function_addr_rva;
-};
-
-struct Import {
-  std::string associated_module;
-  std::string function_name;
-  DWORD function_addr_rva;
-  bool ordinal;
-};
-
-struct Relocation {
-  WORD offset : 12;
-  WORD type : 4;
-};
+// Counts every byte of image and section data that gets copied, the protector
+// prints it after each run so new copies do not sneak in unnoticed. The count
+// is kept for each thread.
+void AddCopiedByteCount( const size_t size );
+void ResetCopiedByteCount();
+uint64_t GetCopiedByteCount();
 
-using EachRelocationCallback_t = void ( * )( IMAGE_BASE_RELOCATION* reloc_block,
-                                             uintptr_t rva,
-                                             Relocation* reloc );
-
-using EachRelocationConstCallback_t =
-    void ( * )( const IMAGE_BASE_RELOCATION* reloc_block,
-                const uintptr_t rva,
-                const Relocation* reloc );
+}  // namespace pe
 
 class PortableExecutable {
  private:
   PortableExecutable( const std::vector<uint8_t>& pe_data );
+  PortableExecutable( std::vector<uint8_t>&& pe_data );
 
  public:
   // Delete the constructor, force user to only be able to use the pe:: namespace
@@ -50,8 +35,12 @@ class PortableExecutable {
   // Copy constructor
   PortableExecutable( const PortableExecutable& rhs );
 
+  // Move constructor, steals the buffer of rhs without copying it
+  PortableExecutable( PortableExecutable&& rhs );
+
   // Assignment constructior
   PortableExecutable& operator=( const PortableExecutable& rhs );
+  PortableExecutable& operator=( PortableExecutable&& rhs );
 
   // Check whether or not the PE is valid throug the headers
   bool IsValid() const;
@@ -82,6 +71,13 @@ class PortableExecutable {
 
   std::vector<Export> GetExports() const;
 
+  // Walks the relocation directory once, use it instead of calling
+  // EachRelocation for every RVA to look up
+  RelocationIndex CreateRelocationIndex();
+
+  // A read-only view over our own buffer, invalidated when the buffer changes
+  PeView GetView() const;
+
   void DisableASLR();
   void Relocate( const uintptr_t new_image_base_address );
 
@@ -102,9 +98,10 @@ class PortableExecutable {
   IMAGE_DOS_HEADER* dos_headers_;
 
   friend PortableExecutable pe::Open( const std::vector<uint8_t>& pe_data );
+  friend PortableExecutable pe::Open( const PeView& pe_view );
 
   friend PortableExecutable pe::Build( const std::vector<uint8_t>& header,
-                                       const std::vector<Section>& sections );
+                                       std::vector<Section>&& sections );
 };
 
 template <typename TFunc>
@@ -151,14 +148,6 @@ void PortableExecutable::EachRelocation( const TFunc& callback ) {
 template <typename TFuncConst>
 void PortableExecutable::EachRelocationConst(
     const TFuncConst& callback ) const {
-  // This callback wrapped enforces the const part in the arguments of the callback
-  const auto callback_wrapper =
-      [=]( const IMAGE_BASE_RELOCATION* reloc_block, const uintptr_t rva,
-           const Relocation* reloc ) { callback( reloc_block, rva, reloc ); };
-
-  // DISGUSTING, but recommended by Meyer according to stackoverflow lol
-  const auto one = static_cast<const PortableExecutable&>( *this );
-  auto two = const_cast<PortableExecutable&>( one );
-
-  two.EachRelocation( callback_wrapper );
+  // The view walks our own buffer, nothing is copied
+  GetView().EachRelocationConst( callback );
 }
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include "pch.h"
+#include "relocation_index.h"
+
+RelocationIndex::RelocationIndex( std::vector<Entry>&& entries )
+    : entries_( std::move( entries ) ) {
+  // The relocation blocks are usually sorted already, but nothing in the
+  // PE format requires it
+  std::stable_sort( entries_.begin(), entries_.end(),
+                    []( const Entry& lhs, const Entry& rhs ) {
+                      return lhs.rva < rhs.rva;
+                    } );
+}
+
+std::vector<RelocationIndex::Entry>::const_iterator RelocationIndex::LowerBound(
+    const uintptr_t rva ) const {
+  return std::lower_bound(
+      entries_.cbegin(), entries_.cend(), rva,
+      []( const Entry& entry, const uintptr_t value ) {
+        return entry.rva < value;
+      } );
+}
+
+bool RelocationIndex::Contains( const uintptr_t rva ) const {
+  const auto it = LowerBound( rva );
+  return it != entries_.cend() && it->rva == rva;
+}
+
+std::vector<uintptr_t> RelocationIndex::GetRvasWithin(
+    const uintptr_t rva,
+    const size_t size ) const {
+  std::vector<uintptr_t> rvas_result;
+
+  for ( auto it = LowerBound( rva );
+        it != entries_.cend() && it->rva < rva + size; ++it ) {
+    rvas_result.push_back( it->rva );
+  }
+
+  return rvas_result;
+}
+
+bool RelocationIndex::Remove( const uintptr_t rva ) {
+  bool removed = false;
+
+  // A pe may relocate the same RVA more than once, remove them all
+  for ( auto it = LowerBound( rva ); it != entries_.cend() && it->rva == rva;
+        ++it ) {
+    // Turn it into padding
+    it->reloc->type = IMAGE_REL_BASED_ABSOLUTE;
+
+    // Reset the offset as well to prevent this from being
+    // used to determine some stuff for the badboy
+    it->reloc->offset = 0;
+
+    removed = true;
+  }
+
+  return removed;
+}
+
+size_t RelocationIndex::GetSize() const {
+  return entries_.size();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "pe_view.h"
+
+// All of the relocations of a pe sorted by their RVA, built in a single walk
+// of the relocation directory. The entries point into the buffer of the pe it
+// was created from, they are invalidated when that buffer changes.
+class RelocationIndex {
+ public:
+  struct Entry {
+    uintptr_t rva;
+    Relocation* reloc;
+  };
+
+  RelocationIndex() = default;
+  RelocationIndex( std::vector<Entry>&& entries );
+
+  bool Contains( const uintptr_t rva ) const;
+
+  // Returns the RVA of every relocation within [rva, rva + size) sorted
+  std::vector<uintptr_t> GetRvasWithin( const uintptr_t rva,
+                                        const size_t size ) const;
+
+  // Turns the relocations at that RVA into padding, returns false if there
+  // were none
+  bool Remove( const uintptr_t rva );
+
+  size_t GetSize() const;
+
+ private:
+  std::vector<Entry>::const_iterator LowerBound( const uintptr_t rva ) const;
+
+  // Padding relocations are not part of it
+  std::vector<Entry> entries_;
+};
@@ -4,13 +4,18 @@
 #include "peutils.h"
 
 Section::Section( const IMAGE_SECTION_HEADER& section_header,
-                  const std::vector<uint8_t> pe_data )
+                  const std::vector<uint8_t>& pe_data )
+    : Section( section_header, pe_data.data() ) {}
+
+Section::Section( const IMAGE_SECTION_HEADER& section_header,
+                  const uint8_t* pe_data )
     : section_header_( section_header ) {
+  pe::AddCopiedByteCount( section_header.SizeOfRawData );
+
   // We use SizeOfRawData because it has to be aligned in the executable (file)
-  data_ =
-      std::vector<uint8_t>( pe_data.cbegin() + section_header.PointerToRawData,
-                            pe_data.cbegin() + section_header.PointerToRawData +
-                                section_header_.SizeOfRawData );
+  data_ = std::vector<uint8_t>( pe_data + section_header.PointerToRawData,
+                                pe_data + section_header.PointerToRawData +
+                                    section_header_.SizeOfRawData );
 }
 
 uintptr_t Section::AppendCode( const std::vector<uint8_t>& code,
@@ -37,6 +42,19 @@ uintptr_t Section::AppendCode( const uint8_t* buffer,
   return current_offset;
 }
 
+uintptr_t Section::AppendSpace( const uintptr_t size,
+                                const uint32_t file_alignment ) {
+  const auto current_offset = data_.size();
+
+  data_.resize( data_.size() + size );
+
+  section_header_.SizeOfRawData =
+      peutils::AlignUp( data_.size(), file_alignment );
+  section_header_.Misc.VirtualSize = data_.size();
+
+  return current_offset;
+}
+
 std::string Section::GetName() const {
   return std::string( reinterpret_cast<const char*>( section_header_.Name ) );
 }
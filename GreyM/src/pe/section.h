@@ -22,7 +22,7 @@ uintptr_t SectionOffsetToRva( const IMAGE_SECTION_HEADER& section_header,
 namespace pe {
 
 PortableExecutable Build( const std::vector<uint8_t>& header,
-                          const std::vector<Section>& sections );
+                          std::vector<Section>&& sections );
 
 }  // namespace pe
 
@@ -31,7 +31,10 @@ class Section {
   Section() : section_header_{ 0 }, data_{} {}
 
   Section( const IMAGE_SECTION_HEADER& section_header,
-           const std::vector<uint8_t> pe_data );
+           const std::vector<uint8_t>& pe_data );
+
+  Section( const IMAGE_SECTION_HEADER& section_header,
+           const uint8_t* pe_data );
 
   // AppendCode returns the new code offset relative to the section beginning
   // in other words, if offset is 0, it is on the beginning of the section
@@ -43,6 +46,10 @@ class Section {
                         const uintptr_t size,
                         const uint32_t file_alignment );
 
+  // Appends size zeroed bytes to be written through GetData, returns the
+  // offset like AppendCode
+  uintptr_t AppendSpace( const uintptr_t size, const uint32_t file_alignment );
+
   template <typename T>
   uintptr_t AppendValue( const T& variable, const uint32_t file_alignment );
 
@@ -64,7 +71,7 @@ class Section {
                                               const DWORD characteristics );
 
   friend PortableExecutable pe::Build( const std::vector<uint8_t>& header,
-                                       const std::vector<Section>& sections );
+                                       std::vector<Section>&& sections );
 };
 
 template <typename T>
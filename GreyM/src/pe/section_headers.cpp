@@ -2,15 +2,40 @@
 #include "section_headers.h"
 #include "section.h"
 
+SectionHeaders::SectionHeaders( std::vector<IMAGE_SECTION_HEADER*>& headers )
+    : headers_( headers ),
+      headers_by_rva_( headers ),
+      last_rva_hit_( nullptr ) {
+  std::stable_sort( headers_by_rva_.begin(), headers_by_rva_.end(),
+                    []( const IMAGE_SECTION_HEADER* lhs,
+                        const IMAGE_SECTION_HEADER* rhs ) {
+                      return lhs->VirtualAddress < rhs->VirtualAddress;
+                    } );
+
+  section_begin_rvas_.reserve( headers_by_rva_.size() );
+
+  for ( const auto section_header : headers_by_rva_ )
+    section_begin_rvas_.push_back( section_header->VirtualAddress );
+
+  for ( const auto section_header : headers_ ) {
+    // The name is not null terminated if it takes all of the 8 characters
+    const auto name = reinterpret_cast<const char*>( section_header->Name );
+    const auto name_length = strnlen( name, sizeof( section_header->Name ) );
+
+    // emplace keeps the first one just like the search used to
+    headers_by_name_.emplace( std::string( name, name_length ),
+                              section_header );
+  }
+}
+
 IMAGE_SECTION_HEADER* SectionHeaders::FromName(
     const std::string& name ) const {
-  for ( auto& section_header : headers_ ) {
-    if ( strcmp( reinterpret_cast<const char*>( section_header->Name ),
-                 name.c_str() ) == 0 )
-      return section_header;
-  }
+  const auto it = headers_by_name_.find( name );
 
-  return nullptr;
+  if ( it == headers_by_name_.end() )
+    return nullptr;
+
+  return it->second;
 }
 
 uintptr_t SectionHeaders::RvaToFileOffset( const uintptr_t rva ) const {
@@ -20,8 +45,7 @@ uintptr_t SectionHeaders::RvaToFileOffset( const uintptr_t rva ) const {
     return 0;
 
   // if the section is empty
-  if ( strcmp( reinterpret_cast<const char*>( section_header->Name ), "" ) ==
-       0 )
+  if ( section_header->Name[ 0 ] == '\0' )
     return 0;
 
   return section_header->PointerToRawData +
@@ -29,8 +53,28 @@ uintptr_t SectionHeaders::RvaToFileOffset( const uintptr_t rva ) const {
 }
 
 IMAGE_SECTION_HEADER* SectionHeaders::FromRva( const uintptr_t rva ) const {
-  for ( auto& section_header : headers_ ) {
+  if ( last_rva_hit_ && section::IsRvaWithinSection( *last_rva_hit_, rva ) )
+    return last_rva_hit_;
+
+  // The last section that begins at or before the rva
+  auto it = std::upper_bound( section_begin_rvas_.begin(),
+                              section_begin_rvas_.end(), rva );
+
+  if ( it == section_begin_rvas_.begin() )
+    return nullptr;
+
+  // Empty sections can begin at the same rva as the one that has it, check
+  // all of them in the order of the headers
+  const auto begin_rva = *( it - 1 );
+
+  for ( it = std::lower_bound( section_begin_rvas_.begin(),
+                               section_begin_rvas_.end(), begin_rva );
+        it != section_begin_rvas_.end() && *it == begin_rva; ++it ) {
+    const auto section_header =
+        headers_by_rva_[ it - section_begin_rvas_.begin() ];
+
     if ( section::IsRvaWithinSection( *section_header, rva ) ) {
+      last_rva_hit_ = section_header;
       return section_header;
     }
   }
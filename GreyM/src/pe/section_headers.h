@@ -1,9 +1,10 @@
 #pragma once
 
+// The lookups are built once on construction, a copy is meant to be used by
+// a single thread at a time because of the last hit cache
 class SectionHeaders {
  public:
-  SectionHeaders( std::vector<IMAGE_SECTION_HEADER*>& headers )
-      : headers_( headers ) {}
+  SectionHeaders( std::vector<IMAGE_SECTION_HEADER*>& headers );
 
   IMAGE_SECTION_HEADER* FromName( const std::string& name ) const;
 
@@ -13,4 +14,13 @@ class SectionHeaders {
 
  private:
   std::vector<IMAGE_SECTION_HEADER*> headers_;
-};
\ No newline at end of file
+
+  // The headers sorted by their virtual address for a binary search
+  std::vector<IMAGE_SECTION_HEADER*> headers_by_rva_;
+  std::vector<uintptr_t> section_begin_rvas_;
+
+  std::unordered_map<std::string, IMAGE_SECTION_HEADER*> headers_by_name_;
+
+  // Lookups usually hit the same section many times in a row
+  mutable IMAGE_SECTION_HEADER* last_rva_hit_;
+};
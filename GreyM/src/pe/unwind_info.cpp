@@ -0,0 +1,166 @@
+#include "pch.h"
+#include "unwind_info.h"
+
+namespace unwind_info {
+
+constexpr uint8_t kUwopAllocLarge = 1;
+constexpr uint8_t kUwopAllocSmall = 2;
+constexpr uint8_t kUwopEpilog = 6;
+
+constexpr uint32_t kMaxUnwindCodes = 0xFF;
+
+uint16_t MakeUnwindCode( const uint8_t unwind_op, const uint8_t op_info ) {
+  // The code offset is only looked at within the prolog, these have none
+  return static_cast<uint16_t>( ( unwind_op | ( op_info << 4 ) ) << 8 );
+}
+
+uint8_t GetUnwindOp( const uint16_t unwind_code ) {
+  return ( unwind_code >> 8 ) & 0xF;
+}
+
+std::vector<IMAGE_RUNTIME_FUNCTION_ENTRY> GetRuntimeFunctions(
+    const PeView& pe ) {
+  std::vector<IMAGE_RUNTIME_FUNCTION_ENTRY> runtime_functions;
+
+  const auto& exception_directory =
+      pe.GetNtHeaders()
+          ->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXCEPTION ];
+
+  if ( exception_directory.VirtualAddress == 0 ||
+       exception_directory.Size == 0 ) {
+    return runtime_functions;
+  }
+
+  const auto exception_directory_offset =
+      pe.GetSectionHeaders().RvaToFileOffset(
+          exception_directory.VirtualAddress );
+
+  if ( exception_directory_offset == 0 ||
+       exception_directory_offset + exception_directory.Size > pe.GetSize() ) {
+    return runtime_functions;
+  }
+
+  const auto first_runtime_function =
+      reinterpret_cast<const IMAGE_RUNTIME_FUNCTION_ENTRY*>(
+          pe.GetPeImagePtr() + exception_directory_offset );
+
+  runtime_functions.assign(
+      first_runtime_function,
+      first_runtime_function +
+          exception_directory.Size / sizeof( IMAGE_RUNTIME_FUNCTION_ENTRY ) );
+
+  return runtime_functions;
+}
+
+bool Read( const PeView& pe, const uint32_t rva, UnwindInfo* unwind_info ) {
+  const auto offset = pe.GetSectionHeaders().RvaToFileOffset( rva );
+
+  if ( offset == 0 || offset + sizeof( uint32_t ) > pe.GetSize() ) {
+    return false;
+  }
+
+  const auto data = pe.GetPeImagePtr() + offset;
+
+  const uint8_t version = data[ 0 ] & 0x7;
+  const uint8_t flags = data[ 0 ] >> 3;
+  const uint8_t code_count = data[ 2 ];
+
+  if ( ( version != 1 && version != 2 ) || ( flags & kChainInfoFlag ) ) {
+    return false;
+  }
+
+  if ( offset + sizeof( uint32_t ) + code_count * sizeof( uint16_t ) >
+       pe.GetSize() ) {
+    return false;
+  }
+
+  unwind_info->version = version;
+  unwind_info->prolog_size = data[ 1 ];
+  unwind_info->frame = data[ 3 ];
+
+  const auto codes =
+      reinterpret_cast<const uint16_t*>( data + sizeof( uint32_t ) );
+
+  unwind_info->codes.assign( codes, codes + code_count );
+
+  return true;
+}
+
+UnwindInfo GetBodyUnwindInfo( const UnwindInfo& unwind_info ) {
+  UnwindInfo body_unwind_info;
+  body_unwind_info.frame = unwind_info.frame;
+
+  size_t first_code = 0;
+
+  // The epilog codes of version 2 come first
+  if ( unwind_info.version == 2 ) {
+    while ( first_code < unwind_info.codes.size() &&
+            GetUnwindOp( unwind_info.codes[ first_code ] ) == kUwopEpilog ) {
+      ++first_code;
+    }
+  }
+
+  body_unwind_info.codes.assign( unwind_info.codes.begin() + first_code,
+                                 unwind_info.codes.end() );
+
+  return body_unwind_info;
+}
+
+void AddStackAllocation( UnwindInfo* unwind_info, const uint32_t size ) {
+  assert( size % 8 == 0 );
+
+  auto& codes = unwind_info->codes;
+
+  if ( size == 0 ) {
+    return;
+  }
+
+  if ( size <= 128 ) {
+    const auto op_info = static_cast<uint8_t>( size / 8 - 1 );
+    codes.push_back( MakeUnwindCode( kUwopAllocSmall, op_info ) );
+  } else if ( size <= 0x7FFF8 ) {
+    codes.push_back( MakeUnwindCode( kUwopAllocLarge, 0 ) );
+    codes.push_back( static_cast<uint16_t>( size / 8 ) );
+  } else {
+    codes.push_back( MakeUnwindCode( kUwopAllocLarge, 1 ) );
+    codes.push_back( static_cast<uint16_t>( size ) );
+    codes.push_back( static_cast<uint16_t>( size >> 16 ) );
+  }
+}
+
+std::vector<uint8_t> Serialize(
+    const UnwindInfo& unwind_info,
+    const IMAGE_RUNTIME_FUNCTION_ENTRY* chained_function ) {
+  if ( unwind_info.codes.size() > kMaxUnwindCodes ) {
+    throw std::runtime_error( "Too many unwind codes for an UNWIND_INFO" );
+  }
+
+  const uint8_t flags = chained_function ? kChainInfoFlag : 0;
+
+  std::vector<uint8_t> data = {
+      static_cast<uint8_t>( unwind_info.version | ( flags << 3 ) ),
+      unwind_info.prolog_size,
+      static_cast<uint8_t>( unwind_info.codes.size() ), unwind_info.frame };
+
+  for ( const auto code : unwind_info.codes ) {
+    data.push_back( static_cast<uint8_t>( code ) );
+    data.push_back( static_cast<uint8_t>( code >> 8 ) );
+  }
+
+  // The codes are padded to an even count, this keeps the size aligned too
+  if ( unwind_info.codes.size() % 2 != 0 ) {
+    data.insert( data.end(), sizeof( uint16_t ), 0 );
+  }
+
+  if ( chained_function ) {
+    const auto chained_function_data =
+        reinterpret_cast<const uint8_t*>( chained_function );
+
+    data.insert( data.end(), chained_function_data,
+                 chained_function_data + sizeof( *chained_function ) );
+  }
+
+  return data;
+}
+
+}  // namespace unwind_info
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "pe_view.h"
+
+/*
+  The x64 exception directory and the UNWIND_INFO its entries point to:
+
+    ubyte version : 3, flags : 5
+    ubyte size of prolog
+    ubyte count of codes
+    ubyte frame register : 4, frame offset : 4
+    ushort codes[ count of codes ]      <-- Padded to an even count
+    RUNTIME_FUNCTION chained            <-- Or the handler, depending on flags
+
+  Nothing here writes a handler, the protector has no use for one.
+*/
+namespace unwind_info {
+
+constexpr uint8_t kChainInfoFlag = 0x4;
+
+struct UnwindInfo {
+  uint8_t version = 1;
+  uint8_t prolog_size = 0;
+
+  // The frame register in the low and the frame offset in the high 4 bits
+  uint8_t frame = 0;
+
+  // The UNWIND_CODE slots in the order that the unwinder applies them
+  std::vector<uint16_t> codes;
+};
+
+// The entries of the exception directory in the order of the file, empty if
+// the pe has none
+std::vector<IMAGE_RUNTIME_FUNCTION_ENTRY> GetRuntimeFunctions(
+    const PeView& pe );
+
+// The UNWIND_INFO at the rva without its handler, false if it is chained to
+// another one or does not fit in the pe
+bool Read( const PeView& pe, const uint32_t rva, UnwindInfo* unwind_info );
+
+// The codes that undo the whole prolog, as the unwinder sees it from within
+// the body of the function. The epilog codes of version 2 are left out
+// because they describe the end of that function only.
+UnwindInfo GetBodyUnwindInfo( const UnwindInfo& unwind_info );
+
+// Undoes a stack allocation of size bytes, a multiple of 8
+void AddStackAllocation( UnwindInfo* unwind_info, const uint32_t size );
+
+// The UNWIND_INFO with the chained entry if there is one, the size is a
+// multiple of 4 and the UnwindData of the chained entry is the last value
+std::vector<uint8_t> Serialize(
+    const UnwindInfo& unwind_info,
+    const IMAGE_RUNTIME_FUNCTION_ENTRY* chained_function = nullptr );
+
+}  // namespace unwind_info
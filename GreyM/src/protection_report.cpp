@@ -0,0 +1,185 @@
+#include "pch.h"
+#include "protection_report.h"
+#include "utils/file_io.h"
+
+namespace {
+
+// The innermost phase of the thread, each file of a batch runs on its own
+thread_local ScopedReportPhase* current_phase = nullptr;
+
+std::string EscapeJsonString( const std::string& value ) {
+  std::string escaped;
+
+  escaped.reserve( value.size() );
+
+  for ( const char c : value ) {
+    if ( c == '"' || c == '\\' ) {
+      escaped += '\\';
+      escaped += c;
+    } else if ( static_cast<unsigned char>( c ) < 0x20 ) {
+      char buf[ 8 ];
+      sprintf_s( buf, "\\u%04x", c );
+      escaped += buf;
+    } else {
+      escaped += c;
+    }
+  }
+
+  return escaped;
+}
+
+}  // namespace
+
+ScopedReportPhase::ScopedReportPhase( ProtectionReport* report,
+                                      const char* name )
+    : report_( report ),
+      name_( name ),
+      elapsed_milliseconds_( 0 ),
+      outer_phase_( nullptr ) {
+  if ( !report_ )
+    return;
+
+  outer_phase_ = current_phase;
+
+  if ( outer_phase_ )
+    outer_phase_->Pause();
+
+  current_phase = this;
+
+  stopwatch_.Start();
+}
+
+ScopedReportPhase::~ScopedReportPhase() {
+  if ( !report_ )
+    return;
+
+  Pause();
+
+  current_phase = outer_phase_;
+
+  if ( outer_phase_ )
+    outer_phase_->Resume();
+
+  auto& phases = report_->phases;
+
+  const auto phase_found =
+      std::find_if( phases.begin(), phases.end(),
+                    [&]( const ProtectionReport::Phase& phase ) {
+                      return phase.name == name_;
+                    } );
+
+  if ( phase_found != phases.end() ) {
+    phase_found->milliseconds += elapsed_milliseconds_;
+  } else {
+    phases.push_back( ProtectionReport::Phase{ name_, elapsed_milliseconds_ } );
+  }
+}
+
+void ScopedReportPhase::Pause() {
+  stopwatch_.Stop();
+  elapsed_milliseconds_ += stopwatch_.GetElapsedMilliseconds();
+}
+
+void ScopedReportPhase::Resume() {
+  stopwatch_.Restart();
+}
+
+std::string protection_report::ToJson( const ProtectionReport& report ) {
+  std::stringstream json;
+
+  json << "{\n";
+
+  json << "  \"phases_ms\": {";
+
+  for ( size_t i = 0; i < report.phases.size(); ++i ) {
+    const auto& phase = report.phases[ i ];
+
+    json << ( i == 0 ? "\n" : ",\n" ) << "    \""
+         << EscapeJsonString( phase.name ) << "\": " << phase.milliseconds;
+  }
+
+  json << "\n  },\n";
+
+  json << "  \"disassembled_instructions\": "
+       << report.disassembled_instruction_count << ",\n";
+  json << "  \"virtualized_instructions\": "
+       << report.virtualized_instruction_count << ",\n";
+  json << "  \"invalidated_instructions\": "
+       << report.invalidated_instruction_count << ",\n";
+  json << "  \"fixups\": " << report.fixup_count << ",\n";
+  json << "  \"removed_relocations\": " << report.removed_relocation_count
+       << ",\n";
+  json << "  \"copied_bytes\": " << report.copied_byte_count << ",\n";
+
+  json << "  \"sections\": [";
+
+  for ( size_t i = 0; i < report.sections.size(); ++i ) {
+    const auto& section = report.sections[ i ];
+
+    json << ( i == 0 ? "\n" : ",\n" ) << "    { \"name\": \""
+         << EscapeJsonString( section.name )
+         << "\", \"original_size\": " << section.original_size
+         << ", \"protected_size\": " << section.protected_size
+         << ", \"added_bytes\": "
+         << static_cast<int64_t>( section.protected_size ) -
+                static_cast<int64_t>( section.original_size )
+         << " }";
+  }
+
+  json << "\n  ]";
+
+  if ( report.is_dry_run ) {
+    const auto& cost_estimate = report.cost_estimate;
+
+    json << ",\n  \"cost_estimate\": {\n";
+    json << "    \"vm_loader_section_growth\": "
+         << cost_estimate.vm_loader_section_growth << ",\n";
+    json << "    \"virtualized_code_section_growth\": "
+         << cost_estimate.virtualized_code_section_growth << ",\n";
+    json << "    \"vm_bytecode_section_growth\": "
+         << cost_estimate.vm_bytecode_section_growth << ",\n";
+    json << "    \"profile_section_growth\": "
+         << cost_estimate.profile_section_growth << ",\n";
+    json << "    \"reloc_section_growth\": "
+         << cost_estimate.reloc_section_growth << ",\n";
+    json << "    \"calibrated\": "
+         << ( cost_estimate.calibrated ? "true" : "false" ) << ",\n";
+
+    json << "    \"functions\": [";
+
+    for ( size_t i = 0; i < cost_estimate.functions.size(); ++i ) {
+      const auto& function = cost_estimate.functions[ i ];
+
+      json << ( i == 0 ? "\n" : ",\n" )
+           << "      { \"rva\": " << function.function_rva
+           << ", \"sites\": " << function.site_count << " }";
+    }
+
+    json << "\n    ],\n";
+
+    json << "    \"sites\": [";
+
+    for ( size_t i = 0; i < cost_estimate.sites.size(); ++i ) {
+      const auto& site = cost_estimate.sites[ i ];
+
+      json << ( i == 0 ? "\n" : ",\n" ) << "      { \"rva\": " << site.rva
+           << ", \"vm_opcode\": " << site.vm_opcode
+           << ", \"cycles_per_execution\": " << site.cycles_per_execution
+           << ", \"executions\": " << site.execution_count << " }";
+    }
+
+    json << "\n    ]\n  }";
+  }
+
+  json << "\n}\n";
+
+  return json.str();
+}
+
+bool protection_report::WriteJson( const std::wstring& filename,
+                                   const ProtectionReport& report ) {
+  const auto json = ToJson( report );
+
+  return fileio::WriteFileData(
+      filename, std::vector<uint8_t>( json.begin(), json.end() ) );
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "utils/stopwatch.h"
+
+// Filled by protector::Protect if asked for, written as JSON so the build
+// machines can track the time and the size of each protection
+struct ProtectionReport {
+  struct Phase {
+    std::string name;
+    double milliseconds;
+  };
+
+  struct SectionSize {
+    std::string name;
+    // 0 for the sections that we added
+    uint32_t original_size;
+    uint32_t protected_size;
+  };
+
+  struct FunctionSites {
+    // 0 for the sites outside of the functions of the exception directory
+    uint32_t function_rva;
+    uint32_t site_count;
+  };
+
+  struct SiteCost {
+    uint32_t rva;
+    uint32_t vm_opcode;
+    double cycles_per_execution;
+    // From the profile, 0 without one
+    uint64_t execution_count;
+  };
+
+  // What a dry run predicts the virtualization of .text adds, before the
+  // sections are aligned
+  struct CostEstimate {
+    uint64_t vm_loader_section_growth = 0;
+    uint64_t virtualized_code_section_growth = 0;
+    uint64_t vm_bytecode_section_growth = 0;
+    uint64_t profile_section_growth = 0;
+    uint64_t reloc_section_growth = 0;
+
+    // False without an opcode cost table, all the cycles are 0 then
+    bool calibrated = false;
+
+    // Sorted by the rva
+    std::vector<FunctionSites> functions;
+    std::vector<SiteCost> sites;
+  };
+
+  // In the order they first ran, a phase that ran more than once is summed
+  // up. The time of a nested phase is not part of the phase around it.
+  std::vector<Phase> phases;
+
+  uint32_t disassembled_instruction_count = 0;
+  uint32_t virtualized_instruction_count = 0;
+  uint32_t invalidated_instruction_count = 0;
+  uint64_t fixup_count = 0;
+  uint64_t removed_relocation_count = 0;
+  uint64_t copied_byte_count = 0;
+
+  // Taken before the section names are randomized
+  std::vector<SectionSize> sections;
+
+  // Nothing was emitted, the sections are empty and the estimate is set
+  bool is_dry_run = false;
+  CostEstimate cost_estimate;
+};
+
+// Adds the time until it goes out of scope to a phase of the report, does
+// nothing without a report. A phase inside of another one pauses the outer.
+class ScopedReportPhase {
+ public:
+  ScopedReportPhase( ProtectionReport* report, const char* name );
+  ~ScopedReportPhase();
+
+  ScopedReportPhase( const ScopedReportPhase& ) = delete;
+  ScopedReportPhase& operator=( const ScopedReportPhase& ) = delete;
+
+ private:
+  void Pause();
+  void Resume();
+
+  ProtectionReport* report_;
+  const char* name_;
+
+  Stopwatch stopwatch_;
+  double elapsed_milliseconds_;
+
+  ScopedReportPhase* outer_phase_;
+};
+
+namespace protection_report {
+
+std::string ToJson( const ProtectionReport& report );
+
+bool WriteJson( const std::wstring& filename,
+                const ProtectionReport& report );
+
+}  // namespace protection_report
@@ -2,8 +2,11 @@
 #include "protector.h"
 #include "disassembler/pe_disassembly_engine.h"
 #include "pe/portable_executable.h"
+#include "pe/unwind_info.h"
 #include "utils/stopwatch.h"
 #include "virtualizer/virtualizer.h"
+#include "virtualizer/vm_entry_thunk.h"
+#include "virtualizer/import_redirect_thunk.h"
 #include "utils/shellcode.h"
 #include "utils/file_io.h"
 #include "rtti_obfuscator.h"
@@ -11,10 +14,17 @@
 #include "pe/peutils.h"
 #include "utils/console_log.h"
 #include "utils/file_log.h"
+#include "virtualization_policy.h"
+#include "opcode_cost_table.h"
 
 #include "../../Interpreter/src/main.h"
 
 #include "../pe/peutils.h"
+#include "utils/defer.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
 
 namespace protector {
 
@@ -22,6 +32,9 @@ enum class FixupOperation {
   AddVmLoaderSectionVirtualAddress,
   SubtractVmLoaderSectionVirtualAddress,
   AddVirtualizedCodeSectionVirtualAddress,
+  AddProfileSectionVirtualAddress,
+  AddVmBytecodeSectionVirtualAddress,
+  AddVmUnwindSectionVirtualAddress,
 };
 
 enum class OffsetRelativeTo {
@@ -29,6 +42,7 @@ enum class OffsetRelativeTo {
   TextSection,
   RelocSection,
   VirtualizedCodeSection,
+  VmUnwindSection,
   Beginning,
 
   Unknown
@@ -47,7 +61,8 @@ struct Fixup {
 };
 
 struct FixupContext {
-  std::vector<uintptr_t> relocation_rvas_to_remove;
+  // A set, the same relocation can be reached from more than one instruction
+  std::unordered_set<uintptr_t> relocation_rvas_to_remove;
 
   // A list containing offset relative to vm section
   // that will be added to the relocation table in the PE
@@ -61,18 +76,118 @@ struct FixupContext {
 enum class WhatToVirtualize { TextSection, VmLoaderSection };
 
 struct VirtualizerContext {
-  std::vector<uintptr_t> original_pe_relocation_rvas;
+  RelocationIndex original_pe_relocation_index;
   IMAGE_NT_HEADERS* original_pe_nt_headers;
   uint32_t interpreter_function_offset;
   IMAGE_SECTION_HEADER original_text_section_header;
   uint32_t total_virtualized_instructions = 0;
   uint32_t total_disassembled_instructions = 0;
+  uint32_t total_invalidated_instructions = 0;
   WhatToVirtualize what_to_virtualize;
   IMAGE_SECTION_HEADER vm_loader_section_header;
   uintptr_t default_image_base;
 
-  Section original_text_section_copy;
+  bool instrument_virtualized_code = false;
+
+  // Read from the profile of an instrumented build
+  // first: instruction rva, second: execution count
+  std::unordered_map<uint64_t, uint64_t> site_execution_counts;
+  uint64_t hot_site_threshold = 0;
+
+  // The iat slots of the imports that FixImports redirects, calls through
+  // them are virtualized as CALL_IMPORT
+  std::unordered_set<uintptr_t> redirected_import_slot_rvas;
+
+  // The sites of a telemetry build, the index is the site index in the
+  // virtualized code. first: rva, second: the instruction text
+  std::vector<std::pair<uint64_t, std::string>> telemetry_sites = {
+    { 0, "reserved" } };
+
+  bool has_virtualization_policy = false;
+  virtualization_policy::Policy virtualization_policy;
+
+  // The vm loader section offsets of the shared vm entry trampolines
+  // first: GetVmEntryTrampolineKey, second: the offset
+  std::unordered_map<uint64_t, uintptr_t> vm_entry_trampoline_offsets;
+
+#ifndef _WIN64
+  // The vm loader section offset of the image base that all of the loaders
+  // read, it is the only one of them that has to be relocated
+  uintptr_t image_base_slot_offset = 0;
+#endif
+};
+
+// The maximum amount of instructions executed within a single vm entry
+constexpr size_t kMaxVmBlockInstructions = 16;
+
+// A virtualizable instruction collected by the disassembler, its code is
+// generated once the disassembly is done and the blocks are known
+struct PendingVmInstruction {
+  uint64_t address;
+  uint8_t size;
+  VmOpcodes vm_opcode;
+
+  // Points into the pe that is being disassembled, the instruction is decoded
+  // again from here when the virtualized code is generated
+  const uint8_t* code;
+
+  std::vector<uintptr_t> relocation_rvas;
+  virtualizer::VmRegisterUsage register_usage;
+  uint32_t telemetry_site_index = 0;
+
+#if ENABLE_SHARED_VM_ENTRY
+  // The thunk is written from these when the block is emitted
+  VmOpcodes exit_vm_opcode = VmOpcodes::NO_OPCODE;
+  uint32_t profile_counter_count = 0;
+  uint32_t vm_opcode_encryption_key = 0;
+#else
+  // Generated for all the blocks at once, the offsets are filled in when the
+  // block is emitted
+  Shellcode loader_shellcode;
+#endif
+
+  // Only used for logging
+  std::string text;
+};
+
+struct PendingVmBlock {
+  uint32_t vm_opcode_encyption_key = 0;
+  std::vector<PendingVmInstruction> instructions;
+
+  // A taken JCC_IMM leaves the block through the real stack like JMP_IMM,
+  // the block has to leave the same way when no jump is taken
+  bool has_conditional_jump = false;
+
+  // The virtualized code of all the instructions followed by a VM_EXIT
+  std::vector<uint8_t> virtualized_code;
+  std::vector<uintptr_t> virtualized_code_offsets;
+};
+
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+// A RUNTIME_FUNCTION of the vm loader section
+struct VmUnwindFunction {
+  uint32_t begin_offset;
+  uint32_t end_offset;
+  unwind_info::UnwindInfo unwind_info;
+
+  // Continues with the body of a function of the original pe
+  bool has_chained_function = false;
+  IMAGE_RUNTIME_FUNCTION_ENTRY chained_function = {};
+  unwind_info::UnwindInfo chained_unwind_info;
+};
+
+// A part of a thunk, loader or trampoline in which the stack pointer is
+// stack_size bytes below the one it was entered with
+struct VmUnwindRange {
+  uint32_t begin_offset;
+  uint32_t end_offset;
+  uint32_t stack_size;
+
+  // The virtualized instruction that the code was entered from, 0 for the
+  // trampolines. They are called, a site is jumped to.
+  uint32_t site_rva;
 };
+#endif
 
 struct ProtectorContext {
   // The sections that will either be created or modified
@@ -80,66 +195,53 @@ struct ProtectorContext {
   Section virtualized_code_section;
   Section new_text_section;
 
-  FixupContext fixup_context;
-  VirtualizerContext virtualizer_context;
-};
-
-std::vector<uintptr_t> GetRelocationsWithinInstruction(
-    const cs_insn& instruction,
-    const std::vector<uintptr_t>& relocations_to_search ) {
-  std::vector<uintptr_t> reloc_rvas_result;
-
-  auto it_found_result = relocations_to_search.cend();
+  // Only the virtualized code of the blocks, never written at runtime
+  Section vm_bytecode_section;
 
-  for ( int i = 0; i < instruction.size; ++i ) {
-    const auto instruction_rva = instruction.address + i;
-    auto it = std::lower_bound( relocations_to_search.cbegin(),
-                                relocations_to_search.cend(), instruction_rva );
+  // Only used by an instrumented build
+  Section profile_section;
 
-    // If we found that exact value
-    if ( it != relocations_to_search.cend() && *it == instruction_rva ) {
-      reloc_rvas_result.push_back( *it );
-      it_found_result = it;
+#if ENABLE_ADAPTIVE_DEVIRTUALIZATION
+  // Appended to the virtualized code section once the text is virtualized
+  std::vector<VmAdaptiveSite> adaptive_sites;
+#endif
 
-      // Break out and continue with the second loop to avoid binary searching the whole vector again
-      break;
-    }
-  }
+  FixupContext fixup_context;
+  VirtualizerContext virtualizer_context;
 
-  if ( it_found_result != relocations_to_search.cend() ) {
-    // If we found it, we don't need to binary search the whole vector again
-    // continue iterating the found iterator above
-    for ( auto it = it_found_result + 1; it != relocations_to_search.cend();
-          ++it ) {
-      const auto reloc_rva = *it;
+  // Filled by the disassembler in the order it found them, nothing is
+  // emitted until the disassembly is done
+  std::vector<PendingVmInstruction> collected_vm_instructions;
 
-      const bool is_reloc_within_instruction =
-          ( reloc_rva >= instruction.address ) &&
-          ( reloc_rva < ( instruction.address + instruction.size ) );
+  // The instructions the disassembler found out to be data after all
+  std::unordered_set<uint64_t> invalid_instruction_addresses;
 
-      // if the reloc rva was not within the current instructino, then we are
-      // done because the relocations following this one are definitely not
-      // within this instruction
-      if ( !is_reloc_within_instruction )
-        break;
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+  // The functions of the interpreter, the ranges are turned into functions
+  // once the original exception directory is at hand
+  std::vector<VmUnwindFunction> vm_unwind_functions;
+  std::vector<VmUnwindRange> vm_unwind_ranges;
+#endif
 
-      reloc_rvas_result.push_back( reloc_rva );
-    }
-  }
+  // Optional, the phases are measured into it
+  ProtectionReport* report = nullptr;
+};
 
-  return reloc_rvas_result;
+std::vector<uintptr_t> GetRelocationsWithinInstruction(
+    const cs_insn& instruction,
+    const RelocationIndex& relocations_to_search ) {
+  return relocations_to_search.GetRvasWithin(
+      static_cast<uintptr_t>( instruction.address ), instruction.size );
 }
 
 PortableExecutable ReadInterpreterPe() {
   const std::wstring interpreter_filename = TEXT( "Interpreter.dll" );
 
-  const auto interpreter_file_data =
-      fileio::ReadBinaryFile( interpreter_filename );
-
-  if ( interpreter_file_data.empty() )
-    throw std::runtime_error( "Unable to read the content of Interpreter.dll" );
+  const fileio::MappedFile interpreter_file( interpreter_filename );
 
-  return pe::Open( interpreter_file_data );
+  // The interpreter gets relocated later on, so it has to be copied once
+  return pe::Open(
+      PeView( interpreter_file.GetData(), interpreter_file.GetSize() ) );
 }
 
 void AddInterpreterCodeToSection( const PortableExecutable& interpreter_pe,
@@ -547,45 +649,6 @@ void RelocateInterpreterPe( PortableExecutable* interpreter_pe,
   interpreter_pe->Relocate( base_address_delta + section_delta );
 }
 
-std::vector<uint8_t> CreateRelocationBlockBuffer(
-    const uint32_t virtual_address,
-    const std::vector<Relocation>& relocations ) {
-  std::vector<uint8_t> relocation_block_bytes;
-
-  // Required to be size of a WORD due to the PE format
-  assert( sizeof( Relocation ) == sizeof( WORD ) );
-
-  IMAGE_BASE_RELOCATION reloc_block;
-  {
-    reloc_block.VirtualAddress = virtual_address;
-    reloc_block.SizeOfBlock = sizeof( IMAGE_BASE_RELOCATION ) +
-                              relocations.size() * sizeof( Relocation );
-  }
-
-  const uint8_t* reloc_block_buf = reinterpret_cast<uint8_t*>( &reloc_block );
-
-  relocation_block_bytes.insert( relocation_block_bytes.begin(),
-                                 reloc_block_buf,
-                                 reloc_block_buf + sizeof( reloc_block ) );
-
-  for ( const auto& reloc : relocations ) {
-    const uint8_t* reloc_buf = reinterpret_cast<const uint8_t*>( &reloc );
-
-    relocation_block_bytes.insert( relocation_block_bytes.end(), reloc_buf,
-                                   reloc_buf + sizeof( reloc ) );
-  }
-
-  return relocation_block_bytes;
-}
-
-uint32_t DetermineFirstRelocationBlockVirtualAddress(
-    const std::vector<uintptr_t>& vm_section_offsets_to_add_to_relocation_table,
-    const int highest_reloc_offset ) {
-  assert( vm_section_offsets_to_add_to_relocation_table.size() > 0 );
-  return peutils::AlignDown( vm_section_offsets_to_add_to_relocation_table[ 0 ],
-                             highest_reloc_offset );
-}
-
 void TrimRelocSectionPadding( const IMAGE_NT_HEADERS* nt_headers,
                               Section* reloc_section ) {
   auto reloc_section_data = reloc_section->GetData();
@@ -601,29 +664,47 @@ void TrimRelocSectionPadding( const IMAGE_NT_HEADERS* nt_headers,
                              reloc_section_data->end() );
 }
 
-uintptr_t AppendRelocationBlock( const uintptr_t reloc_block_virtual_address,
-                                 std::vector<Relocation>& relocations,
-                                 IMAGE_NT_HEADERS* nt_headers,
-                                 Section* reloc_section ) {
+// The end of the relocations in the same 4k page as the one at begin, the
+// offsets are sorted
+size_t GetRelocationPageEnd( const std::vector<uintptr_t>& sorted_offsets,
+                             const size_t begin,
+                             const uintptr_t page_size ) {
+  const auto page = peutils::AlignDown( sorted_offsets[ begin ], page_size );
+
+  auto end = begin + 1;
+
+  while ( end < sorted_offsets.size() &&
+          peutils::AlignDown( sorted_offsets[ end ], page_size ) == page ) {
+    ++end;
+  }
+
+  return end;
+}
+
+uint32_t GetRelocationBlockSize( const size_t relocation_count ) {
   // if the count of relocations are odd, we need to add one no-op with type
   // and type 0, offset 0 to align to 32 bit boundary
-  if ( relocations.size() % 2 != 0 ) {
-    relocations.push_back( Relocation{ 0 } );
-  }
+  const auto padded_relocation_count = ( relocation_count + 1 ) & ~1;
 
-  std::vector<uint8_t> reloc_block_bytes =
-      CreateRelocationBlockBuffer( reloc_block_virtual_address, relocations );
+  return static_cast<uint32_t>( sizeof( IMAGE_BASE_RELOCATION ) +
+                                padded_relocation_count *
+                                    sizeof( Relocation ) );
+}
 
-  const auto dest_offset = reloc_section->AppendCode(
-      reloc_block_bytes, nt_headers->OptionalHeader.SectionAlignment,
-      nt_headers->OptionalHeader.FileAlignment );
+// The size of the page grouped blocks for the sorted offsets
+uintptr_t GetRelocationBlocksSize( const std::vector<uintptr_t>& sorted_offsets,
+                                   const uintptr_t page_size ) {
+  uintptr_t reloc_blocks_size = 0;
 
-  auto reloc_directory = &nt_headers->OptionalHeader
-                              .DataDirectory[ IMAGE_DIRECTORY_ENTRY_BASERELOC ];
+  for ( size_t begin = 0; begin < sorted_offsets.size(); ) {
+    const auto end = GetRelocationPageEnd( sorted_offsets, begin, page_size );
+
+    reloc_blocks_size += GetRelocationBlockSize( end - begin );
 
-  reloc_directory->Size += reloc_block_bytes.size();
+    begin = end;
+  }
 
-  return dest_offset;
+  return reloc_blocks_size;
 }
 
 // Adds relocations upon the relocation table that relocates
@@ -646,64 +727,68 @@ void AddRelocations(
   // Required to be the .reloc section
   assert( reloc_section->GetName() == ".reloc" );
 
+  // Required to be size of a WORD due to the PE format
+  static_assert( sizeof( Relocation ) == sizeof( WORD ),
+                 "a relocation has to be a WORD" );
+
   // 0x1000 or 4096
   constexpr auto k4kPage = 1 << 12;
 
-  auto reloc_block_virtual_address =
-      DetermineFirstRelocationBlockVirtualAddress(
-          section_offsets_to_add_to_relocation_table, k4kPage );
+  const auto& offsets = section_offsets_to_add_to_relocation_table;
 
   TrimRelocSectionPadding( nt_headers, reloc_section );
 
+  // Sized up front, the blocks are written straight into the section
+  const auto reloc_blocks_size = GetRelocationBlocksSize( offsets, k4kPage );
+
+  const auto reloc_blocks_offset = reloc_section->AppendSpace(
+      reloc_blocks_size, nt_headers->OptionalHeader.FileAlignment );
+
+  const auto reloc_section_data = reloc_section->GetData()->data();
+
   Fixup fixup;
   fixup.desc = fixup_desc;
 
-  std::vector<Relocation> new_relocations;
+  auto reloc_block_offset = reloc_blocks_offset;
+
+  for ( size_t begin = 0; begin < offsets.size(); ) {
+    const auto end = GetRelocationPageEnd( offsets, begin, k4kPage );
+
+    const auto reloc_block = reinterpret_cast<IMAGE_BASE_RELOCATION*>(
+        reloc_section_data + reloc_block_offset );
 
-  for ( const auto vm_section_offset_to_relocate :
-        section_offsets_to_add_to_relocation_table ) {
-    const auto delta_offset_from_reloc_block_va =
-        vm_section_offset_to_relocate - reloc_block_virtual_address;
+    // Fixed up to an rva once the section is placed
+    reloc_block->VirtualAddress = static_cast<DWORD>(
+        peutils::AlignDown( offsets[ begin ], k4kPage ) );
+    reloc_block->SizeOfBlock = GetRelocationBlockSize( end - begin );
 
-    Relocation relocation;
+    // The padding relocation is already zeroed
+    const auto relocations = reinterpret_cast<Relocation*>( reloc_block + 1 );
+
+    for ( auto i = begin; i < end; ++i ) {
+      Relocation relocation;
 #ifdef _WIN64
-    relocation.type = IMAGE_REL_BASED_DIR64;
+      relocation.type = IMAGE_REL_BASED_DIR64;
 #else
-    relocation.type = IMAGE_REL_BASED_HIGHLOW;
+      relocation.type = IMAGE_REL_BASED_HIGHLOW;
 #endif
-    relocation.offset = delta_offset_from_reloc_block_va;
-
-    // If the next relocation offset is bigger than the allowed value
-    if ( delta_offset_from_reloc_block_va >= k4kPage ) {
-      fixup.offset =
-          AppendRelocationBlock( reloc_block_virtual_address, new_relocations,
-                                 nt_headers, reloc_section );
-      fixups->push_back( fixup );
+      relocation.offset = offsets[ i ] - reloc_block->VirtualAddress;
 
-      new_relocations.clear();
-
-      // Align the reloc block to a 4k page value (4096)
-      reloc_block_virtual_address =
-          peutils::AlignDown( vm_section_offset_to_relocate, k4kPage );
+      relocations[ i - begin ] = relocation;
+    }
 
-      assert( ( vm_section_offset_to_relocate - reloc_block_virtual_address ) <
-              k4kPage );
+    fixup.offset = reloc_block_offset;
+    fixups->push_back( fixup );
 
-      // refresh the offset for the new block
-      relocation.offset =
-          vm_section_offset_to_relocate - reloc_block_virtual_address;
-    }
+    reloc_block_offset += reloc_block->SizeOfBlock;
 
-    new_relocations.push_back( relocation );
+    begin = end;
   }
 
-  // If there are still relocations left to add
-  if ( new_relocations.size() > 0 ) {
-    fixup.offset =
-        AppendRelocationBlock( reloc_block_virtual_address, new_relocations,
-                               nt_headers, reloc_section );
-    fixups->push_back( fixup );
-  }
+  auto reloc_directory = &nt_headers->OptionalHeader
+                              .DataDirectory[ IMAGE_DIRECTORY_ENTRY_BASERELOC ];
+
+  reloc_directory->Size += static_cast<DWORD>( reloc_blocks_size );
 }
 
 void AddVirtualizedCodeSectionRelocations( IMAGE_NT_HEADERS* nt_headers,
@@ -735,28 +820,18 @@ void AddVmSectionRelocations( IMAGE_NT_HEADERS* nt_headers,
                   nt_headers, reloc_section, &fixup_context->fixups );
 }
 
-void RemoveRelocations( const std::vector<uintptr_t>& relocation_rvas_to_remove,
-                        PortableExecutable* pe ) {
+void RemoveRelocations(
+    const std::unordered_set<uintptr_t>& relocation_rvas_to_remove,
+    PortableExecutable* pe ) {
   // The relocations to be removed are old relocations of the instruction that we have virtualized.
   // We handle the relocation ourselves, therefore we remove them to not fuck up the jmp to the virtualized code.
+  // NOTE: We cannot compare the offsets because, a relocation may have
+  // same offsets but different rva's due to adding the reloc block
+  // virtual address. Therefore the index is keyed by the RVA's.
+  auto relocation_index = pe->CreateRelocationIndex();
+
   for ( const auto reloc_rva : relocation_rvas_to_remove ) {
-    pe->EachRelocation( [&]( IMAGE_BASE_RELOCATION* reloc_block,
-                             const uintptr_t rva, Relocation* reloc ) {
-      // NOTE: We cannot compare the offsets because, a relocation may have
-      // same offsets but different rva's due to adding the reloc block
-      // virtual address. Therefore we compare with the RVA's.
-      if ( reloc_rva == rva ) {
-        // Turn it into padding
-        reloc->type = IMAGE_REL_BASED_ABSOLUTE;
-
-        // Reset the offset as well to prevent this from being
-        // used to determine some stuff for the badboy
-        reloc->offset = 0;
-
-        // std::cout << "Remove relocation for offset: " << std::hex
-        //           << reloc->offset << " rva: " << rva << std::endl;
-      }
-    } );
+    relocation_index.Remove( reloc_rva );
   }
 }
 
@@ -800,26 +875,6 @@ std::vector<uint32_t> GetRelocationsWithinSectionAsSectionOffsets(
   return offsets_result;
 }
 
-// Returns a list containing all the relocation RVA values for the specified PE
-// sorted for quick binary search lookup
-std::vector<uintptr_t> GetRelocationRvas( const PortableExecutable& pe ) {
-  std::vector<uintptr_t> relocation_rvas;
-
-  // Copy the relocations from the original pe into a vector
-  pe.EachRelocationConst( [&]( const IMAGE_BASE_RELOCATION* reloc_block,
-                               const uintptr_t rva, const Relocation* reloc ) {
-    // From MSDN PE documentation:
-    // reloc.type = IMAGE_REL_BASED_ABSOLUTE: The base relocation is
-    // skipped. This type can be used to pad a block. Therefore we skip
-    // relocating if the relocation is of that type to avoid issues
-    if ( reloc->type != IMAGE_REL_BASED_ABSOLUTE ) {
-      relocation_rvas.push_back( rva );
-    }
-  } );
-
-  return relocation_rvas;
-}
-
 void ApplyFixups( PortableExecutable* pe,
                   const IMAGE_SECTION_HEADER& text_section,
                   const std::vector<Fixup>& fixups ) {
@@ -839,95 +894,145 @@ void ApplyFixups( PortableExecutable* pe,
 
   const auto reloc_section = new_pe_section_headers.FromName( ".reloc" );
 
-  for ( const auto fixup : fixups ) {
-    uintptr_t file_offset = 0;
-
-    switch ( fixup.desc.offset_type ) {
-      case OffsetRelativeTo::VmLoaderSection: {
-        const uintptr_t rva = section::SectionOffsetToRva(
-            *new_pe_vm_loader_section, fixup.offset );
-        file_offset = new_pe_section_headers.RvaToFileOffset( rva );
-      } break;
-
-      case OffsetRelativeTo::TextSection: {
-        const uintptr_t rva =
-            section::SectionOffsetToRva( text_section, fixup.offset );
-        file_offset = new_pe_section_headers.RvaToFileOffset( rva );
-      } break;
-
-      case OffsetRelativeTo::RelocSection: {
-        const uintptr_t rva =
-            section::SectionOffsetToRva( *reloc_section, fixup.offset );
-        file_offset = new_pe_section_headers.RvaToFileOffset( rva );
-      } break;
-
-      case OffsetRelativeTo::VirtualizedCodeSection: {
-        const uintptr_t rva = section::SectionOffsetToRva(
-            *new_pe_virtualized_code_section, fixup.offset );
-        file_offset = new_pe_section_headers.RvaToFileOffset( rva );
-      } break;
-
-      case OffsetRelativeTo::Beginning: {
-        file_offset = fixup.offset;
-      } break;
+  const auto new_pe_profile_section =
+      new_pe_section_headers.FromName( VM_PROFILE_SECTION_NAME );
+
+  const auto new_pe_vm_bytecode_section =
+      new_pe_section_headers.FromName( VM_BYTECODE_SECTION_NAME );
+
+  const auto new_pe_vm_unwind_section =
+      new_pe_section_headers.FromName( VM_UNWIND_SECTION_NAME );
+
+  // The file offset of each section once, a fixup is its base plus the offset
+  std::array<uintptr_t, static_cast<size_t>( OffsetRelativeTo::Unknown )>
+      file_offset_bases = {};
+  std::array<bool, static_cast<size_t>( OffsetRelativeTo::Unknown )>
+      has_file_offset_base = {};
+
+  const auto set_file_offset_base =
+      [&]( const OffsetRelativeTo offset_type,
+           const IMAGE_SECTION_HEADER* section_header ) {
+        if ( section_header ) {
+          file_offset_bases[ static_cast<size_t>( offset_type ) ] =
+              new_pe_section_headers.RvaToFileOffset(
+                  section_header->VirtualAddress );
+          has_file_offset_base[ static_cast<size_t>( offset_type ) ] = true;
+        }
+      };
 
-      default:
-        assert( false && "bruh" );
+  set_file_offset_base( OffsetRelativeTo::VmLoaderSection,
+                        new_pe_vm_loader_section );
+  set_file_offset_base( OffsetRelativeTo::TextSection, &text_section );
+  set_file_offset_base( OffsetRelativeTo::RelocSection, reloc_section );
+  set_file_offset_base( OffsetRelativeTo::VirtualizedCodeSection,
+                        new_pe_virtualized_code_section );
+  set_file_offset_base( OffsetRelativeTo::VmUnwindSection,
+                        new_pe_vm_unwind_section );
+  has_file_offset_base[ static_cast<size_t>( OffsetRelativeTo::Beginning ) ] =
+      true;
+
+  // The same for the value that each operation adds
+  const auto get_operation_delta = [&]( const FixupOperation operation ) {
+    const IMAGE_SECTION_HEADER* section_header = nullptr;
+    bool subtract = false;
+
+    switch ( operation ) {
+      case FixupOperation::AddVmLoaderSectionVirtualAddress:
+        section_header = new_pe_vm_loader_section;
+        break;
+      case FixupOperation::SubtractVmLoaderSectionVirtualAddress:
+        section_header = new_pe_vm_loader_section;
+        subtract = true;
+        break;
+      case FixupOperation::AddVirtualizedCodeSectionVirtualAddress:
+        section_header = new_pe_virtualized_code_section;
         break;
+      case FixupOperation::AddProfileSectionVirtualAddress:
+        section_header = new_pe_profile_section;
+        break;
+      case FixupOperation::AddVmBytecodeSectionVirtualAddress:
+        section_header = new_pe_vm_bytecode_section;
+        break;
+      case FixupOperation::AddVmUnwindSectionVirtualAddress:
+        section_header = new_pe_vm_unwind_section;
+        break;
+      default:
+        throw std::runtime_error( "unsupported fixup operation" );
     }
 
-    const auto image_ptr_to_update = pe->GetPeImagePtr() + file_offset;
+    if ( !section_header ) {
+      return std::make_pair( false, uint64_t{ 0 } );
+    }
 
-    switch ( fixup.desc.size ) {
-      case sizeof( uint32_t ): {
-        const auto value = *reinterpret_cast<uint32_t*>( image_ptr_to_update );
+    const uint64_t virtual_address = section_header->VirtualAddress;
 
-        switch ( fixup.desc.operation ) {
-          case FixupOperation::AddVmLoaderSectionVirtualAddress:
-            *reinterpret_cast<uint32_t*>( image_ptr_to_update ) =
-                value + new_pe_vm_loader_section->VirtualAddress;
-            break;
+    return std::make_pair( true,
+                           subtract ? 0 - virtual_address : virtual_address );
+  };
 
-          case FixupOperation::AddVirtualizedCodeSectionVirtualAddress:
-            *reinterpret_cast<uint32_t*>( image_ptr_to_update ) =
-                value + new_pe_virtualized_code_section->VirtualAddress;
-            break;
+  const std::array<std::pair<bool, uint64_t>, 6> operation_deltas = {
+      get_operation_delta( FixupOperation::AddVmLoaderSectionVirtualAddress ),
+      get_operation_delta(
+          FixupOperation::SubtractVmLoaderSectionVirtualAddress ),
+      get_operation_delta(
+          FixupOperation::AddVirtualizedCodeSectionVirtualAddress ),
+      get_operation_delta( FixupOperation::AddProfileSectionVirtualAddress ),
+      get_operation_delta(
+          FixupOperation::AddVmBytecodeSectionVirtualAddress ),
+      get_operation_delta(
+          FixupOperation::AddVmUnwindSectionVirtualAddress ),
+  };
 
-          case FixupOperation::SubtractVmLoaderSectionVirtualAddress:
-            *reinterpret_cast<uint32_t*>( image_ptr_to_update ) =
-                value - new_pe_vm_loader_section->VirtualAddress;
-            break;
+  // Grouped by section and sorted by offset, each section is walked once
+  // from the beginning to the end. The order of the fixups does not matter,
+  // they only add to the values.
+  std::vector<const Fixup*> sorted_fixups;
+  sorted_fixups.reserve( fixups.size() );
 
-          default:
-            throw std::runtime_error( "unsupported fixup operation" );
-            break;
-        }
-      } break;
+  for ( const auto& fixup : fixups ) {
+    sorted_fixups.push_back( &fixup );
+  }
 
-      case sizeof( uint64_t ): {
-        const auto value = *reinterpret_cast<uint64_t*>( image_ptr_to_update );
+  std::sort( sorted_fixups.begin(), sorted_fixups.end(),
+             []( const Fixup* a, const Fixup* b ) {
+               if ( a->desc.offset_type != b->desc.offset_type ) {
+                 return a->desc.offset_type < b->desc.offset_type;
+               }
 
-        switch ( fixup.desc.operation ) {
-          case FixupOperation::AddVmLoaderSectionVirtualAddress:
-            *reinterpret_cast<uint64_t*>( image_ptr_to_update ) =
-                value + new_pe_vm_loader_section->VirtualAddress;
-            break;
+               return a->offset < b->offset;
+             } );
 
-          case FixupOperation::AddVirtualizedCodeSectionVirtualAddress:
-            *reinterpret_cast<uint64_t*>( image_ptr_to_update ) =
-                value + new_pe_virtualized_code_section->VirtualAddress;
-            break;
+  const auto image = pe->GetPeImagePtr();
 
-          case FixupOperation::SubtractVmLoaderSectionVirtualAddress:
-            *reinterpret_cast<uint64_t*>( image_ptr_to_update ) =
-                value - new_pe_vm_loader_section->VirtualAddress;
-            break;
+  for ( const auto fixup : sorted_fixups ) {
+    const auto offset_type = static_cast<size_t>( fixup->desc.offset_type );
 
-          default:
-            throw std::runtime_error( "unsupported fixup operation" );
-            break;
-        }
-      } break;
+    if ( offset_type >= file_offset_bases.size() ||
+         !has_file_offset_base[ offset_type ] ) {
+      throw std::runtime_error( "fixup relative to a missing section" );
+    }
+
+    const auto operation = static_cast<size_t>( fixup->desc.operation );
+
+    if ( operation >= operation_deltas.size() ||
+         !operation_deltas[ operation ].first ) {
+      throw std::runtime_error( "fixup operation on a missing section" );
+    }
+
+    const auto image_ptr_to_update =
+        image + file_offset_bases[ offset_type ] + fixup->offset;
+
+    const auto delta = operation_deltas[ operation ].second;
+
+    switch ( fixup->desc.size ) {
+      case sizeof( uint32_t ):
+        *reinterpret_cast<uint32_t*>( image_ptr_to_update ) +=
+            static_cast<uint32_t>( delta );
+        break;
+
+      case sizeof( uint64_t ):
+        *reinterpret_cast<uint64_t*>( image_ptr_to_update ) += delta;
+        break;
 
       default:
         throw std::runtime_error( "unsupported fixup size" );
@@ -935,11 +1040,6 @@ void ApplyFixups( PortableExecutable* pe,
     }
   }
 
-  // NOTE: This is not fully tested, may cause issues
-  // Why? If the software has a string that contains the following pattern: .?AV
-  // It will randomize that string, NOT GOOD.
-  //rtti_obfuscator::ObfuscateRTTI( pe );
-
   const auto nullify_pe_directory = []( PortableExecutable* pe,
                                         IMAGE_NT_HEADERS* nt_headers,
                                         SectionHeaders& section_headers,
@@ -1007,441 +1107,1862 @@ void AddInterpreterRelocationsToFixup( PortableExecutable& interpreter_pe,
   }
 }
 
-PortableExecutable AssembleNewPe( const PortableExecutable& original_pe,
-                                  ProtectorContext* context ) {
-  auto new_sections = original_pe.CopySectionsDeep();
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+// Turns the stack ranges into functions. A site stands in for the function of
+// the original pe it is in: the unwinder undoes the stack of the site, then
+// the prolog of that function as it would from the site itself. A site with
+// no function is in a leaf, one within a prolog gets nothing.
+void AddVmUnwindRangeFunctions( const PortableExecutable& original_pe,
+                                ProtectorContext* context ) {
+  const auto original_pe_view = original_pe.GetView();
+
+  auto original_functions =
+      unwind_info::GetRuntimeFunctions( original_pe_view );
+
+  std::sort( original_functions.begin(), original_functions.end(),
+             []( const IMAGE_RUNTIME_FUNCTION_ENTRY& lhs,
+                 const IMAGE_RUNTIME_FUNCTION_ENTRY& rhs ) {
+               return lhs.BeginAddress < rhs.BeginAddress;
+             } );
+
+  // The function that contains the rva, nullptr for a leaf
+  const auto FindOriginalFunction =
+      [&]( const uint32_t rva ) -> const IMAGE_RUNTIME_FUNCTION_ENTRY* {
+    if ( rva == 0 ) {
+      return nullptr;
+    }
 
-  // Replace the original text section with our modified one
-  std::transform( new_sections.begin(), new_sections.end(),
-                  new_sections.begin(), [&]( Section& section ) {
-                    if ( section.GetName() == ".text" ) {
-                      return context->new_text_section;
-                    }
+    auto it = std::upper_bound(
+        original_functions.cbegin(), original_functions.cend(), rva,
+        []( const uint32_t rva, const IMAGE_RUNTIME_FUNCTION_ENTRY& function ) {
+          return rva < function.BeginAddress;
+        } );
 
-                    return section;
-                  } );
+    if ( it == original_functions.cbegin() || rva >= ( --it )->EndAddress ) {
+      return nullptr;
+    }
 
-  auto& reloc_section = new_sections.back();
+    return &*it;
+  };
 
-  // Provided that the .reloc section is the last section, we can add
-  // unlimited of relocations to it
-  assert( reloc_section.GetName() == ".reloc" );
+  // The unwind info of each function that a site is in, the functions that
+  // cannot be stood in for are not in here
+  // first: the begin rva of the function, second: its unwind info
+  std::unordered_map<uint32_t, unwind_info::UnwindInfo> function_unwind_infos;
+  std::unordered_set<uint32_t> unusable_functions;
 
-  auto new_header_data = original_pe.CopyHeaderData();
+  for ( const auto& vm_unwind_range : context->vm_unwind_ranges ) {
+    VmUnwindFunction vm_unwind_function;
+    vm_unwind_function.begin_offset = vm_unwind_range.begin_offset;
+    vm_unwind_function.end_offset = vm_unwind_range.end_offset;
 
-  IMAGE_NT_HEADERS* new_header_nt_header =
-      peutils::GetNtHeaders( new_header_data.data() );
+    const auto site_rva = vm_unwind_range.site_rva;
 
-  AddVmSectionRelocations( new_header_nt_header, &reloc_section,
-                           &context->fixup_context );
+    const auto original_function = FindOriginalFunction( site_rva );
 
-#if ENABLE_TLS_CALLBACKS
-  AddVirtualizedCodeSectionRelocations( new_header_nt_header, &reloc_section,
-                                        &context->fixup_context );
-#endif
+    if ( !original_function ) {
+      unwind_info::AddStackAllocation( &vm_unwind_function.unwind_info,
+                                       vm_unwind_range.stack_size );
 
-  // add the new sections to the new pe
-  new_sections.push_back( context->vm_loader_section );
-  new_sections.push_back( context->virtualized_code_section );
+      context->vm_unwind_functions.push_back( std::move( vm_unwind_function ) );
+      continue;
+    }
 
-  return pe::Build( new_header_data, new_sections );
-}
+    if ( unusable_functions.count( original_function->BeginAddress ) ) {
+      continue;
+    }
 
-void EachInstructionCallback( const cs_insn& instruction,
-                              const uint8_t*,
-                              void* data ) {
-  auto context = reinterpret_cast<ProtectorContext*>( data );
+    auto function_unwind_info =
+        function_unwind_infos.find( original_function->BeginAddress );
 
-  const auto& original_pe_nt_headers =
-      context->virtualizer_context.original_pe_nt_headers;
+    if ( function_unwind_info == function_unwind_infos.end() ) {
+      unwind_info::UnwindInfo unwind_info;
 
-  const auto vm_opcode = virtualizer::GetVmOpcode( instruction );
+      if ( !unwind_info::Read( original_pe_view, original_function->UnwindData,
+                               &unwind_info ) ) {
+        unusable_functions.insert( original_function->BeginAddress );
+        continue;
+      }
 
-  if ( virtualizer::IsVirtualizeable( instruction, vm_opcode ) ) {
-    if ( instruction.detail->x86.eflags != 0 ) {
-      // NOTE: Consider using this eflags to describe what eflags
-      // it changes when virtualizing the instructions for the interpreter
-      throw std::runtime_error(
-          "An instruction changing eflags was found, not supported at the "
-          "moment" );
+      function_unwind_info =
+          function_unwind_infos
+              .emplace( original_function->BeginAddress,
+                        std::move( unwind_info ) )
+              .first;
     }
 
-    // Get the relocations within the instruction, if any exists
-    const auto relocations_rva_within_instruction =
-        GetRelocationsWithinInstruction(
-            instruction,
-            context->virtualizer_context.original_pe_relocation_rvas );
-
-    const uint32_t vm_opcode_encyption_key = RandomU32( 1000, 10000000 );
-
-    const auto virtualized_shellcode = virtualizer::CreateVirtualizedShellcode(
-        instruction, vm_opcode, vm_opcode_encyption_key,
-        relocations_rva_within_instruction,
-        context->virtualizer_context.default_image_base );
-
-    const bool created_vm_code = virtualized_shellcode.GetBuffer().size() > 0;
-
-    if ( created_vm_code ) {
-      const auto virtualized_code_offset =
-          context->virtualized_code_section.AppendCode(
-              virtualized_shellcode.GetBuffer(),
-              original_pe_nt_headers->OptionalHeader.SectionAlignment,
-              original_pe_nt_headers->OptionalHeader.FileAlignment );
-
-      // generate loader shellcode for the virtualized shellcode
-      auto vm_code_loader_shellcode =
-          virtualizer::GetLoaderShellcodeForVirtualizedCode(
-              instruction, vm_opcode,
-              original_pe_nt_headers->OptionalHeader.ImageBase );
-
-      vm_code_loader_shellcode.ModifyVariable( VmOpcodeEncryptionKeyVariable,
-                                               vm_opcode_encyption_key );
-
-      vm_code_loader_shellcode.ModifyVariable<uintptr_t>(
-          VmCodeAddrVariable, virtualized_code_offset );
-
-      const auto loader_shellcode_offset_before =
-          context->vm_loader_section.GetCurrentOffset();
-
-      const auto vm_core_function_shellcode_offset =
-          vm_code_loader_shellcode.GetNamedValueOffset(
-              VmCoreFunctionVariable );
-
-      constexpr auto kCallInstructionSize = 5;
-
-      // this value does not need to be fixed up as we did the others because
-      // it it is a call to something in the SAME SECTION
-      vm_code_loader_shellcode.ModifyVariable<uint32_t>(
-          VmCoreFunctionVariable,
-          context->virtualizer_context.interpreter_function_offset -
-              loader_shellcode_offset_before - kCallInstructionSize -
-              vm_core_function_shellcode_offset + 1 );
-
-      constexpr uint32_t kJmpInstructionSize = 5;
-
-      const auto orig_addr_value_offset =
-          vm_code_loader_shellcode.GetNamedValueOffset( OrigAddrVariable );
-
-      const auto destination =
-          static_cast<uint32_t>( instruction.address + instruction.size );
-
-      const auto origin = static_cast<uint32_t>(
-          loader_shellcode_offset_before + orig_addr_value_offset );
-
-      vm_code_loader_shellcode.ModifyVariable<uint32_t>(
-          OrigAddrVariable, destination - origin - kJmpInstructionSize + 1 );
-
-      // Append the vm loader shellcode to the vm loader section
-      const auto loader_shellcode_offset =
-          context->vm_loader_section.AppendCode(
-              vm_code_loader_shellcode.GetBuffer(),
-              original_pe_nt_headers->OptionalHeader.SectionAlignment,
-              original_pe_nt_headers->OptionalHeader.FileAlignment );
-
-      ////////////////////////////
-      // AddJmpBackAddrToFixup
-      Fixup jmp_back_addr_fixup;
-      jmp_back_addr_fixup.offset =
-          loader_shellcode_offset + orig_addr_value_offset;
-      jmp_back_addr_fixup.desc.offset_type = OffsetRelativeTo::VmLoaderSection;
-      jmp_back_addr_fixup.desc.operation =
-          FixupOperation::SubtractVmLoaderSectionVirtualAddress;
-      jmp_back_addr_fixup.desc.size = sizeof( uint32_t );
-      context->fixup_context.fixups.push_back( jmp_back_addr_fixup );
-      ////////////////////////////////
-
-      ///////////////////
-      // AddVmCodeAddressToFixup
-      const auto vm_code_addr_offset =
-          loader_shellcode_offset +
-          vm_code_loader_shellcode.GetNamedValueOffset( VmCodeAddrVariable );
-
-      Fixup virtualized_code_addr_fixup;
-      virtualized_code_addr_fixup.offset = vm_code_addr_offset;
-      virtualized_code_addr_fixup.desc.offset_type =
-          OffsetRelativeTo::VmLoaderSection;
-      virtualized_code_addr_fixup.desc.operation =
-          FixupOperation::AddVirtualizedCodeSectionVirtualAddress;
-      virtualized_code_addr_fixup.desc.size = sizeof( uint32_t );
-      context->fixup_context.fixups.push_back( virtualized_code_addr_fixup );
-
-      const auto vm_var_section_shellcode_offset =
-          vm_code_loader_shellcode.GetNamedValueOffset( ImageBaseVariable );
-
-      // add fixup for the image base argument for interpreter call
-      context->fixup_context.vm_section_offsets_to_add_to_relocation_table
-          .push_back( loader_shellcode_offset +
-                      vm_var_section_shellcode_offset );
-      ///////////////
-
-      uintptr_t section_offset = 0;
-      uint8_t* section_data = 0;
-      OffsetRelativeTo jmp_fixup_relative_to = OffsetRelativeTo::Unknown;
-
-      switch ( context->virtualizer_context.what_to_virtualize ) {
-        case WhatToVirtualize::TextSection: {
-          section_offset = section::RvaToSectionOffset(
-              context->virtualizer_context.original_text_section_header,
-              static_cast<uint32_t>( instruction.address ) );
-
-          section_data = context->new_text_section.GetData()->data();
-
-          jmp_fixup_relative_to = OffsetRelativeTo::TextSection;
-        } break;
-        case WhatToVirtualize::VmLoaderSection: {
-          section_offset = section::RvaToSectionOffset(
-              context->virtualizer_context.vm_loader_section_header,
-              static_cast<uint32_t>( instruction.address ) );
-
-          section_data = context->vm_loader_section.GetData()->data();
-
-          jmp_fixup_relative_to = OffsetRelativeTo::VmLoaderSection;
-        } break;
-        default:
-          assert( false );
-          break;
-      }
+    if ( site_rva - original_function->BeginAddress <
+         function_unwind_info->second.prolog_size ) {
+      continue;
+    }
 
-      const auto first = section_data + section_offset;
+    auto body_unwind_info =
+        unwind_info::GetBodyUnwindInfo( function_unwind_info->second );
 
-      const auto last = first + instruction.size;
-      const auto dest = first;
+    // The body is chained, its save offsets are relative to the stack
+    // pointer after the allocation is undone
+    if ( vm_unwind_range.stack_size == 0 ) {
+      vm_unwind_function.unwind_info = std::move( body_unwind_info );
+    } else {
+      unwind_info::AddStackAllocation( &vm_unwind_function.unwind_info,
+                                       vm_unwind_range.stack_size );
 
-      // Fill the whole instruction with random bytes
-      std::transform( first, last, dest,
-                      []( uint8_t b ) { return RandomU8(); } );
+      vm_unwind_function.has_chained_function = true;
+      vm_unwind_function.chained_function = *original_function;
+      vm_unwind_function.chained_unwind_info = std::move( body_unwind_info );
+    }
 
-      constexpr uint8_t kJmpOpcode = 0xE9;
+    context->vm_unwind_functions.push_back( std::move( vm_unwind_function ) );
+  }
+}
 
-      // Write the jump
-      *first = kJmpOpcode;
+// The original exception directory cannot grow, the new one is its copy with
+// the functions of the vm loader section appended. They are all after the
+// original ones because the section is.
+Section CreateVmUnwindSection( const PortableExecutable& original_pe,
+                               std::vector<uint8_t>* header_data,
+                               ProtectorContext* context ) {
+  AddVmUnwindRangeFunctions( original_pe, context );
 
-      const auto jmp_addr_offset = section_offset + 1;
+  auto& vm_unwind_functions = context->vm_unwind_functions;
 
-      const uint32_t jmp_destination =
-          static_cast<uint32_t>( loader_shellcode_offset -
-                                 instruction.address ) -
-          kJmpInstructionSize;
+  std::sort( vm_unwind_functions.begin(), vm_unwind_functions.end(),
+             []( const VmUnwindFunction& lhs, const VmUnwindFunction& rhs ) {
+               return lhs.begin_offset < rhs.begin_offset;
+             } );
 
-      // Cast the jump desination to a uint8_t array because the section data
-      // is in uint8_t format
-      const auto jmp_destination_as_uint8_array =
-          reinterpret_cast<const uint8_t*>( &jmp_destination );
+  auto runtime_functions =
+      unwind_info::GetRuntimeFunctions( original_pe.GetView() );
 
-      // Write the jump destination
-      std::copy( jmp_destination_as_uint8_array,
-                 jmp_destination_as_uint8_array + sizeof( jmp_destination ),
-                 section_data + jmp_addr_offset );
+  const auto runtime_function_count =
+      runtime_functions.size() + vm_unwind_functions.size();
 
-      Fixup jmp_to_vm_loader_fixup;
-      jmp_to_vm_loader_fixup.offset = jmp_addr_offset;
-      jmp_to_vm_loader_fixup.desc.offset_type = jmp_fixup_relative_to;
-      jmp_to_vm_loader_fixup.desc.operation =
-          FixupOperation::AddVmLoaderSectionVirtualAddress;
-      jmp_to_vm_loader_fixup.desc.size = sizeof( uint32_t );
-      context->fixup_context.fixups.push_back( jmp_to_vm_loader_fixup );
+  // The unwind infos come right after the table
+  const auto unwind_infos_offset =
+      runtime_function_count * sizeof( IMAGE_RUNTIME_FUNCTION_ENTRY );
 
-      // if it was relocated, add it to a list to remove the relocation later
-      // on from PE because when we virtualize an instruction, we handle the relocation ourselve
-      for ( const auto reloc_rva : relocations_rva_within_instruction ) {
-        context->fixup_context.relocation_rvas_to_remove.push_back( reloc_rva );
-      }
+  std::vector<uint8_t> unwind_infos;
 
-      ++context->virtualizer_context.total_virtualized_instructions;
+  // Most of the sites of a function share the same one
+  // first: the serialized unwind info, second: its offset
+  std::map<std::vector<uint8_t>, uint32_t> unwind_info_offsets;
 
-      file_log::Info( "Virtualized 0x%08I64x, %s %s", instruction.address,
-                      instruction.mnemonic, instruction.op_str );
-    }
-  }
+  const auto AddFixup = [&]( const uintptr_t offset,
+                             const FixupOperation operation ) {
+    Fixup fixup;
+    fixup.offset = offset;
+    fixup.desc.offset_type = OffsetRelativeTo::VmUnwindSection;
+    fixup.desc.operation = operation;
+    fixup.desc.size = sizeof( uint32_t );
+    context->fixup_context.fixups.push_back( fixup );
+  };
 
-  ++context->virtualizer_context.total_disassembled_instructions;
-};
+  const auto AddUnwindInfo =
+      [&]( const unwind_info::UnwindInfo& unwind_info,
+           const IMAGE_RUNTIME_FUNCTION_ENTRY* chained_function ) {
+        auto unwind_info_data =
+            unwind_info::Serialize( unwind_info, chained_function );
 
-// Because the disassembler can get it wrong sometimes, we add a callback to reset
-// the virtualized instruction if it notices that it disassembled invalid instructions
-void InvalidInstructionCallback( const uint64_t address,
-                                 const SmallInstructionData ins_data,
-                                 void* data ) {
-  auto context = reinterpret_cast<ProtectorContext*>( data );
+        const auto it = unwind_info_offsets.find( unwind_info_data );
 
-  const auto text_section_offset = section::RvaToSectionOffset(
-      context->virtualizer_context.original_text_section_header, address );
+        if ( it != unwind_info_offsets.end() ) {
+          return it->second;
+        }
 
-  // NOTE: THERE IS MORE WE NEED TO DO HERE I THINK
-  //assert( false && "verify if the changes made here are correct" );
+        const auto unwind_info_offset =
+            static_cast<uint32_t>( unwind_infos_offset + unwind_infos.size() );
 
-  //const auto text_section_data =
-  //    original_pe.GetPeImagePtr() +
-  //    original_text_section_header.PointerToRawData;
-  const auto text_section_data = context->new_text_section.GetData()->data();
+        unwind_infos.insert( unwind_infos.end(), unwind_info_data.cbegin(),
+                             unwind_info_data.cend() );
 
-  auto original_pe_text_section_data =
-      context->virtualizer_context.original_text_section_copy.GetData();
+        // The UnwindData of the chained function is the last value
+        if ( chained_function ) {
+          AddFixup( unwind_infos_offset + unwind_infos.size() -
+                        sizeof( uint32_t ),
+                    FixupOperation::AddVmUnwindSectionVirtualAddress );
+        }
 
-  // TODO: replace with std::copy
-  // if the invalid instruction was virtualized, we reset it back here
-  // below
-  memcpy( text_section_data + text_section_offset,
-          &( *original_pe_text_section_data )[ text_section_offset ],
-          ins_data.instruction_size_ );
+        unwind_info_offsets.emplace( std::move( unwind_info_data ),
+                                     unwind_info_offset );
 
-  // Do this disgusting hack for now, change later
-  cs_insn temp_instruction;
-  temp_instruction.size = ins_data.instruction_size_;
-  temp_instruction.address = address;
+        return unwind_info_offset;
+      };
 
-  // Get the relocations within the instruction, if any exists
-  const auto relocations_rva_within_instruction =
-      GetRelocationsWithinInstruction(
-          temp_instruction,
-          context->virtualizer_context.original_pe_relocation_rvas );
+  for ( const auto& vm_unwind_function : vm_unwind_functions ) {
+    IMAGE_RUNTIME_FUNCTION_ENTRY runtime_function;
+    runtime_function.BeginAddress = vm_unwind_function.begin_offset;
+    runtime_function.EndAddress = vm_unwind_function.end_offset;
+
+    if ( vm_unwind_function.has_chained_function ) {
+      auto chained_function = vm_unwind_function.chained_function;
+      chained_function.UnwindData =
+          AddUnwindInfo( vm_unwind_function.chained_unwind_info, nullptr );
+
+      runtime_function.UnwindData =
+          AddUnwindInfo( vm_unwind_function.unwind_info, &chained_function );
+    } else {
+      runtime_function.UnwindData =
+          AddUnwindInfo( vm_unwind_function.unwind_info, nullptr );
+    }
 
-  // Remove the relocations from the remove-list
-  // In other words, restore the relocations that were previously removed
-  for ( const auto& reloc_rva : relocations_rva_within_instruction ) {
-    const auto it_result = std::find(
-        context->fixup_context.relocation_rvas_to_remove.cbegin(),
-        context->fixup_context.relocation_rvas_to_remove.cend(), reloc_rva );
+    const auto runtime_function_offset =
+        runtime_functions.size() * sizeof( IMAGE_RUNTIME_FUNCTION_ENTRY );
 
-    const bool found =
-        it_result != context->fixup_context.relocation_rvas_to_remove.end();
+    runtime_functions.push_back( runtime_function );
 
-    if ( found ) {
-      context->fixup_context.relocation_rvas_to_remove.erase( it_result );
-    }
+    AddFixup( runtime_function_offset +
+                  offsetof( IMAGE_RUNTIME_FUNCTION_ENTRY, BeginAddress ),
+              FixupOperation::AddVmLoaderSectionVirtualAddress );
+    AddFixup( runtime_function_offset +
+                  offsetof( IMAGE_RUNTIME_FUNCTION_ENTRY, EndAddress ),
+              FixupOperation::AddVmLoaderSectionVirtualAddress );
+    AddFixup( runtime_function_offset +
+                  offsetof( IMAGE_RUNTIME_FUNCTION_ENTRY, UnwindData ),
+              FixupOperation::AddVmUnwindSectionVirtualAddress );
   }
 
-  char buf[ MAX_PATH ]{ 0 };
-  sprintf_s( buf, "Resetting invalid instruction 0x%08I64x\n",
-             static_cast<uint64_t>( address ) );
-  printf( "%s\n", buf );
-};
-
-// Takes in the almost finished PE and virtualizes the TLS callbacks that we added in the beginning
-PortableExecutable VirtualizeMyTlsCallbacksAndNewEntrypoint(
-    PortableExecutable& new_pe,
-    PortableExecutable& original_pe,
-    const PortableExecutable& interpreter_pe,
-    const IMAGE_NT_HEADERS& original_pe_nt_headers,
-    const IMAGE_SECTION_HEADER& original_text_section_header,
-    ProtectorContext* context ) {
-  // Since we are going to create a new PE based on the previously
-  // created PE, we can re-use the same protector context
-  // We only need to update one value inside of it
-
-  context->fixup_context.relocation_rvas_to_remove.clear();
+  std::vector<uint8_t> section_data(
+      reinterpret_cast<const uint8_t*>( runtime_functions.data() ),
+      reinterpret_cast<const uint8_t*>( runtime_functions.data() +
+                                        runtime_functions.size() ) );
 
-  std::vector<uintptr_t> new_pe_relocation_rvas = GetRelocationRvas( new_pe );
+  section_data.insert( section_data.end(), unwind_infos.cbegin(),
+                       unwind_infos.cend() );
 
-  // Sort for quick binary search
-  std::sort( new_pe_relocation_rvas.begin(), new_pe_relocation_rvas.end() );
+  const auto nt_headers = peutils::GetNtHeaders( header_data->data() );
 
-  // Update the original relocations to the new PE relocations
-  context->virtualizer_context.original_pe_relocation_rvas =
-      new_pe_relocation_rvas;
+  auto& exception_directory =
+      nt_headers->OptionalHeader
+          .DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXCEPTION ];
+
+  exception_directory.VirtualAddress = 0;
+  exception_directory.Size = static_cast<uint32_t>(
+      runtime_function_count * sizeof( IMAGE_RUNTIME_FUNCTION_ENTRY ) );
+
+  Fixup exception_directory_fixup;
+  exception_directory_fixup.offset =
+      reinterpret_cast<uintptr_t>( &exception_directory.VirtualAddress ) -
+      reinterpret_cast<uintptr_t>( header_data->data() );
+  exception_directory_fixup.desc.offset_type = OffsetRelativeTo::Beginning;
+  exception_directory_fixup.desc.operation =
+      FixupOperation::AddVmUnwindSectionVirtualAddress;
+  exception_directory_fixup.desc.size = sizeof( uint32_t );
+  context->fixup_context.fixups.push_back( exception_directory_fixup );
+
+  auto vm_unwind_section = section::CreateEmptySection(
+      VM_UNWIND_SECTION_NAME,
+      IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_INITIALIZED_DATA );
+
+  const auto& optional_header =
+      context->virtualizer_context.original_pe_nt_headers->OptionalHeader;
+
+  vm_unwind_section.AppendCode( section_data,
+                                optional_header.SectionAlignment,
+                                optional_header.FileAlignment );
+
+  return vm_unwind_section;
+}
+#endif
 
-  const auto vm_loader_section_header =
-      new_pe.GetSectionHeaders().FromName( VM_LOADER_SECTION_NAME );
+PortableExecutable AssembleNewPe( const PortableExecutable& original_pe,
+                                  ProtectorContext* context ) {
+  std::vector<Section> new_sections;
 
-  context->virtualizer_context.vm_loader_section_header =
-      *vm_loader_section_header;
+  const auto original_section_views = original_pe.GetView().GetSections();
 
-  const auto OnInvalidInstructionCallback =
-      []( const uint64_t address, const SmallInstructionData ins_data, void* ) {
-        // We do not anticipate this will occur in such small code such as my TLS callbacks
-        throw std::runtime_error(
-            "An invalid instruction was disassembled while trying to "
-            "virtualize our own code." );
-      };
+  new_sections.reserve( original_section_views.size() + 4 );
 
-  PeDisassemblyEngine pe_disassembler( new_pe );
+  // Replace the original text section with our modified one, without copying
+  // the original one first only to throw it away
+  for ( const auto& section_view : original_section_views ) {
+    if ( section_view.GetName() == ".text" ) {
+      new_sections.push_back( context->new_text_section );
+    } else {
+      new_sections.push_back( original_pe.CopySectionDeep(
+          &section_view.GetSectionHeader() ) );
+    }
+  }
 
-  const auto first_interpreter_tls_callback_offset =
-      GetExportedFunctionOffsetRelativeToSection( interpreter_pe,
-                                                  "FirstTlsCallback" );
+  auto& reloc_section = new_sections.back();
 
-  const auto second_interpreter_tls_callback_offset =
-      GetExportedFunctionOffsetRelativeToSection( interpreter_pe,
-                                                  "SecondTlsCallback" );
+  // Provided that the .reloc section is the last section, we can add
+  // unlimited of relocations to it
+  assert( reloc_section.GetName() == ".reloc" );
 
-  const auto custom_entrypoint_interpreter_offset =
-      GetExportedFunctionOffsetRelativeToSection( interpreter_pe,
-                                                  "BeforeEntrypoint" );
+  auto new_header_data = original_pe.CopyHeaderData();
 
-  assert( first_interpreter_tls_callback_offset ||
-          second_interpreter_tls_callback_offset ||
-          custom_entrypoint_interpreter_offset );
+  IMAGE_NT_HEADERS* new_header_nt_header =
+      peutils::GetNtHeaders( new_header_data.data() );
 
-#if 1
-  // Add my TLS callbacks as disassembly points for the disassembly engine
   {
-    const auto first_tls_callback_offset =
-        vm_loader_section_header->PointerToRawData +
-        first_interpreter_tls_callback_offset;
+    ScopedReportPhase phase( context->report, "relocation_rebuild" );
 
-    const auto first_tls_callback_rva =
-        vm_loader_section_header->VirtualAddress +
-        first_interpreter_tls_callback_offset;
+    AddVmSectionRelocations( new_header_nt_header, &reloc_section,
+                             &context->fixup_context );
 
-    DisassemblyPoint disasm_point;
-    disasm_point.code = new_pe.GetPeImagePtr() + first_tls_callback_offset;
-    disasm_point.rva = first_tls_callback_rva;
-    pe_disassembler.AddDisassemblyPoint( disasm_point );
+#if ENABLE_TLS_CALLBACKS
+    AddVirtualizedCodeSectionRelocations(
+        new_header_nt_header, &reloc_section, &context->fixup_context );
+#endif
   }
-  {
-    const auto second_tls_callback_offset =
-        vm_loader_section_header->PointerToRawData +
-        second_interpreter_tls_callback_offset;
 
-    const auto second_tls_callback_rva =
-        vm_loader_section_header->VirtualAddress +
-        second_interpreter_tls_callback_offset;
+  // add the new sections to the new pe
+  new_sections.push_back( context->vm_loader_section );
+  new_sections.push_back( context->virtualized_code_section );
+  new_sections.push_back( context->vm_bytecode_section );
 
-    DisassemblyPoint disasm_point;
-    disasm_point.code = new_pe.GetPeImagePtr() + second_tls_callback_offset;
-    disasm_point.rva = second_tls_callback_rva;
-    pe_disassembler.AddDisassemblyPoint( disasm_point );
+  if ( context->virtualizer_context.instrument_virtualized_code ) {
+    new_sections.push_back( context->profile_section );
   }
+
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+  new_sections.push_back(
+      CreateVmUnwindSection( original_pe, &new_header_data, context ) );
 #endif
 
-  {
-    // The new_pe has the newly added entrypoint, lets virtualize that as well
-    const auto new_entrypoint_rva =
-        new_pe.GetNtHeaders()->OptionalHeader.AddressOfEntryPoint;
+  return pe::Build( new_header_data, std::move( new_sections ) );
+}
 
-    // custom_entrypoint_offset
-    const auto new_entrypoint_offset =
-        new_pe.GetSectionHeaders().RvaToFileOffset( new_entrypoint_rva );
+#ifndef _WIN64
+// Has to be added before any of the loaders, they are emitted with the
+// current offset of the section in mind
+void AddImageBaseSlot( ProtectorContext* context ) {
+  const auto& optional_header =
+      context->virtualizer_context.original_pe_nt_headers->OptionalHeader;
 
-    DisassemblyPoint disasm_point;
-    disasm_point.code = new_pe.GetPeImagePtr() + new_entrypoint_offset;
-    disasm_point.rva = new_entrypoint_rva;
-    pe_disassembler.AddDisassemblyPoint( disasm_point );
+  const auto image_base_slot_offset = context->vm_loader_section.AppendValue(
+      static_cast<uint32_t>( optional_header.ImageBase ),
+      optional_header.FileAlignment );
 
-    // Set the disassembly point to the first TLS callback
-    pe_disassembler.SetDisassemblyPoint(
-        disasm_point, vm_loader_section_header->SizeOfRawData );
-  }
+  context->fixup_context.vm_section_offsets_to_add_to_relocation_table
+      .push_back( image_base_slot_offset );
+
+  context->virtualizer_context.image_base_slot_offset = image_base_slot_offset;
+}
+#endif
+
+// Adds the fixups of the image base argument at value_offset in the vm loader
+// section and returns the value to store there before they apply
+uint32_t GetImageBaseValue( const uintptr_t value_offset,
+                            ProtectorContext* context ) {
+  const auto origin =
+      static_cast<uint32_t>( value_offset + kImageBaseDisplacementOrigin );
+
+#ifdef _WIN64
+  // Relative to the rip, the image base is at rva 0
+  Fixup image_base_fixup;
+  image_base_fixup.offset = value_offset;
+  image_base_fixup.desc.offset_type = OffsetRelativeTo::VmLoaderSection;
+  image_base_fixup.desc.operation =
+      FixupOperation::SubtractVmLoaderSectionVirtualAddress;
+  image_base_fixup.desc.size = sizeof( uint32_t );
+  context->fixup_context.fixups.push_back( image_base_fixup );
+
+  return 0 - origin;
+#else
+  // Relative to the eip within the same section, no fixup needed
+  return static_cast<uint32_t>(
+             context->virtualizer_context.image_base_slot_offset ) -
+         origin;
+#endif
+}
+
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+// The stack ranges of the code at code_offset in the vm loader section. Only
+// the sites of the original pe have a function to stand in for, the ones in
+// our own TLS callbacks are left out.
+void AddVmUnwindRanges( const uintptr_t code_offset,
+                        const std::vector<StackRange>& stack_ranges,
+                        const uint32_t site_rva,
+                        ProtectorContext* context ) {
+  if ( site_rva != 0 && context->virtualizer_context.what_to_virtualize !=
+                            WhatToVirtualize::TextSection ) {
+    return;
+  }
+
+  for ( const auto& stack_range : stack_ranges ) {
+    VmUnwindRange vm_unwind_range;
+    vm_unwind_range.begin_offset =
+        static_cast<uint32_t>( code_offset + stack_range.begin_offset );
+    vm_unwind_range.end_offset =
+        static_cast<uint32_t>( code_offset + stack_range.end_offset );
+    vm_unwind_range.stack_size = stack_range.stack_size;
+    vm_unwind_range.site_rva = site_rva;
+
+    context->vm_unwind_ranges.push_back( vm_unwind_range );
+  }
+}
+
+// The interpreter is at the beginning of the vm loader section, its functions
+// keep their unwind data. The handlers are outside of the section, they are
+// dropped and a chained entry is left out.
+void AddInterpreterUnwindFunctions( const PortableExecutable& interpreter_pe,
+                                    ProtectorContext* context ) {
+  const auto interpreter_pe_view = interpreter_pe.GetView();
+
+  const auto vm_fun_section_header =
+      *interpreter_pe.GetSectionHeaders().FromName(
+          VM_FUNCTIONS_SECTION_NAME );
+
+  for ( const auto& runtime_function :
+        unwind_info::GetRuntimeFunctions( interpreter_pe_view ) ) {
+    if ( !section::IsRvaWithinSection( vm_fun_section_header,
+                                       runtime_function.BeginAddress ) ) {
+      continue;
+    }
+
+    VmUnwindFunction vm_unwind_function;
+
+    if ( !unwind_info::Read( interpreter_pe_view, runtime_function.UnwindData,
+                             &vm_unwind_function.unwind_info ) ) {
+      continue;
+    }
+
+    vm_unwind_function.begin_offset =
+        static_cast<uint32_t>( section::RvaToSectionOffset(
+            vm_fun_section_header, runtime_function.BeginAddress ) );
+    vm_unwind_function.end_offset =
+        static_cast<uint32_t>( section::RvaToSectionOffset(
+            vm_fun_section_header, runtime_function.EndAddress ) );
+
+    context->vm_unwind_functions.push_back( std::move( vm_unwind_function ) );
+  }
+}
+#endif
+
+#if ENABLE_SHARED_VM_ENTRY
+uint64_t GetVmEntryTrampolineKey(
+    const virtualizer::VmRegisterUsage& register_usage ) {
+  return ( static_cast<uint64_t>( register_usage.register_slots ) << 8 ) |
+         static_cast<uint64_t>( register_usage.virtual_push_count );
+}
+
+// Returns the vm loader section offset of the trampoline for the register
+// usage, it is emitted the first time a site needs it
+uintptr_t GetVmEntryTrampolineOffset(
+    const virtualizer::VmRegisterUsage& register_usage,
+    ProtectorContext* context ) {
+  auto& trampoline_offsets =
+      context->virtualizer_context.vm_entry_trampoline_offsets;
+
+  const auto trampoline_key = GetVmEntryTrampolineKey( register_usage );
+
+  const auto it = trampoline_offsets.find( trampoline_key );
+
+  if ( it != trampoline_offsets.end() ) {
+    return it->second;
+  }
+
+  const auto& original_pe_nt_headers =
+      context->virtualizer_context.original_pe_nt_headers;
+
+  auto trampoline_shellcode =
+      virtualizer::GetVmEntryTrampolineShellcode( register_usage );
+
+  const auto trampoline_offset_before =
+      context->vm_loader_section.GetCurrentOffset();
+
+  const auto vm_core_function_shellcode_offset =
+      trampoline_shellcode.GetNamedValueOffset( VmCoreFunctionVariable );
+
+  // A call to something in the same section, no fixup needed
+  trampoline_shellcode.ModifyVariable<uint32_t>(
+      VmCoreFunctionVariable,
+      context->virtualizer_context.interpreter_function_offset -
+          static_cast<uint32_t>( trampoline_offset_before +
+                                 vm_core_function_shellcode_offset +
+                                 sizeof( uint32_t ) ) );
+
+  trampoline_shellcode.ModifyVariable<uint32_t>(
+      ImageBaseVariable,
+      GetImageBaseValue(
+          trampoline_offset_before +
+              trampoline_shellcode.GetNamedValueOffset( ImageBaseVariable ),
+          context ) );
+
+  const auto trampoline_offset = context->vm_loader_section.AppendCode(
+      trampoline_shellcode.GetBuffer(),
+      original_pe_nt_headers->OptionalHeader.SectionAlignment,
+      original_pe_nt_headers->OptionalHeader.FileAlignment );
+
+  trampoline_offsets[ trampoline_key ] = trampoline_offset;
+
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+  AddVmUnwindRanges( trampoline_offset, trampoline_shellcode.GetStackRanges(),
+                     0, context );
+#endif
+
+  return trampoline_offset;
+}
+#endif
+
+// Adds the fixups of a profile counter reference at value_offset in the vm
+// loader section and returns the value to store there before they apply
+uint32_t GetProfileCounterValue( const uint32_t profile_counter_offset,
+                                 const uintptr_t value_offset,
+                                 ProtectorContext* context ) {
+  Fixup profile_counter_fixup;
+  profile_counter_fixup.offset = value_offset;
+  profile_counter_fixup.desc.offset_type = OffsetRelativeTo::VmLoaderSection;
+  profile_counter_fixup.desc.operation =
+      FixupOperation::AddProfileSectionVirtualAddress;
+  profile_counter_fixup.desc.size = sizeof( uint32_t );
+  context->fixup_context.fixups.push_back( profile_counter_fixup );
+
+#ifdef _WIN64
+  // The counter is rip relative to the end of the inc instruction
+  profile_counter_fixup.desc.operation =
+      FixupOperation::SubtractVmLoaderSectionVirtualAddress;
+  context->fixup_context.fixups.push_back( profile_counter_fixup );
+
+  return profile_counter_offset -
+         static_cast<uint32_t>( value_offset + sizeof( uint32_t ) );
+#else
+  // The counter is an absolute address that has to be relocated
+  context->fixup_context.vm_section_offsets_to_add_to_relocation_table
+      .push_back( value_offset );
+
+  return static_cast<uint32_t>( context->virtualizer_context
+                                    .original_pe_nt_headers->OptionalHeader
+                                    .ImageBase ) +
+         profile_counter_offset;
+#endif
+}
+
+// Lays out the loader shellcode of one virtualized instruction and replaces
+// the instruction with a jump to it, the loader executes the virtualized code
+// at virtualized_code_offset and jumps back to jmp_back_address afterwards
+void EmitVirtualizedInstruction(
+    PendingVmInstruction* vm_instruction_ptr,
+    const virtualizer::VmRegisterUsage& register_usage,
+    const uintptr_t virtualized_code_offset,
+    const uint64_t jmp_back_address,
+    const std::vector<uint32_t>& profile_counter_offsets,
+    ProtectorContext* context ) {
+  const auto& vm_instruction = *vm_instruction_ptr;
+
+  const auto& original_pe_nt_headers =
+      context->virtualizer_context.original_pe_nt_headers;
+
+  constexpr uint32_t kJmpInstructionSize = 5;
+
+  const auto destination = static_cast<uint32_t>( jmp_back_address );
+
+#if ENABLE_SHARED_VM_ENTRY
+  // Emitted before the thunk, it has to be known to write the call to it
+  const auto trampoline_offset =
+      GetVmEntryTrampolineOffset( register_usage, context );
+
+  const auto thunk_layout = vm_entry_thunk::GetLayout(
+      vm_instruction.exit_vm_opcode, vm_instruction.profile_counter_count );
+
+  const auto loader_shellcode_offset = context->vm_loader_section.AppendSpace(
+      thunk_layout.size, original_pe_nt_headers->OptionalHeader.FileAlignment );
+
+  // Written in place, the values go to the offsets of the layout
+  const auto thunk =
+      context->vm_loader_section.GetData()->data() + loader_shellcode_offset;
+
+  vm_entry_thunk::Write( thunk, thunk_layout, vm_instruction.exit_vm_opcode,
+                         vm_instruction.profile_counter_count,
+                         vm_instruction.vm_opcode_encryption_key );
+
+  // A uint32_t in the thunk, the trampoline passes it zero extended
+  vm_entry_thunk::StoreValue(
+      thunk, thunk_layout.GetVmCodeAddrOffset(),
+      static_cast<uint32_t>( virtualized_code_offset ) );
+
+  // Within the same section as well
+  vm_entry_thunk::StoreValue(
+      thunk, thunk_layout.GetTrampolineOffset(),
+      static_cast<uint32_t>(
+          trampoline_offset -
+          ( loader_shellcode_offset + thunk_layout.GetTrampolineOffset() +
+            sizeof( uint32_t ) ) ) );
+
+  const auto orig_addr_value_offset = thunk_layout.GetOrigAddrOffset();
+
+  const auto origin = static_cast<uint32_t>( loader_shellcode_offset +
+                                             orig_addr_value_offset );
+
+  vm_entry_thunk::StoreValue( thunk, orig_addr_value_offset,
+                              destination - origin - kJmpInstructionSize + 1 );
+
+  for ( uint32_t i = 0; i < profile_counter_offsets.size(); ++i ) {
+    const auto profile_counter_value_offset =
+        thunk_layout.GetProfileCounterValueOffset( i );
+
+    vm_entry_thunk::StoreValue(
+        thunk, profile_counter_value_offset,
+        GetProfileCounterValue(
+            profile_counter_offsets[ i ],
+            loader_shellcode_offset + profile_counter_value_offset,
+            context ) );
+  }
+
+  const auto vm_code_addr_offset =
+      loader_shellcode_offset + thunk_layout.GetVmCodeAddrOffset();
+#else
+  auto& vm_code_loader_shellcode = vm_instruction_ptr->loader_shellcode;
+
+  vm_code_loader_shellcode.ModifyVariable<uint32_t>(
+      VmCodeAddrVariable, static_cast<uint32_t>( virtualized_code_offset ) );
+
+  const auto loader_shellcode_offset_before =
+      context->vm_loader_section.GetCurrentOffset();
+
+  const auto vm_core_function_shellcode_offset =
+      vm_code_loader_shellcode.GetNamedValueOffset( VmCoreFunctionVariable );
+
+  constexpr auto kCallInstructionSize = 5;
+
+  // this value does not need to be fixed up as we did the others because
+  // it it is a call to something in the SAME SECTION
+  vm_code_loader_shellcode.ModifyVariable<uint32_t>(
+      VmCoreFunctionVariable,
+      context->virtualizer_context.interpreter_function_offset -
+          loader_shellcode_offset_before - kCallInstructionSize -
+          vm_core_function_shellcode_offset + 1 );
+
+  const auto orig_addr_value_offset =
+      vm_code_loader_shellcode.GetNamedValueOffset( OrigAddrVariable );
+
+  const auto origin = static_cast<uint32_t>( loader_shellcode_offset_before +
+                                             orig_addr_value_offset );
+
+  vm_code_loader_shellcode.ModifyVariable<uint32_t>(
+      OrigAddrVariable, destination - origin - kJmpInstructionSize + 1 );
+
+  for ( uint32_t i = 0; i < profile_counter_offsets.size(); ++i ) {
+    const auto profile_counter_variable =
+        virtualizer::GetVmProfileCounterVariable( i );
+
+    const auto profile_counter_value_offset =
+        vm_code_loader_shellcode.GetNamedValueOffset( profile_counter_variable );
+
+    vm_code_loader_shellcode.ModifyVariable<uint32_t>(
+        profile_counter_variable,
+        GetProfileCounterValue(
+            profile_counter_offsets[ i ],
+            loader_shellcode_offset_before + profile_counter_value_offset,
+            context ) );
+  }
+
+  vm_code_loader_shellcode.ModifyVariable<uint32_t>(
+      ImageBaseVariable,
+      GetImageBaseValue(
+          loader_shellcode_offset_before +
+              vm_code_loader_shellcode.GetNamedValueOffset( ImageBaseVariable ),
+          context ) );
+
+  // Append the vm loader shellcode to the vm loader section
+  const auto loader_shellcode_offset = context->vm_loader_section.AppendCode(
+      vm_code_loader_shellcode.GetBuffer(),
+      original_pe_nt_headers->OptionalHeader.SectionAlignment,
+      original_pe_nt_headers->OptionalHeader.FileAlignment );
+
+  const auto vm_code_addr_offset =
+      loader_shellcode_offset +
+      vm_code_loader_shellcode.GetNamedValueOffset( VmCodeAddrVariable );
+#endif
+
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+#if ENABLE_SHARED_VM_ENTRY
+  const auto thunk_stack_ranges =
+      vm_entry_thunk::GetStackRanges( thunk_layout );
+
+  const std::vector<StackRange> stack_ranges(
+      thunk_stack_ranges.ranges.cbegin(),
+      thunk_stack_ranges.ranges.cbegin() + thunk_stack_ranges.count );
+#else
+  const auto stack_ranges = vm_code_loader_shellcode.GetStackRanges();
+#endif
+
+  AddVmUnwindRanges( loader_shellcode_offset, stack_ranges,
+                     static_cast<uint32_t>( vm_instruction.address ),
+                     context );
+#endif
+
+  ////////////////////////////
+  // AddJmpBackAddrToFixup
+  Fixup jmp_back_addr_fixup;
+  jmp_back_addr_fixup.offset = loader_shellcode_offset + orig_addr_value_offset;
+  jmp_back_addr_fixup.desc.offset_type = OffsetRelativeTo::VmLoaderSection;
+  jmp_back_addr_fixup.desc.operation =
+      FixupOperation::SubtractVmLoaderSectionVirtualAddress;
+  jmp_back_addr_fixup.desc.size = sizeof( uint32_t );
+  context->fixup_context.fixups.push_back( jmp_back_addr_fixup );
+  ////////////////////////////////
+
+  ///////////////////
+  // AddVmCodeAddressToFixup
+  Fixup virtualized_code_addr_fixup;
+  virtualized_code_addr_fixup.offset = vm_code_addr_offset;
+  virtualized_code_addr_fixup.desc.offset_type =
+      OffsetRelativeTo::VmLoaderSection;
+  virtualized_code_addr_fixup.desc.operation =
+      FixupOperation::AddVmBytecodeSectionVirtualAddress;
+  virtualized_code_addr_fixup.desc.size = sizeof( uint32_t );
+  context->fixup_context.fixups.push_back( virtualized_code_addr_fixup );
+  ///////////////
+
+  uintptr_t section_offset = 0;
+  uint8_t* section_data = 0;
+  OffsetRelativeTo jmp_fixup_relative_to = OffsetRelativeTo::Unknown;
+
+  switch ( context->virtualizer_context.what_to_virtualize ) {
+    case WhatToVirtualize::TextSection: {
+      section_offset = section::RvaToSectionOffset(
+          context->virtualizer_context.original_text_section_header,
+          static_cast<uint32_t>( vm_instruction.address ) );
+
+      section_data = context->new_text_section.GetData()->data();
+
+      jmp_fixup_relative_to = OffsetRelativeTo::TextSection;
+    } break;
+    case WhatToVirtualize::VmLoaderSection: {
+      section_offset = section::RvaToSectionOffset(
+          context->virtualizer_context.vm_loader_section_header,
+          static_cast<uint32_t>( vm_instruction.address ) );
+
+      section_data = context->vm_loader_section.GetData()->data();
+
+      jmp_fixup_relative_to = OffsetRelativeTo::VmLoaderSection;
+    } break;
+    default:
+      assert( false );
+      break;
+  }
+
+  const auto first = section_data + section_offset;
+
+  // Fill the whole instruction with random bytes
+  rng::Fill( first, vm_instruction.size );
+
+  constexpr uint8_t kJmpOpcode = 0xE9;
+
+  // Write the jump
+  *first = kJmpOpcode;
+
+  const auto jmp_addr_offset = section_offset + 1;
+
+  const uint32_t jmp_destination =
+      static_cast<uint32_t>( loader_shellcode_offset -
+                             vm_instruction.address ) -
+      kJmpInstructionSize;
+
+  // Cast the jump desination to a uint8_t array because the section data
+  // is in uint8_t format
+  const auto jmp_destination_as_uint8_array =
+      reinterpret_cast<const uint8_t*>( &jmp_destination );
+
+  // Write the jump destination
+  std::copy( jmp_destination_as_uint8_array,
+             jmp_destination_as_uint8_array + sizeof( jmp_destination ),
+             section_data + jmp_addr_offset );
+
+  Fixup jmp_to_vm_loader_fixup;
+  jmp_to_vm_loader_fixup.offset = jmp_addr_offset;
+  jmp_to_vm_loader_fixup.desc.offset_type = jmp_fixup_relative_to;
+  jmp_to_vm_loader_fixup.desc.operation =
+      FixupOperation::AddVmLoaderSectionVirtualAddress;
+  jmp_to_vm_loader_fixup.desc.size = sizeof( uint32_t );
+  context->fixup_context.fixups.push_back( jmp_to_vm_loader_fixup );
+
+  // if it was relocated, add it to a list to remove the relocation later
+  // on from PE because when we virtualize an instruction, we handle the relocation ourselve
+  for ( const auto reloc_rva : vm_instruction.relocation_rvas ) {
+    context->fixup_context.relocation_rvas_to_remove.insert( reloc_rva );
+  }
+
+  ++context->virtualizer_context.total_virtualized_instructions;
+
+  file_log::VirtualizedSiteRecord site_record;
+  site_record.address = vm_instruction.address;
+  site_record.vm_opcode = static_cast<uint32_t>( vm_instruction.vm_opcode );
+  site_record.size = vm_instruction.size;
+
+  FILE_LOG_RECORD( file_log::LogRecordType::VirtualizedSite, site_record );
+
+  FILE_LOG_TRACE( "Virtualized 0x%08I64x, %s", vm_instruction.address,
+                  vm_instruction.text.c_str() );
+}
+
+// A telemetry build has the site index right after the vm opcode
+void AddVmTelemetrySiteIndex( std::vector<uint8_t>* virtualized_code,
+                              const uint32_t site_index ) {
+  const auto site_index_bytes = reinterpret_cast<const uint8_t*>( &site_index );
+
+  virtualized_code->insert( virtualized_code->begin() + VM_OPCODE_SIZE,
+                            site_index_bytes,
+                            site_index_bytes + sizeof( site_index ) );
+}
+
+// The loader is entered through a jmp that is written over the instruction
+bool HasRoomForVmEntryJmp( const PendingVmInstruction& vm_instruction ) {
+  constexpr uint32_t kJmpInstructionSize = 5;
+
+  return vm_instruction.size >= kJmpInstructionSize;
+}
+
+// Counts the instruction against the density of its policy range, only called
+// for the ones that are going to be emitted
+bool IsWithinPolicyDensity( VirtualizerContext* virtualizer_context,
+                            const uint64_t address ) {
+  if ( virtualizer_context->what_to_virtualize !=
+           WhatToVirtualize::TextSection ||
+       !virtualizer_context->has_virtualization_policy ) {
+    return true;
+  }
+
+  return virtualization_policy::ShouldVirtualize(
+      &virtualizer_context->virtualization_policy,
+      static_cast<uint32_t>( address ) );
+}
+
+// Groups the collected instructions into blocks in the order the
+// disassembler found them. A block only continues with an instruction that
+// directly follows the previous one, that way anything that was not
+// virtualized or turned out to be invalid in between ends the block.
+std::vector<PendingVmBlock> BuildVmBlocks( ProtectorContext* context ) {
+  std::vector<PendingVmBlock> vm_blocks;
+
+  PendingVmBlock pending_block;
+
+  const auto end_block = [&]() {
+    if ( !pending_block.instructions.empty() ) {
+      vm_blocks.push_back( std::move( pending_block ) );
+      pending_block = PendingVmBlock();
+    }
+  };
+
+  for ( auto& vm_instruction : context->collected_vm_instructions ) {
+    if ( context->invalid_instruction_addresses.count(
+             vm_instruction.address ) ) {
+      continue;
+    }
+
+    const auto vm_opcode = vm_instruction.vm_opcode;
+
+    if ( !pending_block.instructions.empty() ) {
+      const auto& previous_instruction = pending_block.instructions.back();
+
+      if ( previous_instruction.address + previous_instruction.size !=
+           vm_instruction.address ) {
+        end_block();
+      }
+    }
+
+    // The call and push epilogs cannot handle a jump that was taken earlier
+    // in the block, such an instruction begins a new block instead
+    if ( pending_block.has_conditional_jump &&
+         virtualizer::IsVmBlockTerminator( vm_opcode ) &&
+         vm_opcode != VmOpcodes::JMP_IMM ) {
+      end_block();
+    }
+
+    // Only the entry of a block needs the room for the jmp, a short one
+    // stays native when it would begin a block
+    if ( pending_block.instructions.empty() &&
+         !HasRoomForVmEntryJmp( vm_instruction ) ) {
+      continue;
+    }
+
+    // Left native, which ends the block
+    if ( !IsWithinPolicyDensity( &context->virtualizer_context,
+                                 vm_instruction.address ) ) {
+      end_block();
+      continue;
+    }
+
+    // The whole block is encrypted with the same key because it is passed
+    // once to the interpreter by the loader
+    if ( pending_block.instructions.empty() ) {
+      pending_block.vm_opcode_encyption_key = RandomU32( 1000, 10000000 );
+    }
+
+#if ENABLE_VM_TELEMETRY
+    auto& telemetry_sites = context->virtualizer_context.telemetry_sites;
+
+    vm_instruction.telemetry_site_index =
+        static_cast<uint32_t>( telemetry_sites.size() );
+
+    telemetry_sites.push_back(
+        { vm_instruction.address, vm_instruction.text } );
+#endif
+
+    pending_block.instructions.push_back( std::move( vm_instruction ) );
+
+    if ( vm_opcode == VmOpcodes::JCC_IMM ) {
+      pending_block.has_conditional_jump = true;
+    }
+
+#if ENABLE_BLOCK_VIRTUALIZATION
+    const bool end_of_block =
+        virtualizer::IsVmBlockTerminator( vm_opcode ) ||
+        pending_block.instructions.size() >= kMaxVmBlockInstructions;
+#else
+    const bool end_of_block = true;
+#endif
+
+    if ( end_of_block ) {
+      end_block();
+    }
+  }
+
+  end_block();
+
+  context->collected_vm_instructions.clear();
+  context->invalid_instruction_addresses.clear();
+
+  return vm_blocks;
+}
+
+csh OpenCapstoneHandle() {
+#ifdef _WIN64
+  const cs_mode mode = cs_mode::CS_MODE_64;
+#else
+  const cs_mode mode = cs_mode::CS_MODE_32;
+#endif
+
+  csh handle = 0;
+
+  const cs_err cs_status = cs_open( CS_ARCH_X86, mode, &handle );
+
+  if ( cs_status != cs_err::CS_ERR_OK ) {
+    throw std::runtime_error( "cs_open failed with error code " +
+                              std::to_string( cs_status ) );
+  }
+
+  const cs_err detail_status =
+      cs_option( handle, cs_opt_type::CS_OPT_DETAIL, CS_OPT_ON );
+
+  if ( detail_status != cs_err::CS_ERR_OK ) {
+    cs_close( &handle );
+    throw std::runtime_error( "cs_option failed with error code " +
+                              std::to_string( detail_status ) );
+  }
+
+  return handle;
+}
+
+// Generates the virtualized code and the loader shellcode of a block, it
+// does not touch any section so the blocks can be generated on any thread
+void GenerateVmBlockCode( const VirtualizerContext& virtualizer_context,
+                          csh disassembler_handle,
+                          cs_insn* instruction,
+                          PendingVmBlock* vm_block ) {
+  auto& block_virtualized_code = vm_block->virtualized_code;
+
+  for ( const auto& vm_instruction : vm_block->instructions ) {
+    auto code = vm_instruction.code;
+    size_t code_size = vm_instruction.size;
+    uint64_t address = vm_instruction.address;
+
+    if ( !cs_disasm_iter( disassembler_handle, &code, &code_size, &address,
+                          instruction ) ) {
+      throw std::runtime_error( "Unable to decode a collected instruction" );
+    }
+
+    auto virtualized_code =
+        virtualizer::CreateVirtualizedShellcode(
+            *instruction, vm_instruction.vm_opcode,
+            vm_block->vm_opcode_encyption_key, vm_instruction.relocation_rvas,
+            virtualizer_context.default_image_base )
+            .GetBuffer();
+
+    // EachInstructionCallback only collects the ones that have code
+    if ( virtualized_code.empty() ) {
+      throw std::runtime_error( "No code was created for a collected "
+                                "instruction" );
+    }
+
+#if ENABLE_VM_TELEMETRY
+    AddVmTelemetrySiteIndex( &virtualized_code,
+                             vm_instruction.telemetry_site_index );
+#endif
+
+    vm_block->virtualized_code_offsets.push_back(
+        block_virtualized_code.size() );
+
+    block_virtualized_code.insert( block_virtualized_code.end(),
+                                   virtualized_code.cbegin(),
+                                   virtualized_code.cend() );
+  }
+
+  const auto& last_instruction = vm_block->instructions.back();
+
+  // All the loaders of the block continue after the last instruction
+  const auto block_end_address =
+      last_instruction.address + last_instruction.size;
+
+  auto exit_vm_opcode = last_instruction.vm_opcode;
+
+  virtualizer::VmRegisterUsage exit_register_usage;
+
+  // Make the not taken path of a conditional jump leave through the real
+  // stack as well, then every path uses the epilog of JMP_IMM
+  if ( vm_block->has_conditional_jump &&
+       !virtualizer::IsVmBlockTerminator( exit_vm_opcode ) ) {
+    auto vm_jmp_code =
+        virtualizer::CreateVmJmpShellcode( block_end_address,
+                                           vm_block->vm_opcode_encyption_key )
+            .GetBuffer();
+
+#if ENABLE_VM_TELEMETRY
+    AddVmTelemetrySiteIndex( &vm_jmp_code, 0 );
+#endif
+
+    block_virtualized_code.insert( block_virtualized_code.end(),
+                                   vm_jmp_code.cbegin(), vm_jmp_code.cend() );
+
+    exit_vm_opcode = VmOpcodes::JMP_IMM;
+
+    exit_register_usage.virtual_push_count =
+        virtualizer::GetVmHandlerVirtualPushCount( VmOpcodes::JMP_IMM );
+  }
+
+  const auto vm_exit_shellcode =
+      virtualizer::CreateVmExitShellcode( vm_block->vm_opcode_encyption_key );
+
+  block_virtualized_code.insert( block_virtualized_code.end(),
+                                 vm_exit_shellcode.GetBuffer().cbegin(),
+                                 vm_exit_shellcode.GetBuffer().cend() );
+
+  // A loader that enters at an instruction executes the rest of the block as
+  // well, therefore it has to save the registers used by all of them
+  auto register_usage = exit_register_usage;
+
+  for ( size_t i = vm_block->instructions.size(); i-- > 0; ) {
+    auto& vm_instruction = vm_block->instructions[ i ];
+
+    virtualizer::MergeVmRegisterUsage( &register_usage,
+                                       vm_instruction.register_usage );
+
+    vm_instruction.register_usage = register_usage;
+  }
+
+  // Only the instructions of the original PE are instrumented because the
+  // profile is looked up by their rva when protecting the next time
+  const bool instrument_block =
+      virtualizer_context.instrument_virtualized_code &&
+      virtualizer_context.what_to_virtualize == WhatToVirtualize::TextSection;
+
+  for ( size_t i = 0; i < vm_block->instructions.size(); ++i ) {
+    auto& vm_instruction = vm_block->instructions[ i ];
+
+    // Every instruction from the entry until the end of the block is executed
+    const auto profile_counter_count = static_cast<uint32_t>(
+        instrument_block ? vm_block->instructions.size() - i : 0 );
+
+#if ENABLE_SHARED_VM_ENTRY
+    vm_instruction.exit_vm_opcode = exit_vm_opcode;
+    vm_instruction.profile_counter_count = profile_counter_count;
+    vm_instruction.vm_opcode_encryption_key =
+        vm_block->vm_opcode_encyption_key;
+#else
+    vm_instruction.loader_shellcode =
+        virtualizer::GetLoaderShellcodeForVirtualizedCode(
+            exit_vm_opcode, vm_instruction.register_usage,
+            profile_counter_count );
+
+    vm_instruction.loader_shellcode.ModifyVariable(
+        VmOpcodeEncryptionKeyVariable, vm_block->vm_opcode_encyption_key );
+#endif
+  }
+}
+
+// Generates the code of every block on all the cores. The blocks do not
+// depend on each other, so the output is the same for any thread count.
+void GenerateVmBlocksCode( const VirtualizerContext& virtualizer_context,
+                           std::vector<PendingVmBlock>* vm_blocks ) {
+  auto worker_count = std::thread::hardware_concurrency();
+
+  if ( worker_count == 0 )
+    worker_count = 1;
+
+  if ( worker_count > vm_blocks->size() )
+    worker_count = static_cast<uint32_t>( vm_blocks->size() );
+
+  std::atomic<size_t> next_block_index = 0;
+
+  std::vector<std::exception_ptr> worker_exceptions( worker_count );
+  std::vector<std::thread> threads;
+
+  for ( uint32_t i = 0; i < worker_count; ++i ) {
+    threads.emplace_back( [&, i]() {
+      try {
+        // Each thread decodes with its own handle
+        auto disassembler_handle = OpenCapstoneHandle();
+        Defer( { cs_close( &disassembler_handle ); } );
+
+        const auto instruction = cs_malloc( disassembler_handle );
+        Defer( { cs_free( instruction, 1 ); } );
+
+        for ( ;; ) {
+          const auto block_index = next_block_index++;
+
+          if ( block_index >= vm_blocks->size() )
+            break;
+
+          GenerateVmBlockCode( virtualizer_context, disassembler_handle,
+                               instruction, &( *vm_blocks )[ block_index ] );
+        }
+      } catch ( ... ) {
+        worker_exceptions[ i ] = std::current_exception();
+
+        // Nothing is emitted on a failure, let the others stop early
+        next_block_index = vm_blocks->size();
+      }
+    } );
+  }
+
+  for ( auto& thread : threads )
+    thread.join();
+
+  for ( const auto& worker_exception : worker_exceptions ) {
+    if ( worker_exception )
+      std::rethrow_exception( worker_exception );
+  }
+}
+
+#if ENABLE_ADAPTIVE_DEVIRTUALIZATION
+// Stores the original code of the instruction for the interpreter to write
+// back once the site gets hot. The jump has to be within one aligned qword
+// to be swapped atomically, the image base keeps the alignment of the rva.
+void AddAdaptiveSite( const PendingVmInstruction& vm_instruction,
+                      const uint32_t profile_site_index,
+                      ProtectorContext* context ) {
+  constexpr uint64_t kJmpInstructionSize = 5;
+
+  // The relocations of the instruction are removed from the pe
+  if ( !vm_instruction.relocation_rvas.empty() ||
+       !HasRoomForVmEntryJmp( vm_instruction ) ||
+       ( vm_instruction.address & 7 ) + kJmpInstructionSize > 8 ||
+       vm_instruction.size > VM_MAX_INSTRUCTION_SIZE ) {
+    return;
+  }
+
+  VmAdaptiveSite adaptive_site{};
+  adaptive_site.rva = static_cast<uint32_t>( vm_instruction.address );
+  adaptive_site.profile_site_index = profile_site_index;
+  adaptive_site.code_key = rng::NextU64();
+  adaptive_site.size = vm_instruction.size;
+
+  for ( uint8_t i = 0; i < vm_instruction.size; ++i ) {
+    adaptive_site.code[ i ] =
+        vm_instruction.code[ i ] ^
+        static_cast<uint8_t>( adaptive_site.code_key >> ( ( i % 8 ) * 8 ) );
+  }
+
+  context->adaptive_sites.push_back( adaptive_site );
+}
+#endif
+
+// Lays out a generated block, the virtualized code of all the instructions is
+// after each other and terminated by a VM_EXIT. Every instruction still gets
+// its own loader that starts executing at its own virtualized code, in case
+// something jumps into the middle of the block. One that is too short for
+// the jmp keeps its original code instead, it runs natively into the next
+// instruction when something jumps to it.
+void EmitVmBlock( PendingVmBlock* vm_block, ProtectorContext* context ) {
+  const auto& original_pe_nt_headers =
+      context->virtualizer_context.original_pe_nt_headers;
+
+  const auto block_virtualized_code_offset =
+      context->vm_bytecode_section.AppendCode(
+          vm_block->virtualized_code,
+          original_pe_nt_headers->OptionalHeader.SectionAlignment,
+          original_pe_nt_headers->OptionalHeader.FileAlignment );
+
+  const auto& last_instruction = vm_block->instructions.back();
+
+  // All the loaders of the block continue after the last instruction
+  const auto block_end_address =
+      last_instruction.address + last_instruction.size;
+
+  // Only the instructions of the original PE are instrumented because the
+  // profile is looked up by their rva when protecting the next time
+  const bool instrument_block =
+      context->virtualizer_context.instrument_virtualized_code &&
+      context->virtualizer_context.what_to_virtualize ==
+          WhatToVirtualize::TextSection;
+
+  std::vector<uint32_t> profile_counter_offsets;
+
+  if ( instrument_block ) {
+    for ( const auto& vm_instruction : vm_block->instructions ) {
+      VmProfileSite profile_site;
+      profile_site.rva = static_cast<uint32_t>( vm_instruction.address );
+      profile_site.reserved = 0;
+      profile_site.execution_count = 0;
+
+      const auto profile_site_offset = context->profile_section.AppendValue(
+          profile_site, original_pe_nt_headers->OptionalHeader.FileAlignment );
+
+      profile_counter_offsets.push_back( static_cast<uint32_t>(
+          profile_site_offset + offsetof( VmProfileSite, execution_count ) ) );
+
+#if ENABLE_ADAPTIVE_DEVIRTUALIZATION
+      AddAdaptiveSite( vm_instruction,
+                       static_cast<uint32_t>( profile_site_offset /
+                                              sizeof( VmProfileSite ) ),
+                       context );
+#endif
+    }
+  }
+
+  for ( size_t i = 0; i < vm_block->instructions.size(); ++i ) {
+    auto& vm_instruction = vm_block->instructions[ i ];
+
+    // Executed by the loaders of the instructions before it
+    if ( !HasRoomForVmEntryJmp( vm_instruction ) ) {
+      ++context->virtualizer_context.total_virtualized_instructions;
+      continue;
+    }
+
+    // Every instruction from the entry until the end of the block is executed
+    const std::vector<uint32_t> entry_profile_counter_offsets(
+        profile_counter_offsets.begin() +
+            ( std::min )( i, profile_counter_offsets.size() ),
+        profile_counter_offsets.end() );
+
+    EmitVirtualizedInstruction(
+        &vm_instruction, vm_instruction.register_usage,
+        block_virtualized_code_offset + vm_block->virtualized_code_offsets[ i ],
+        block_end_address, entry_profile_counter_offsets, context );
+  }
+}
+
+#if ENABLE_VM_FUNCTION_LAYOUT
+// Orders the blocks by the function they are in, both sections are appended
+// in the same order so the loaders and the virtualized code of a function end
+// up next to each other. The functions with the most executions in the
+// profile come first, the rest keep the order the linker gave them. Without
+// an exception directory each block counts as its own function.
+void LayOutVmBlocksByFunction( const VirtualizerContext& virtualizer_context,
+                               const PeDisassemblyEngine& pe_disassembler,
+                               std::vector<PendingVmBlock>* vm_blocks ) {
+  struct BlockPlacement {
+    uint64_t function_execution_count;
+    uintptr_t function_rva;
+    uint64_t address;
+    size_t block_index;
+  };
+
+  std::vector<BlockPlacement> placements;
+  placements.reserve( vm_blocks->size() );
+
+  // first: function rva, second: the executions of its sites
+  std::unordered_map<uintptr_t, uint64_t> function_execution_counts;
+
+  const auto& site_execution_counts =
+      virtualizer_context.site_execution_counts;
+
+  for ( size_t i = 0; i < vm_blocks->size(); ++i ) {
+    const auto& vm_block = ( *vm_blocks )[ i ];
+    const auto address = vm_block.instructions.front().address;
+
+    const auto function = pe_disassembler.FindExceptionDirectoryFunction(
+        static_cast<uintptr_t>( address ) );
+
+    const auto function_rva = function ? function->begin_address
+                                       : static_cast<uintptr_t>( address );
+
+    auto& function_execution_count = function_execution_counts[ function_rva ];
+
+    for ( const auto& vm_instruction : vm_block.instructions ) {
+      const auto it = site_execution_counts.find( vm_instruction.address );
+
+      if ( it != site_execution_counts.end() ) {
+        function_execution_count += it->second;
+      }
+    }
+
+    placements.push_back( { 0, function_rva, address, i } );
+  }
+
+  for ( auto& placement : placements ) {
+    placement.function_execution_count =
+        function_execution_counts[ placement.function_rva ];
+  }
+
+  std::sort( placements.begin(), placements.end(),
+             []( const BlockPlacement& lhs, const BlockPlacement& rhs ) {
+               if ( lhs.function_execution_count !=
+                    rhs.function_execution_count )
+                 return lhs.function_execution_count >
+                        rhs.function_execution_count;
+
+               if ( lhs.function_rva != rhs.function_rva )
+                 return lhs.function_rva < rhs.function_rva;
+
+               return lhs.address < rhs.address;
+             } );
+
+  std::vector<PendingVmBlock> sorted_vm_blocks;
+  sorted_vm_blocks.reserve( vm_blocks->size() );
+
+  for ( const auto& placement : placements ) {
+    sorted_vm_blocks.push_back(
+        std::move( ( *vm_blocks )[ placement.block_index ] ) );
+  }
+
+  *vm_blocks = std::move( sorted_vm_blocks );
+}
+#endif
+
+// Builds the blocks out of the collected instructions, generates their code
+// on all the cores and then lays them out one after the other
+void EmitCollectedVmInstructions( const PeDisassemblyEngine& pe_disassembler,
+                                  ProtectorContext* context ) {
+  auto vm_blocks = BuildVmBlocks( context );
+
+#if ENABLE_VM_FUNCTION_LAYOUT
+  LayOutVmBlocksByFunction( context->virtualizer_context, pe_disassembler,
+                            &vm_blocks );
+#endif
+
+  GenerateVmBlocksCode( context->virtualizer_context, &vm_blocks );
+
+  for ( auto& vm_block : vm_blocks ) {
+    EmitVmBlock( &vm_block, context );
+  }
+}
+
+// Everything that EmitCollectedVmInstructions would add for the collected
+// instructions, without emitting any of it. The vm loader pass is left out,
+// it only virtualizes our own TLS callbacks and entrypoint.
+ProtectionReport::CostEstimate EstimateVmCost(
+    const PeDisassemblyEngine& pe_disassembler,
+    const opcode_cost_table::CostTable& cost_table,
+    ProtectorContext* context ) {
+  auto vm_blocks = BuildVmBlocks( context );
+
+  GenerateVmBlocksCode( context->virtualizer_context, &vm_blocks );
+
+  const auto& virtualizer_context = context->virtualizer_context;
+  const auto& fixup_context = context->fixup_context;
+
+  ProtectionReport::CostEstimate cost_estimate;
+  cost_estimate.calibrated = !cost_table.opcode_cycles.empty();
+
+  // Where the loaders would be appended, the relocations of the counters
+  // are grouped by the page that they end up in
+  uintptr_t vm_loader_section_offset =
+      context->vm_loader_section.GetCurrentOffset();
+
+  auto vm_section_relocation_offsets =
+      fixup_context.vm_section_offsets_to_add_to_relocation_table;
+
+#if ENABLE_SHARED_VM_ENTRY
+  // The trampolines that exist already are not added again
+  std::unordered_set<uint64_t> trampoline_keys;
+
+  for ( const auto& trampoline_offset :
+        virtualizer_context.vm_entry_trampoline_offsets ) {
+    trampoline_keys.insert( trampoline_offset.first );
+  }
+#endif
+
+  const bool instrument = virtualizer_context.instrument_virtualized_code;
+
+  // first: function rva, second: the amount of sites
+  std::map<uint32_t, uint32_t> function_site_counts;
+
+  for ( auto& vm_block : vm_blocks ) {
+    cost_estimate.vm_bytecode_section_growth +=
+        vm_block.virtualized_code.size();
+
+    for ( size_t i = 0; i < vm_block.instructions.size(); ++i ) {
+      auto& vm_instruction = vm_block.instructions[ i ];
+
+      // Every instruction from the entry until the end of the block is
+      // executed, the same as GenerateVmBlockCode counts them
+      const auto profile_counter_count = static_cast<uint32_t>(
+          instrument ? vm_block.instructions.size() - i : 0 );
+
+      std::vector<uintptr_t> profile_counter_value_offsets;
+
+#if ENABLE_SHARED_VM_ENTRY
+      if ( trampoline_keys
+               .insert(
+                   GetVmEntryTrampolineKey( vm_instruction.register_usage ) )
+               .second ) {
+        vm_loader_section_offset +=
+            virtualizer::GetVmEntryTrampolineShellcode(
+                vm_instruction.register_usage )
+                .GetBuffer()
+                .size();
+      }
+
+      const auto thunk_layout = vm_entry_thunk::GetLayout(
+          vm_instruction.exit_vm_opcode, profile_counter_count );
+
+      for ( uint32_t j = 0; j < profile_counter_count; ++j ) {
+        profile_counter_value_offsets.push_back(
+            vm_loader_section_offset +
+            thunk_layout.GetProfileCounterValueOffset( j ) );
+      }
+
+      vm_loader_section_offset += thunk_layout.size;
+#else
+      auto& loader_shellcode = vm_instruction.loader_shellcode;
+
+      for ( uint32_t j = 0; j < profile_counter_count; ++j ) {
+        profile_counter_value_offsets.push_back(
+            vm_loader_section_offset +
+            loader_shellcode.GetNamedValueOffset(
+                virtualizer::GetVmProfileCounterVariable( j ) ) );
+      }
+
+      vm_loader_section_offset += loader_shellcode.GetBuffer().size();
+#endif
+
+#ifndef _WIN64
+      // The counters are absolute addresses on x86
+      vm_section_relocation_offsets.insert(
+          vm_section_relocation_offsets.end(),
+          profile_counter_value_offsets.begin(),
+          profile_counter_value_offsets.end() );
+#endif
+
+      if ( instrument ) {
+        cost_estimate.profile_section_growth += sizeof( VmProfileSite );
+      }
+
+      const auto function = pe_disassembler.FindExceptionDirectoryFunction(
+          static_cast<uintptr_t>( vm_instruction.address ) );
+
+      ++function_site_counts[ function ? static_cast<uint32_t>(
+                                             function->begin_address )
+                                       : 0 ];
+
+      ProtectionReport::SiteCost site_cost;
+      site_cost.rva = static_cast<uint32_t>( vm_instruction.address );
+      site_cost.vm_opcode = static_cast<uint32_t>( vm_instruction.vm_opcode );
+      site_cost.cycles_per_execution =
+          opcode_cost_table::GetCycles( cost_table, vm_instruction.vm_opcode );
+
+      const auto execution_count =
+          virtualizer_context.site_execution_counts.find(
+              vm_instruction.address );
+
+      site_cost.execution_count =
+          execution_count != virtualizer_context.site_execution_counts.end()
+              ? execution_count->second
+              : 0;
+
+      cost_estimate.sites.push_back( site_cost );
+    }
+  }
+
+  // The new sections are counted as a whole, .reloc only by what it gets
+  cost_estimate.vm_loader_section_growth = vm_loader_section_offset;
+  cost_estimate.virtualized_code_section_growth =
+      context->virtualized_code_section.GetCurrentOffset();
+  cost_estimate.vm_bytecode_section_growth +=
+      context->vm_bytecode_section.GetCurrentOffset();
+
+  if ( instrument ) {
+    cost_estimate.profile_section_growth +=
+        context->profile_section.GetCurrentOffset();
+  }
+
+  for ( auto offsets :
+        { vm_section_relocation_offsets,
+          fixup_context
+              .virtualized_code_section_offsets_to_add_to_relocation_table } ) {
+    std::sort( offsets.begin(), offsets.end() );
+
+    cost_estimate.reloc_section_growth +=
+        GetRelocationBlocksSize( offsets, 1 << 12 );
+  }
+
+  for ( const auto& function_site_count : function_site_counts ) {
+    cost_estimate.functions.push_back(
+        { function_site_count.first, function_site_count.second } );
+  }
+
+  std::sort( cost_estimate.sites.begin(), cost_estimate.sites.end(),
+             []( const ProtectionReport::SiteCost& lhs,
+                 const ProtectionReport::SiteCost& rhs ) {
+               return lhs.rva < rhs.rva;
+             } );
+
+  return cost_estimate;
+}
+
+#if ENABLE_ADAPTIVE_DEVIRTUALIZATION
+// Appends the sites that the interpreter may devirtualize after each other
+void AddAdaptiveSites( const uintptr_t vm_code_section_data_offset,
+                       const uint64_t threshold,
+                       ProtectorContext* context ) {
+  if ( context->adaptive_sites.empty() ) {
+    return;
+  }
+
+  auto& virtualized_code_section = context->virtualized_code_section;
+
+  const auto adaptive_sites_offset = virtualized_code_section.AppendCode(
+      reinterpret_cast<const uint8_t*>( context->adaptive_sites.data() ),
+      context->adaptive_sites.size() * sizeof( VmAdaptiveSite ),
+      context->virtualizer_context.original_pe_nt_headers->OptionalHeader
+          .FileAlignment );
+
+  // Appending may have moved the data
+  const auto vm_code_section_data_ptr = reinterpret_cast<VmCodeSectionData*>(
+      virtualized_code_section.GetData()->data() +
+      vm_code_section_data_offset );
+
+  vm_code_section_data_ptr->adaptive_site_rva =
+      static_cast<uint32_t>( adaptive_sites_offset );
+  vm_code_section_data_ptr->adaptive_site_count =
+      static_cast<uint32_t>( context->adaptive_sites.size() );
+  vm_code_section_data_ptr->adaptive_site_threshold = threshold;
+
+  Fixup adaptive_site_rva_fixup;
+  adaptive_site_rva_fixup.offset =
+      vm_code_section_data_offset +
+      offsetof( VmCodeSectionData, adaptive_site_rva );
+  adaptive_site_rva_fixup.desc.offset_type =
+      OffsetRelativeTo::VirtualizedCodeSection;
+  adaptive_site_rva_fixup.desc.operation =
+      FixupOperation::AddVirtualizedCodeSectionVirtualAddress;
+  adaptive_site_rva_fixup.desc.size = sizeof( uint32_t );
+  context->fixup_context.fixups.push_back( adaptive_site_rva_fixup );
+}
+#endif
+
+// Returns true if the profile says that the instruction executes too often
+// to be worth the vm overhead
+bool IsHotSite( const VirtualizerContext& virtualizer_context,
+                const uint64_t address ) {
+  if ( virtualizer_context.what_to_virtualize !=
+       WhatToVirtualize::TextSection ) {
+    return false;
+  }
+
+  const auto it = virtualizer_context.site_execution_counts.find( address );
+
+  return it != virtualizer_context.site_execution_counts.end() &&
+         it->second > virtualizer_context.hot_site_threshold;
+}
+
+// Returns true if the rules of the policy file allow virtualizing the
+// instruction, the density is applied in BuildVmBlocks. The vm loader section
+// is always virtualized.
+bool IsAllowedByPolicy( VirtualizerContext* virtualizer_context,
+                        const uint64_t address ) {
+  if ( virtualizer_context->what_to_virtualize !=
+           WhatToVirtualize::TextSection ||
+       !virtualizer_context->has_virtualization_policy ) {
+    return true;
+  }
+
+  return virtualization_policy::IsIncluded(
+      &virtualizer_context->virtualization_policy,
+      static_cast<uint32_t>( address ) );
+}
+
+// Turns a call through the iat of a redirected import into a CALL_IMPORT which
+// skips the redirect shellcode at runtime
+VmOpcodes GetFusedVmOpcode( const VirtualizerContext& virtualizer_context,
+                            const cs_insn& instruction,
+                            const VmOpcodes vm_opcode ) {
+  if ( virtualizer_context.what_to_virtualize !=
+       WhatToVirtualize::TextSection ) {
+    return vm_opcode;
+  }
+
+  if ( vm_opcode != VmOpcodes::CALL_MEMORY &&
+       vm_opcode != VmOpcodes::CALL_MEMORY_RIP_RELATIVE ) {
+    return vm_opcode;
+  }
+
+  const auto relocations_rva_within_instruction =
+      GetRelocationsWithinInstruction(
+          instruction, virtualizer_context.original_pe_relocation_index );
+
+  const auto import_slot_rva = virtualizer::GetCallMemorySlotRva(
+      instruction, !relocations_rva_within_instruction.empty(),
+      virtualizer_context.default_image_base );
+
+  // 0 is a call through a register, the slot is not known
+  if ( import_slot_rva != 0 &&
+       virtualizer_context.redirected_import_slot_rvas.count(
+           import_slot_rva ) ) {
+    return VmOpcodes::CALL_IMPORT;
+  }
+
+  return vm_opcode;
+}
+
+// Only collects the instructions that can be virtualized, the code is
+// generated and emitted by EmitCollectedVmInstructions afterwards
+void EachInstructionCallback( const cs_insn& instruction,
+                              const uint8_t* code,
+                              void* data ) {
+  auto context = reinterpret_cast<ProtectorContext*>( data );
+
+  ++context->virtualizer_context.total_disassembled_instructions;
+
+  // Two tier decoding left the detail out, GetVmOpcode has nothing for it
+  if ( !instruction.detail )
+    return;
+
+  const auto vm_opcode = GetFusedVmOpcode(
+      context->virtualizer_context, instruction,
+      virtualizer::GetVmOpcode( instruction ) );
+
+  if ( !virtualizer::IsVirtualizeable( vm_opcode ) ||
+       IsHotSite( context->virtualizer_context, instruction.address ) ||
+       !IsAllowedByPolicy( &context->virtualizer_context,
+                           instruction.address ) ) {
+    return;
+  }
+
+  // The flag aware handlers emulate the eflags in the saved eflags
+  if ( instruction.detail->x86.eflags != 0 &&
+       !virtualizer::DoesVmHandlerUseEflags( vm_opcode ) ) {
+    throw std::runtime_error(
+        "An instruction changing eflags was found, not supported at the "
+        "moment" );
+  }
+
+  // Get the relocations within the instruction, if any exists
+  auto relocation_rvas = GetRelocationsWithinInstruction(
+      instruction, context->virtualizer_context.original_pe_relocation_index );
+
+  // Some operands have no handler, like rsp based memory or ah, the code is
+  // generated once here to leave those native. The key does not matter.
+  const bool created_vm_code =
+      virtualizer::CreateVirtualizedShellcode(
+          instruction, vm_opcode, 0, relocation_rvas,
+          context->virtualizer_context.default_image_base )
+          .GetBuffer()
+          .size() > 0;
+
+  if ( !created_vm_code )
+    return;
+
+  PendingVmInstruction vm_instruction;
+  vm_instruction.address = instruction.address;
+  vm_instruction.size = static_cast<uint8_t>( instruction.size );
+  vm_instruction.vm_opcode = vm_opcode;
+  vm_instruction.code = code;
+  vm_instruction.relocation_rvas = std::move( relocation_rvas );
+
+  vm_instruction.register_usage =
+      virtualizer::GetVmRegisterUsage( instruction, vm_opcode );
+  vm_instruction.text =
+      std::string( instruction.mnemonic ) + " " + instruction.op_str;
+
+  context->collected_vm_instructions.push_back( std::move( vm_instruction ) );
+};
+
+// Because the disassembler can get it wrong sometimes, it tells us about the
+// instructions that turned out to be data. Nothing has been emitted at this
+// point, so they are simply left out when the blocks are built.
+void InvalidInstructionCallback( const uint64_t address,
+                                 const SmallInstructionData ins_data,
+                                 void* data ) {
+  auto context = reinterpret_cast<ProtectorContext*>( data );
+
+  if ( !context->invalid_instruction_addresses.insert( address ).second )
+    return;
+
+  ++context->virtualizer_context.total_invalidated_instructions;
+
+  FILE_LOG_WARNING( "Skipping invalid instruction 0x%08I64x",
+                    static_cast<uint64_t>( address ) );
+};
+
+// Where pe::Build places the vm loader section, right after .reloc once the
+// relocations of the new sections are appended to it
+uint32_t GetVmLoaderSectionVirtualAddress(
+    const PortableExecutable& original_pe,
+    const ProtectorContext& context ) {
+  const auto nt_headers = original_pe.GetNtHeaders();
+
+  const auto reloc_section_header =
+      *original_pe.GetSectionHeaders().FromName( ".reloc" );
+
+  const auto& reloc_directory =
+      nt_headers->OptionalHeader
+          .DataDirectory[ IMAGE_DIRECTORY_ENTRY_BASERELOC ];
+
+  std::vector<const std::vector<uintptr_t>*> offset_lists = {
+      &context.fixup_context.vm_section_offsets_to_add_to_relocation_table };
+
+#if ENABLE_TLS_CALLBACKS
+  offset_lists.push_back(
+      &context.fixup_context
+           .virtualized_code_section_offsets_to_add_to_relocation_table );
+#endif
+
+  // AddRelocations trims the padding of .reloc before it appends anything
+  uintptr_t reloc_section_size = reloc_section_header.Misc.VirtualSize;
+  uintptr_t reloc_blocks_size = 0;
+  bool has_new_relocations = false;
+
+  for ( const auto offset_list : offset_lists ) {
+    if ( offset_list->empty() )
+      continue;
+
+    auto sorted_offsets = *offset_list;
+    std::sort( sorted_offsets.begin(), sorted_offsets.end() );
+
+    reloc_blocks_size += GetRelocationBlocksSize( sorted_offsets, 1 << 12 );
+    has_new_relocations = true;
+  }
+
+  if ( has_new_relocations )
+    reloc_section_size = reloc_directory.Size + reloc_blocks_size;
+
+  return static_cast<uint32_t>( peutils::AlignUp(
+      reloc_section_header.VirtualAddress + reloc_section_size,
+      nt_headers->OptionalHeader.SectionAlignment ) );
+}
+
+// A copy of the vm loader section with the fixups that only depend on its own
+// rva applied, the disassembler and the virtualizer have to see the values
+// that the final pe is going to have
+std::vector<uint8_t> GetVmLoaderSectionCodeWithFixups(
+    const ProtectorContext& context,
+    const uint32_t vm_loader_section_virtual_address ) {
+  auto code = *context.vm_loader_section.GetData();
+
+  for ( const auto& fixup : context.fixup_context.fixups ) {
+    if ( fixup.desc.offset_type != OffsetRelativeTo::VmLoaderSection ||
+         fixup.desc.size != sizeof( uint32_t ) ) {
+      continue;
+    }
+
+    uint32_t delta = 0;
+
+    switch ( fixup.desc.operation ) {
+      case FixupOperation::AddVmLoaderSectionVirtualAddress:
+        delta = vm_loader_section_virtual_address;
+        break;
+      case FixupOperation::SubtractVmLoaderSectionVirtualAddress:
+        delta = 0 - vm_loader_section_virtual_address;
+        break;
+      default:
+        continue;
+    }
+
+    uint32_t value = 0;
+    memcpy( &value, code.data() + fixup.offset, sizeof( value ) );
+
+    value += delta;
+    memcpy( code.data() + fixup.offset, &value, sizeof( value ) );
+  }
+
+  return code;
+}
+
+// Virtualizes the TLS callbacks and the entrypoint that we added to the vm
+// loader section, in the section itself before the pe is assembled. The
+// addresses are the rvas that the section will have at
+// vm_loader_section_virtual_address.
+void VirtualizeMyTlsCallbacksAndNewEntrypoint(
+    const PortableExecutable& original_pe,
+    const PortableExecutable& interpreter_pe,
+    const uint32_t vm_loader_section_virtual_address,
+    ProtectorContext* context ) {
+  // Only the relocations of this pass, the ones of the text section were
+  // removed from the original pe already
+  context->fixup_context.relocation_rvas_to_remove.clear();
+
+  auto vm_loader_section_header =
+      context->vm_loader_section.GetSectionHeader();
+  vm_loader_section_header.VirtualAddress = vm_loader_section_virtual_address;
+
+  context->virtualizer_context.vm_loader_section_header =
+      vm_loader_section_header;
+
+  // Has to outlive the collected instructions, they point into it
+  const auto vm_loader_code = GetVmLoaderSectionCodeWithFixups(
+      *context, vm_loader_section_virtual_address );
+
+  // Our own relocations are not in a relocation table yet, the entries are
+  // only searched so they do not need a Relocation
+  const auto& vm_section_offsets_to_relocate =
+      context->fixup_context.vm_section_offsets_to_add_to_relocation_table;
+
+  std::vector<RelocationIndex::Entry> relocation_entries;
+
+  for ( const auto offset : vm_section_offsets_to_relocate ) {
+    relocation_entries.push_back(
+        { vm_loader_section_virtual_address + offset, nullptr } );
+  }
+
+  context->virtualizer_context.original_pe_relocation_index =
+      RelocationIndex( std::move( relocation_entries ) );
+
+  const auto OnInvalidInstructionCallback =
+      []( const uint64_t address, const SmallInstructionData ins_data, void* ) {
+        // We do not anticipate this will occur in such small code such as my TLS callbacks
+        throw std::runtime_error(
+            "An invalid instruction was disassembled while trying to "
+            "virtualize our own code." );
+      };
 
-  pe_disassembler.BeginDisassembling( EachInstructionCallback,
-                                      OnInvalidInstructionCallback, context );
+  // Nothing of the original pe is disassembled, the points are in our code
+  PeDisassemblyEngine pe_disassembler( original_pe.GetView() );
 
-  // Re-create the PE again with the virtualized TLS callbacks
-  auto new_pe_result = AssembleNewPe( original_pe, context );
+  const auto first_interpreter_tls_callback_offset =
+      GetExportedFunctionOffsetRelativeToSection( interpreter_pe,
+                                                  "FirstTlsCallback" );
 
-  ApplyFixups( &new_pe_result, original_text_section_header,
-               context->fixup_context.fixups );
+  const auto second_interpreter_tls_callback_offset =
+      GetExportedFunctionOffsetRelativeToSection( interpreter_pe,
+                                                  "SecondTlsCallback" );
 
-  // This time we remove it afterwards the whole PE is finished. Why?
-  // Because LOW chance to remove something by mistake because I am
-  // only virtualizing my own added stuff
-  // Also, cannot remove it before because e.g. I add my own
-  // relocation when I override my entrypoint.
-  // Scuffed as fock.
-  RemoveRelocations( context->fixup_context.relocation_rvas_to_remove,
-                     &new_pe_result );
+  const auto custom_entrypoint_interpreter_offset =
+      GetExportedFunctionOffsetRelativeToSection( interpreter_pe,
+                                                  "BeforeEntrypoint" );
+
+  assert( first_interpreter_tls_callback_offset ||
+          second_interpreter_tls_callback_offset ||
+          custom_entrypoint_interpreter_offset );
+
+  const auto get_disassembly_point = [&]( const uint32_t offset ) {
+    DisassemblyPoint disasm_point;
+    disasm_point.code = const_cast<uint8_t*>( vm_loader_code.data() ) + offset;
+    disasm_point.rva = vm_loader_section_virtual_address + offset;
+    return disasm_point;
+  };
+
+#if 1
+  // Add my TLS callbacks as disassembly points for the disassembly engine
+  pe_disassembler.AddDisassemblyPoint(
+      get_disassembly_point( first_interpreter_tls_callback_offset ) );
+
+  pe_disassembler.AddDisassemblyPoint(
+      get_disassembly_point( second_interpreter_tls_callback_offset ) );
+#endif
 
-  return new_pe_result;
+  {
+    // The overridden entrypoint is still an offset into the vm loader
+    // section, it is fixed up to the rva once the pe is assembled
+    const auto new_entrypoint_offset =
+        context->virtualizer_context.original_pe_nt_headers->OptionalHeader
+            .AddressOfEntryPoint;
+
+    const auto disasm_point = get_disassembly_point( new_entrypoint_offset );
+
+    pe_disassembler.AddDisassemblyPoint( disasm_point );
+
+    pe_disassembler.SetDisassemblyPoint(
+        disasm_point, vm_loader_code.size() - new_entrypoint_offset );
+  }
+
+  pe_disassembler.BeginDisassembling( EachInstructionCallback,
+                                      OnInvalidInstructionCallback, context );
+
+  EmitCollectedVmInstructions( pe_disassembler, context );
 }
 
 void RemoveImports( PortableExecutable* pe,
@@ -1487,6 +3008,119 @@ void RemoveImports( PortableExecutable* pe,
   iat_data_directory->VirtualAddress = 0;
 }
 
+// Pads the section up to the alignment first, the offset is aligned within
+// the section and the section itself is page aligned
+uintptr_t AppendAlignedSpace( Section* section,
+                              const uintptr_t size,
+                              const uint32_t alignment,
+                              const uint32_t file_alignment ) {
+  const auto padding =
+      peutils::AlignUp( section->GetCurrentOffset(), alignment ) -
+      section->GetCurrentOffset();
+
+  section->AppendSpace( padding, file_alignment );
+
+  return section->AppendSpace( size, file_alignment );
+}
+
+// Emits the redirect shellcode of each import into the vm loader section,
+// every one with its own xor key. The interpreter only has to write their
+// encrypted targets into the slots of the vm code section at runtime.
+void AddImportRedirectShellcodes( const uint32_t import_count,
+                                  const uintptr_t vm_code_section_data_offset,
+                                  ProtectorContext* context ) {
+  if ( import_count == 0 ) {
+    return;
+  }
+
+  const auto file_alignment =
+      context->virtualizer_context.original_pe_nt_headers->OptionalHeader
+          .FileAlignment;
+
+  // Pointer aligned so that each target is written with a single store
+  const auto target_slots_offset = AppendAlignedSpace(
+      &context->virtualized_code_section, import_count * sizeof( uintptr_t ),
+      sizeof( uintptr_t ), file_alignment );
+
+  auto& vm_loader_section = context->vm_loader_section;
+
+  const auto shellcodes_offset = AppendAlignedSpace(
+      &vm_loader_section, import_count * VM_IMPORT_REDIRECT_SHELLCODE_STRIDE,
+      VM_IMPORT_REDIRECT_TABLE_ALIGNMENT, file_alignment );
+
+  const auto shellcodes = vm_loader_section.GetData()->data() +
+                          shellcodes_offset;
+
+  // The gaps between the shellcodes are never executed
+  memset( shellcodes, 0xCC,
+          import_count * VM_IMPORT_REDIRECT_SHELLCODE_STRIDE );
+
+  for ( uint32_t i = 0; i < import_count; ++i ) {
+    const auto shellcode_offset =
+        shellcodes_offset + i * VM_IMPORT_REDIRECT_SHELLCODE_STRIDE;
+    const auto shellcode = shellcodes + i * VM_IMPORT_REDIRECT_SHELLCODE_STRIDE;
+
+    memcpy( shellcode, import_redirect_thunk::kShellcode.data(),
+            import_redirect_thunk::kShellcode.size() );
+
+    const auto xor_key = RandomU32( 1, import_redirect_thunk::kMaxXorKey );
+    memcpy( shellcode + VM_IMPORT_REDIRECT_XOR_KEY_OFFSET, &xor_key,
+            sizeof( xor_key ) );
+
+    const auto target_slot_value_offset =
+        shellcode_offset + VM_IMPORT_REDIRECT_TARGET_SLOT_OFFSET;
+    const auto target_slot_offset =
+        target_slots_offset + i * sizeof( uintptr_t );
+
+    Fixup target_slot_fixup;
+    target_slot_fixup.offset = target_slot_value_offset;
+    target_slot_fixup.desc.offset_type = OffsetRelativeTo::VmLoaderSection;
+    target_slot_fixup.desc.operation =
+        FixupOperation::AddVirtualizedCodeSectionVirtualAddress;
+    target_slot_fixup.desc.size = sizeof( uint32_t );
+    context->fixup_context.fixups.push_back( target_slot_fixup );
+
+#ifdef _WIN64
+    // Relative to the end of the mov
+    target_slot_fixup.desc.operation =
+        FixupOperation::SubtractVmLoaderSectionVirtualAddress;
+    context->fixup_context.fixups.push_back( target_slot_fixup );
+
+    const auto target_slot_value =
+        static_cast<uint32_t>( target_slot_offset - target_slot_value_offset -
+                               sizeof( uint32_t ) );
+#else
+    // An absolute address, one relocation for each import
+    context->fixup_context.vm_section_offsets_to_add_to_relocation_table
+        .push_back( target_slot_value_offset );
+
+    const auto target_slot_value = static_cast<uint32_t>(
+        context->virtualizer_context.default_image_base + target_slot_offset );
+#endif
+
+    memcpy( shellcode + VM_IMPORT_REDIRECT_TARGET_SLOT_OFFSET,
+            &target_slot_value, sizeof( target_slot_value ) );
+  }
+
+  const auto vm_code_section_data_ptr = reinterpret_cast<VmCodeSectionData*>(
+      context->virtualized_code_section.GetData()->data() +
+      vm_code_section_data_offset );
+
+  vm_code_section_data_ptr->import_redirect_rva =
+      static_cast<uint32_t>( shellcodes_offset );
+
+  Fixup import_redirect_rva_fixup;
+  import_redirect_rva_fixup.offset =
+      vm_code_section_data_offset +
+      offsetof( VmCodeSectionData, import_redirect_rva );
+  import_redirect_rva_fixup.desc.offset_type =
+      OffsetRelativeTo::VirtualizedCodeSection;
+  import_redirect_rva_fixup.desc.operation =
+      FixupOperation::AddVmLoaderSectionVirtualAddress;
+  import_redirect_rva_fixup.desc.size = sizeof( uint32_t );
+  context->fixup_context.fixups.push_back( import_redirect_rva_fixup );
+}
+
 const auto DefaultImageBaseVariable = TEXT( "DefaultImageBase" );
 const auto BeforeEntrypointFunctionVariable =
     TEXT( "BeforeEntrypointFunction" );
@@ -1666,7 +3300,148 @@ void OverrideOriginalEntrypoint( const PortableExecutable& original_pe,
       .push_back( vm_loader_offset_ep_shellcode_imagebase_offset );
 }
 
-PortableExecutable Protect( PortableExecutable original_pe ) {
+// Reads the VmProfileSite array written by an instrumented build
+std::unordered_map<uint64_t, uint64_t> ReadVirtualizationProfile(
+    const std::wstring& profile_path ) {
+  const auto profile_data = fileio::ReadBinaryFile( profile_path );
+
+  if ( profile_data.size() % sizeof( VmProfileSite ) != 0 ) {
+    throw std::runtime_error( "The virtualization profile is corrupt" );
+  }
+
+  const auto profile_sites =
+      reinterpret_cast<const VmProfileSite*>( profile_data.data() );
+
+  std::unordered_map<uint64_t, uint64_t> site_execution_counts;
+
+  for ( size_t i = 0; i < profile_data.size() / sizeof( VmProfileSite );
+        ++i ) {
+    const auto& profile_site = profile_sites[ i ];
+
+    // The same instruction is never virtualized twice, but the counts can
+    // be summed to allow merging profiles from several runs
+    if ( profile_site.rva != 0 ) {
+      site_execution_counts[ profile_site.rva ] +=
+          profile_site.execution_count;
+    }
+  }
+
+  return site_execution_counts;
+}
+
+// Stores the digests of the non writable sections for the file integrity
+// check, must be called once the file will not be modified anymore
+void AddFileIntegrityDigests( PortableExecutable* pe,
+                              const uintptr_t vm_code_section_data_offset ) {
+  const auto section_headers = pe->GetSectionHeaders();
+
+  const auto vm_code_section_header =
+      section_headers.FromName( VM_CODE_SECTION_NAME );
+
+  auto& pe_data = pe->GetPeData();
+
+  auto vm_code_section_data = reinterpret_cast<VmCodeSectionData*>(
+      pe_data.data() + vm_code_section_header->PointerToRawData +
+      vm_code_section_data_offset );
+
+  vm_code_section_data->integrity_section_count = 0;
+
+  const auto nt_headers = pe->GetNtHeaders();
+
+  for ( int i = 0; i < nt_headers->FileHeader.NumberOfSections; ++i ) {
+    const auto section = &IMAGE_FIRST_SECTION( nt_headers )[ i ];
+
+    // The writable sections, including the vm code section that holds
+    // these digests, are modified at runtime
+    if ( ( section->Characteristics & IMAGE_SCN_MEM_WRITE ) ||
+         section->SizeOfRawData == 0 ) {
+      continue;
+    }
+
+    if ( vm_code_section_data->integrity_section_count >=
+         VM_MAX_INTEGRITY_SECTIONS ) {
+      throw std::runtime_error(
+          "Too many sections for the file integrity check" );
+    }
+
+    auto& section_digest =
+        vm_code_section_data->integrity_sections
+            [ vm_code_section_data->integrity_section_count++ ];
+
+    section_digest.file_offset = section->PointerToRawData;
+    section_digest.size = section->SizeOfRawData;
+
+    VmHashData( pe_data.data() + section->PointerToRawData,
+                section->SizeOfRawData, &section_digest.digest_low,
+                &section_digest.digest_high );
+  }
+}
+
+// Lets the interpreter of a telemetry build find the VmCodeSectionData and
+// writes the site table, one "<site index> <rva> <instruction>" per line
+void AddVmTelemetryData( PortableExecutable* pe,
+                         const uintptr_t vm_code_section_data_offset,
+                         const VirtualizerContext& virtualizer_context,
+                         const std::wstring& site_table_path ) {
+  const auto vm_code_section_header =
+      pe->GetSectionHeaders().FromName( VM_CODE_SECTION_NAME );
+
+  const auto vm_code_section_data_rva = static_cast<uint32_t>(
+      vm_code_section_header->VirtualAddress + vm_code_section_data_offset );
+
+  auto& pe_data = pe->GetPeData();
+
+  auto vm_code_section_data = reinterpret_cast<VmCodeSectionData*>(
+      pe_data.data() + vm_code_section_header->PointerToRawData +
+      vm_code_section_data_offset );
+
+  vm_code_section_data->telemetry_site_count =
+      static_cast<uint32_t>( virtualizer_context.telemetry_sites.size() );
+
+  auto dos_header = reinterpret_cast<IMAGE_DOS_HEADER*>( pe_data.data() );
+
+  memcpy( dos_header->e_res2, &vm_code_section_data_rva,
+          sizeof( vm_code_section_data_rva ) );
+
+  if ( site_table_path.empty() ) {
+    return;
+  }
+
+  std::ofstream site_table_file( site_table_path );
+
+  if ( !site_table_file.is_open() ) {
+    throw std::runtime_error( "Unable to write the telemetry site table" );
+  }
+
+  const auto& telemetry_sites = virtualizer_context.telemetry_sites;
+
+  for ( size_t i = 0; i < telemetry_sites.size(); ++i ) {
+    char rva[ 32 ];
+    sprintf_s( rva, "0x%08I64x", telemetry_sites[ i ].first );
+
+    site_table_file << i << " " << rva << " " << telemetry_sites[ i ].second
+                    << "\n";
+  }
+}
+
+PortableExecutable ProtectWithInterpreter( PortableExecutable original_pe,
+                                           PortableExecutable interpreter_pe,
+                                           const ProtectorOptions& options,
+                                           ProtectionReport* report ) {
+  // Only one phase at a time, the old one has to end before the next begins
+  std::unique_ptr<ScopedReportPhase> phase;
+
+  const auto BeginPhase = [&]( const char* name ) {
+    phase.reset();
+    phase = std::make_unique<ScopedReportPhase>( report, name );
+  };
+
+  BeginPhase( "load" );
+
+  if ( options.dry_run && !report ) {
+    throw std::runtime_error( "A dry run needs a report for the estimate" );
+  }
+
   const auto original_pe_nt_headers = original_pe.GetNtHeaders();
 
 #ifndef _WIN64
@@ -1683,20 +3458,36 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
   }
 #endif
 
-  // Before the original_pe argument is touched, initialize the disassembly engine with it
-  PeDisassemblyEngine pe_disassembler( original_pe );
+  // Reads the image through a view of original_pe, nothing modifies it until
+  // the disassembly is done
+  PeDisassemblyEngine pe_disassembler( original_pe.GetView() );
+
+  pe_disassembler.SetSeedFromExceptionDirectory(
+      options.seed_from_exception_directory );
+
+  if ( options.two_tier_decoding )
+    pe_disassembler.SetTwoTierDecoding( virtualizer::MayHaveVmOpcode );
+
+  // Same goes for the hash, the cache is only valid for the unmodified input.
+  // The seeding changes what is found, a cache of the other mode is not used.
+  const uint64_t original_pe_image_hash =
+      options.analysis_cache_path.empty()
+          ? 0
+          : analysis_cache::HashImage( original_pe.GetPeImagePtr(),
+                                       original_pe.GetPeData().size() ) ^
+                ( options.seed_from_exception_directory ? 0 : 1 );
 
   // todo make the section sizes aligned with the remap
   // be aware, that remap will not work if protected with vmprotect
 
-  PortableExecutable interpreter_pe = ReadInterpreterPe();
-
   if ( !interpreter_pe.IsValid() ) {
     throw std::runtime_error( "Interpreter is not valid portable executable" );
   }
 
   ProtectorContext context;
 
+  context.report = report;
+
   context.virtualizer_context.original_pe_nt_headers = original_pe_nt_headers;
 
   context.virtualizer_context.default_image_base =
@@ -1714,16 +3505,61 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
 
   context.vm_loader_section = CreateVmSection( interpreter_pe );
 
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+  AddInterpreterUnwindFunctions( interpreter_pe, &context );
+#endif
+
+  // The adaptive devirtualization decides with the counters as well
+  context.virtualizer_context.instrument_virtualized_code =
+      options.instrument_virtualized_code || ENABLE_ADAPTIVE_DEVIRTUALIZATION;
+
+  context.virtualizer_context.hot_site_threshold = options.hot_site_threshold;
+
+  if ( !options.profile_path.empty() ) {
+    context.virtualizer_context.site_execution_counts =
+        ReadVirtualizationProfile( options.profile_path );
+  }
+
+  if ( !options.policy_path.empty() ) {
+    context.virtualizer_context.has_virtualization_policy = true;
+    context.virtualizer_context.virtualization_policy =
+        virtualization_policy::Load( options.policy_path, original_pe );
+  }
+
+  opcode_cost_table::CostTable cost_table;
+
+  if ( options.dry_run && !options.opcode_cost_table_path.empty() ) {
+    cost_table = opcode_cost_table::Load( options.opcode_cost_table_path );
+  }
+
   // Add write access because we edit the callback list in the FirstTlsCallback()
   context.virtualized_code_section = section::CreateEmptySection(
       VM_CODE_SECTION_NAME, IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_DISCARDABLE |
-                                IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_WRITE );
+                                IMAGE_SCN_MEM_WRITE );
+
+  // The interpreter only reads the virtualized code, keeping it apart from
+  // the writable state leaves its pages shareable
+  context.vm_bytecode_section = section::CreateEmptySection(
+      VM_BYTECODE_SECTION_NAME,
+      IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_INITIALIZED_DATA );
+
+  // The first byte is reserved to ensure that the section is never empty
+  context.vm_bytecode_section.AppendValue(
+      uint8_t{ 0 }, original_pe_nt_headers->OptionalHeader.FileAlignment );
 
   VmCodeSectionData vm_code_section_data;
 
   vm_code_section_data.real_entrypoint =
       original_pe_nt_headers->OptionalHeader.AddressOfEntryPoint;
 
+  vm_code_section_data.write_virtualization_profile =
+      options.instrument_virtualized_code;
+
+  vm_code_section_data.anti_debug_poll_interval_ms =
+      options.anti_debug_poll_interval_ms;
+  vm_code_section_data.anti_debug_poll_jitter_ms =
+      options.anti_debug_poll_jitter_ms;
+
   // TODO: Add this as an option for the user
   // Why? It can cause issues for some software such as PE-bear with QTcore
   // and my flyff bot, failing to select monsters..?
@@ -1733,16 +3569,25 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
   memset( vm_code_section_data.zeroed_data_for_import_directory, 0,
           sizeof( vm_code_section_data.zeroed_data_for_import_directory ) );
 
+  const auto original_imports = original_pe.GetImports();
+
   vm_code_section_data.import_count =
-      static_cast<uint32_t>( original_pe.GetImports().size() );
+      static_cast<uint32_t>( original_imports.size() );
 
-  // Fill with random data for fun
-  for ( int i = 0;
-        i < sizeof( vm_code_section_data.friendly_message ) / sizeof( char );
-        ++i ) {
-    vm_code_section_data.friendly_message[ i ] = RandomU8();
+  if ( vm_code_section_data.redirect_imports ) {
+    for ( const auto& import : original_imports ) {
+      if ( import.function_addr_rva != 0 ) {
+        context.virtualizer_context.redirected_import_slot_rvas.insert(
+            import.function_addr_rva );
+      }
+    }
   }
 
+  // Fill with random data for fun
+  rng::Fill(
+      reinterpret_cast<uint8_t*>( vm_code_section_data.friendly_message ),
+      sizeof( vm_code_section_data.friendly_message ) );
+
   // Write the message for the reverse engineer'er
   strcpy( vm_code_section_data.friendly_message,
           "bruh, you're not supposed to be here! yo momma fat" );
@@ -1760,8 +3605,105 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
           vm_code_section_data,
           original_pe_nt_headers->OptionalHeader.FileAlignment );
 
+  if ( context.virtualizer_context.instrument_virtualized_code ) {
+    context.profile_section = section::CreateEmptySection(
+        VM_PROFILE_SECTION_NAME, IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE |
+                                     IMAGE_SCN_CNT_INITIALIZED_DATA );
+
+    // The first site is reserved to ensure that the section is never empty
+    VmProfileSite reserved_profile_site{};
+
+    context.profile_section.AppendValue(
+        reserved_profile_site,
+        original_pe_nt_headers->OptionalHeader.FileAlignment );
+
+    Fixup profile_section_rva_fixup;
+    profile_section_rva_fixup.offset =
+        vm_code_section_data_offset +
+        offsetof( VmCodeSectionData, profile_section_rva );
+    profile_section_rva_fixup.desc.offset_type =
+        OffsetRelativeTo::VirtualizedCodeSection;
+    profile_section_rva_fixup.desc.operation =
+        FixupOperation::AddProfileSectionVirtualAddress;
+    profile_section_rva_fixup.desc.size = sizeof( uint32_t );
+    context.fixup_context.fixups.push_back( profile_section_rva_fixup );
+  }
+
+  Stopwatch stopwatch;
+  stopwatch.Start();
+
+  AddInterpreterRelocationsToFixup( interpreter_pe, &context );
+
+#ifndef _WIN64
+  AddImageBaseSlot( &context );
+#endif
+
+  // Sorted by the index for quick binary search
+  context.virtualizer_context.original_pe_relocation_index =
+      original_pe.CreateRelocationIndex();
+
+  context.virtualizer_context.what_to_virtualize =
+      WhatToVirtualize::TextSection;
+
+  BeginPhase( "disassembly" );
+
+  AnalysisCache cached_analysis;
+
+  const bool use_cached_analysis =
+      !options.analysis_cache_path.empty() &&
+      analysis_cache::Read( options.analysis_cache_path,
+                            original_pe_image_hash, &cached_analysis );
+
+  if ( use_cached_analysis ) {
+    printf( "Using the analysis cache\n" );
+
+    pe_disassembler.DisassembleFromCache( cached_analysis,
+                                          EachInstructionCallback, &context );
+  } else if ( options.disassembly_worker_count > 0 ) {
+    pe_disassembler.DisassembleFromEntrypointParallel(
+        EachInstructionCallback, &context, options.disassembly_worker_count );
+  } else {
+    pe_disassembler.DisassembleFromEntrypoint(
+        EachInstructionCallback, InvalidInstructionCallback, &context );
+  }
+
+  if ( !options.analysis_cache_path.empty() && !use_cached_analysis ) {
+    if ( !analysis_cache::Write(
+             options.analysis_cache_path,
+             pe_disassembler.CreateAnalysisCache( original_pe_image_hash ) ) ) {
+      printf( "Unable to write the analysis cache\n" );
+    }
+  }
+
+  if ( options.dry_run ) {
+    BeginPhase( "cost_estimate" );
+
+    report->is_dry_run = true;
+    report->cost_estimate =
+        EstimateVmCost( pe_disassembler, cost_table, &context );
+
+    phase.reset();
+
+    report->disassembled_instruction_count =
+        context.virtualizer_context.total_disassembled_instructions;
+    report->invalidated_instruction_count =
+        context.virtualizer_context.total_invalidated_instructions;
+
+    // Never written, the caller only looks at the report
+    return original_pe;
+  }
+
+  BeginPhase( "virtualization" );
+
+  // The disassembly above reads through a view of original_pe, it is only
+  // modified from here on
   RemoveImports( &original_pe, &context, vm_code_section_data_offset );
 
+  if ( vm_code_section_data.redirect_imports ) {
+    AddImportRedirectShellcodes( vm_code_section_data.import_count,
+                                 vm_code_section_data_offset, &context );
+  }
+
 #if ENABLE_TLS_CALLBACKS
   AddTlsCallbacks( vm_code_section_data, interpreter_pe, &original_pe,
                    &context );
@@ -1772,11 +3714,6 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
   const auto original_text_section_header =
       *original_pe.GetSectionHeaders().FromName( ".text" );
 
-  // Save the text section before modifying it for use later
-  // when an invalid instruction has been virtualized to reset the instruction
-  context.virtualizer_context.original_text_section_copy =
-      original_pe.CopySectionDeep( &original_text_section_header );
-
   // The text section that will be modified with jumps
   context.new_text_section =
       original_pe.CopySectionDeep( &original_text_section_header );
@@ -1784,23 +3721,22 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
   context.virtualizer_context.original_text_section_header =
       original_text_section_header;
 
-  Stopwatch stopwatch;
-  stopwatch.Start();
-
-  AddInterpreterRelocationsToFixup( interpreter_pe, &context );
-
-  context.virtualizer_context.original_pe_relocation_rvas =
-      GetRelocationRvas( original_pe );
+  // Nothing was emitted while disassembling, virtualize everything now
+  EmitCollectedVmInstructions( pe_disassembler, &context );
 
-  // Sort for quick binary search
-  std::sort( context.virtualizer_context.original_pe_relocation_rvas.begin(),
-             context.virtualizer_context.original_pe_relocation_rvas.end() );
+  if ( context.virtualizer_context.instrument_virtualized_code ) {
+    const auto vm_code_section_data_ptr = reinterpret_cast<VmCodeSectionData*>(
+        context.virtualized_code_section.GetData()->data() +
+        vm_code_section_data_offset );
 
-  context.virtualizer_context.what_to_virtualize =
-      WhatToVirtualize::TextSection;
+    vm_code_section_data_ptr->profile_site_count = static_cast<uint32_t>(
+        context.profile_section.GetCurrentOffset() / sizeof( VmProfileSite ) );
+  }
 
-  pe_disassembler.DisassembleFromEntrypoint(
-      EachInstructionCallback, InvalidInstructionCallback, &context );
+#if ENABLE_ADAPTIVE_DEVIRTUALIZATION
+  AddAdaptiveSites( vm_code_section_data_offset,
+                    options.adaptive_devirtualization_threshold, &context );
+#endif
 
 #if 0
   // IF WE ADD PADDING THIS LATE TO THE LAST SECTION the calculate
@@ -1822,8 +3758,9 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
     padding_data.resize( new_aligned_size - last_section_size );
   }
 
-  for ( size_t i = 0; i < padding_data.size() - 1; ++i ) {
-    padding_data[ i ] = rand() % 0xff;
+  // The last byte stays zero
+  if ( padding_data.size() > 1 ) {
+    rng::Fill( padding_data.data(), padding_data.size() - 1 );
   }
 
   last_section.AppendCode( padding_data,
@@ -1836,33 +3773,107 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
   assert( context.new_text_section.GetSectionHeader().SizeOfRawData ==
           original_text_section_header.SizeOfRawData );
 
+  BeginPhase( "relocation_rebuild" );
+
   // We remove the relocations before assembling it. Otherwise it can by mistake
   // remove one of our own relocations because it us using RVA and they have not yet been fixed up.
   RemoveRelocations( context.fixup_context.relocation_rvas_to_remove,
                      &original_pe );
 
-  // Save a copy of the context before we build the first PE. Why?
-  // Because it modifes the context and adds fixup that we don't want
-  // added when we build the absolutely last version of the PE
-  // Ugly way to do it :(
-  ProtectorContext context_saved = context;
+  if ( report ) {
+    report->removed_relocation_count +=
+        context.fixup_context.relocation_rvas_to_remove.size();
+  }
+
+  BeginPhase( "vm_loader_pass" );
 
-  // Build and fix the almost finished PE
-  auto new_pe = AssembleNewPe( original_pe, &context );
+  context.virtualizer_context.what_to_virtualize =
+      WhatToVirtualize::VmLoaderSection;
+
+  // Our TLS callbacks and entrypoint are virtualized in the same pass, the pe
+  // is only assembled once afterwards. The pass has to know the rva of the
+  // vm loader section up front, .reloc is in front of it and grows with the
+  // relocations the pass adds. In the rare case that moves the section to
+  // the next page the pass is done again from a copy with the right rva.
+  auto vm_loader_section_virtual_address =
+      GetVmLoaderSectionVirtualAddress( original_pe, context );
+
+  ProtectorContext final_context = context;
+
+  auto new_pe = [&]() {
+    for ( ;; ) {
+      VirtualizeMyTlsCallbacksAndNewEntrypoint(
+          original_pe, interpreter_pe, vm_loader_section_virtual_address,
+          &final_context );
+
+      BeginPhase( "assemble" );
+
+      auto assembled_pe = AssembleNewPe( original_pe, &final_context );
+
+      const auto assembled_vm_loader_section_virtual_address =
+          assembled_pe.GetSectionHeaders()
+              .FromName( VM_LOADER_SECTION_NAME )
+              ->VirtualAddress;
+
+      if ( assembled_vm_loader_section_virtual_address ==
+           vm_loader_section_virtual_address ) {
+        return assembled_pe;
+      }
+
+      BeginPhase( "vm_loader_pass" );
+
+      vm_loader_section_virtual_address =
+          assembled_vm_loader_section_virtual_address;
+
+      final_context = context;
+    }
+  }();
+
+  BeginPhase( "fixups" );
 
-  // NOTE: We do not need to fixup this version of the PE because we
-  // only use this version to virtualize my TLS callbacks
   ApplyFixups( &new_pe, original_text_section_header,
-               context.fixup_context.fixups );
+               final_context.fixup_context.fixups );
 
-  context_saved.virtualizer_context.what_to_virtualize =
-      WhatToVirtualize::VmLoaderSection;
+  // This time we remove it afterwards the whole PE is finished. Why?
+  // Because LOW chance to remove something by mistake because I am
+  // only virtualizing my own added stuff
+  // Also, cannot remove it before because e.g. I add my own
+  // relocation when I override my entrypoint.
+  // Scuffed as fock.
+  RemoveRelocations( final_context.fixup_context.relocation_rvas_to_remove,
+                     &new_pe );
+
+  if ( report ) {
+    report->removed_relocation_count +=
+        final_context.fixup_context.relocation_rvas_to_remove.size();
+  }
+
+  if ( report ) {
+    const auto original_section_headers = original_pe.GetSectionHeaders();
+
+    for ( const auto& section_view : new_pe.GetView().GetSections() ) {
+      const auto original_section_header =
+          original_section_headers.FromName( section_view.GetName() );
+
+      ProtectionReport::SectionSize section_size;
+      section_size.name = section_view.GetName();
+      section_size.original_size =
+          original_section_header ? original_section_header->SizeOfRawData
+                                  : 0;
+      section_size.protected_size = section_view.GetSize();
+
+      report->sections.push_back( section_size );
+    }
+  }
+
+  BeginPhase( "finalize" );
+
+  // Before the sections are renamed, it skips the .rsrc by its name
+  if ( options.obfuscate_rtti ) {
+    const auto obfuscated_count = rtti_obfuscator::ObfuscateRTTI( &new_pe );
 
-  // Now virtualize the TLS callbacks that we added in the beginning and
-  // create a new PE again with the virtualized TLS callbacks
-  new_pe = VirtualizeMyTlsCallbacksAndNewEntrypoint(
-      new_pe, original_pe, interpreter_pe, *original_pe_nt_headers,
-      original_text_section_header, &context_saved );
+    printf( "Obfuscated %u type names\n", obfuscated_count );
+  }
 
 // Randomize all section names except for the vm code
 // section because we rely on it being that name in our tls callbacks
@@ -1885,8 +3896,31 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
   }
 #endif
 
+#if ENABLE_VM_TELEMETRY
+  AddVmTelemetryData( &new_pe, vm_code_section_data_offset,
+                      final_context.virtualizer_context,
+                      options.telemetry_site_table_path );
+#endif
+
+#if ENABLE_FILE_INTEGRITY_CHECKS
+  AddFileIntegrityDigests( &new_pe, vm_code_section_data_offset );
+#endif
+
   stopwatch.Stop();
 
+  phase.reset();
+
+  if ( report ) {
+    report->disassembled_instruction_count =
+        context.virtualizer_context.total_disassembled_instructions;
+    report->virtualized_instruction_count =
+        final_context.virtualizer_context.total_virtualized_instructions;
+    report->invalidated_instruction_count =
+        context.virtualizer_context.total_invalidated_instructions;
+    report->fixup_count = final_context.fixup_context.fixups.size();
+    report->copied_byte_count = pe::GetCopiedByteCount();
+  }
+
   printf( "Total Disassembled Instructions: %d\n",
           context.virtualizer_context.total_disassembled_instructions );
 
@@ -1895,6 +3929,34 @@ PortableExecutable Protect( PortableExecutable original_pe ) {
 
   printf( "Time spent: %f ms\n", stopwatch.GetElapsedMilliseconds() );
 
+  printf( "Bytes copied: %I64u\n", pe::GetCopiedByteCount() );
+
   return new_pe;
 }
+
+PortableExecutable Protect( PortableExecutable pe,
+                            const ProtectorOptions& options,
+                            ProtectionReport* report ) {
+  pe::ResetCopiedByteCount();
+
+  auto interpreter_pe = [&]() {
+    ScopedReportPhase phase( report, "load" );
+    return ReadInterpreterPe();
+  }();
+
+  return ProtectWithInterpreter( std::move( pe ), std::move( interpreter_pe ),
+                                 options, report );
+}
+
+PortableExecutable Protect( PortableExecutable pe,
+                            const PortableExecutable& interpreter_pe,
+                            const ProtectorOptions& options,
+                            ProtectionReport* report ) {
+  pe::ResetCopiedByteCount();
+
+  // It is relocated to the image base of the pe, so every pe needs its own
+  return ProtectWithInterpreter( std::move( pe ), interpreter_pe, options,
+                                 report );
+}
+
 }  // namespace protector
\ No newline at end of file
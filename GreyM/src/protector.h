@@ -1,9 +1,82 @@
 #pragma once
 
+#include "protection_report.h"
+
 class PortableExecutable;
 
 namespace protector {
 
-PortableExecutable Protect( const PortableExecutable pe );
+struct ProtectorOptions {
+  // Adds an execution counter to every virtualized instruction, the protected
+  // PE writes them to <module path>.vmprofile when the process exits
+  bool instrument_virtualized_code = false;
+
+  // A profile written by an instrumented build. Instructions that executed
+  // more times than the threshold are not virtualized.
+  std::wstring profile_path;
+  uint64_t hot_site_threshold = 10000;
+
+  // Selects the functions and rva ranges to virtualize or skip, see
+  // virtualization_policy.h for the format
+  std::wstring policy_path;
+
+  // Only used when the interpreter is built with ENABLE_VM_TELEMETRY, maps
+  // the site indices of the telemetry to the rva and the instruction
+  std::wstring telemetry_site_table_path;
+
+  // Only used when the interpreter is built with
+  // ENABLE_ADAPTIVE_DEVIRTUALIZATION, a site that executes more times than
+  // this within a reprotect interval is written back as the original code
+  uint64_t adaptive_devirtualization_threshold = 100000;
+
+  // Only used when the interpreter is built with ENABLE_ANTI_DEBUG_WATCHDOG,
+  // the watchdog checks every interval plus a random part of the jitter
+  uint32_t anti_debug_poll_interval_ms = 500;
+  uint32_t anti_debug_poll_jitter_ms = 250;
+
+  // Disassembles the target on this many threads, 0 keeps the serial
+  // disassembler. The parallel one visits the instructions in address order.
+  uint32_t disassembly_worker_count = 0;
+
+  // x64 only, starts from every function of .pdata and stops the sweep at
+  // the end of each one instead of finding the functions by their prolog
+  bool seed_from_exception_directory = true;
+
+  // Only decodes the capstone detail of the instructions that change where
+  // the disassembler goes and the ones that can be virtualized
+  bool two_tier_decoding = true;
+
+  // The disassembly of the target is stored in there and used again as long
+  // as the target did not change, so only the first run disassembles it
+  std::wstring analysis_cache_path;
+
+  // Stops once the sites are selected and fills the cost estimate of the
+  // report instead, it needs a report. The pe that is returned is the input
+  // and not protected, do not write it.
+  bool dry_run = false;
+
+  // Only used by a dry run, see opcode_cost_table.h for the format
+  std::wstring opcode_cost_table_path;
+
+  // Replaces the type names of the RTTI with random ones. Off by default,
+  // an exception that is thrown across modules is caught by its type name.
+  bool obfuscate_rtti = false;
+};
+
+// Maps Interpreter.dll and copies it out
+PortableExecutable ReadInterpreterPe();
+
+// The pe is taken by value and modified in place, move it in to avoid a copy.
+// The report is optional, the caller adds the time it takes to write the file.
+PortableExecutable Protect( PortableExecutable pe,
+                            const ProtectorOptions& options = {},
+                            ProtectionReport* report = nullptr );
+
+// Same as above with an interpreter that was read once for many files, it is
+// copied and not modified
+PortableExecutable Protect( PortableExecutable pe,
+                            const PortableExecutable& interpreter_pe,
+                            const ProtectorOptions& options = {},
+                            ProtectionReport* report = nullptr );
 
 }  // namespace protector
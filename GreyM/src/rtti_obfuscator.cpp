@@ -3,40 +3,153 @@
 #include "pe/portable_executable.h"
 #include "utils/random.h"
 
-namespace rtti_obfuscator {
+namespace {
+
+constexpr size_t kMaxTypenameLength = 255;
+
+// The .?AV or .?AU and the @@ at the end are kept
+constexpr size_t kTypenamePrefixLength = 4;
+constexpr size_t kTypenameSuffixLength = 2;
+
+// Decorated names only contain those, so the random names still undecorate
+constexpr char kTypenameChars[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+
+// The names are inside of the TypeDescriptors, those are in initialized data
+// that is not executable. The resources and the relocations never have any.
+bool MayContainTypeDescriptors( const IMAGE_SECTION_HEADER& section_header ) {
+  const auto characteristics = section_header.Characteristics;
+
+  if ( !( characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA ) ||
+       ( characteristics & IMAGE_SCN_MEM_EXECUTE ) ||
+       ( characteristics & IMAGE_SCN_MEM_DISCARDABLE ) ) {
+    return false;
+  }
+
+  const auto name = reinterpret_cast<const char*>( section_header.Name );
+
+  return strncmp( name, ".rsrc", IMAGE_SIZEOF_SHORT_NAME ) != 0;
+}
+
+// Returns the length of the type name that starts at the '.', 0 if it is a
+// '.' of anything else
+size_t GetTypenameLength( const uint8_t* name,
+                          const uint8_t* section_begin,
+                          const uint8_t* section_end ) {
+  const size_t size_left = section_end - name;
+
+  // .?AV is a class and .?AU a struct
+  if ( size_left < kTypenamePrefixLength || name[ 1 ] != '?' ||
+       name[ 2 ] != 'A' || ( name[ 3 ] != 'V' && name[ 3 ] != 'U' ) ) {
+    return 0;
+  }
+
+  // The spare pointer right before the name is always null in the file, a
+  // string that happens to contain .?AV usually has text in front of it
+  if ( static_cast<size_t>( name - section_begin ) < sizeof( uintptr_t ) ) {
+    return 0;
+  }
+
+  uintptr_t spare = 0;
+  memcpy( &spare, name - sizeof( uintptr_t ), sizeof( spare ) );
+
+  if ( spare != 0 ) {
+    return 0;
+  }
+
+  const auto terminator = static_cast<const uint8_t*>( memchr(
+      name, '\0', ( std::min )( size_left, kMaxTypenameLength + 1 ) ) );
+
+  if ( !terminator ) {
+    return 0;
+  }
+
+  const size_t length = terminator - name;
+
+  if ( length <= kTypenamePrefixLength + kTypenameSuffixLength ||
+       terminator[ -1 ] != '@' || terminator[ -2 ] != '@' ) {
+    return 0;
+  }
+
+  for ( auto it = name; it != terminator; ++it ) {
+    if ( *it < 0x20 || *it > 0x7e ) {
+      return 0;
+    }
+  }
+
+  return length;
+}
+
+// Eight chars out of every random number
+void FillRandomTypename( uint8_t* name,
+                         const size_t length ) {
+  const auto first = name + kTypenamePrefixLength;
+  const auto last = name + length - kTypenameSuffixLength;
 
-void ObfuscateRTTI( PortableExecutable* pe ) {
-  constexpr int kMaxTypenameLength = 255;
+  constexpr size_t kCharCount = sizeof( kTypenameChars ) - 1;
 
-  std::array<uint8_t, kMaxTypenameLength> buffer{ 0 };
+  for ( auto it = first; it < last; ) {
+    auto random = rng::NextU64();
 
+    for ( int i = 0; i < 8 && it < last; ++i, ++it, random >>= 8 ) {
+      *it = kTypenameChars[ ( random & 0xff ) % kCharCount ];
+    }
+  }
+}
+
+}  // namespace
+
+namespace rtti_obfuscator {
+
+uint32_t ObfuscateRTTI( PortableExecutable* pe ) {
   auto& pe_data = pe->GetPeData();
 
-  std::vector<uint8_t> pattern = { '.', '?', 'A', 'V' };
-
-  for ( size_t i = 0; i < pe_data.size() - pattern.size(); ++i ) {
-    const auto current_it = pe_data.begin() + i;
-    const auto current_it_end = current_it + pattern.size();
-    // check if the iterator is equal to the pattern .?AV
-    if ( std::equal( current_it, current_it_end, pattern.begin() ) ) {
-      const auto max_chars_to_search_for_end_it =
-          current_it_end + kMaxTypenameLength;
-      // find the end of the string, if no found, the string is longer than 255
-      // or not a string at all in that case, we do not want to do anything with
-      // it
-      const auto typename_end =
-          std::find_if( current_it_end, max_chars_to_search_for_end_it,
-                        []( uint8_t value ) { return value == '\0'; } );
-      if ( typename_end != pe_data.end() ) {
-        const auto typename_str_length =
-            std::distance( current_it, typename_end );
-        // replace the typename string with 3 random bytes
-        GenerateRandomBytes( buffer, 3 );
-        std::copy( buffer.begin(), buffer.begin() + typename_str_length,
-                   current_it );
+  const auto nt_headers = pe->GetNtHeaders();
+
+  uint32_t obfuscated_count = 0;
+
+  for ( WORD i = 0; i < nt_headers->FileHeader.NumberOfSections; ++i ) {
+    const auto& section_header = IMAGE_FIRST_SECTION( nt_headers )[ i ];
+
+    if ( !MayContainTypeDescriptors( section_header ) ||
+         section_header.PointerToRawData >= pe_data.size() ) {
+      continue;
+    }
+
+    const auto section_begin = &pe_data[ section_header.PointerToRawData ];
+    const auto section_end =
+        section_begin +
+        ( std::min )( static_cast<size_t>( section_header.SizeOfRawData ),
+                      pe_data.size() - section_header.PointerToRawData );
+
+    auto it = section_begin;
+
+    // memchr is vectorized by the crt, it skips most of the data at once
+    while ( it < section_end ) {
+      const auto dot = static_cast<uint8_t*>(
+          memchr( it, '.', section_end - it ) );
+
+      if ( !dot ) {
+        break;
       }
+
+      const auto length =
+          GetTypenameLength( dot, section_begin, section_end );
+
+      if ( length == 0 ) {
+        it = dot + 1;
+        continue;
+      }
+
+      FillRandomTypename( dot, length );
+
+      ++obfuscated_count;
+
+      it = dot + length;
     }
   }
+
+  return obfuscated_count;
 }
 
-}  // namespace rtti_obfuscator
\ No newline at end of file
+}  // namespace rtti_obfuscator
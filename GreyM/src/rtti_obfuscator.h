@@ -4,7 +4,8 @@ class PortableExecutable;
 
 namespace rtti_obfuscator {
 
-// Obfuscates the runtime type information information
-void ObfuscateRTTI( PortableExecutable* pe );
+// Replaces the names of the class and struct type descriptors with random
+// ones of the same length, returns how many were replaced
+uint32_t ObfuscateRTTI( PortableExecutable* pe );
 
-}  // namespace rtti_obfuscator
\ No newline at end of file
+}  // namespace rtti_obfuscator
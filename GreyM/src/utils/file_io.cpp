@@ -39,3 +39,61 @@ bool fileio::WriteFileData( const std::wstring& filename,
 
   return !file.bad() || !file.fail();
 }
+
+
+fileio::MappedFile::MappedFile( const std::wstring& filename )
+    : file_( INVALID_HANDLE_VALUE ),
+      file_mapping_( nullptr ),
+      data_( nullptr ),
+      size_( 0 ) {
+  file_ = CreateFileW( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+
+  if ( file_ == INVALID_HANDLE_VALUE ) {
+    throw std::runtime_error( "Unable to open file " +
+                              string_utils::WideToAnsi( filename ) );
+  }
+
+  LARGE_INTEGER file_size;
+
+  // An empty file cannot be mapped
+  if ( !GetFileSizeEx( file_, &file_size ) || file_size.QuadPart == 0 ) {
+    CloseHandle( file_ );
+    throw std::runtime_error( "Unable to map the empty file " +
+                              string_utils::WideToAnsi( filename ) );
+  }
+
+  size_ = static_cast<size_t>( file_size.QuadPart );
+
+  file_mapping_ =
+      CreateFileMappingW( file_, nullptr, PAGE_READONLY, 0, 0, nullptr );
+
+  if ( file_mapping_ ) {
+    data_ = static_cast<const uint8_t*>(
+        MapViewOfFile( file_mapping_, FILE_MAP_READ, 0, 0, 0 ) );
+  }
+
+  if ( !data_ ) {
+    if ( file_mapping_ )
+      CloseHandle( file_mapping_ );
+
+    CloseHandle( file_ );
+
+    throw std::runtime_error( "Unable to map the file " +
+                              string_utils::WideToAnsi( filename ) );
+  }
+}
+
+fileio::MappedFile::~MappedFile() {
+  UnmapViewOfFile( data_ );
+  CloseHandle( file_mapping_ );
+  CloseHandle( file_ );
+}
+
+const uint8_t* fileio::MappedFile::GetData() const {
+  return data_;
+}
+
+size_t fileio::MappedFile::GetSize() const {
+  return size_;
+}
\ No newline at end of file
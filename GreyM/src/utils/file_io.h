@@ -8,4 +8,25 @@ std::vector<uint8_t> ReadBinaryFile( const std::wstring& filename );
 bool WriteFileData( const std::wstring& filename,
                     const std::vector<uint8_t>& buf );
 
+// A read-only mapping of a whole file, nothing is read until it is touched.
+// Throws if the file cannot be opened or mapped.
+class MappedFile {
+ public:
+  MappedFile( const std::wstring& filename );
+  ~MappedFile();
+
+  MappedFile( const MappedFile& ) = delete;
+  MappedFile& operator=( const MappedFile& ) = delete;
+
+  const uint8_t* GetData() const;
+  size_t GetSize() const;
+
+ private:
+  HANDLE file_;
+  HANDLE file_mapping_;
+
+  const uint8_t* data_;
+  size_t size_;
+};
+
 }  // namespace fileio
\ No newline at end of file
@@ -1,36 +1,222 @@
 #include "pch.h"
 #include "file_log.h"
 
-static std::ofstream file( "log.txt", std::ofstream::out );
+#include <atomic>
+#include <memory>
+#include <thread>
 
-// to avoid allocations each time, use the same buffer all the time
-static char g_log_buffer[ 1024 + 1 ];
+namespace {
 
-void LogFormat( const uintptr_t offset,
-                          const char* format,
-                          va_list args ) {
-  const auto chars_written_count =
-      vsprintf( g_log_buffer + offset, format, args );
+constexpr size_t kRingSlotCount = 16384;
+constexpr size_t kRingSlotDataSize = 240;
+
+enum class RingSlotKind : uint8_t { Text, Record };
+
+struct RingSlot {
+  // The index of the entry that owns the slot next, see Logger
+  std::atomic<size_t> sequence;
+
+  RingSlotKind kind;
+  uint16_t record_type;
+  uint16_t size;
+  char data[ kRingSlotDataSize ];
+};
+
+const char* kLevelPrefixes[] = { "[TRACE] ", "[INFO] ", "[WARN] ",
+                                 "[ERROR] " };
+
+// A bounded queue with many writers and a single reader. The slot of entry i
+// is free to write when its sequence is i, and readable once the writer set
+// it to i + 1. The reader hands it back for entry i + kRingSlotCount.
+class Logger {
+ public:
+  Logger()
+      : text_file_( "log.txt", std::ofstream::out ),
+        record_file_( "log.records",
+                      std::ofstream::out | std::ofstream::binary ),
+        slots_( new RingSlot[ kRingSlotCount ] ) {
+    for ( size_t i = 0; i < kRingSlotCount; ++i )
+      slots_[ i ].sequence.store( i, std::memory_order_relaxed );
+
+    drain_thread_ = std::thread( &Logger::Drain, this );
+  }
+
+  ~Logger() {
+    stop_.store( true, std::memory_order_release );
+    drain_thread_.join();
+  }
+
+  RingSlot* Acquire( size_t* entry_index ) {
+    size_t index = write_index_.load( std::memory_order_relaxed );
+
+    for ( ;; ) {
+      auto slot = &slots_[ index % kRingSlotCount ];
+
+      const auto sequence = slot->sequence.load( std::memory_order_acquire );
+
+      const auto difference =
+          static_cast<intptr_t>( sequence ) - static_cast<intptr_t>( index );
+
+      if ( difference == 0 ) {
+        if ( write_index_.compare_exchange_weak(
+                 index, index + 1, std::memory_order_relaxed ) ) {
+          *entry_index = index;
+          return slot;
+        }
+      } else {
+        // When it is full we wait for the drain thread rather than drop the
+        // entry, otherwise another writer took the slot first
+        if ( difference < 0 )
+          std::this_thread::yield();
+
+        index = write_index_.load( std::memory_order_relaxed );
+      }
+    }
+  }
+
+  void Publish( RingSlot* slot, const size_t entry_index ) {
+    slot->sequence.store( entry_index + 1, std::memory_order_release );
+  }
+
+  void Flush() {
+    const auto target_index = write_index_.load( std::memory_order_acquire );
+
+    while ( flushed_index_.load( std::memory_order_acquire ) < target_index )
+      std::this_thread::yield();
+  }
+
+ private:
+  bool DrainAvailable() {
+    bool drained_any = false;
+
+    for ( ;; ) {
+      auto slot = &slots_[ read_index_ % kRingSlotCount ];
+
+      if ( slot->sequence.load( std::memory_order_acquire ) !=
+           read_index_ + 1 )
+        break;
+
+      if ( slot->kind == RingSlotKind::Text ) {
+        text_file_.write( slot->data, slot->size );
+      } else {
+        record_file_.write( reinterpret_cast<const char*>( &slot->record_type ),
+                            sizeof( slot->record_type ) );
+        record_file_.write( reinterpret_cast<const char*>( &slot->size ),
+                            sizeof( slot->size ) );
+        record_file_.write( slot->data, slot->size );
+      }
+
+      slot->sequence.store( read_index_ + kRingSlotCount,
+                            std::memory_order_release );
+
+      ++read_index_;
+      drained_any = true;
+    }
+
+    return drained_any;
+  }
+
+  void Drain() {
+    for ( ;; ) {
+      // Read before draining, whatever was written before the stop is still
+      // drained on the last pass
+      const bool stopping = stop_.load( std::memory_order_acquire );
+
+      if ( DrainAvailable() )
+        continue;
+
+      // Only flushed once it is idle, the streams buffer the rest
+      text_file_.flush();
+      record_file_.flush();
 
-  // add newline
-  g_log_buffer[ offset + chars_written_count ] = '\n';
-  // null terminate it
-  g_log_buffer[ offset + chars_written_count + 1 ] = '\0';
+      flushed_index_.store( read_index_, std::memory_order_release );
 
-  file << g_log_buffer;
+      if ( stopping )
+        break;
 
-  // Reset the log buffer
-  g_log_buffer[ 0 ] = '\0';
+      Sleep( 1 );
+    }
+  }
+
+  std::ofstream text_file_;
+  std::ofstream record_file_;
+
+  std::unique_ptr<RingSlot[]> slots_;
+
+  std::atomic<size_t> write_index_ = 0;
+  std::atomic<size_t> flushed_index_ = 0;
+  std::atomic<bool> stop_ = false;
+
+  // Only touched by the drain thread
+  size_t read_index_ = 0;
+
+  std::thread drain_thread_;
+};
+
+Logger& GetLogger() {
+  static Logger logger;
+  return logger;
 }
 
-void file_log::Info( const char* format, ... ) {
-  strcat( g_log_buffer, "[INFO] \0" );
+}  // namespace
 
-  va_list args;
+void file_log::Write( const LogLevel level, const char* format, ... ) {
+  auto& logger = GetLogger();
 
+  size_t entry_index = 0;
+  auto slot = logger.Acquire( &entry_index );
+
+  const auto prefix = kLevelPrefixes[ static_cast<uint8_t>( level ) ];
+  const auto prefix_length = strlen( prefix );
+
+  memcpy( slot->data, prefix, prefix_length );
+
+  // Leave a char for the newline
+  const auto text_capacity = kRingSlotDataSize - prefix_length - 1;
+
+  va_list args;
   va_start( args, format );
 
-  LogFormat( strlen( g_log_buffer ), format, args );
+  const auto chars_written_count =
+      vsnprintf( slot->data + prefix_length, text_capacity, format, args );
 
   va_end( args );
+
+  size_t text_length = 0;
+
+  if ( chars_written_count > 0 ) {
+    text_length = ( std::min )( static_cast<size_t>( chars_written_count ),
+                                text_capacity - 1 );
+  }
+
+  slot->data[ prefix_length + text_length ] = '\n';
+
+  slot->kind = RingSlotKind::Text;
+  slot->size = static_cast<uint16_t>( prefix_length + text_length + 1 );
+
+  logger.Publish( slot, entry_index );
+}
+
+void file_log::WriteRecord( const LogRecordType type,
+                            const void* data,
+                            const uint16_t size ) {
+  if ( size > kRingSlotDataSize )
+    throw std::runtime_error( "The log record does not fit in a slot" );
+
+  auto& logger = GetLogger();
+
+  size_t entry_index = 0;
+  auto slot = logger.Acquire( &entry_index );
+
+  memcpy( slot->data, data, size );
+
+  slot->kind = RingSlotKind::Record;
+  slot->record_type = static_cast<uint16_t>( type );
+  slot->size = size;
+
+  logger.Publish( slot, entry_index );
+}
+
+void file_log::Flush() {
+  GetLogger().Flush();
 }
@@ -1,14 +1,104 @@
 #pragma once
 
 /*
-  Not thread safe, tried to make as fast as possible, 
-  hence the use of C api and not C++ shit
+  Any thread formats its entry straight into a slot of a ring buffer and
+  moves on, a single background thread writes the slots to log.txt. Nothing
+  is locked and nothing is written to disk on the calling thread.
+
+  The entries below FILE_LOG_MIN_LEVEL are compiled out, arguments included,
+  so use the macros and not file_log::Write directly.
+
+  The binary records skip the formatting, they go to log.records as
+  [uint16_t type][uint16_t size][size bytes] one after another.
 */
 
 #include <stdarg.h>
 
+#define FILE_LOG_LEVEL_TRACE 0
+#define FILE_LOG_LEVEL_INFO 1
+#define FILE_LOG_LEVEL_WARNING 2
+#define FILE_LOG_LEVEL_ERROR 3
+#define FILE_LOG_LEVEL_NONE 4
+
+#ifndef FILE_LOG_MIN_LEVEL
+#ifdef _DEBUG
+#define FILE_LOG_MIN_LEVEL FILE_LOG_LEVEL_TRACE
+#else
+#define FILE_LOG_MIN_LEVEL FILE_LOG_LEVEL_INFO
+#endif
+#endif
+
+// The records are cheap enough to keep in release
+#ifndef FILE_LOG_ENABLE_RECORDS
+#define FILE_LOG_ENABLE_RECORDS TRUE
+#endif
+
 namespace file_log {
 
-void Info( const char* format, ... );
+enum class LogLevel : uint8_t {
+  Trace = FILE_LOG_LEVEL_TRACE,
+  Info = FILE_LOG_LEVEL_INFO,
+  Warning = FILE_LOG_LEVEL_WARNING,
+  Error = FILE_LOG_LEVEL_ERROR
+};
+
+enum class LogRecordType : uint16_t {
+  VirtualizedSite = 1,
+};
+
+#pragma pack( push, 1 )
+struct VirtualizedSiteRecord {
+  uint64_t address;
+  uint32_t vm_opcode;
+  uint8_t size;
+};
+#pragma pack( pop )
+
+// Entries longer than a slot are truncated
+void Write( const LogLevel level, const char* format, ... );
+
+// Throws if the record does not fit in a slot
+void WriteRecord( const LogRecordType type,
+                  const void* data,
+                  const uint16_t size );
+
+// Waits until everything written so far is in the files
+void Flush();
+
+}  // namespace file_log
+
+#if FILE_LOG_MIN_LEVEL <= FILE_LOG_LEVEL_TRACE
+#define FILE_LOG_TRACE( ... ) \
+  file_log::Write( file_log::LogLevel::Trace, __VA_ARGS__ )
+#else
+#define FILE_LOG_TRACE( ... ) ( (void)0 )
+#endif
+
+#if FILE_LOG_MIN_LEVEL <= FILE_LOG_LEVEL_INFO
+#define FILE_LOG_INFO( ... ) \
+  file_log::Write( file_log::LogLevel::Info, __VA_ARGS__ )
+#else
+#define FILE_LOG_INFO( ... ) ( (void)0 )
+#endif
+
+#if FILE_LOG_MIN_LEVEL <= FILE_LOG_LEVEL_WARNING
+#define FILE_LOG_WARNING( ... ) \
+  file_log::Write( file_log::LogLevel::Warning, __VA_ARGS__ )
+#else
+#define FILE_LOG_WARNING( ... ) ( (void)0 )
+#endif
+
+#if FILE_LOG_MIN_LEVEL <= FILE_LOG_LEVEL_ERROR
+#define FILE_LOG_ERROR( ... ) \
+  file_log::Write( file_log::LogLevel::Error, __VA_ARGS__ )
+#else
+#define FILE_LOG_ERROR( ... ) ( (void)0 )
+#endif
 
-}  // namespace file_log
\ No newline at end of file
+#if FILE_LOG_ENABLE_RECORDS
+#define FILE_LOG_RECORD( type, record )                                 \
+  file_log::WriteRecord( type, &( record ),                             \
+                         static_cast<uint16_t>( sizeof( record ) ) )
+#else
+#define FILE_LOG_RECORD( type, record ) ( (void)0 )
+#endif
@@ -1,17 +1,102 @@
 #pragma once
 
-inline uint8_t RandomU8() {
-  return rand() % 0xff;
-}
+#include <cstdint>
+#include <cstring>
+
+namespace rng {
+
+// xoshiro256**, the state is expanded from a single seed with splitmix64
+class Xoshiro256 {
+ public:
+  explicit Xoshiro256( uint64_t seed ) {
+    for ( auto& word : state_ ) {
+      uint64_t value = ( seed += 0x9E3779B97F4A7C15 );
+      value = ( value ^ ( value >> 30 ) ) * 0xBF58476D1CE4E5B9;
+      value = ( value ^ ( value >> 27 ) ) * 0x94D049BB133111EB;
+      word = value ^ ( value >> 31 );
+    }
+  }
+
+  uint64_t Next() {
+    const uint64_t result = RotateLeft( state_[ 1 ] * 5, 7 ) * 9;
+    const uint64_t t = state_[ 1 ] << 17;
+
+    state_[ 2 ] ^= state_[ 0 ];
+    state_[ 3 ] ^= state_[ 1 ];
+    state_[ 1 ] ^= state_[ 2 ];
+    state_[ 0 ] ^= state_[ 3 ];
+
+    state_[ 2 ] ^= t;
+    state_[ 3 ] = RotateLeft( state_[ 3 ], 45 );
 
-template <int N>
-inline void GenerateRandomBytes( std::array<uint8_t, N>& buffer,
-                                 const uint32_t length ) {
-  for ( uint32_t i = 0; i < length; ++i ) {
-    buffer[ i ] = RandomU8();
+    return result;
   }
+
+  // Eight bytes out of every number
+  void Fill( uint8_t* data, const size_t size ) {
+    size_t i = 0;
+
+    for ( ; i + sizeof( uint64_t ) <= size; i += sizeof( uint64_t ) ) {
+      const auto value = Next();
+      memcpy( data + i, &value, sizeof( value ) );
+    }
+
+    if ( i < size ) {
+      const auto value = Next();
+      memcpy( data + i, &value, size - i );
+    }
+  }
+
+ private:
+  static uint64_t RotateLeft( const uint64_t value, const int count ) {
+    return ( value << count ) | ( value >> ( 64 - count ) );
+  }
+
+  uint64_t state_[ 4 ];
+};
+
+// The generator behind all of the randomization, only this has to change to
+// use another one
+using Generator = Xoshiro256;
+
+// Each thread has its own generator, a thread that never seeds it gets the
+// same numbers every run
+inline Generator& GetThreadGenerator() {
+  thread_local Generator generator( 0 );
+  return generator;
+}
+
+// The same seed gives the same protected output
+inline void Seed( const uint64_t seed ) {
+  GetThreadGenerator() = Generator( seed );
+}
+
+// A seed of its own for each index, splitmix64 of the base and the index
+inline uint64_t DeriveSeed( const uint64_t base_seed, const uint64_t index ) {
+  uint64_t value = ( base_seed ^ index ) + 0x9E3779B97F4A7C15;
+  value = ( value ^ ( value >> 30 ) ) * 0xBF58476D1CE4E5B9;
+  value = ( value ^ ( value >> 27 ) ) * 0x94D049BB133111EB;
+  return value ^ ( value >> 31 );
+}
+
+inline uint64_t NextU64() {
+  return GetThreadGenerator().Next();
 }
 
-inline uint32_t RandomU32( const int min, const int max ) {
-  return rand() % max + min;
-}
\ No newline at end of file
+inline void Fill( uint8_t* data, const size_t size ) {
+  GetThreadGenerator().Fill( data, size );
+}
+
+}  // namespace rng
+
+inline uint8_t RandomU8() {
+  return static_cast<uint8_t>( rng::NextU64() >> 56 );
+}
+
+// A number within [min, max], mapped with a multiply instead of a modulo
+inline uint32_t RandomU32( const uint32_t min, const uint32_t max ) {
+  const uint64_t range = static_cast<uint64_t>( max ) - min + 1;
+
+  return min + static_cast<uint32_t>( ( ( rng::NextU64() >> 32 ) * range ) >>
+                                      32 );
+}
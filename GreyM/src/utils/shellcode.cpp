@@ -10,11 +10,15 @@ void Shellcode::AddBytes( const std::initializer_list<uint8_t> bytes ) {
   buffer_.insert( buffer_.end(), bytes );
 }
 
+void Shellcode::AddBytes( const uint8_t* bytes, const size_t size ) {
+  buffer_.insert( buffer_.end(), bytes, bytes + size );
+}
+
 int32_t Shellcode::GetNamedValueOffset( const std::wstring& value_name ) {
-  for ( const auto& named_value : named_value_offsets_ ) {
-    if ( named_value.first == value_name ) {
-      return named_value.second;
-    }
+  const auto it = named_value_offsets_.find( value_name );
+
+  if ( it != named_value_offsets_.end() ) {
+    return it->second;
   }
 
   throw std::runtime_error( string_utils::WideToAnsi( value_name ) +
@@ -28,3 +32,40 @@ void Shellcode::Reserve( const size_t capacity ) {
 const std::vector<uint8_t>& Shellcode::GetBuffer() const {
   return buffer_;
 }
+
+void Shellcode::SetStackSize( const uint32_t stack_size ) {
+  stack_size_ = stack_size;
+  stack_sizes_.emplace_back( static_cast<uint32_t>( buffer_.size() ),
+                             stack_size );
+}
+
+void Shellcode::AdjustStackSize( const int32_t delta ) {
+  if ( stack_size_ != kUnknownStackSize ) {
+    SetStackSize( stack_size_ + delta );
+  }
+}
+
+std::vector<StackRange> Shellcode::GetStackRanges() const {
+  std::vector<StackRange> stack_ranges;
+
+  uint32_t begin_offset = 0;
+  uint32_t stack_size = 0;
+
+  const auto AddStackRange = [&]( const uint32_t end_offset ) {
+    if ( end_offset > begin_offset && stack_size != kUnknownStackSize ) {
+      stack_ranges.push_back( { begin_offset, end_offset, stack_size } );
+    }
+  };
+
+  for ( const auto& offset_stack_size : stack_sizes_ ) {
+    AddStackRange( offset_stack_size.first );
+
+    // A later one at the same offset replaces it
+    begin_offset = offset_stack_size.first;
+    stack_size = offset_stack_size.second;
+  }
+
+  AddStackRange( static_cast<uint32_t>( buffer_.size() ) );
+
+  return stack_ranges;
+}
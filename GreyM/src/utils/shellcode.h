@@ -3,10 +3,21 @@
 #include <string>
 #include <algorithm>
 
+// A part of a shellcode in which the stack pointer is stack_size bytes below
+// the one at the beginning of it
+struct StackRange {
+  uint32_t begin_offset;
+  uint32_t end_offset;
+  uint32_t stack_size;
+};
+
 class Shellcode {
  public:
+  static constexpr uint32_t kUnknownStackSize = UINT32_MAX;
+
   void AddByte( const uint8_t value );
   void AddBytes( const std::initializer_list<uint8_t> bytes );
+  void AddBytes( const uint8_t* bytes, const size_t size );
 
   template <typename T>
   void AddVariable( const T& value,
@@ -24,9 +35,22 @@ class Shellcode {
 
   const std::vector<uint8_t>& GetBuffer() const;
 
+  // The stack size from the current offset on, the unwind data is made from
+  // it. kUnknownStackSize where it depends on the runtime, it stays unknown
+  // until it is set again.
+  void SetStackSize( const uint32_t stack_size );
+  void AdjustStackSize( const int32_t delta );
+
+  // The parts with a known stack size
+  std::vector<StackRange> GetStackRanges() const;
+
  private:
   std::vector<uint8_t> buffer_;
   std::unordered_map<std::wstring, uint32_t> named_value_offsets_;
+
+  // first: offset, second: the stack size from there on
+  std::vector<std::pair<uint32_t, uint32_t>> stack_sizes_;
+  uint32_t stack_size_ = 0;
 };
 
 template <typename T>
@@ -0,0 +1,346 @@
+#include "pch.h"
+#include "virtualization_policy.h"
+#include "pe/portable_executable.h"
+#include "utils/string_utils.h"
+
+namespace virtualization_policy {
+
+struct MapSymbol {
+  std::string name;
+  uint32_t rva;
+};
+
+// Reads the public symbols from a MSVC linker map file
+std::vector<MapSymbol> ReadMapFile( const std::string& map_path ) {
+  std::ifstream file( map_path );
+
+  if ( !file.is_open() ) {
+    throw std::runtime_error( "Unable to open map file " + map_path );
+  }
+
+  std::vector<MapSymbol> symbols;
+
+  uint64_t preferred_load_address = 0;
+
+  std::string line;
+
+  while ( std::getline( file, line ) ) {
+    constexpr auto kLoadAddressPrefix = " Preferred load address is ";
+
+    if ( line.find( kLoadAddressPrefix ) == 0 ) {
+      preferred_load_address = std::stoull(
+          line.substr( strlen( kLoadAddressPrefix ) ), nullptr, 16 );
+      continue;
+    }
+
+    // Symbol lines look like this:
+    //  0001:00000010       ?Foo@@YAXXZ       0000000140001010 f   main.obj
+    std::istringstream line_stream( line );
+
+    std::string address;
+    std::string name;
+    std::string virtual_address;
+
+    if ( !( line_stream >> address >> name >> virtual_address ) ) {
+      continue;
+    }
+
+    if ( address.size() != 13 || address[ 4 ] != ':' ) {
+      continue;
+    }
+
+    const auto symbol_virtual_address =
+        strtoull( virtual_address.c_str(), nullptr, 16 );
+
+    // Absolute symbols and the ones before the image are not interesting
+    if ( symbol_virtual_address <= preferred_load_address ) {
+      continue;
+    }
+
+    MapSymbol symbol;
+    symbol.name = name;
+    symbol.rva =
+        static_cast<uint32_t>( symbol_virtual_address - preferred_load_address );
+
+    symbols.push_back( symbol );
+  }
+
+  return symbols;
+}
+
+// Compares with the name as it was written in the source code as well, e.g.
+// Foo matches the decorated ?Foo@@YAXXZ and _Foo
+bool IsSymbolNameMatching( const std::string& symbol_name,
+                           const std::string& name ) {
+  if ( symbol_name == name ) {
+    return true;
+  }
+
+  if ( symbol_name == "_" + name ) {
+    return true;
+  }
+
+  const auto decorated_prefix = "?" + name + "@";
+
+  return symbol_name.compare( 0, decorated_prefix.size(),
+                              decorated_prefix ) == 0;
+}
+
+// Returns the end of the function that begins at rva, which is where the next
+// known function begins
+uint32_t GetFunctionEnd( const std::vector<uint32_t>& sorted_function_rvas,
+                         const uint32_t rva,
+                         const uint32_t text_section_end ) {
+  const auto it = std::upper_bound( sorted_function_rvas.cbegin(),
+                                    sorted_function_rvas.cend(), rva );
+
+  if ( it == sorted_function_rvas.cend() || *it > text_section_end ) {
+    return text_section_end;
+  }
+
+  return *it;
+}
+
+// A whole percent, anything above 100 is 100. False unless all of the text
+// is the number.
+bool ParseDensity( const std::string& text, uint32_t* density_percent ) {
+  if ( text.empty() || !isdigit( static_cast<unsigned char>( text[ 0 ] ) ) ) {
+    return false;
+  }
+
+  char* end = nullptr;
+  const auto value = strtoul( text.c_str(), &end, 10 );
+
+  if ( *end != '\0' ) {
+    return false;
+  }
+
+  *density_percent = static_cast<uint32_t>( ( std::min )( value, 100ul ) );
+
+  return true;
+}
+
+Policy Load( const std::wstring& policy_path, const PortableExecutable& pe ) {
+  std::ifstream file( policy_path );
+
+  if ( !file.is_open() ) {
+    throw std::runtime_error( "Unable to open policy file " +
+                              string_utils::WideToAnsi( policy_path ) );
+  }
+
+  struct NamedRule {
+    std::string kind;
+    std::string name;
+    bool virtualize;
+    uint32_t density_percent;
+  };
+
+  Policy policy;
+
+  std::vector<NamedRule> named_rules;
+  std::vector<MapSymbol> map_symbols;
+
+  std::string line;
+  int line_number = 0;
+
+  while ( std::getline( file, line ) ) {
+    ++line_number;
+
+    std::istringstream line_stream( line );
+
+    std::string action;
+
+    if ( !( line_stream >> action ) || action[ 0 ] == '#' ) {
+      continue;
+    }
+
+    const auto error = [&]( const std::string& message ) {
+      return std::runtime_error( "Policy line " +
+                                 std::to_string( line_number ) + ": " +
+                                 message );
+    };
+
+    if ( action == "default" ) {
+      std::string value;
+      line_stream >> value;
+
+      if ( value != "include" && value != "exclude" ) {
+        throw error( "expected include or exclude" );
+      }
+
+      policy.virtualize_by_default = value == "include";
+    } else if ( action == "map" ) {
+      std::string map_path;
+      std::getline( line_stream >> std::ws, map_path );
+
+      const auto symbols = ReadMapFile( map_path );
+      map_symbols.insert( map_symbols.end(), symbols.begin(), symbols.end() );
+    } else if ( action == "include" || action == "exclude" ) {
+      const bool virtualize = action == "include";
+
+      std::string kind;
+      std::string value;
+
+      if ( !( line_stream >> kind >> value ) ) {
+        throw error( "expected a rule kind and value" );
+      }
+
+      uint32_t density_percent = 100;
+      std::string density;
+
+      if ( line_stream >> density &&
+           !ParseDensity( density, &density_percent ) ) {
+        throw error( "expected a density percent instead of " + density );
+      }
+
+      if ( kind == "rva" ) {
+        const auto separator = value.find( '-' );
+
+        if ( separator == std::string::npos ) {
+          throw error( "expected a range such as 0x1000-0x2000" );
+        }
+
+        PolicyRange range;
+        range.begin_rva = static_cast<uint32_t>(
+            std::stoul( value.substr( 0, separator ), nullptr, 16 ) );
+        range.end_rva = static_cast<uint32_t>(
+            std::stoul( value.substr( separator + 1 ), nullptr, 16 ) );
+        range.virtualize = virtualize;
+        range.density_percent = density_percent;
+
+        policy.ranges.push_back( range );
+      } else if ( kind == "export" || kind == "symbol" ) {
+        // Resolved below once every map file has been read
+        named_rules.push_back( { kind, value, virtualize, density_percent } );
+      } else {
+        throw error( "unknown rule kind " + kind );
+      }
+    } else {
+      throw error( "unknown action " + action );
+    }
+  }
+
+  if ( named_rules.empty() ) {
+    return policy;
+  }
+
+  const auto exports = pe.GetExports();
+
+  const auto text_section = pe.GetSectionHeaders().FromName( ".text" );
+
+  if ( !text_section ) {
+    throw std::runtime_error( "Policy names require a .text section" );
+  }
+
+  const auto text_section_end =
+      text_section->VirtualAddress + text_section->Misc.VirtualSize;
+
+  // Every known function start, used to determine where functions end
+  std::vector<uint32_t> function_rvas;
+
+  for ( const auto& symbol : map_symbols ) {
+    function_rvas.push_back( symbol.rva );
+  }
+
+  for ( const auto& e : exports ) {
+    function_rvas.push_back( e.function_addr_rva );
+  }
+
+  std::sort( function_rvas.begin(), function_rvas.end() );
+
+  for ( const auto& rule : named_rules ) {
+    std::vector<uint32_t> rule_rvas;
+
+    if ( rule.kind == "export" ) {
+      for ( const auto& e : exports ) {
+        if ( e.function_name == rule.name ) {
+          rule_rvas.push_back( e.function_addr_rva );
+        }
+      }
+    } else {
+      for ( const auto& symbol : map_symbols ) {
+        if ( IsSymbolNameMatching( symbol.name, rule.name ) ) {
+          rule_rvas.push_back( symbol.rva );
+        }
+      }
+    }
+
+    if ( rule_rvas.empty() ) {
+      throw std::runtime_error( "Policy " + rule.kind + " " + rule.name +
+                                " was not found" );
+    }
+
+    for ( const auto rva : rule_rvas ) {
+      PolicyRange range;
+      range.begin_rva = rva;
+      range.end_rva = GetFunctionEnd( function_rvas, rva, text_section_end );
+      range.virtualize = rule.virtualize;
+      range.density_percent = rule.density_percent;
+
+      policy.ranges.push_back( range );
+    }
+  }
+
+  return policy;
+}
+
+// Returns the range that decides about the rva, nullptr if none covers it
+PolicyRange* FindRange( Policy* policy, const uint32_t rva ) {
+  PolicyRange* included_range = nullptr;
+
+  for ( auto& range : policy->ranges ) {
+    if ( rva < range.begin_rva || rva >= range.end_rva ) {
+      continue;
+    }
+
+    // An exclusion always wins over an inclusion
+    if ( !range.virtualize ) {
+      return &range;
+    }
+
+    // Use the smallest range when they are nested
+    if ( !included_range || ( range.end_rva - range.begin_rva ) <
+                                ( included_range->end_rva -
+                                  included_range->begin_rva ) ) {
+      included_range = &range;
+    }
+  }
+
+  return included_range;
+}
+
+bool IsIncluded( Policy* policy, const uint32_t rva ) {
+  const auto range = FindRange( policy, rva );
+
+  if ( !range ) {
+    return policy->virtualize_by_default;
+  }
+
+  return range->virtualize;
+}
+
+bool ShouldVirtualize( Policy* policy, const uint32_t rva ) {
+  const auto included_range = FindRange( policy, rva );
+
+  if ( !included_range ) {
+    return policy->virtualize_by_default;
+  }
+
+  if ( !included_range->virtualize ) {
+    return false;
+  }
+
+  ++included_range->total_candidates;
+
+  // Spread the virtualized instructions evenly over the range
+  if ( included_range->total_virtualized * 100 >=
+       included_range->density_percent * included_range->total_candidates ) {
+    return false;
+  }
+
+  ++included_range->total_virtualized;
+
+  return true;
+}
+
+}  // namespace virtualization_policy
@@ -0,0 +1,50 @@
+#pragma once
+
+class PortableExecutable;
+
+/*
+  A policy file selects what code is virtualized, one rule per line:
+
+    # comment
+    default include|exclude
+    map <path to the MSVC linker .map file>
+    include rva <begin>-<end> [density percent]
+    include export <name> [density percent]
+    include symbol <name> [density percent]
+    exclude rva <begin>-<end>
+    exclude export <name>
+    exclude symbol <name>
+
+  Export and symbol rules cover the function from its address until the next
+  known function. The density limits the percentage of the virtualizable
+  instructions within the range that will be virtualized.
+*/
+namespace virtualization_policy {
+
+struct PolicyRange {
+  uint32_t begin_rva;
+  uint32_t end_rva;
+  bool virtualize;
+  uint32_t density_percent;
+
+  // Used to keep track of the density while virtualizing
+  uint32_t total_candidates = 0;
+  uint32_t total_virtualized = 0;
+};
+
+struct Policy {
+  bool virtualize_by_default = true;
+  std::vector<PolicyRange> ranges;
+};
+
+// Reads the policy and resolves the export and symbol names against the PE
+Policy Load( const std::wstring& policy_path, const PortableExecutable& pe );
+
+// Only the include and exclude rules, the density is left out
+bool IsIncluded( Policy* policy, const uint32_t rva );
+
+// Must be called once for each instruction that is about to be virtualized
+// because the density limits are counted as the instructions are seen
+bool ShouldVirtualize( Policy* policy, const uint32_t rva );
+
+}  // namespace virtualization_policy
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "../../Interpreter/src/main.h"
+
+#include <array>
+
+/*
+  The protector emits one of these for each import, the interpreter points
+  the iat slot of the import to it and only writes its encrypted address:
+
+    push eax                        <-- Room for the import address
+    pushfd                          <-- xor modifies the eflags
+    push eax
+    mov eax, [EncryptedTargetSlot]  <-- In the vm code section
+    xor eax, XorKey
+    mov [esp + 8], eax
+    pop eax
+    popfd
+    ret                             <-- To the import
+
+  The CALL_IMPORT handler decrypts the address straight from the slot and
+  the key of the thunk.
+*/
+namespace import_redirect_thunk {
+
+#ifdef _WIN64
+// push rax
+// pushfq
+// push rax
+// mov rax, qword ptr [rip + disp32]
+// xor rax, XorKey
+// mov qword ptr [rsp + 0x10], rax
+// pop rax
+// popfq
+// ret
+constexpr std::array<uint8_t, 24> kShellcode = {
+    0x50, 0x9C, 0x50, 0x48, 0x8B, 0x05, 0x00, 0x00, 0x00, 0x00, 0x48, 0x35,
+    0x00, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0x10, 0x58, 0x9D, 0xC3 };
+
+// The xor key is sign extended to 64 bits, the interpreter zero extends it
+constexpr uint32_t kMaxXorKey = 0x7FFFFFFF;
+#else
+// push eax
+// pushfd
+// push eax
+// mov eax, dword ptr [addr]
+// xor eax, XorKey
+// mov dword ptr [esp + 8], eax
+// pop eax
+// popfd
+// ret
+constexpr std::array<uint8_t, 20> kShellcode = {
+    0x50, 0x9C, 0x50, 0xA1, 0x00, 0x00, 0x00, 0x00, 0x35, 0x00,
+    0x00, 0x00, 0x00, 0x89, 0x44, 0x24, 0x08, 0x58, 0x9D, 0xC3 };
+
+constexpr uint32_t kMaxXorKey = 0xFFFFFFFF;
+#endif
+
+static_assert( kShellcode.size() <= VM_IMPORT_REDIRECT_SHELLCODE_STRIDE,
+               "The import redirect shellcode does not fit in its stride" );
+
+}  // namespace import_redirect_thunk
@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "virtualizer.h"
 #include "../utils/shellcode.h"
+#include "vm_entry_thunk.h"
 
 namespace virtualizer {
 
@@ -148,6 +149,70 @@ VmRegister GetVmRegisterOffsetFromX86MemoryReg( const cs_x86_op& operand ) {
   return vm_reg;
 }
 
+// Returns the low nibble of the jcc opcode, the interpreter evaluates the
+// condition with it. Returns -1 if it is not a supported conditional jump.
+int GetJccConditionCode( const unsigned int instruction_id ) {
+  switch ( instruction_id ) {
+    case x86_insn::X86_INS_JO:
+      return 0x0;
+    case x86_insn::X86_INS_JNO:
+      return 0x1;
+    case x86_insn::X86_INS_JB:
+      return 0x2;
+    case x86_insn::X86_INS_JAE:
+      return 0x3;
+    case x86_insn::X86_INS_JE:
+      return 0x4;
+    case x86_insn::X86_INS_JNE:
+      return 0x5;
+    case x86_insn::X86_INS_JBE:
+      return 0x6;
+    case x86_insn::X86_INS_JA:
+      return 0x7;
+    case x86_insn::X86_INS_JS:
+      return 0x8;
+    case x86_insn::X86_INS_JNS:
+      return 0x9;
+    case x86_insn::X86_INS_JP:
+      return 0xA;
+    case x86_insn::X86_INS_JNP:
+      return 0xB;
+    case x86_insn::X86_INS_JL:
+      return 0xC;
+    case x86_insn::X86_INS_JGE:
+      return 0xD;
+    case x86_insn::X86_INS_JLE:
+      return 0xE;
+    case x86_insn::X86_INS_JG:
+      return 0xF;
+    default:
+      return -1;
+  }
+}
+
+VmAluOperation GetVmAluOperation( const unsigned int instruction_id ) {
+  switch ( instruction_id ) {
+    case x86_insn::X86_INS_ADD:
+      return VmAluOperation::ADD;
+    case x86_insn::X86_INS_SUB:
+      return VmAluOperation::SUB;
+    case x86_insn::X86_INS_AND:
+      return VmAluOperation::AND;
+    case x86_insn::X86_INS_OR:
+      return VmAluOperation::OR;
+    case x86_insn::X86_INS_XOR:
+      return VmAluOperation::XOR;
+    case x86_insn::X86_INS_CMP:
+      return VmAluOperation::CMP;
+    case x86_insn::X86_INS_TEST:
+      return VmAluOperation::TEST;
+    default:
+      break;
+  }
+
+  throw std::runtime_error( "The instruction is not an alu operation" );
+}
+
 VmOpcodes GetVmOpcode( const cs_insn& instruction ) {
   const auto& operands = instruction.detail->x86.operands;
 
@@ -214,10 +279,40 @@ VmOpcodes GetVmOpcode( const cs_insn& instruction ) {
       }
     } break;
 
-      //// also changes eflags, read what they change and emulate them
-      //// https://c9x.me/x86/html/file_module_x86_id_5.html
-      // case x86_insn::X86_INS_ADD: {
-      //} break;
+    case x86_insn::X86_INS_ADD:
+    case x86_insn::X86_INS_SUB:
+    case x86_insn::X86_INS_AND:
+    case x86_insn::X86_INS_OR:
+    case x86_insn::X86_INS_XOR:
+    case x86_insn::X86_INS_CMP:
+    case x86_insn::X86_INS_TEST: {
+      const auto& operand1 = operands[ 0 ];
+      const auto& operand2 = operands[ 1 ];
+
+      if ( operand1.type == x86_op_type::X86_OP_REG ) {
+        // add reg, imm
+        if ( operand2.type == x86_op_type::X86_OP_IMM ) {
+          vm_opcode = VmOpcodes::ALU_REGISTER_IMMEDIATE;
+        }
+        // add reg, reg
+        else if ( operand2.type == x86_op_type::X86_OP_REG ) {
+          vm_opcode = VmOpcodes::ALU_REGISTER_REGISTER;
+        }
+        // add reg, [reg +- offset]
+        else if ( IsOperandMemoryRegOffset( operand2 ) ) {
+          vm_opcode = VmOpcodes::ALU_REGISTER_MEMORY_REG_OFFSET;
+        }
+      } else if ( IsOperandMemoryRegOffset( operand1 ) ) {
+        // add [reg +- offset], reg
+        if ( operand2.type == x86_op_type::X86_OP_REG ) {
+          vm_opcode = VmOpcodes::ALU_MEMORY_REG_OFFSET_REG;
+        }
+        // add [reg +- offset], imm
+        else if ( operand2.type == x86_op_type::X86_OP_IMM ) {
+          vm_opcode = VmOpcodes::ALU_MEMORY_REG_OFFSET_IMM;
+        }
+      }
+    } break;
 
       //// no flags are affected
       /// https://c9x.me/x86/html/file_module_x86_id_153.html
@@ -257,21 +352,277 @@ VmOpcodes GetVmOpcode( const cs_insn& instruction ) {
     } break;
 
     default:
+      if ( GetJccConditionCode( instruction.id ) != -1 &&
+           operands[ 0 ].type == X86_OP_IMM ) {
+        vm_opcode = VmOpcodes::JCC_IMM;
+      }
       break;
   }
 
   return vm_opcode;
 }
 
-bool IsVirtualizeable( const cs_insn& instruction, const VmOpcodes vm_opcode ) {
-  // the instruction has to be bigger than a jmp
-  if ( instruction.size < 5 ) {
-    return false;
+bool MayHaveVmOpcode( const unsigned int instruction_id ) {
+  switch ( instruction_id ) {
+    case x86_insn::X86_INS_MOV:
+    case x86_insn::X86_INS_CALL:
+    case x86_insn::X86_INS_ADD:
+    case x86_insn::X86_INS_SUB:
+    case x86_insn::X86_INS_AND:
+    case x86_insn::X86_INS_OR:
+    case x86_insn::X86_INS_XOR:
+    case x86_insn::X86_INS_CMP:
+    case x86_insn::X86_INS_TEST:
+    case x86_insn::X86_INS_PUSH:
+    case x86_insn::X86_INS_LEA:
+    case x86_insn::X86_INS_JMP:
+      return true;
+    default:
+      return GetJccConditionCode( instruction_id ) != -1;
   }
+}
 
+// The size is not checked here, an instruction that is smaller than a jmp can
+// still be in the middle of a block, see BuildVmBlocks
+bool IsVirtualizeable( const VmOpcodes vm_opcode ) {
   return vm_opcode != VmOpcodes::NO_OPCODE;
 }
 
+VmHandlerIndex GetVmHandlerIndex( const VmOpcodes vm_opcode ) {
+  switch ( vm_opcode ) {
+    case VmOpcodes::MOV_REGISTER_IMMEDIATE:
+      return VmHandlerIndex::MOV_REGISTER_IMMEDIATE;
+    case VmOpcodes::MOV_REGISTER_REGISTER:
+      return VmHandlerIndex::MOV_REGISTER_REGISTER;
+    case VmOpcodes::MOV_REGISTER_MEMORY_IMMEDIATE:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_IMMEDIATE;
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_IMM:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_IMM;
+    case VmOpcodes::CALL_IMMEDIATE:
+      return VmHandlerIndex::CALL_IMMEDIATE;
+    case VmOpcodes::CALL_MEMORY:
+      return VmHandlerIndex::CALL_MEMORY;
+    case VmOpcodes::CALL_MEMORY_RIP_RELATIVE:
+      return VmHandlerIndex::CALL_MEMORY_RIP_RELATIVE;
+    case VmOpcodes::CALL_IMPORT:
+      return VmHandlerIndex::CALL_IMPORT;
+    case VmOpcodes::LEA_REG_MEMORY_IMMEDIATE_RIP_RELATIVE:
+      return VmHandlerIndex::LEA_REG_MEMORY_IMMEDIATE_RIP_RELATIVE;
+    case VmOpcodes::PUSH_IMM:
+      return VmHandlerIndex::PUSH_IMM;
+    case VmOpcodes::PUSH_REGISTER_MEMORY_REG_OFFSET:
+      return VmHandlerIndex::PUSH_REGISTER_MEMORY_REG_OFFSET;
+    case VmOpcodes::JMP_IMM:
+      return VmHandlerIndex::JMP_IMM;
+    case VmOpcodes::ALU_REGISTER_IMMEDIATE:
+      return VmHandlerIndex::ALU_REGISTER_IMMEDIATE;
+    case VmOpcodes::ALU_REGISTER_REGISTER:
+      return VmHandlerIndex::ALU_REGISTER_REGISTER;
+    case VmOpcodes::ALU_REGISTER_MEMORY_REG_OFFSET:
+      return VmHandlerIndex::ALU_REGISTER_MEMORY_REG_OFFSET;
+    case VmOpcodes::ALU_MEMORY_REG_OFFSET_REG:
+      return VmHandlerIndex::ALU_MEMORY_REG_OFFSET_REG;
+    case VmOpcodes::ALU_MEMORY_REG_OFFSET_IMM:
+      return VmHandlerIndex::ALU_MEMORY_REG_OFFSET_IMM;
+    case VmOpcodes::JCC_IMM:
+      return VmHandlerIndex::JCC_IMM;
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_8:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_REG_OFFSET_8;
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_16:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_REG_OFFSET_16;
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_32:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_REG_OFFSET_32;
+#ifdef _WIN64
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_64:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_REG_OFFSET_64;
+#endif
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_8_RELOCATED:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_REG_OFFSET_8_RELOCATED;
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_16_RELOCATED:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_REG_OFFSET_16_RELOCATED;
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_32_RELOCATED:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_REG_OFFSET_32_RELOCATED;
+#ifdef _WIN64
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_64_RELOCATED:
+      return VmHandlerIndex::MOV_REGISTER_MEMORY_REG_OFFSET_64_RELOCATED;
+#endif
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_8:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_REG_8;
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_16:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_REG_16;
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_32:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_REG_32;
+#ifdef _WIN64
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_64:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_REG_64;
+#endif
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_8_RELOCATED:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_REG_8_RELOCATED;
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_16_RELOCATED:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_REG_16_RELOCATED;
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_32_RELOCATED:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_REG_32_RELOCATED;
+#ifdef _WIN64
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_64_RELOCATED:
+      return VmHandlerIndex::MOV_MEMORY_REG_OFFSET_REG_64_RELOCATED;
+#endif
+    case VmOpcodes::VM_EXIT:
+      return VmHandlerIndex::VM_EXIT;
+    default:
+      break;
+  }
+
+  throw std::runtime_error( "The vm opcode does not have a handler" );
+}
+
+VmOpcodes GetSizedVmOpcode( const VmOpcodes vm_opcode,
+                            const uint8_t operand_size,
+                            const bool relocated_disp ) {
+  // Ordered by the operand size, 1 2 4 8, then the relocated ones. The 8
+  // byte ones only exist on x64.
+#ifdef _WIN64
+  constexpr uint32_t kOperandSizeCount = 4;
+
+  static constexpr VmOpcodes kMovRegisterMemoryRegOffset[] = {
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_8,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_16,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_32,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_64,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_8_RELOCATED,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_16_RELOCATED,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_32_RELOCATED,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_64_RELOCATED };
+
+  static constexpr VmOpcodes kMovMemoryRegOffsetReg[] = {
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_8,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_16,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_32,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_64,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_8_RELOCATED,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_16_RELOCATED,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_32_RELOCATED,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_64_RELOCATED };
+#else
+  constexpr uint32_t kOperandSizeCount = 3;
+
+  static constexpr VmOpcodes kMovRegisterMemoryRegOffset[] = {
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_8,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_16,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_32,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_8_RELOCATED,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_16_RELOCATED,
+    VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET_32_RELOCATED };
+
+  static constexpr VmOpcodes kMovMemoryRegOffsetReg[] = {
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_8,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_16,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_32,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_8_RELOCATED,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_16_RELOCATED,
+    VmOpcodes::MOV_MEMORY_REG_OFFSET_REG_32_RELOCATED };
+#endif
+
+  static_assert( _countof( kMovRegisterMemoryRegOffset ) ==
+                         kOperandSizeCount * 2 &&
+                     _countof( kMovMemoryRegOffsetReg ) ==
+                         kOperandSizeCount * 2,
+                 "One sized handler for each operand size and relocation" );
+
+  const VmOpcodes* sized_vm_opcodes = nullptr;
+
+  switch ( vm_opcode ) {
+    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET:
+      sized_vm_opcodes = kMovRegisterMemoryRegOffset;
+      break;
+    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG:
+      sized_vm_opcodes = kMovMemoryRegOffsetReg;
+      break;
+    default:
+      return vm_opcode;
+  }
+
+  uint32_t size_index = 0;
+
+  switch ( operand_size ) {
+    case 1:
+      size_index = 0;
+      break;
+    case 2:
+      size_index = 1;
+      break;
+    case 4:
+      size_index = 2;
+      break;
+#ifdef _WIN64
+    case 8:
+      size_index = 3;
+      break;
+#endif
+    default:
+      return VmOpcodes::NO_OPCODE;
+  }
+
+  return sized_vm_opcodes[ size_index +
+                           ( relocated_disp ? kOperandSizeCount : 0 ) ];
+}
+
+uint32_t GetVmDispatchValue( const VmOpcodes vm_opcode ) {
+#if ENABLE_DENSE_VM_DISPATCH
+  return static_cast<uint32_t>( GetVmHandlerIndex( vm_opcode ) );
+#else
+  return static_cast<uint32_t>( vm_opcode );
+#endif
+}
+
+bool IsVmBlockTerminator( const VmOpcodes vm_opcode ) {
+  // These handlers push onto the real stack or transfer control, the loader
+  // epilog is built around them so they have to be the last one in a block
+  switch ( vm_opcode ) {
+    case VmOpcodes::CALL_IMMEDIATE:
+    case VmOpcodes::CALL_MEMORY:
+    case VmOpcodes::CALL_MEMORY_RIP_RELATIVE:
+    case VmOpcodes::CALL_IMPORT:
+    case VmOpcodes::PUSH_IMM:
+    case VmOpcodes::PUSH_REGISTER_MEMORY_REG_OFFSET:
+    case VmOpcodes::JMP_IMM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+uintptr_t GetCallMemorySlotRva( const cs_insn& instruction,
+                                const bool relocated,
+                                const uintptr_t default_image_base ) {
+  const auto& operand = instruction.detail->x86.operands[ 0 ];
+
+  // call qword ptr [rip + 0x25bec]
+  if ( operand.mem.base == x86_reg::X86_REG_RIP ) {
+    return instruction.address + instruction.size + operand.mem.disp;
+  }
+
+  // call dword ptr [0xF61008], the absolute address has a relocation
+  if ( relocated ) {
+    return static_cast<uintptr_t>( operand.mem.disp ) - default_image_base;
+  }
+
+  return 0;
+}
+
+bool DoesVmHandlerUseEflags( const VmOpcodes vm_opcode ) {
+  switch ( vm_opcode ) {
+    case VmOpcodes::ALU_REGISTER_IMMEDIATE:
+    case VmOpcodes::ALU_REGISTER_REGISTER:
+    case VmOpcodes::ALU_REGISTER_MEMORY_REG_OFFSET:
+    case VmOpcodes::ALU_MEMORY_REG_OFFSET_REG:
+    case VmOpcodes::ALU_MEMORY_REG_OFFSET_IMM:
+    case VmOpcodes::JCC_IMM:
+      return true;
+    default:
+      return false;
+  }
+}
+
 uintptr_t GetOperandMemoryValue( const cs_x86_op& operand,
                                  const bool relocated,
                                  const uintptr_t default_image_base ) {
@@ -292,6 +643,88 @@ uintptr_t GetOperandImmediateValue( const cs_x86_op& operand,
   }
 }
 
+// The vm opcode is followed by the relocation flags of the instruction, in
+// the compact bytecode they're folded into the opcode byte
+void AddVmOpcode( Shellcode* shellcode,
+                  const VmOpcodes vm_opcode,
+                  const uint32_t vm_opcode_encyption_key,
+                  const bool relocated_disp,
+                  const bool relocated_imm ) {
+#if ENABLE_COMPACT_BYTECODE
+  auto compact_opcode =
+      static_cast<uint8_t>( GetVmDispatchValue( vm_opcode ) );
+
+  assert( compact_opcode <= VM_COMPACT_OPCODE_HANDLER_MASK );
+
+  if ( relocated_disp ) {
+    compact_opcode |= VM_COMPACT_OPCODE_RELOCATED_DISP;
+  }
+
+  if ( relocated_imm ) {
+    compact_opcode |= VM_COMPACT_OPCODE_RELOCATED_IMM;
+  }
+
+  shellcode->AddByte( compact_opcode ^
+                      static_cast<uint8_t>( vm_opcode_encyption_key ) );
+#else
+  shellcode->AddValue<uint32_t>( GetVmDispatchValue( vm_opcode ) ^
+                                 vm_opcode_encyption_key );
+
+  // Add uint8_t RelocatedDisp 0/1
+  shellcode->AddByte( static_cast<uint8_t>( relocated_disp ) );
+
+  // Add uint8_t RelocatedImm 0/1
+  shellcode->AddByte( static_cast<uint8_t>( relocated_imm ) );
+#endif
+}
+
+void AddVmRegister( Shellcode* shellcode, const VmRegister& vm_reg ) {
+#if ENABLE_COMPACT_BYTECODE
+  const auto slot = vm_reg.register_offset / sizeof( uintptr_t );
+
+  assert( vm_reg.register_offset % sizeof( uintptr_t ) == 0 );
+  assert( slot <= VM_PACKED_REGISTER_SLOT_MASK );
+
+  uint8_t size_log2 = 0;
+
+  while ( ( 1u << size_log2 ) < vm_reg.register_size ) {
+    ++size_log2;
+  }
+
+  assert( ( 1u << size_log2 ) == vm_reg.register_size && size_log2 <= 3 );
+
+  shellcode->AddByte( static_cast<uint8_t>(
+      slot | ( size_log2 << VM_PACKED_REGISTER_SIZE_SHIFT ) ) );
+#else
+  shellcode->AddValue( vm_reg );
+#endif
+}
+
+// Displacements and immediates are zigzag LEB128 encoded in the compact
+// bytecode, most of them are a small positive or negative number
+void AddVmValue( Shellcode* shellcode, const uintptr_t value ) {
+#if ENABLE_COMPACT_BYTECODE
+  constexpr auto kValueBits = sizeof( uintptr_t ) * 8;
+
+  auto zigzag = ( value << 1 ) ^
+                static_cast<uintptr_t>( static_cast<intptr_t>( value ) >>
+                                        ( kValueBits - 1 ) );
+
+  do {
+    uint8_t byte = zigzag & 0x7F;
+    zigzag >>= 7;
+
+    if ( zigzag != 0 ) {
+      byte |= 0x80;
+    }
+
+    shellcode->AddByte( byte );
+  } while ( zigzag != 0 );
+#else
+  shellcode->AddValue( value );
+#endif
+}
+
 Shellcode CreateVirtualizedShellcode(
     const cs_insn& instruction,
     const VmOpcodes vm_opcode,
@@ -302,9 +735,6 @@ Shellcode CreateVirtualizedShellcode(
 
   assert( vm_opcode != VmOpcodes::NO_OPCODE );
 
-  shellcode.AddValue<uint32_t>( static_cast<uint32_t>( vm_opcode ) ^
-                                vm_opcode_encyption_key );
-
   const auto& operands = instruction.detail->x86.operands;
 
   int imm_count = 0;
@@ -344,11 +774,16 @@ Shellcode CreateVirtualizedShellcode(
     }
   }
 
-  // Add uint8_t RelocatedDisp 0/1
-  shellcode.AddByte( static_cast<uint8_t>( relocated_disp ) );
+  // The operands of the sized handlers have the same size
+  const auto handler_vm_opcode =
+      GetSizedVmOpcode( vm_opcode, operands[ 0 ].size, relocated_disp );
 
-  // Add uint8_t RelocatedImm 0/1
-  shellcode.AddByte( static_cast<uint8_t>( relocated_imm ) );
+  if ( handler_vm_opcode == VmOpcodes::NO_OPCODE ) {
+    return {};
+  }
+
+  AddVmOpcode( &shellcode, handler_vm_opcode, vm_opcode_encyption_key,
+               relocated_disp, relocated_imm );
 
   switch ( vm_opcode ) {
     case VmOpcodes::LEA_REG_MEMORY_IMMEDIATE_RIP_RELATIVE: {
@@ -379,7 +814,7 @@ Shellcode CreateVirtualizedShellcode(
       assert( relocated_imm == false );
       assert( relocated_disp == false );
 
-      shellcode.AddValue( vm_reg );
+      AddVmRegister( &shellcode, vm_reg );
 
       const auto relative_data_addr = GetOperandMemoryValue(
           operands[ 1 ], relocated_disp, default_image_base );
@@ -388,7 +823,7 @@ Shellcode CreateVirtualizedShellcode(
 
       const auto abs_data_addr = relative_data_addr + instruction.size + rip;
 
-      shellcode.AddValue<uintptr_t>( abs_data_addr );
+      AddVmValue( &shellcode, abs_data_addr );
     } break;
 
     case VmOpcodes::CALL_MEMORY_RIP_RELATIVE: {
@@ -427,7 +862,14 @@ Shellcode CreateVirtualizedShellcode(
 
       const auto abs_dest_call = relative_call_addr + instruction.size + rip;
 
-      shellcode.AddValue<uintptr_t>( abs_dest_call );
+      AddVmValue( &shellcode, abs_dest_call );
+    } break;
+
+    case VmOpcodes::CALL_IMPORT: {
+      const auto import_slot_rva = GetCallMemorySlotRva(
+          instruction, relocated_disp, default_image_base );
+
+      AddVmValue( &shellcode, import_slot_rva );
     } break;
 
     case VmOpcodes::CALL_MEMORY: {
@@ -446,7 +888,7 @@ Shellcode CreateVirtualizedShellcode(
       const auto absolute_call_target_addr = GetOperandMemoryValue(
           operands[ 0 ], relocated_disp, default_image_base );
 
-      shellcode.AddValue<uintptr_t>( absolute_call_target_addr );
+      AddVmValue( &shellcode, absolute_call_target_addr );
     } break;
 
     case VmOpcodes::CALL_IMMEDIATE: {
@@ -455,7 +897,7 @@ Shellcode CreateVirtualizedShellcode(
       const auto absolute_call_target_addr = GetOperandImmediateValue(
           operands[ 0 ], relocated_imm, default_image_base );
 
-      shellcode.AddValue<uintptr_t>( absolute_call_target_addr );
+      AddVmValue( &shellcode, absolute_call_target_addr );
     } break;
 
     case VmOpcodes::JMP_IMM: {
@@ -464,7 +906,133 @@ Shellcode CreateVirtualizedShellcode(
       const auto absolute_jmp_target_addr = GetOperandImmediateValue(
           operands[ 0 ], relocated_imm, default_image_base );
 
-      shellcode.AddValue<uintptr_t>( absolute_jmp_target_addr );
+      AddVmValue( &shellcode, absolute_jmp_target_addr );
+    } break;
+
+    case VmOpcodes::JCC_IMM: {
+      assert( operands[ 0 ].type == x86_op_type::X86_OP_IMM );
+
+      shellcode.AddByte(
+          static_cast<uint8_t>( GetJccConditionCode( instruction.id ) ) );
+
+      AddVmValue( &shellcode,
+                  GetOperandImmediateValue( operands[ 0 ], relocated_imm,
+                                            default_image_base ) );
+    } break;
+
+    case VmOpcodes::ALU_REGISTER_IMMEDIATE: {
+      assert( operands[ 0 ].type == x86_op_type::X86_OP_REG );
+      assert( operands[ 1 ].type == x86_op_type::X86_OP_IMM );
+
+      const auto vm_reg_dest =
+          GetVmRegisterOffsetFromX86ImmediateReg( operands[ 0 ] );
+
+      // If the register is not supported, return empty
+      if ( vm_reg_dest.register_offset == -1 )
+        return {};
+
+      shellcode.AddValue( GetVmAluOperation( instruction.id ) );
+      AddVmRegister( &shellcode, vm_reg_dest );
+      AddVmValue( &shellcode,
+                  GetOperandImmediateValue( operands[ 1 ], relocated_imm,
+                                            default_image_base ) );
+    } break;
+
+      // Example: xor eax, eax
+    case VmOpcodes::ALU_REGISTER_REGISTER: {
+      assert( operands[ 0 ].type == x86_op_type::X86_OP_REG );
+      assert( operands[ 1 ].type == x86_op_type::X86_OP_REG );
+
+      // Ensure both of the operand sizes are the same
+      assert( operands[ 0 ].size == operands[ 1 ].size );
+
+      const auto vm_reg_dest =
+          GetVmRegisterOffsetFromX86ImmediateReg( operands[ 0 ] );
+      const auto vm_reg_src =
+          GetVmRegisterOffsetFromX86ImmediateReg( operands[ 1 ] );
+
+      // If the register is not supported, return empty
+      if ( vm_reg_dest.register_offset == -1 ||
+           vm_reg_src.register_offset == -1 )
+        return {};
+
+      shellcode.AddValue( GetVmAluOperation( instruction.id ) );
+      AddVmRegister( &shellcode, vm_reg_dest );
+      AddVmRegister( &shellcode, vm_reg_src );
+    } break;
+
+      // Example: cmp ecx, dword ptr [ebp - 0x100]
+    case VmOpcodes::ALU_REGISTER_MEMORY_REG_OFFSET: {
+      assert( operands[ 0 ].type == x86_op_type::X86_OP_REG );
+      assert( operands[ 1 ].type == x86_op_type::X86_OP_MEM );
+
+      // Ensure both of the operand sizes are the same
+      assert( operands[ 0 ].size == operands[ 1 ].size );
+
+      const auto vm_reg_dest =
+          GetVmRegisterOffsetFromX86ImmediateReg( operands[ 0 ] );
+      const auto vm_reg_src = GetVmRegisterOffsetFromX86MemoryReg( operands[ 1 ] );
+
+      // If the register is not supported, return empty
+      if ( vm_reg_dest.register_offset == -1 ||
+           vm_reg_src.register_offset == -1 )
+        return {};
+
+      shellcode.AddValue( GetVmAluOperation( instruction.id ) );
+      AddVmRegister( &shellcode, vm_reg_dest );
+      AddVmRegister( &shellcode, vm_reg_src );
+      AddVmValue( &shellcode,
+                  GetOperandMemoryValue( operands[ 1 ], relocated_disp,
+                                         default_image_base ) );
+    } break;
+
+      // Example: sub dword ptr [ebx + 0x84], eax
+    case VmOpcodes::ALU_MEMORY_REG_OFFSET_REG: {
+      assert( operands[ 0 ].type == x86_op_type::X86_OP_MEM );
+      assert( operands[ 1 ].type == x86_op_type::X86_OP_REG );
+
+      // Ensure both of the operand sizes are the same
+      assert( operands[ 0 ].size == operands[ 1 ].size );
+
+      const auto vm_reg_dest = GetVmRegisterOffsetFromX86MemoryReg( operands[ 0 ] );
+      const auto vm_reg_src =
+          GetVmRegisterOffsetFromX86ImmediateReg( operands[ 1 ] );
+
+      // If the register is not supported, return empty
+      if ( vm_reg_dest.register_offset == -1 ||
+           vm_reg_src.register_offset == -1 )
+        return {};
+
+      shellcode.AddValue( GetVmAluOperation( instruction.id ) );
+      AddVmRegister( &shellcode, vm_reg_dest );
+      AddVmRegister( &shellcode, vm_reg_src );
+      AddVmValue( &shellcode,
+                  GetOperandMemoryValue( operands[ 0 ], relocated_disp,
+                                         default_image_base ) );
+    } break;
+
+      // Example: cmp dword ptr [ebp - 0x100], 0
+    case VmOpcodes::ALU_MEMORY_REG_OFFSET_IMM: {
+      assert( operands[ 0 ].type == x86_op_type::X86_OP_MEM );
+      assert( operands[ 1 ].type == x86_op_type::X86_OP_IMM );
+
+      const auto vm_reg_dest = GetVmRegisterOffsetFromX86MemoryReg( operands[ 0 ] );
+
+      // If the register is not supported, return empty
+      if ( vm_reg_dest.register_offset == -1 )
+        return {};
+
+      // The interpreter only handles one of them being relocated
+      assert( !( relocated_imm && relocated_disp ) );
+
+      shellcode.AddValue( GetVmAluOperation( instruction.id ) );
+      AddVmRegister( &shellcode, vm_reg_dest );
+      AddVmValue( &shellcode,
+                  GetOperandImmediateValue( operands[ 1 ], relocated_imm,
+                                            default_image_base ) );
+      AddVmValue( &shellcode,
+                  GetOperandMemoryValue( operands[ 0 ], relocated_disp,
+                                         default_image_base ) );
     } break;
 
     case VmOpcodes::MOV_REGISTER_MEMORY_IMMEDIATE: {
@@ -481,10 +1049,11 @@ Shellcode CreateVirtualizedShellcode(
         return {};
 
       // Push the register index to the virtualized code
-      shellcode.AddValue( vm_reg );
+      AddVmRegister( &shellcode, vm_reg );
 
-      shellcode.AddValue( GetOperandMemoryValue( operands[ 1 ], relocated_disp,
-                                                 default_image_base ) );
+      AddVmValue( &shellcode,
+                  GetOperandMemoryValue( operands[ 1 ], relocated_disp,
+                                         default_image_base ) );
     } break;
 
       // Example: mov ecx, dword ptr [eax + 0x43c140]
@@ -517,13 +1086,13 @@ Shellcode CreateVirtualizedShellcode(
           GetOperandMemoryValue( operand2, relocated_disp, default_image_base );
 
       // Push the register offset to be changed to the virtualized code
-      shellcode.AddValue( vm_reg_dest );
+      AddVmRegister( &shellcode, vm_reg_dest );
 
       // Push the reg offset
-      shellcode.AddValue( vm_reg_src );
+      AddVmRegister( &shellcode, vm_reg_src );
 
       // Push the reg disp offset
-      shellcode.AddValue( reg_src_disp );
+      AddVmValue( &shellcode, reg_src_disp );
     } break;
 
     case VmOpcodes::MOV_REGISTER_REGISTER: {
@@ -544,8 +1113,8 @@ Shellcode CreateVirtualizedShellcode(
         return {};
 
       // Push the register index to the virtualized code
-      shellcode.AddValue( vm_reg_dest );
-      shellcode.AddValue( vm_reg_src );
+      AddVmRegister( &shellcode, vm_reg_dest );
+      AddVmRegister( &shellcode, vm_reg_src );
     } break;
 
     case VmOpcodes::MOV_REGISTER_IMMEDIATE: {
@@ -567,9 +1136,10 @@ Shellcode CreateVirtualizedShellcode(
         return {};
 
       // Push the register index to the virtualized code
-      shellcode.AddValue( vm_reg );
-      shellcode.AddValue( GetOperandImmediateValue(
-          operands[ 1 ], relocated_imm, default_image_base ) );
+      AddVmRegister( &shellcode, vm_reg );
+      AddVmValue( &shellcode,
+                  GetOperandImmediateValue( operands[ 1 ], relocated_imm,
+                                            default_image_base ) );
     } break;
 
       // Example: mov dword ptr [eax + 0x43c50c], ecx
@@ -594,14 +1164,15 @@ Shellcode CreateVirtualizedShellcode(
         return {};
 
       // Push the register offset to be changed to the virtualized code
-      shellcode.AddValue( vm_reg_dest );
+      AddVmRegister( &shellcode, vm_reg_dest );
 
       // Push the source reg offset
-      shellcode.AddValue( vm_reg_src );
+      AddVmRegister( &shellcode, vm_reg_src );
 
       // Push the reg disp offset
-      shellcode.AddValue( GetOperandMemoryValue( dest_operand1, relocated_disp,
-                                                 default_image_base ) );
+      AddVmValue( &shellcode,
+                  GetOperandMemoryValue( dest_operand1, relocated_disp,
+                                         default_image_base ) );
     } break;
 
     case VmOpcodes::MOV_MEMORY_REG_OFFSET_IMM: {
@@ -627,13 +1198,15 @@ Shellcode CreateVirtualizedShellcode(
       // modify the interpreter simply call if for both instead of else if
       assert( !( relocated_imm && relocated_disp ) );
 
-      shellcode.AddValue( vm_reg_dest );
+      AddVmRegister( &shellcode, vm_reg_dest );
 
-      shellcode.AddValue( GetOperandImmediateValue( src_operand2, relocated_imm,
-                                                    default_image_base ) );
+      AddVmValue( &shellcode,
+                  GetOperandImmediateValue( src_operand2, relocated_imm,
+                                            default_image_base ) );
 
-      shellcode.AddValue( GetOperandMemoryValue( dest_operand1, relocated_disp,
-                                                 default_image_base ) );
+      AddVmValue( &shellcode,
+                  GetOperandMemoryValue( dest_operand1, relocated_disp,
+                                         default_image_base ) );
 
 // On x86, we do not support operand sizes of 8
 #ifndef _WIN64
@@ -660,8 +1233,9 @@ Shellcode CreateVirtualizedShellcode(
       assert( operands[ 0 ].size == 4 );
 #endif
 
-      shellcode.AddValue( GetOperandImmediateValue(
-          operands[ 0 ], relocated_imm, default_image_base ) );
+      AddVmValue( &shellcode,
+                  GetOperandImmediateValue( operands[ 0 ], relocated_imm,
+                                            default_image_base ) );
     } break;
 
     case VmOpcodes::PUSH_REGISTER_MEMORY_REG_OFFSET: {
@@ -684,11 +1258,12 @@ Shellcode CreateVirtualizedShellcode(
         return {};
 
       // Push the register offset to be changed to the virtualized code
-      shellcode.AddValue( vm_reg_dest );
+      AddVmRegister( &shellcode, vm_reg_dest );
 
       // Push the reg disp offset
-      shellcode.AddValue( GetOperandMemoryValue( operand1, relocated_disp,
-                                                 default_image_base ) );
+      AddVmValue( &shellcode,
+                  GetOperandMemoryValue( operand1, relocated_disp,
+                                         default_image_base ) );
     } break;
 
     default:
@@ -705,16 +1280,428 @@ Shellcode CreateVirtualizedShellcode(
   return shellcode;
 }
 
+Shellcode CreateVmExitShellcode( const uint32_t vm_opcode_encyption_key ) {
+  Shellcode shellcode;
+
+  AddVmOpcode( &shellcode, VmOpcodes::VM_EXIT, vm_opcode_encyption_key, false,
+               false );
+
+  return shellcode;
+}
+
+Shellcode CreateVmJmpShellcode( const uintptr_t jmp_target_rva,
+                                const uint32_t vm_opcode_encyption_key ) {
+  Shellcode shellcode;
+
+  // Neither the disp or imm is relocated
+  AddVmOpcode( &shellcode, VmOpcodes::JMP_IMM, vm_opcode_encyption_key, false,
+               false );
+
+  AddVmValue( &shellcode, jmp_target_rva );
+
+  return shellcode;
+}
+
+struct LoaderRegister {
+  uint32_t register_offset;
+
+  // The register number used in the ModR/M byte
+  uint8_t encoding;
+
+  // Volatile registers are clobbered by the interpreter call and are
+  // therefore always saved by the loader
+  bool is_volatile;
+};
+
+// The general purpose registers of the VmRegisters frame
+const LoaderRegister kLoaderRegisters[] = {
+#ifdef _WIN64
+  { offsetof( VmRegisters, r15 ), 15, false },
+  { offsetof( VmRegisters, r14 ), 14, false },
+  { offsetof( VmRegisters, r13 ), 13, false },
+  { offsetof( VmRegisters, r12 ), 12, false },
+  { offsetof( VmRegisters, r11 ), 11, true },
+  { offsetof( VmRegisters, r10 ), 10, true },
+  { offsetof( VmRegisters, r9 ), 9, true },
+  { offsetof( VmRegisters, r8 ), 8, true },
+#endif
+  { offsetof( VmRegisters, edi ), 7, false },
+  { offsetof( VmRegisters, esi ), 6, false },
+  { offsetof( VmRegisters, ebp ), 5, false },
+  { offsetof( VmRegisters, edx ), 2, true },
+  { offsetof( VmRegisters, ecx ), 1, true },
+  { offsetof( VmRegisters, ebx ), 3, false },
+  { offsetof( VmRegisters, eax ), 0, true },
+};
+
+#ifdef _WIN64
+// Only xmm0-xmm5 are volatile on x64, the interpreter preserves xmm6 and xmm7
+constexpr uint8_t kLoaderVolatileXmmRegisters = 6;
+#endif
+
+bool IsLoaderRegisterUsed( const LoaderRegister& loader_register,
+                           const VmRegisterUsage& register_usage ) {
+  const auto slot = loader_register.register_offset / sizeof( uintptr_t );
+
+  return loader_register.is_volatile ||
+         ( register_usage.register_slots & ( 1u << slot ) ) != 0;
+}
+
+// Adds either mov [esp + stack_offset], reg or mov reg, [esp + stack_offset]
+void AddRegisterStackMove( Shellcode* shellcode,
+                           const LoaderRegister& loader_register,
+                           const bool store ) {
+#ifdef _WIN64
+  // REX.W, with REX.R for r8-r15
+  shellcode->AddByte( loader_register.encoding >= 8 ? 0x4C : 0x48 );
+#endif
+
+  shellcode->AddByte( store ? 0x89 : 0x8B );
+
+  const uint8_t reg = ( loader_register.encoding & 7 ) << 3;
+
+  // The ModR/M rm field points to a SIB byte with esp as base
+  if ( loader_register.register_offset < 0x80 ) {
+    shellcode->AddBytes( { static_cast<uint8_t>( 0x44 | reg ), 0x24 } );
+    shellcode->AddValue<uint8_t>(
+        static_cast<uint8_t>( loader_register.register_offset ) );
+  } else {
+    shellcode->AddBytes( { static_cast<uint8_t>( 0x84 | reg ), 0x24 } );
+    shellcode->AddValue<uint32_t>( loader_register.register_offset );
+  }
+}
+
+#ifdef _WIN64
+// Adds either movdqu [rsp + offset], xmm or movdqu xmm, [rsp + offset]
+void AddXmmRegisterStackMove( Shellcode* shellcode,
+                              const uint8_t xmm_register,
+                              const bool store ) {
+  const uint32_t stack_offset =
+      offsetof( VmRegisters, xmm0 ) + xmm_register * sizeof( XMM );
+
+  shellcode->AddBytes( { 0xF3, 0x0F } );
+  shellcode->AddByte( store ? 0x7F : 0x6F );
+
+  const uint8_t reg = xmm_register << 3;
+
+  if ( stack_offset < 0x80 ) {
+    shellcode->AddBytes( { static_cast<uint8_t>( 0x44 | reg ), 0x24 } );
+    shellcode->AddValue<uint8_t>( static_cast<uint8_t>( stack_offset ) );
+  } else {
+    shellcode->AddBytes( { static_cast<uint8_t>( 0x84 | reg ), 0x24 } );
+    shellcode->AddValue<uint32_t>( stack_offset );
+  }
+}
+#endif
+
+// Adds lea esp, [esp + displacement], unlike add/sub it keeps the eflags
+void AddStackPointerAdjustment( Shellcode* shellcode,
+                                const int32_t displacement ) {
+#ifdef _WIN64
+  shellcode->AddBytes( { 0x48, 0x8D, 0xA4, 0x24 } );
+#else
+  shellcode->AddBytes( { 0x8D, 0xA4, 0x24 } );
+#endif
+  shellcode->AddValue<int32_t>( displacement );
+}
+
+// The size of the VmRegisters frame below the pushed eflags
+constexpr int32_t kVmRegistersFrameSizeWithoutFlags =
+    offsetof( VmRegisters, pushfd );
+
+/*
+  The loader always allocates the whole VmRegisters frame so the register
+  offsets of the interpreter stay the same, but only the slots that are used
+  are written. Equivalent to the pushes in the previous version:
+
+    pushfq
+    lea rsp, [rsp - 0xF8]
+    mov qword ptr [rsp + offsetof( VmRegisters, reg )], reg    <-- For each used register
+    movdqu xmmword ptr [rsp + offsetof( VmRegisters, xmm0 )], xmm0
+*/
+void AddLoaderRegisterSaves( Shellcode* shellcode,
+                             const VmRegisterUsage& register_usage ) {
+  // pushfd
+  shellcode->AddByte( 0x9C );
+  shellcode->AdjustStackSize( static_cast<int32_t>( sizeof( uintptr_t ) ) );
+
+  AddStackPointerAdjustment( shellcode, -kVmRegistersFrameSizeWithoutFlags );
+  shellcode->AdjustStackSize( kVmRegistersFrameSizeWithoutFlags );
+
+  for ( const auto& loader_register : kLoaderRegisters ) {
+    if ( IsLoaderRegisterUsed( loader_register, register_usage ) ) {
+      AddRegisterStackMove( shellcode, loader_register, true );
+    }
+  }
+
+#ifdef _WIN64
+  // Saved for every handler, nothing stops the compiler from using the sse
+  // registers anywhere in the interpreter
+  for ( uint8_t i = 0; i < kLoaderVolatileXmmRegisters; ++i ) {
+    AddXmmRegisterStackMove( shellcode, i, true );
+  }
+#endif
+}
+
+// Restores the same registers from the frame after the pop esp, the
+// interpreter may have moved the frame when pushing to the real stack
+void AddLoaderRegisterRestores( Shellcode* shellcode,
+                                const VmRegisterUsage& register_usage ) {
+#ifdef _WIN64
+  for ( uint8_t i = 0; i < kLoaderVolatileXmmRegisters; ++i ) {
+    AddXmmRegisterStackMove( shellcode, i, false );
+  }
+#endif
+
+  for ( const auto& loader_register : kLoaderRegisters ) {
+    if ( IsLoaderRegisterUsed( loader_register, register_usage ) ) {
+      AddRegisterStackMove( shellcode, loader_register, false );
+    }
+  }
+
+  AddStackPointerAdjustment( shellcode, kVmRegistersFrameSizeWithoutFlags );
+  shellcode->AdjustStackSize( -kVmRegistersFrameSizeWithoutFlags );
+
+  // popfd
+  shellcode->AddByte( 0x9D );
+  shellcode->AdjustStackSize( -static_cast<int32_t>( sizeof( uintptr_t ) ) );
+}
+
+std::wstring GetVmProfileCounterVariable( const uint32_t counter_index ) {
+  return VmProfileCounterVariable + std::to_wstring( counter_index );
+}
+
+// Adds an increment for each of the execution counters, the addresses of the
+// counters are filled in by the protector. Has to be added after the eflags
+// were saved because inc modifies them.
+void AddProfileCounterIncrements( Shellcode* shellcode,
+                                  const uint32_t profile_counter_count ) {
+  for ( uint32_t i = 0; i < profile_counter_count; ++i ) {
+#ifdef _WIN64
+    // lock inc qword ptr [rip + disp32]
+    shellcode->AddBytes( { 0xF0, 0x48, 0xFF, 0x05 } );
+#else
+    // lock inc dword ptr [addr]
+    shellcode->AddBytes( { 0xF0, 0xFF, 0x05 } );
+#endif
+    shellcode->AddVariable<uint32_t>( 0, GetVmProfileCounterVariable( i ) );
+  }
+}
+
+uint32_t GetVmHandlerVirtualPushCount( const VmOpcodes vm_opcode ) {
+  switch ( vm_opcode ) {
+    // The return address and the call target
+    case VmOpcodes::CALL_IMMEDIATE:
+    case VmOpcodes::CALL_MEMORY:
+    case VmOpcodes::CALL_MEMORY_RIP_RELATIVE:
+    case VmOpcodes::CALL_IMPORT:
+      return 2;
+    case VmOpcodes::PUSH_IMM:
+    case VmOpcodes::PUSH_REGISTER_MEMORY_REG_OFFSET:
+      return 1;
+    // The jump target that the epilog returns to, only if the jcc is taken
+    case VmOpcodes::JMP_IMM:
+    case VmOpcodes::JCC_IMM:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+VmRegisterUsage GetVmRegisterUsage( const cs_insn& instruction,
+                                    const VmOpcodes vm_opcode ) {
+  VmRegisterUsage register_usage;
+
+  const auto AddRegister = [&]( const x86_reg reg ) {
+    const auto register_offset = GetVmRegisterOffsetFromX86Reg( reg );
+
+    // Registers that the interpreter does not handle are not in the frame
+    if ( register_offset != -1 ) {
+      register_usage.register_slots |=
+          1u << ( register_offset / sizeof( uintptr_t ) );
+    }
+  };
+
+  const auto& x86 = instruction.detail->x86;
+
+  for ( int i = 0; i < x86.op_count; ++i ) {
+    const auto& operand = x86.operands[ i ];
+
+    if ( operand.type == x86_op_type::X86_OP_REG ) {
+      AddRegister( operand.reg );
+    } else if ( operand.type == x86_op_type::X86_OP_MEM ) {
+      AddRegister( operand.mem.base );
+      AddRegister( operand.mem.index );
+    }
+  }
+
+  // The implicit registers, e.g. esp for push
+  for ( int i = 0; i < instruction.detail->regs_read_count; ++i ) {
+    AddRegister( static_cast<x86_reg>( instruction.detail->regs_read[ i ] ) );
+  }
+
+  for ( int i = 0; i < instruction.detail->regs_write_count; ++i ) {
+    AddRegister( static_cast<x86_reg>( instruction.detail->regs_write[ i ] ) );
+  }
+
+  register_usage.virtual_push_count = GetVmHandlerVirtualPushCount( vm_opcode );
+
+  return register_usage;
+}
+
+VmRegisterUsage GetFullVmRegisterUsage() {
+  VmRegisterUsage register_usage;
+
+  for ( const auto& loader_register : kLoaderRegisters ) {
+    register_usage.register_slots |=
+        1u << ( loader_register.register_offset / sizeof( uintptr_t ) );
+  }
+
+  register_usage.virtual_push_count = VM_MAX_VIRTUAL_PUSHES;
+
+  return register_usage;
+}
+
+void MergeVmRegisterUsage( VmRegisterUsage* register_usage,
+                           const VmRegisterUsage& other ) {
+  register_usage->register_slots |= other.register_slots;
+
+  // Only the last handler of an entry pushes, the pushes do not add up
+  register_usage->virtual_push_count = ( std::max )(
+      register_usage->virtual_push_count, other.virtual_push_count );
+}
+
+// The stack that the loader allocates for the VmContext and the pushes above
+// the esp it pushes, the registers are moved down into it by the pushes
+uint32_t GetVmStackAllocationSize( const VmRegisterUsage& register_usage ) {
+#if ENABLE_COMPACT_VM_FRAME
+  // The pushed esp is the esp of the VmContext, the registers pointer is the
+  // only part of it inside of the allocation
+  auto push_count = register_usage.virtual_push_count;
+
+#ifdef _WIN64
+  // An even count keeps the stack 16 byte aligned for the interpreter call
+  // together with the pushed rsp and the home space
+  push_count = ( push_count + 1 ) & ~1u;
+#endif
+
+  return static_cast<uint32_t>( sizeof( VmContext ) - sizeof( uintptr_t ) +
+                                push_count * sizeof( uintptr_t ) );
+#else
+  return VM_INTERPRETER_STACK_ALLOCATION_SIZE_BYTES;
+#endif
+}
+
+// sub esp, stack allocation
+// push esp
+// add dword ptr [esp], stack allocation    <-- The esp of the VmContext
+// sub esp, VM_INTERPRETER_CALL_STACK_SIZE_BYTES
+void AddVmStackAllocation( Shellcode* shellcode,
+                           const VmRegisterUsage& register_usage ) {
+  const auto stack_allocation_size = GetVmStackAllocationSize( register_usage );
+
+#ifdef _WIN64
+  shellcode->AddBytes( { 0x48, 0x81, 0xEC } );
+#else
+  shellcode->AddBytes( { 0x81, 0xEC } );
+#endif
+  shellcode->AddValue<uint32_t>( stack_allocation_size );
+  shellcode->AdjustStackSize( static_cast<int32_t>( stack_allocation_size ) );
+
+  shellcode->AddByte( 0x54 );
+  shellcode->AdjustStackSize( static_cast<int32_t>( sizeof( uintptr_t ) ) );
+
+  shellcode->AddBytes( { 0x81, 0x04, 0x24 } );
+  shellcode->AddValue<uint32_t>( stack_allocation_size );
+
+  if ( VM_INTERPRETER_CALL_STACK_SIZE_BYTES != 0 ) {
+#ifdef _WIN64
+    shellcode->AddBytes( { 0x48, 0x81, 0xEC } );
+#else
+    shellcode->AddBytes( { 0x81, 0xEC } );
+#endif
+    shellcode->AddValue<uint32_t>( VM_INTERPRETER_CALL_STACK_SIZE_BYTES );
+    shellcode->AdjustStackSize( VM_INTERPRETER_CALL_STACK_SIZE_BYTES );
+  }
+}
+
+// add esp, VM_INTERPRETER_CALL_STACK_SIZE_BYTES
+// pop esp                                  <-- Frees the stack allocation
+void AddVmStackFree( Shellcode* shellcode,
+                     const VmRegisterUsage& register_usage ) {
+  if ( VM_INTERPRETER_CALL_STACK_SIZE_BYTES != 0 ) {
+#ifdef _WIN64
+    shellcode->AddBytes( { 0x48, 0x81, 0xC4 } );
+#else
+    shellcode->AddBytes( { 0x81, 0xC4 } );
+#endif
+    shellcode->AddValue<uint32_t>( VM_INTERPRETER_CALL_STACK_SIZE_BYTES );
+    shellcode->AdjustStackSize( -VM_INTERPRETER_CALL_STACK_SIZE_BYTES );
+  }
+
+  shellcode->AddByte( 0x5C );
+
+  // The interpreter moves the frame down by the amount it pushed
+  if ( register_usage.virtual_push_count > 0 ) {
+    shellcode->SetStackSize( Shellcode::kUnknownStackSize );
+  } else {
+    shellcode->AdjustStackSize( -static_cast<int32_t>(
+        GetVmStackAllocationSize( register_usage ) + sizeof( uintptr_t ) ) );
+  }
+}
+
+// The image base argument of the interpreter call, it is found relative to
+// the code so that the loaders need no relocation of their own. The protector
+// fills in the displacement, see kImageBaseDisplacementOrigin.
+void AddImageBaseArgument( Shellcode* shellcode ) {
+#ifdef _WIN64
+  // lea r9, [rip + disp32] (4th argument)
+  shellcode->AddBytes( { 0x4C, 0x8D, 0x0D } );
+  shellcode->AddVariable<uint32_t>( 0, ImageBaseVariable );
+#else
+  // push eax
+  // call 0
+  // pop eax
+  // mov eax, dword ptr [eax + disp32]    <-- The shared image base slot
+  // xchg dword ptr [esp], eax            <-- Restores eax as well
+  shellcode->AddBytes( { 0x50, 0xE8, 0x00, 0x00, 0x00, 0x00, 0x58, 0x8B,
+                         0x80 } );
+  shellcode->AddVariable<uint32_t>( 0, ImageBaseVariable );
+  shellcode->AddBytes( { 0x87, 0x04, 0x24 } );
+#endif
+}
+
+// The epilog bytes are shared with the vm entry thunks
+void AddLoaderEpilog( Shellcode* shellcode, const VmOpcodes vm_opcode ) {
+  const auto epilog = vm_entry_thunk::GetEpilog( vm_opcode );
+
+  shellcode->AddBytes( epilog.data, epilog.size );
+
+  // A virtualized call returns to here on the stack of the site
+  shellcode->SetStackSize( 0 );
+
+  for ( uint32_t i = 0; i < vm_entry_thunk::kReturnPaddingSize; ++i ) {
+    shellcode->AddByte( vm_entry_thunk::kNop );
+  }
+
+  // jmp
+  shellcode->AddByte( 0xE9 );
+  shellcode->AddVariable( 0, OrigAddrVariable );
+}
+
 Shellcode GetX86LoaderShellcodeForVirtualizedCode(
-    const cs_insn& instruction,
     const VmOpcodes vm_opcode,
-    const uintptr_t image_base ) {
+    const VmRegisterUsage& register_usage,
+    const uint32_t profile_counter_count ) {
   /*
       It is very important that we do not access data outside the actual stack, if an interrupt 
       occurs that the wrong moment, the data outside the stack can become corrupt.
 
       NOTE: The following code does not modify the E/RFLAGS as the previous iteration did
 
+      NOTE: The register pushes and pops are written as movs into a VmRegisters frame
+      by AddLoaderRegisterSaves/AddLoaderRegisterRestores, only the used ones are saved
+
       Before Interpreter
         pushfd 
         push eax
@@ -724,16 +1711,20 @@ Shellcode GetX86LoaderShellcodeForVirtualizedCode(
         push ebp
         push esi
         push edi
-        sub esp,C8
+        sub esp,C8              <-- GetVmStackAllocationSize, 0xC8 (200) without a compact frame
         push esp
         add dword ptr ss:[esp],C8
-        sub esp,100
-        push test executable out.3F0000
+        sub esp,100             <-- VM_INTERPRETER_CALL_STACK_SIZE_BYTES, left out when 0
+        push eax
+        call 0
+        pop eax
+        mov eax, dword ptr [eax + ImageBaseSlot]
+        xchg dword ptr [esp], eax
         push 58B1
         push esp
         push C993A
         call test executable out.4394D0
-        add esp,100
+        add esp,100             <-- Also left out when 0
         pop esp
         pop edi
         pop esi
@@ -764,39 +1755,13 @@ Shellcode GetX86LoaderShellcodeForVirtualizedCode(
 
   //shellcode.Reserve( 100 );
 
-  // pushfd
-  shellcode.AddByte( 0x9C );
-  // push eax
-  shellcode.AddByte( 0x50 );
-  // push ebx
-  shellcode.AddByte( 0x53 );
-  // push ecx
-  shellcode.AddByte( 0x51 );
-  // push edx
-  shellcode.AddByte( 0x52 );
-  // push ebp
-  shellcode.AddByte( 0x55 );
-  // push esi
-  shellcode.AddByte( 0x56 );
-  // push edi
-  shellcode.AddByte( 0x57 );
-
-  // sub esp, 200 (MAX_PUSHES * sizeof(uint32_t))
-  shellcode.AddBytes( { 0x81, 0xEC, 0xC8, 0x00, 0x00, 0x00 } );
-
-  // push esp
-  shellcode.AddByte( 0x54 );
+  AddLoaderRegisterSaves( &shellcode, register_usage );
 
-  // add dword ptr [esp], 0x200
-  shellcode.AddBytes( { 0x81, 0x04, 0x24, 0xC8, 0x00, 0x00, 0x00 } );
+  AddProfileCounterIncrements( &shellcode, profile_counter_count );
 
-  // sub rsp, 0x100
-  shellcode.AddBytes( { 0x81, 0xEC, 0x00, 0x01, 0x00, 0x00 } );
+  AddVmStackAllocation( &shellcode, register_usage );
 
-  // push the address to .vmvar section
-  // push
-  shellcode.AddByte( 0x68 );
-  shellcode.AddVariable<uint32_t>( image_base, ImageBaseVariable );
+  AddImageBaseArgument( &shellcode );
 
   // push current eip
   // push
@@ -814,93 +1779,28 @@ Shellcode GetX86LoaderShellcodeForVirtualizedCode(
   shellcode.AddByte( 0xE8 );
   shellcode.AddVariable( 0, VmCoreFunctionVariable );
 
-  // add rsp, 0x100
-  shellcode.AddBytes( { 0x81, 0xC4, 0x00, 0x01, 0x00, 0x00 } );
-
-  // pop esp
-  shellcode.AddByte( 0x5C );
-
-  // pop edi
-  shellcode.AddByte( 0x5F );
-  // pop esi
-  shellcode.AddByte( 0x5E );
-  // pop ebp
-  shellcode.AddByte( 0x5D );
-  // pop edx
-  shellcode.AddByte( 0x5A );
-  // pop ecx
-  shellcode.AddByte( 0x59 );
-  // pop ebx
-  shellcode.AddByte( 0x5B );
-  // pop eax
-  shellcode.AddByte( 0x58 );
-
-  // popfd
-  shellcode.AddByte( 0x9D );
-
-  if ( vm_opcode == VmOpcodes::CALL_IMMEDIATE ) {
-    // push eax
-    shellcode.AddByte( 0x50 );
+  AddVmStackFree( &shellcode, register_usage );
 
-    // call 0
-    shellcode.AddBytes( { 0xE8, 0x00, 0x00, 0x00, 0x00 } );
+  AddLoaderRegisterRestores( &shellcode, register_usage );
 
-    // pop eax
-    shellcode.AddByte( 0x58 );
-
-    // lea eax, ds:[eax+0xA]
-    shellcode.AddBytes( { 0x8D, 0x40, 0x0A } );
-
-    // mov dword ptr ss:[esp+0x8], eax
-    shellcode.AddBytes( { 0x89, 0x44, 0x24, 0x08 } );
-
-    // pop eax
-    shellcode.AddByte( 0x58 );
-
-    // ret
-    shellcode.AddByte( 0xC3 );
-  } else if ( vm_opcode == VmOpcodes::CALL_MEMORY ) {
-    // push eax
-    shellcode.AddByte( 0x50 );
-
-    // call 0
-    shellcode.AddBytes( { 0xE8, 0x00, 0x00, 0x00, 0x00 } );
-
-    // pop eax
-    shellcode.AddByte( 0x58 );
-
-    // lea eax, ds:[eax+0xA]
-    shellcode.AddBytes( { 0x8D, 0x40, 0x0A } );
-
-    // mov dword ptr ss:[esp+0x8], eax
-    shellcode.AddBytes( { 0x89, 0x44, 0x24, 0x08 } );
-
-    // pop eax
-    shellcode.AddByte( 0x58 );
-
-    // ret
-    shellcode.AddByte( 0xC3 );
-  } else if ( vm_opcode == VmOpcodes::JMP_IMM ) {
-    // ret
-    shellcode.AddByte( 0xC3 );
-  }
-
-  // jmp
-  shellcode.AddByte( 0xE9 );
-  shellcode.AddVariable( 0, OrigAddrVariable );
+  AddLoaderEpilog( &shellcode, vm_opcode );
 
   return shellcode;
 }
 
-Shellcode GetX64LoaderShellcodeForVirtualizedCode( const cs_insn& instruction,
-                                                   const VmOpcodes vm_opcode,
-                                                   const uint64_t image_base ) {
+Shellcode GetX64LoaderShellcodeForVirtualizedCode(
+    const VmOpcodes vm_opcode,
+    const VmRegisterUsage& register_usage,
+    const uint32_t profile_counter_count ) {
   /*
       It is very important that we do not access data outside the actual stack, if an interrupt 
       occurs that the wrong moment, the data outside the stack can become corrupt.
 
       NOTE: The following code does not modify the E/RFLAGS as the previous iteration did
 
+      NOTE: The register pushes and pops are written as movs into a VmRegisters frame
+      by AddLoaderRegisterSaves/AddLoaderRegisterRestores, only the used ones are saved
+
       Previous method to save XMM register (push xmm7):
         sub rsp, 0x10
         movdqu xmmword ptr ss:[rsp], xmm7
@@ -931,18 +1831,16 @@ Shellcode GetX64LoaderShellcodeForVirtualizedCode( const cs_insn& instruction,
         push r13
         push r14
         push r15
-        sub rsp,C8                                <-- Allocate extra stack incase we push values onto the stack
+        sub rsp,C8                                <-- GetVmStackAllocationSize, 0xC8 (200) without a compact frame
         push rsp
         add dword ptr ss:[rsp],C8
-                                                      Allocate stack space for the function call, 
-        sub rsp,100                               <-- the stack space depends on how many arguments 
-                                                      the call has in this case it has 4, so i dont know
-        mov r9, Imagebase                         <-- 4th Argument Image Base
+        sub rsp,100                               <-- VM_INTERPRETER_CALL_STACK_SIZE_BYTES, 0x20 of home space with a compact frame
+        lea r9, [rip + Imagebase]                 <-- 4th Argument Image Base
         mov r8d,7A0F                              <-- 3rd Argument Xor Key
         mov rdx,rsp                               <-- 2nd Argument RSP
         mov rcx,437686A                           <-- 1st Argument VmCodeAddress
         call VmInterpreter
-        add rsp,100                               <-- Free stack that was allocated before function call
+        add rsp,100                               <-- Free the stack that was allocated for the call
         pop rsp
         pop r15
         pop r14
@@ -1003,82 +1901,13 @@ Shellcode GetX64LoaderShellcodeForVirtualizedCode( const cs_insn& instruction,
 
   // shellcode.Reserve( 100 );
 
-  // pushfd
-  shellcode.AddByte( 0x9C );
-  // push rax
-  shellcode.AddByte( 0x50 );
-  // push rbx
-  shellcode.AddByte( 0x53 );
-  // push rcx
-  shellcode.AddByte( 0x51 );
-  // push rdx
-  shellcode.AddByte( 0x52 );
-  // push rbp
-  shellcode.AddByte( 0x55 );
-  // push rsi
-  shellcode.AddByte( 0x56 );
-  // push rdi
-  shellcode.AddByte( 0x57 );
-
-  // sub rsp, 0x80
-  shellcode.AddBytes( { 0x48, 0x81, 0xEC, 0x80, 0x00, 0x00, 0x00 } );
-
-  // movdqu xmmword ptr ss:[rsp+0x70], xmm7
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x7F, 0x7C, 0x24, 0x70 } );
-
-  // movdqu xmmword ptr ss:[rsp+0x60], xmm6
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x7F, 0x74, 0x24, 0x60 } );
-
-  // movdqu xmmword ptr ss:[rsp+0x50], xmm5
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x7F, 0x6C, 0x24, 0x50 } );
-
-  // movdqu xmmword ptr ss:[rsp+0x40], xmm4
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x7F, 0x64, 0x24, 0x40 } );
-
-  // movdqu xmmword ptr ss:[rsp+0x30], xmm3
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x7F, 0x5C, 0x24, 0x30 } );
-
-  // movdqu xmmword ptr ss:[rsp+0x20], xmm2
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x7F, 0x54, 0x24, 0x20 } );
-
-  // movdqu xmmword ptr ss:[rsp+0x10], xmm1
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x7F, 0x4C, 0x24, 0x10 } );
-
-  // movdqu xmmword ptr ss:[rsp], xmm0
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x7F, 0x04, 0x24 } );
-
-  // push r8
-  shellcode.AddBytes( { 0x41, 0x50 } );
-  // push r9
-  shellcode.AddBytes( { 0x41, 0x51 } );
-  // push r10
-  shellcode.AddBytes( { 0x41, 0x52 } );
-  // push r11
-  shellcode.AddBytes( { 0x41, 0x53 } );
-  // push r12
-  shellcode.AddBytes( { 0x41, 0x54 } );
-  // push r13
-  shellcode.AddBytes( { 0x41, 0x55 } );
-  // push r14
-  shellcode.AddBytes( { 0x41, 0x56 } );
-  // push r15
-  shellcode.AddBytes( { 0x41, 0x57 } );
-
-  // sub rsp, 200 (MAX_PUSHES * sizeof(uint32_t))
-  shellcode.AddBytes( { 0x48, 0x81, 0xEC, 0xC8, 0x00, 0x00, 0x00 } );
-
-  // push rsp
-  shellcode.AddByte( 0x54 );
+  AddLoaderRegisterSaves( &shellcode, register_usage );
 
-  // add dword ptr [rsp], 0xC8
-  shellcode.AddBytes( { 0x81, 0x04, 0x24, 0xC8, 0x00, 0x00, 0x00 } );
+  AddProfileCounterIncrements( &shellcode, profile_counter_count );
 
-  // sub rsp, 0x100
-  shellcode.AddBytes( { 0x48, 0x81, 0xEC, 0x00, 0x01, 0x00, 0x00 } );
+  AddVmStackAllocation( &shellcode, register_usage );
 
-  // mov r9, Imagebase
-  shellcode.AddBytes( { 0x49, 0xB9 } );
-  shellcode.AddVariable<uint64_t>( image_base, ImageBaseVariable );
+  AddImageBaseArgument( &shellcode );
 
   // mov r8, 4 byte variabe (3rd argument)
   shellcode.AddBytes( { 0x41, 0xB8 } );
@@ -1095,144 +1924,137 @@ Shellcode GetX64LoaderShellcodeForVirtualizedCode( const cs_insn& instruction,
   shellcode.AddByte( 0xE8 );
   shellcode.AddVariable( 0, VmCoreFunctionVariable );
 
-  // add rsp, 0x100
-  shellcode.AddBytes( { 0x48, 0x81, 0xC4, 0x00, 0x01, 0x00, 0x00 } );
-
-  // pop esp
-  shellcode.AddByte( 0x5C );
-
-  // pop r15
-  shellcode.AddBytes( { 0x41, 0x5F } );
-  // pop r14
-  shellcode.AddBytes( { 0x41, 0x5E } );
-  // pop r13
-  shellcode.AddBytes( { 0x41, 0x5D } );
-  // pop r12
-  shellcode.AddBytes( { 0x41, 0x5C } );
-  // pop r11
-  shellcode.AddBytes( { 0x41, 0x5B } );
-  // pop r10
-  shellcode.AddBytes( { 0x41, 0x5A } );
-  // pop r9
-  shellcode.AddBytes( { 0x41, 0x59 } );
-  // pop r8
-  shellcode.AddBytes( { 0x41, 0x58 } );
-
-  // movdqu xmm0, xmmword ptr ss:[rsp]
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x6F, 0x04, 0x24 } );
-
-  // movdqu xmm1, xmmword ptr ss:[rsp+0x10]
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x6F, 0x4C, 0x24, 0x10 } );
-
-  // movdqu xmm2, xmmword ptr ss:[rsp+0x20]
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x6F, 0x54, 0x24, 0x20 } );
-
-  // movdqu xmm3, xmmword ptr ss:[rsp+0x30]
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x6F, 0x5C, 0x24, 0x30 } );
-
-  // movdqu xmm4, xmmword ptr ss:[rsp+0x40]
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x6F, 0x64, 0x24, 0x40 } );
-
-  // movdqu xmm5, xmmword ptr ss:[rsp+0x50]
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x6F, 0x6C, 0x24, 0x50 } );
-
-  // movdqu xmm6, xmmword ptr ss:[rsp+0x60]
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x6F, 0x74, 0x24, 0x60 } );
-
-  // movdqu xmm7, xmmword ptr ss:[rsp+0x70]
-  shellcode.AddBytes( { 0xF3, 0x0F, 0x6F, 0x7C, 0x24, 0x70 } );
-
-  // add rsp, 0x80
-  shellcode.AddBytes( { 0x48, 0x81, 0xC4, 0x80, 0x00, 0x00, 0x00 } );
-
-  // pop edi
-  shellcode.AddByte( 0x5F );
-  // pop esi
-  shellcode.AddByte( 0x5E );
-  // pop ebp
-  shellcode.AddByte( 0x5D );
-  // pop edx
-  shellcode.AddByte( 0x5A );
-  // pop ecx
-  shellcode.AddByte( 0x59 );
-  // pop ebx
-  shellcode.AddByte( 0x5B );
-  // pop eax
-  shellcode.AddByte( 0x58 );
-  // popfd
-  shellcode.AddByte( 0x9D );
-
-  if ( vm_opcode == VmOpcodes::CALL_IMMEDIATE ) {
-    // push rax
-    shellcode.AddByte( 0x50 );
+  AddVmStackFree( &shellcode, register_usage );
 
-    // lea rax, [rip + 0x7]
-    shellcode.AddBytes( { 0x48, 0x8D, 0x05, 0x07, 0x00, 0x00, 0x00 } );
+  AddLoaderRegisterRestores( &shellcode, register_usage );
 
-    // mov qword ptr ss:[rsp+0x10], rax
-    shellcode.AddBytes( { 0x48, 0x89, 0x44, 0x24, 0x10 } );
+  AddLoaderEpilog( &shellcode, vm_opcode );
 
-    // pop rax
-    shellcode.AddByte( 0x58 );
+  return shellcode;
+}
 
-    // ret
-    shellcode.AddByte( 0xC3 );
+Shellcode GetLoaderShellcodeForVirtualizedCode(
+    const VmOpcodes vm_opcode,
+    const VmRegisterUsage& register_usage,
+    const uint32_t profile_counter_count ) {
+#if ENABLE_PARTIAL_REGISTER_FRAME
+  const auto& loader_register_usage = register_usage;
+#else
+  const auto loader_register_usage = GetFullVmRegisterUsage();
+#endif
 
-  } else if ( vm_opcode == VmOpcodes::CALL_MEMORY ) {
-    // push rax
-    shellcode.AddByte( 0x50 );
+#ifdef _WIN64
+  return GetX64LoaderShellcodeForVirtualizedCode(
+      vm_opcode, loader_register_usage, profile_counter_count );
+#else
+  return GetX86LoaderShellcodeForVirtualizedCode(
+      vm_opcode, loader_register_usage, profile_counter_count );
+#endif
+}
 
-    // lea rax, [rip + 0x7]
-    shellcode.AddBytes( { 0x48, 0x8D, 0x05, 0x07, 0x00, 0x00, 0x00 } );
+#if ENABLE_SHARED_VM_ENTRY
+/*
+  The same as the loader without the epilog, the return address that the thunk
+  pushed is the top slot of the VmRegisters frame:
+
+    pushfd
+    lea esp, [esp - offsetof( VmRegisters, pushfd )]
+    mov [esp + offsetof( VmRegisters, reg )], reg     <-- For each used register
+    mov eax, [esp + offsetof( VmRegisters, return_address )]
+    mov ecx, [eax]                                    <-- VmCodeAddr
+    mov edx, [eax + 4]                                <-- VmOpcodeEncryptionKey
+    add [esp + offsetof( VmRegisters, return_address )], 8
+    ...                                               <-- The interpreter call
+    mov reg, [esp + offsetof( VmRegisters, reg )]
+    lea esp, [esp + offsetof( VmRegisters, pushfd )]
+    popfd
+    ret                                               <-- To the thunk epilog
+*/
+Shellcode GetVmEntryTrampolineShellcode(
+    const VmRegisterUsage& register_usage ) {
+#if ENABLE_PARTIAL_REGISTER_FRAME
+  const auto& loader_register_usage = register_usage;
+#else
+  const auto loader_register_usage = GetFullVmRegisterUsage();
+#endif
 
-    // mov qword ptr ss:[rsp+0x10], rax
-    shellcode.AddBytes( { 0x48, 0x89, 0x44, 0x24, 0x10 } );
+  constexpr uint32_t kReturnAddressOffset =
+      offsetof( VmRegisters, return_address );
 
-    // pop rax
-    shellcode.AddByte( 0x58 );
+  Shellcode shellcode;
 
-    // ret
-    shellcode.AddByte( 0xC3 );
-  } else if ( vm_opcode == VmOpcodes::CALL_MEMORY_RIP_RELATIVE ) {
-    // push rax
-    shellcode.AddByte( 0x50 );
+  AddLoaderRegisterSaves( &shellcode, loader_register_usage );
 
-    // lea rax, [rip + 0x7]
-    shellcode.AddBytes( { 0x48, 0x8D, 0x05, 0x07, 0x00, 0x00, 0x00 } );
+#ifdef _WIN64
+  // mov rax, qword ptr [rsp + return_address]
+  shellcode.AddBytes( { 0x48, 0x8B, 0x84, 0x24 } );
+  shellcode.AddValue<uint32_t>( kReturnAddressOffset );
 
-    // mov qword ptr ss:[rsp+0x10], rax
-    shellcode.AddBytes( { 0x48, 0x89, 0x44, 0x24, 0x10 } );
+  // mov ecx, dword ptr [rax] (1st argument)
+  shellcode.AddBytes( { 0x8B, 0x08 } );
 
-    // pop rax
-    shellcode.AddByte( 0x58 );
+  // mov r8d, dword ptr [rax + 4] (3rd argument)
+  shellcode.AddBytes( { 0x44, 0x8B, 0x40, 0x04 } );
 
-    // ret
-    shellcode.AddByte( 0xC3 );
-  } else if ( vm_opcode == VmOpcodes::JMP_IMM ) {
-    // The interpreter simply pushes the jump destination
-    // to the stack and we simply ret to it
+  // add qword ptr [rsp + return_address], 8
+  shellcode.AddBytes( { 0x48, 0x83, 0x84, 0x24 } );
+  shellcode.AddValue<uint32_t>( kReturnAddressOffset );
+  shellcode.AddByte( 0x08 );
 
-    // ret
-    shellcode.AddByte( 0xC3 );
-  }
+  AddVmStackAllocation( &shellcode, loader_register_usage );
 
-  // jmp
-  shellcode.AddByte( 0xE9 );
-  shellcode.AddVariable( 0, OrigAddrVariable );
+  AddImageBaseArgument( &shellcode );
 
-  return shellcode;
-}
+  // mov rdx, rsp (2nd argument)
+  shellcode.AddBytes( { 0x48, 0x8B, 0xD4 } );
 
-Shellcode GetLoaderShellcodeForVirtualizedCode( const cs_insn& instruction,
-                                                const VmOpcodes vm_opcode,
-                                                const uintptr_t image_base ) {
-#ifdef _WIN64
-  return GetX64LoaderShellcodeForVirtualizedCode( instruction, vm_opcode,
-                                                  image_base );
+  // call
+  shellcode.AddByte( 0xE8 );
+  shellcode.AddVariable( 0, VmCoreFunctionVariable );
 #else
-  return GetX86LoaderShellcodeForVirtualizedCode( instruction, vm_opcode,
-                                                  image_base );
+  // mov eax, dword ptr [esp + return_address]
+  shellcode.AddBytes( { 0x8B, 0x84, 0x24 } );
+  shellcode.AddValue<uint32_t>( kReturnAddressOffset );
+
+  // mov ecx, dword ptr [eax]
+  shellcode.AddBytes( { 0x8B, 0x08 } );
+
+  // mov edx, dword ptr [eax + 4]
+  shellcode.AddBytes( { 0x8B, 0x50, 0x04 } );
+
+  // add dword ptr [esp + return_address], 8
+  shellcode.AddBytes( { 0x83, 0x84, 0x24 } );
+  shellcode.AddValue<uint32_t>( kReturnAddressOffset );
+  shellcode.AddByte( 0x08 );
+
+  AddVmStackAllocation( &shellcode, loader_register_usage );
+
+  AddImageBaseArgument( &shellcode );
+
+  // push edx (the key)
+  shellcode.AddByte( 0x52 );
+
+  // push esp
+  shellcode.AddByte( 0x54 );
+
+  // push ecx (the virtualized code)
+  shellcode.AddByte( 0x51 );
+
+  // call
+  shellcode.AddByte( 0xE8 );
+  shellcode.AddVariable( 0, VmCoreFunctionVariable );
+
 #endif
+
+  AddVmStackFree( &shellcode, loader_register_usage );
+
+  AddLoaderRegisterRestores( &shellcode, loader_register_usage );
+
+  // ret
+  shellcode.AddByte( 0xC3 );
+
+  return shellcode;
 }
+#endif
 
 }  // namespace virtualizer
\ No newline at end of file
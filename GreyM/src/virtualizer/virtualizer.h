@@ -11,23 +11,113 @@ const std::wstring VmCodeAddrVariable = TEXT( "VmCodeAddr" );
 
 const std::wstring ImageBaseVariable = TEXT( "ImageBase" );
 
+// The image base variable is a displacement from the offset of the variable
+// plus this, on x64 that is the end of the lea and on x86 the eip that the
+// call before it pushed
+#ifdef _WIN64
+constexpr int32_t kImageBaseDisplacementOrigin = sizeof( uint32_t );
+#else
+constexpr int32_t kImageBaseDisplacementOrigin = -3;
+#endif
+
 const std::wstring OrigAddrVariable = TEXT( "OrigAddr" );
 
 const std::wstring VmCoreFunctionVariable = TEXT( "VmCoreFunction" );
 
+const std::wstring VmEntryTrampolineVariable = TEXT( "VmEntryTrampoline" );
+
+// The loader of an instrumented build has one of these per counter,
+// suffixed by the index of the counter
+const std::wstring VmProfileCounterVariable = TEXT( "VmProfileCounter" );
+
 namespace virtualizer {
 
-bool IsVirtualizeable( const cs_insn& instruction, const VmOpcodes vm_opcode );
+// Describes which parts of the VmRegisters frame a loader has to fill
+struct VmRegisterUsage {
+  // One bit for each uintptr_t sized slot in VmRegisters
+  uint32_t register_slots = 0;
+
+  // The most values that one entry pushes to the real stack, a compact vm
+  // frame only reserves the room for these
+  uint32_t virtual_push_count = 0;
+};
+
+bool IsVirtualizeable( const VmOpcodes vm_opcode );
 VmOpcodes GetVmOpcode( const cs_insn& instruction );
 
+// False if GetVmOpcode returns NO_OPCODE for any instruction with that id, it
+// does not need the capstone detail
+bool MayHaveVmOpcode( const unsigned int instruction_id );
+
+VmHandlerIndex GetVmHandlerIndex( const VmOpcodes vm_opcode );
+
+// The amount of values that the handler pushes to the real stack on vm exit
+uint32_t GetVmHandlerVirtualPushCount( const VmOpcodes vm_opcode );
+
+// The handler that the virtualized code uses for the opcode, the mov handlers
+// that only have sized variants are given the one for the operand size and
+// the relocation, NO_OPCODE if there is none. The others are returned as
+// they are.
+VmOpcodes GetSizedVmOpcode( const VmOpcodes vm_opcode,
+                            const uint8_t operand_size,
+                            const bool relocated_disp );
+
+// The value written unencrypted into the virtualized code, either the
+// VmOpcodes or the VmHandlerIndex value depending on ENABLE_DENSE_VM_DISPATCH
+uint32_t GetVmDispatchValue( const VmOpcodes vm_opcode );
+
+// Returns true if a block of virtualized instructions has to end after it
+bool IsVmBlockTerminator( const VmOpcodes vm_opcode );
+
+// The rva of the pointer that a CALL_MEMORY or CALL_MEMORY_RIP_RELATIVE calls,
+// 0 if it is not known
+uintptr_t GetCallMemorySlotRva( const cs_insn& instruction,
+                                const bool relocated,
+                                const uintptr_t default_image_base );
+
+
+// Returns true if the handler reads or writes the eflags saved by the loader
+bool DoesVmHandlerUseEflags( const VmOpcodes vm_opcode );
+
 Shellcode CreateVirtualizedShellcode(
     const cs_insn& instruction,
     const VmOpcodes vm_opcode,
     const uint32_t vm_opcode_encyption_key,
     const std::vector<uintptr_t>& relocations_within_instruction, const uintptr_t default_image_base );
 
-Shellcode GetLoaderShellcodeForVirtualizedCode( const cs_insn& instruction,
-                                                const VmOpcodes vm_opcode,
-                                                const uintptr_t image_base );
+// The registers the virtualized instruction and its handler reads or writes
+VmRegisterUsage GetVmRegisterUsage( const cs_insn& instruction,
+                                    const VmOpcodes vm_opcode );
+
+// Every register of the frame, as saved by the loader before
+VmRegisterUsage GetFullVmRegisterUsage();
+
+void MergeVmRegisterUsage( VmRegisterUsage* register_usage,
+                           const VmRegisterUsage& other );
+
+// The terminator that makes the interpreter leave a sequence of instructions
+Shellcode CreateVmExitShellcode( const uint32_t vm_opcode_encyption_key );
+
+// A JMP_IMM, used to leave a block that contains a conditional jump at the
+// same place where the not taken path would continue
+Shellcode CreateVmJmpShellcode( const uintptr_t jmp_target_rva,
+                                const uint32_t vm_opcode_encyption_key );
+
+std::wstring GetVmProfileCounterVariable( const uint32_t counter_index );
+
+// The vm_opcode decides the loader epilog, for a block it is the last opcode.
+// An instrumented loader increments profile_counter_count counters on entry.
+Shellcode GetLoaderShellcodeForVirtualizedCode(
+    const VmOpcodes vm_opcode,
+    const VmRegisterUsage& register_usage,
+    const uint32_t profile_counter_count );
+
+#if ENABLE_SHARED_VM_ENTRY
+// The per site part of a shared vm entry is in vm_entry_thunk.h
+// Calls the interpreter with the virtualized code of the thunk that called it,
+// shared by all of the sites with the same register usage
+Shellcode GetVmEntryTrampolineShellcode(
+    const VmRegisterUsage& register_usage );
+#endif
 
 }  // namespace virtualizer
\ No newline at end of file
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "../../Interpreter/src/main.h"
+#include "../utils/shellcode.h"
+
+#include <array>
+
+/*
+  The per site thunk of a shared vm entry is always made of the same parts:
+
+    pushfd                          <-- Only when instrumented
+    lock inc [counter]              <-- For each counter
+    popfd
+    call VmEntryTrampoline
+    dd VmCodeAddr
+    dd VmOpcodeEncryptionKey
+    nop                             <-- Only with unwind data
+    ...                             <-- The epilog of the exit opcode
+    nop                             <-- Only with unwind data
+    jmp OrigAddr
+
+  The offsets of everything that gets patched are known at compile time, the
+  protector copies the parts straight into the vm loader section and stores
+  the values at those offsets instead of building a Shellcode for each site.
+*/
+namespace vm_entry_thunk {
+
+template <size_t N>
+using ShellcodeTemplate = std::array<uint8_t, N>;
+
+constexpr uint8_t kPushfd = 0x9C;
+constexpr uint8_t kPopfd = 0x9D;
+
+#ifdef _WIN64
+// lock inc qword ptr [rip + disp32]
+constexpr ShellcodeTemplate<8> kProfileCounterIncrement = {
+    0xF0, 0x48, 0xFF, 0x05, 0x00, 0x00, 0x00, 0x00 };
+#else
+// lock inc dword ptr [addr]
+constexpr ShellcodeTemplate<7> kProfileCounterIncrement = {
+    0xF0, 0xFF, 0x05, 0x00, 0x00, 0x00, 0x00 };
+#endif
+constexpr uint32_t kProfileCounterValueOffset =
+    kProfileCounterIncrement.size() - sizeof( uint32_t );
+
+// call VmEntryTrampoline, dd VmCodeAddr, dd VmOpcodeEncryptionKey
+constexpr ShellcodeTemplate<13> kEntry = {
+    0xE8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+constexpr uint32_t kEntryTrampolineOffset = 1;
+constexpr uint32_t kEntryVmCodeAddrOffset = 5;
+constexpr uint32_t kEntryVmOpcodeEncryptionKeyOffset = 9;
+
+#ifdef _WIN64
+// push rax
+// lea rax, [rip + 0x7]
+// mov qword ptr ss:[rsp+0x10], rax
+// pop rax
+// ret
+constexpr ShellcodeTemplate<15> kCallEpilog = {
+    0x50, 0x48, 0x8D, 0x05, 0x07, 0x00, 0x00, 0x00,
+    0x48, 0x89, 0x44, 0x24, 0x10, 0x58, 0xC3 };
+#else
+// push eax
+// call 0
+// pop eax
+// lea eax, ds:[eax+0xA]
+// mov dword ptr ss:[esp+0x8], eax
+// pop eax
+// ret
+constexpr ShellcodeTemplate<16> kCallEpilog = {
+    0x50, 0xE8, 0x00, 0x00, 0x00, 0x00, 0x58, 0x8D,
+    0x40, 0x0A, 0x89, 0x44, 0x24, 0x08, 0x58, 0xC3 };
+#endif
+
+// The interpreter pushes the jump destination to the stack, ret to it
+constexpr ShellcodeTemplate<1> kJmpEpilog = { 0xC3 };
+
+// jmp OrigAddr
+constexpr ShellcodeTemplate<5> kJmpBack = { 0xE9, 0x00, 0x00, 0x00, 0x00 };
+constexpr uint32_t kJmpBackOrigAddrOffset = 1;
+
+// The return addresses into a thunk point at a nop in front of the epilog
+// and the jmp back, the unwinder takes a ret or a jmp at the return address
+// for the end of an epilog
+#if ENABLE_VM_UNWIND_DATA && _WIN64
+constexpr uint32_t kReturnPaddingSize = 1;
+#else
+constexpr uint32_t kReturnPaddingSize = 0;
+#endif
+constexpr uint8_t kNop = 0x90;
+
+struct EpilogTemplate {
+  const uint8_t* data;
+  uint32_t size;
+};
+
+// Leaves the loader depending on the exit opcode. A call continues at the
+// jmp back to the original code once the called function returns.
+constexpr EpilogTemplate GetEpilog( const VmOpcodes vm_opcode ) {
+  switch ( vm_opcode ) {
+    case VmOpcodes::CALL_IMMEDIATE:
+    case VmOpcodes::CALL_MEMORY:
+    case VmOpcodes::CALL_IMPORT:
+#ifdef _WIN64
+    case VmOpcodes::CALL_MEMORY_RIP_RELATIVE:
+#endif
+      return { kCallEpilog.data(), kCallEpilog.size() };
+    case VmOpcodes::JMP_IMM:
+      return { kJmpEpilog.data(), kJmpEpilog.size() };
+    default:
+      return { nullptr, 0 };
+  }
+}
+
+// Where the parts of a thunk are, it only depends on the exit opcode and the
+// amount of counters
+struct Layout {
+  uint32_t entry_offset;
+  uint32_t epilog_offset;
+  uint32_t jmp_back_offset;
+  uint32_t size;
+
+  constexpr uint32_t GetProfileCounterValueOffset(
+      const uint32_t counter_index ) const {
+    return 1 + counter_index * kProfileCounterIncrement.size() +
+           kProfileCounterValueOffset;
+  }
+
+  constexpr uint32_t GetTrampolineOffset() const {
+    return entry_offset + kEntryTrampolineOffset;
+  }
+
+  constexpr uint32_t GetVmCodeAddrOffset() const {
+    return entry_offset + kEntryVmCodeAddrOffset;
+  }
+
+  constexpr uint32_t GetVmOpcodeEncryptionKeyOffset() const {
+    return entry_offset + kEntryVmOpcodeEncryptionKeyOffset;
+  }
+
+  constexpr uint32_t GetOrigAddrOffset() const {
+    return jmp_back_offset + kJmpBackOrigAddrOffset;
+  }
+};
+
+constexpr Layout GetLayout( const VmOpcodes exit_vm_opcode,
+                            const uint32_t profile_counter_count ) {
+  Layout layout = {};
+
+  // The counters are wrapped with pushfd and popfd, inc modifies the eflags
+  layout.entry_offset =
+      profile_counter_count > 0
+          ? 2 + profile_counter_count * kProfileCounterIncrement.size()
+          : 0;
+
+  layout.epilog_offset =
+      layout.entry_offset + kEntry.size() + kReturnPaddingSize;
+  layout.jmp_back_offset = layout.epilog_offset +
+                           GetEpilog( exit_vm_opcode ).size +
+                           kReturnPaddingSize;
+  layout.size = layout.jmp_back_offset + kJmpBack.size();
+
+  return layout;
+}
+
+inline void StoreValue( uint8_t* thunk,
+                        const uint32_t offset,
+                        const uint32_t value ) {
+  memcpy( thunk + offset, &value, sizeof( value ) );
+}
+
+// Copies the parts of the thunk to `thunk`, it has to have layout.size bytes.
+// Only the key is filled in, the rest of the values are stored by the caller.
+inline void Write( uint8_t* thunk,
+                   const Layout& layout,
+                   const VmOpcodes exit_vm_opcode,
+                   const uint32_t profile_counter_count,
+                   const uint32_t vm_opcode_encryption_key ) {
+  if ( profile_counter_count > 0 ) {
+    thunk[ 0 ] = kPushfd;
+
+    for ( uint32_t i = 0; i < profile_counter_count; ++i ) {
+      memcpy( thunk + 1 + i * kProfileCounterIncrement.size(),
+              kProfileCounterIncrement.data(),
+              kProfileCounterIncrement.size() );
+    }
+
+    thunk[ layout.entry_offset - 1 ] = kPopfd;
+  }
+
+  memcpy( thunk + layout.entry_offset, kEntry.data(), kEntry.size() );
+
+  StoreValue( thunk, layout.GetVmOpcodeEncryptionKeyOffset(),
+              vm_opcode_encryption_key );
+
+  memset( thunk + layout.epilog_offset - kReturnPaddingSize, kNop,
+          kReturnPaddingSize );
+
+  const auto epilog = GetEpilog( exit_vm_opcode );
+
+  if ( epilog.size > 0 ) {
+    memcpy( thunk + layout.epilog_offset, epilog.data, epilog.size );
+  }
+
+  memset( thunk + layout.jmp_back_offset - kReturnPaddingSize, kNop,
+          kReturnPaddingSize );
+
+  memcpy( thunk + layout.jmp_back_offset, kJmpBack.data(), kJmpBack.size() );
+}
+
+// At most the pushfd, the counters, the entry and the jmp back
+struct StackRanges {
+  std::array<StackRange, 4> ranges;
+  uint32_t count;
+};
+
+// The stack pointer is the one of the site everywhere but after the pushfd,
+// up to and including the popfd. The epilog runs on the values that the
+// interpreter pushed, it is left out.
+constexpr StackRanges GetStackRanges( const Layout& layout ) {
+  StackRanges stack_ranges = {};
+
+  if ( layout.entry_offset > 0 ) {
+    stack_ranges.ranges[ stack_ranges.count++ ] = { 0, 1, 0 };
+    stack_ranges.ranges[ stack_ranges.count++ ] = {
+        1, layout.entry_offset, sizeof( uintptr_t ) };
+  }
+
+  stack_ranges.ranges[ stack_ranges.count++ ] = {
+      layout.entry_offset, layout.epilog_offset, 0 };
+  stack_ranges.ranges[ stack_ranges.count++ ] = {
+      layout.jmp_back_offset - kReturnPaddingSize, layout.size, 0 };
+
+  return stack_ranges;
+}
+
+// The popfd at entry_offset - 1 still runs 8 bytes below the site
+constexpr bool AreStackRangesAroundCounters( const Layout& layout ) {
+  const auto stack_ranges = GetStackRanges( layout );
+
+  const auto& counters = stack_ranges.ranges[ 1 ];
+  const auto& entry = stack_ranges.ranges[ 2 ];
+
+  return stack_ranges.count == 4 && counters.begin_offset == 1 &&
+         counters.end_offset == layout.entry_offset &&
+         counters.stack_size == sizeof( uintptr_t ) &&
+         entry.begin_offset == layout.entry_offset &&
+         entry.end_offset == layout.epilog_offset && entry.stack_size == 0;
+}
+
+static_assert( AreStackRangesAroundCounters(
+                   GetLayout( VmOpcodes::JMP_IMM, 1 ) ) &&
+                   AreStackRangesAroundCounters(
+                       GetLayout( VmOpcodes::CALL_IMMEDIATE, 3 ) ),
+               "The stack ranges do not match the counters of the thunk" );
+
+static_assert( GetStackRanges( GetLayout( VmOpcodes::JMP_IMM, 0 ) ).count ==
+                   2,
+               "A thunk without counters has no pushfd" );
+
+}  // namespace vm_entry_thunk
@@ -23,6 +23,7 @@
 #include <Windows.h>
 #include <cstdint>
 #include <stdio.h>
+#include <intrin.h>
 
 #include "main.h"
 
@@ -40,6 +41,24 @@ using CreateFileMappingA_t = decltype( &CreateFileMappingA );
 using MapViewOfFile_t = decltype( &MapViewOfFile );
 using UnmapViewOfFile_t = decltype( &UnmapViewOfFile );
 using SetFilePointer_t = decltype( &SetFilePointer );
+using WriteFile_t = decltype( &WriteFile );
+using CreateThread_t = decltype( &CreateThread );
+using TerminateProcess_t = decltype( &TerminateProcess );
+using GetProcessTimes_t = decltype( &GetProcessTimes );
+using GetSystemTimePreciseAsFileTime_t =
+    decltype( &GetSystemTimePreciseAsFileTime );
+using Sleep_t = decltype( &Sleep );
+using FlushInstructionCache_t = decltype( &FlushInstructionCache );
+using GetModuleHandleExW_t = decltype( &GetModuleHandleExW );
+using NtQueryInformationProcess_t = LONG( NTAPI* )( HANDLE process,
+                                                    ULONG information_class,
+                                                    PVOID information,
+                                                    ULONG information_length,
+                                                    PULONG return_length );
+using NtSetInformationThread_t = LONG( NTAPI* )( HANDLE thread,
+                                                 ULONG information_class,
+                                                 PVOID information,
+                                                 ULONG information_length );
 
 struct Modules {
   uintptr_t ntdll;
@@ -59,8 +78,21 @@ struct ApiAddresses {
   MapViewOfFile_t MapViewOfFile;
   UnmapViewOfFile_t UnmapViewOfFile;
   SetFilePointer_t SetFilePointer;
+  WriteFile_t WriteFile;
+  CreateThread_t CreateThread;
+  TerminateProcess_t TerminateProcess;
+  GetProcessTimes_t GetProcessTimes;
+  GetSystemTimePreciseAsFileTime_t GetSystemTimePreciseAsFileTime;
+  Sleep_t Sleep;
+  FlushInstructionCache_t FlushInstructionCache;
+  GetModuleHandleExW_t GetModuleHandleExW;
+  NtQueryInformationProcess_t NtQueryInformationProcess;
+  NtSetInformationThread_t NtSetInformationThread;
 };
 
+static_assert( sizeof( ApiAddresses ) <= VM_API_CACHE_SIZE * sizeof( uintptr_t ),
+               "The api cache in VmCodeSectionData is too small" );
+
 IMAGE_NT_HEADERS* GetNtHeaders( const PVOID base ) {
   auto dos_header = reinterpret_cast<IMAGE_DOS_HEADER*>( base );
   auto nt_header = reinterpret_cast<IMAGE_NT_HEADERS*>(
@@ -199,6 +231,22 @@ LDR_DATA_TABLE_ENTRY* GetMainModule() {
   return first_entry;
 }
 
+LDR_DATA_TABLE_ENTRY* GetModuleLdrEntry( const PVOID module_base ) {
+  const auto peb = GetCurrentPeb();
+
+  const auto head = &peb->Ldr->InLoadOrderModuleList;
+
+  for ( auto link = head->Flink; link != head; link = link->Flink ) {
+    auto entry = reinterpret_cast<LDR_DATA_TABLE_ENTRY*>( link );
+
+    if ( entry->DllBase == module_base ) {
+      return entry;
+    }
+  }
+
+  return 0;
+}
+
 uintptr_t GetModule( const uintptr_t module_name_hash ) {
   const auto peb = GetCurrentPeb();
 
@@ -254,6 +302,126 @@ uintptr_t GetExport( const uintptr_t module,
   return 0;
 }
 
+// The export table of a module, looked up once for all the imports of the
+// module instead of scanning and hashing every export name for each import
+struct ExportIndex {
+  uintptr_t module;
+  uint32_t ordinal_base;
+  uint32_t function_count;
+  uint32_t name_count;
+
+  const uint32_t* names;
+  const uint16_t* ordinals;
+  const uint32_t* addresses;
+
+  // An export pointing within the export directory is forwarded
+  uint32_t export_directory_begin;
+  uint32_t export_directory_end;
+};
+
+bool InitializeExportIndex( const uintptr_t module, ExportIndex* export_index ) {
+  const auto nt_headers = GetNtHeaders( reinterpret_cast<PVOID>( module ) );
+
+  const auto& export_data_directory =
+      nt_headers->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXPORT ];
+
+  if ( export_data_directory.Size == 0 ) {
+    return false;
+  }
+
+  const auto export_directory = reinterpret_cast<IMAGE_EXPORT_DIRECTORY*>(
+      module + export_data_directory.VirtualAddress );
+
+  export_index->module = module;
+  export_index->ordinal_base = export_directory->Base;
+  export_index->function_count = export_directory->NumberOfFunctions;
+  export_index->name_count = export_directory->NumberOfNames;
+  export_index->names =
+      reinterpret_cast<uint32_t*>( module + export_directory->AddressOfNames );
+  export_index->ordinals = reinterpret_cast<uint16_t*>(
+      module + export_directory->AddressOfNameOrdinals );
+  export_index->addresses = reinterpret_cast<uint32_t*>(
+      module + export_directory->AddressOfFunctions );
+  export_index->export_directory_begin = export_data_directory.VirtualAddress;
+  export_index->export_directory_end =
+      export_data_directory.VirtualAddress + export_data_directory.Size;
+
+  return true;
+}
+
+// Compares like strcmp, the export names are sorted by their byte values
+int CompareAnsiString( const char* s1, const char* s2 ) {
+  while ( *s1 && *s1 == *s2 ) {
+    ++s1;
+    ++s2;
+  }
+
+  return static_cast<int>( static_cast<uint8_t>( *s1 ) ) -
+         static_cast<int>( static_cast<uint8_t>( *s2 ) );
+}
+
+// Returns 0 if the export is forwarded, the caller has to resolve it instead
+uintptr_t GetExportAddressFromIndex( const ExportIndex& export_index,
+                                     const uint32_t function_index ) {
+  if ( function_index >= export_index.function_count ) {
+    return 0;
+  }
+
+  const auto address = export_index.addresses[ function_index ];
+
+  // An unused ordinal in the gaps of the table, it is not the module base
+  if ( address == 0 ) {
+    return 0;
+  }
+
+  if ( address >= export_index.export_directory_begin &&
+       address < export_index.export_directory_end ) {
+    return 0;
+  }
+
+  return export_index.module + address;
+}
+
+// Binary searches the export name pointer table which is sorted by the pe
+// format, returns 0 if not found or forwarded
+uintptr_t FindExportByName( const ExportIndex& export_index,
+                            const char* name ) {
+  uint32_t low = 0;
+  uint32_t high = export_index.name_count;
+
+  while ( low < high ) {
+    const auto middle = low + ( high - low ) / 2;
+
+    const auto middle_name = reinterpret_cast<const char*>(
+        export_index.module + export_index.names[ middle ] );
+
+    const auto comparison = CompareAnsiString( name, middle_name );
+
+    if ( comparison == 0 ) {
+      return GetExportAddressFromIndex( export_index,
+                                        export_index.ordinals[ middle ] );
+    }
+
+    if ( comparison < 0 ) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+
+  return 0;
+}
+
+uintptr_t FindExportByOrdinal( const ExportIndex& export_index,
+                               const uint32_t ordinal ) {
+  if ( ordinal < export_index.ordinal_base ) {
+    return 0;
+  }
+
+  return GetExportAddressFromIndex( export_index,
+                                    ordinal - export_index.ordinal_base );
+}
+
 IMAGE_SECTION_HEADER* GetSectionHeaderByHash( const PVOID base,
                                               const uintptr_t name_hash ) {
   const auto nt_headers = GetNtHeaders( base );
@@ -287,30 +455,260 @@ VmCodeSectionData* GetVmCodeSectionData( const PVOID base ) {
   return reinterpret_cast<VmCodeSectionData*>( vm_code_sec_data_addr );
 }
 
+// Resolves one import thunk against the export index of its module,
+// GetProcAddress is only used for forwarded exports
+uintptr_t ResolveImportThunk( uint8_t* dll_base_addr,
+                              const HINSTANCE dll_instance,
+                              const ExportIndex* export_index,
+                              const IMAGE_THUNK_DATA* original_thunk,
+                              const ApiAddresses& apis ) {
+  uintptr_t import_function_address = 0;
+
+  const bool by_ordinal = IMAGE_SNAP_BY_ORDINAL( original_thunk->u1.Ordinal );
+
+  if ( by_ordinal ) {
+    const auto ordinal = IMAGE_ORDINAL( original_thunk->u1.Ordinal );
+
+    if ( export_index ) {
+      import_function_address = FindExportByOrdinal( *export_index, ordinal );
+    }
+
+    if ( !import_function_address ) {
+      import_function_address =
+          reinterpret_cast<uintptr_t>( apis.GetProcAddress(
+              dll_instance, reinterpret_cast<char*>( ordinal ) ) );
+    }
+  } else {
+    const auto import_by_name = reinterpret_cast<IMAGE_IMPORT_BY_NAME*>(
+        dll_base_addr + original_thunk->u1.AddressOfData );
+
+    if ( export_index ) {
+      import_function_address =
+          FindExportByName( *export_index, import_by_name->Name );
+    }
+
+    if ( !import_function_address ) {
+      import_function_address = reinterpret_cast<uintptr_t>(
+          apis.GetProcAddress( dll_instance, import_by_name->Name ) );
+    }
+  }
+
+  return import_function_address;
+}
+
+// The slot in the vm code section that the redirect shellcode reads its
+// encrypted import address from
+volatile uintptr_t* GetImportRedirectTargetSlot(
+    const uint8_t* redirection_shellcode ) {
+#ifdef _WIN64
+  const auto displacement = *reinterpret_cast<const int32_t*>(
+      redirection_shellcode + VM_IMPORT_REDIRECT_TARGET_SLOT_OFFSET );
+
+  return reinterpret_cast<volatile uintptr_t*>(
+      const_cast<uint8_t*>( redirection_shellcode ) +
+      VM_IMPORT_REDIRECT_TARGET_SLOT_OFFSET + sizeof( displacement ) +
+      displacement );
+#else
+  return *reinterpret_cast<volatile uintptr_t* const*>(
+      redirection_shellcode + VM_IMPORT_REDIRECT_TARGET_SLOT_OFFSET );
+#endif
+}
+
+uint32_t GetImportRedirectXorKey( const uint8_t* redirection_shellcode ) {
+  return *reinterpret_cast<const uint32_t*>(
+      redirection_shellcode + VM_IMPORT_REDIRECT_XOR_KEY_OFFSET );
+}
+
+void WriteImportRedirectTarget( const uint8_t* redirection_shellcode,
+                                const uintptr_t target ) {
+  // A single store to an aligned slot, another thread executing the
+  // shellcode sees the old or new target
+  *GetImportRedirectTargetSlot( redirection_shellcode ) =
+      target ^ GetImportRedirectXorKey( redirection_shellcode );
+}
+
+// A redirected import that is resolved on its first call
+struct LazyImport {
+  uint32_t descriptor_index;
+  uint32_t original_thunk_rva;
+};
+
+// Lives after the redirect shellcodes, everything LazyResolveImport needs
+// because the import directory info is removed after FixImports
+struct LazyImportContext {
+  uint8_t* dll_base_addr;
+  uint32_t import_descriptors_rva;
+  uint8_t* import_redirect_shellcodes;
+
+  // One lazy_import_entry_shellcode for each import
+  uint8_t* entries;
+  LazyImport* imports;
+
+  // Loaded on the first resolved import of each descriptor
+  HINSTANCE* modules;
+
+  ApiAddresses apis;
+};
+
+// Called by the lazy_import_resolver_shellcode on the first call to an
+// import, returns the import address that the shellcode jumps to
+uintptr_t __cdecl LazyResolveImport( LazyImportContext* context,
+                                     const uintptr_t import_index ) {
+  const auto& lazy_import = context->imports[ import_index ];
+
+  const auto import_desc = reinterpret_cast<IMAGE_IMPORT_DESCRIPTOR*>(
+                               context->dll_base_addr +
+                               context->import_descriptors_rva ) +
+                           lazy_import.descriptor_index;
+
+  auto dll_instance = context->modules[ lazy_import.descriptor_index ];
+
+  // Two threads may both load it, LoadLibraryA returns the same handle
+  if ( !dll_instance ) {
+    dll_instance = context->apis.LoadLibraryA( reinterpret_cast<const char*>(
+        context->dll_base_addr + import_desc->Name ) );
+
+    context->modules[ lazy_import.descriptor_index ] = dll_instance;
+  }
+
+  ExportIndex export_index;
+  const bool has_export_index =
+      dll_instance &&
+      InitializeExportIndex( reinterpret_cast<uintptr_t>( dll_instance ),
+                             &export_index );
+
+  const auto import_function_address = ResolveImportThunk(
+      context->dll_base_addr, dll_instance,
+      has_export_index ? &export_index : nullptr,
+      reinterpret_cast<IMAGE_THUNK_DATA*>( context->dll_base_addr +
+                                           lazy_import.original_thunk_rva ),
+      context->apis );
+
+  // Patch the redirect shellcode, the next calls go straight to the import
+  WriteImportRedirectTarget(
+      context->import_redirect_shellcodes +
+          import_index * VM_IMPORT_REDIRECT_SHELLCODE_STRIDE,
+      import_function_address );
+
+  return import_function_address;
+}
+
+// Creates the lazy entries, the resolver shellcode and its context, returns
+// the context or nullptr if allocating failed
+LazyImportContext* InitializeLazyImports(
+    uint8_t* dll_base_addr,
+    VmCodeSectionData* vm_code_section_data,
+    const IMAGE_DATA_DIRECTORY& import_data_directory,
+    uint8_t* import_redirect_shellcodes,
+    const ApiAddresses& apis ) {
+  uint32_t descriptor_count = 0;
+
+  for ( auto import_desc = reinterpret_cast<IMAGE_IMPORT_DESCRIPTOR*>(
+            dll_base_addr + import_data_directory.VirtualAddress );
+        import_desc->Name; ++import_desc ) {
+    ++descriptor_count;
+  }
+
+  const auto import_count = vm_code_section_data->import_count;
+
+  const auto entries_size =
+      import_count * sizeof( vm_code_section_data->lazy_import_entry_shellcode );
+  const auto resolver_size =
+      sizeof( vm_code_section_data->lazy_import_resolver_shellcode );
+
+  // Pointer align the context and the tables after it
+  const auto context_offset = ( entries_size + resolver_size +
+                                sizeof( uintptr_t ) - 1 ) &
+                              ~( sizeof( uintptr_t ) - 1 );
+
+  const auto alloc_size = context_offset + sizeof( LazyImportContext ) +
+                          descriptor_count * sizeof( HINSTANCE ) +
+                          import_count * sizeof( LazyImport );
+
+  const auto lazy_import_memory = reinterpret_cast<uint8_t*>(
+      apis.VirtualAlloc( NULL, alloc_size, MEM_COMMIT | MEM_RESERVE,
+                         PAGE_EXECUTE_READWRITE ) );
+
+  if ( !lazy_import_memory ) {
+    return nullptr;
+  }
+
+  // VirtualAlloc zeroes it, the modules start out as not loaded
+  const auto context =
+      reinterpret_cast<LazyImportContext*>( lazy_import_memory + context_offset );
+
+  context->dll_base_addr = dll_base_addr;
+  context->import_descriptors_rva = import_data_directory.VirtualAddress;
+  context->import_redirect_shellcodes = import_redirect_shellcodes;
+  context->entries = lazy_import_memory;
+  context->modules = reinterpret_cast<HINSTANCE*>( context + 1 );
+  context->imports =
+      reinterpret_cast<LazyImport*>( context->modules + descriptor_count );
+  context->apis = apis;
+
+  const auto resolver = lazy_import_memory + entries_size;
+
+  MemoryCopy( vm_code_section_data->lazy_import_resolver_shellcode, resolver,
+              sizeof( vm_code_section_data->lazy_import_resolver_shellcode ) );
+
+  *reinterpret_cast<uintptr_t*>(
+      resolver + VM_LAZY_IMPORT_RESOLVER_CONTEXT_OFFSET ) =
+      reinterpret_cast<uintptr_t>( context );
+
+  *reinterpret_cast<uintptr_t*>(
+      resolver + VM_LAZY_IMPORT_RESOLVER_FUNCTION_OFFSET ) =
+      reinterpret_cast<uintptr_t>( &LazyResolveImport );
+
+  return context;
+}
+
 void FixImports( uint8_t* dll_base_addr,
                  VmCodeSectionData* vm_code_section_data,
                  const IMAGE_DATA_DIRECTORY& import_data_directory,
                  const ApiAddresses& apis ) {
-  const auto import_redirections_alloc_size =
-      vm_code_section_data->import_count *
-      sizeof( vm_code_section_data->import_redirect_shellcode );
-
-  int import_redirect_memory_offset = 0;
+  // The protector emitted the shellcodes, only their targets are written
+  const auto import_redirect_shellcodes =
+      dll_base_addr + vm_code_section_data->import_redirect_rva;
+
+  // Without redirection the iat has to hold the real addresses, so only
+  // redirected imports can be resolved lazily
+  LazyImportContext* lazy_import_context = nullptr;
+
+#if ENABLE_LAZY_IMPORTS
+  if ( vm_code_section_data->redirect_imports ) {
+    lazy_import_context = InitializeLazyImports(
+        dll_base_addr, vm_code_section_data, import_data_directory,
+        import_redirect_shellcodes, apis );
+  }
+#endif
 
-  // Allocate the memory where we'll write all of the import redirections
-  const auto import_redirect_memory = reinterpret_cast<uintptr_t>(
-      apis.VirtualAlloc( NULL, import_redirections_alloc_size,
-                         MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE ) );
+  uint32_t import_index = 0;
 
   auto import_desc = reinterpret_cast<IMAGE_IMPORT_DESCRIPTOR*>(
       dll_base_addr + import_data_directory.VirtualAddress );
 
   // For each import descriptor
-  for ( ; import_desc->Name; ++import_desc ) {
+  for ( uint32_t descriptor_index = 0; import_desc->Name;
+        ++import_desc, ++descriptor_index ) {
     const auto dll_name =
         reinterpret_cast<const char*>( dll_base_addr + import_desc->Name );
 
-    const HINSTANCE dll_instance = apis.LoadLibraryA( dll_name );
+    HINSTANCE dll_instance = NULL;
+
+    // Every thunk of the descriptor is resolved against the same index,
+    // GetProcAddress is only used for forwarded exports
+    ExportIndex export_index;
+    bool has_export_index = false;
+
+    // The lazy imports load the module on first use instead
+    if ( !lazy_import_context ) {
+      dll_instance = apis.LoadLibraryA( dll_name );
+
+      has_export_index =
+          dll_instance &&
+          InitializeExportIndex( reinterpret_cast<uintptr_t>( dll_instance ),
+                                 &export_index );
+    }
 
     // We read from the original thunk
     auto original_thunk = reinterpret_cast<IMAGE_THUNK_DATA*>(
@@ -322,58 +720,53 @@ void FixImports( uint8_t* dll_base_addr,
 
     // For each import thunk
     for ( ; original_thunk->u1.AddressOfData;
-          ++original_thunk, ++first_thunk ) {
+          ++original_thunk, ++first_thunk, ++import_index ) {
       uintptr_t import_function_address = 0;
 
-      const bool by_ordinal =
-          IMAGE_SNAP_BY_ORDINAL( original_thunk->u1.Ordinal );
+      if ( lazy_import_context ) {
+        auto& lazy_import = lazy_import_context->imports[ import_index ];
 
-      if ( by_ordinal ) {
-        // TODO: Replace with my own get proc address, support ordinal tho
-        const auto ordinal = IMAGE_ORDINAL( original_thunk->u1.Ordinal );
-
-        import_function_address =
-            reinterpret_cast<uintptr_t>( apis.GetProcAddress(
-                dll_instance, reinterpret_cast<char*>( ordinal ) ) );
-      } else {
-        const auto import_by_name = reinterpret_cast<IMAGE_IMPORT_BY_NAME*>(
-            dll_base_addr + original_thunk->u1.AddressOfData );
+        lazy_import.descriptor_index = descriptor_index;
+        lazy_import.original_thunk_rva = static_cast<uint32_t>(
+            reinterpret_cast<uint8_t*>( original_thunk ) - dll_base_addr );
 
-        import_function_address = reinterpret_cast<uintptr_t>(
-            apis.GetProcAddress( dll_instance, import_by_name->Name ) );
-      }
+        const auto entry_size =
+            sizeof( vm_code_section_data->lazy_import_entry_shellcode );
 
-      if ( vm_code_section_data->redirect_imports ) {
-        auto redirection_shellcode =
-            vm_code_section_data->import_redirect_shellcode;
+        const auto lazy_import_entry =
+            lazy_import_context->entries + import_index * entry_size;
 
-        // TODO: Consider randomly generating/modifying one line in the shellcode to not only have a simple XOR
-        // TODO: Generate the xor key "randomly" using the import_redirect_memory_offset as a seed
+        MemoryCopy( vm_code_section_data->lazy_import_entry_shellcode,
+                    lazy_import_entry, entry_size );
 
-        const uint32_t xor_key = 0x1337;
+        *reinterpret_cast<uint32_t*>( lazy_import_entry +
+                                      VM_LAZY_IMPORT_ENTRY_INDEX_OFFSET ) =
+            import_index;
 
-#ifdef _WIN64
-        // Write the encrypted address
-        *reinterpret_cast<uint64_t*>( redirection_shellcode + 5 ) =
-            import_function_address ^ xor_key;
+        // The resolver shellcode is right after the entries
+        const auto resolver = lazy_import_context->entries +
+                              vm_code_section_data->import_count * entry_size;
 
-        // Write the xor key
-        *reinterpret_cast<uint32_t*>( redirection_shellcode + 15 ) = xor_key;
-#else
-        // Write the encrypted address
-        *reinterpret_cast<uint32_t*>( redirection_shellcode + 4 ) =
-            import_function_address ^ xor_key;
+        *reinterpret_cast<int32_t*>( lazy_import_entry +
+                                     VM_LAZY_IMPORT_ENTRY_RESOLVER_OFFSET ) =
+            static_cast<int32_t>( resolver - ( lazy_import_entry + entry_size ) );
 
-        // Write the xor key
-        *reinterpret_cast<uint32_t*>( redirection_shellcode + 9 ) = xor_key;
-#endif
+        // The redirect shellcode starts out calling the lazy entry
+        import_function_address =
+            reinterpret_cast<uintptr_t>( lazy_import_entry );
+      } else {
+        import_function_address = ResolveImportThunk(
+            dll_base_addr, dll_instance,
+            has_export_index ? &export_index : nullptr, original_thunk, apis );
+      }
 
-        const auto redirection_destination = reinterpret_cast<uint8_t*>(
-            import_redirect_memory + import_redirect_memory_offset );
+      if ( vm_code_section_data->redirect_imports ) {
+        const auto redirection_shellcode =
+            import_redirect_shellcodes +
+            import_index * VM_IMPORT_REDIRECT_SHELLCODE_STRIDE;
 
-        // Write the redirection shellcode to the allocated location
-        MemoryCopy( redirection_shellcode, redirection_destination,
-                    sizeof( vm_code_section_data->import_redirect_shellcode ) );
+        WriteImportRedirectTarget( redirection_shellcode,
+                                   import_function_address );
 
         DWORD old_protection;
         apis.VirtualProtect( first_thunk, sizeof( IMAGE_THUNK_DATA ),
@@ -381,13 +774,10 @@ void FixImports( uint8_t* dll_base_addr,
 
         // Set the API call to the redirection shellcode
         *reinterpret_cast<uintptr_t*>( first_thunk ) =
-            import_redirect_memory + import_redirect_memory_offset;
+            reinterpret_cast<uintptr_t>( redirection_shellcode );
 
         apis.VirtualProtect( first_thunk, sizeof( IMAGE_THUNK_DATA ),
                              old_protection, &old_protection );
-
-        import_redirect_memory_offset +=
-            sizeof( vm_code_section_data->import_redirect_shellcode );
       } else {
         DWORD old_protection;
         apis.VirtualProtect( first_thunk, sizeof( IMAGE_THUNK_DATA ),
@@ -403,11 +793,12 @@ void FixImports( uint8_t* dll_base_addr,
   }
 }
 
-void AntiAttachDebugger( const Modules& module_addresses,
-                         const ApiAddresses& apis ) {
+// The code pages of ntdll stay executable while they are written, another
+// thread could be running on them
+void AntiAttachDebugger( const ApiAddresses& apis ) {
   DWORD old_protection;
   apis.VirtualProtect( reinterpret_cast<LPVOID>( apis.DbgUiRemoteBreakin ), 1,
-                       PAGE_READWRITE, &old_protection );
+                       PAGE_EXECUTE_READWRITE, &old_protection );
 
   // ret
   *reinterpret_cast<uint8_t*>( apis.DbgUiRemoteBreakin ) = 0xC3;
@@ -416,7 +807,7 @@ void AntiAttachDebugger( const Modules& module_addresses,
                        old_protection, &old_protection );
 
   apis.VirtualProtect( reinterpret_cast<LPVOID>( apis.DbgBreakPoint ), 1,
-                       PAGE_READWRITE, &old_protection );
+                       PAGE_EXECUTE_READWRITE, &old_protection );
 
   // ret
   *reinterpret_cast<uint8_t*>( apis.DbgBreakPoint ) = 0xC3;
@@ -494,6 +885,56 @@ ApiAddresses InitializeApis( const Modules& modules ) {
   const auto set_file_pointer = reinterpret_cast<SetFilePointer_t>(
       GetExport( kernel32, set_file_pointer_hash ) );
 
+  constexpr auto write_file_hash = HashString( "WriteFile" );
+  const auto write_file =
+      reinterpret_cast<WriteFile_t>( GetExport( kernel32, write_file_hash ) );
+
+  constexpr auto create_thread_hash = HashString( "CreateThread" );
+  const auto create_thread = reinterpret_cast<CreateThread_t>(
+      GetExport( kernel32, create_thread_hash ) );
+
+  constexpr auto terminate_process_hash = HashString( "TerminateProcess" );
+  const auto terminate_process = reinterpret_cast<TerminateProcess_t>(
+      GetExport( kernel32, terminate_process_hash ) );
+
+  constexpr auto get_process_times_hash = HashString( "GetProcessTimes" );
+  const auto get_process_times = reinterpret_cast<GetProcessTimes_t>(
+      GetExport( kernel32, get_process_times_hash ) );
+
+  // Null before windows 8, only used by the startup benchmark
+  constexpr auto get_system_time_precise_as_file_time_hash =
+      HashString( "GetSystemTimePreciseAsFileTime" );
+  const auto get_system_time_precise_as_file_time =
+      reinterpret_cast<GetSystemTimePreciseAsFileTime_t>(
+          GetExport( kernel32, get_system_time_precise_as_file_time_hash ) );
+
+  constexpr auto sleep_hash = HashString( "Sleep" );
+  const auto sleep =
+      reinterpret_cast<Sleep_t>( GetExport( kernel32, sleep_hash ) );
+
+  constexpr auto flush_instruction_cache_hash =
+      HashString( "FlushInstructionCache" );
+  const auto flush_instruction_cache =
+      reinterpret_cast<FlushInstructionCache_t>(
+          GetExport( kernel32, flush_instruction_cache_hash ) );
+
+  constexpr auto get_module_handle_ex_w_hash =
+      HashString( "GetModuleHandleExW" );
+  const auto get_module_handle_ex_w = reinterpret_cast<GetModuleHandleExW_t>(
+      GetExport( kernel32, get_module_handle_ex_w_hash ) );
+
+  constexpr auto nt_query_information_process_hash =
+      HashString( "NtQueryInformationProcess" );
+  const auto nt_query_information_process =
+      reinterpret_cast<NtQueryInformationProcess_t>(
+          GetExport( ntdll, nt_query_information_process_hash ) );
+
+  constexpr auto nt_set_information_thread_hash =
+      HashString( "NtSetInformationThread" );
+  const auto nt_set_information_thread =
+      reinterpret_cast<NtSetInformationThread_t>(
+          GetExport( ntdll, nt_set_information_thread_hash ) );
+
   ApiAddresses apis;
 
   apis.GetProcAddress = get_proc_address;
@@ -508,21 +949,124 @@ ApiAddresses InitializeApis( const Modules& modules ) {
   apis.MapViewOfFile = map_view_of_file;
   apis.UnmapViewOfFile = unmap_view_of_file;
   apis.SetFilePointer = set_file_pointer;
+  apis.WriteFile = write_file;
+  apis.CreateThread = create_thread;
+  apis.TerminateProcess = terminate_process;
+  apis.GetProcessTimes = get_process_times;
+  apis.GetSystemTimePreciseAsFileTime = get_system_time_precise_as_file_time;
+  apis.Sleep = sleep;
+  apis.FlushInstructionCache = flush_instruction_cache;
+  apis.GetModuleHandleExW = get_module_handle_ex_w;
+  apis.NtQueryInformationProcess = nt_query_information_process;
+  apis.NtSetInformationThread = nt_set_information_thread;
+
+  return apis;
+}
+
+uintptr_t GetApiCacheKey( const uintptr_t api_cache_key, const int index ) {
+  return api_cache_key ^ ( static_cast<uintptr_t>( index ) * 0x9E3779B9 );
+}
+
+// Walking the loader list and the export tables of ntdll and kernel32 is only
+// done once, the later callbacks decrypt the apis from the cache
+ApiAddresses GetApis( VmCodeSectionData* vm_code_section_data ) {
+  constexpr auto api_count =
+      static_cast<int>( sizeof( ApiAddresses ) / sizeof( uintptr_t ) );
+
+  ApiAddresses apis;
+  auto api_values = reinterpret_cast<uintptr_t*>( &apis );
+
+  const auto begin_cycles = __rdtsc();
+
+  if ( vm_code_section_data->api_cache_key != 0 ) {
+    for ( int i = 0; i < api_count; ++i ) {
+      api_values[ i ] =
+          vm_code_section_data->api_cache[ i ] ^
+          GetApiCacheKey( vm_code_section_data->api_cache_key, i );
+    }
+
+#if ENABLE_STARTUP_BENCHMARK
+    vm_code_section_data->startup_benchmark.api_cache_cycles =
+        __rdtsc() - begin_cycles;
+#endif
+
+    return apis;
+  }
+
+  apis = InitializeApis( GetModules() );
+
+  // Never 0, that means the cache is empty
+  const auto api_cache_key =
+      ( static_cast<uintptr_t>( begin_cycles ) ^
+        reinterpret_cast<uintptr_t>( vm_code_section_data ) ) |
+      1;
+
+  for ( int i = 0; i < api_count; ++i ) {
+    vm_code_section_data->api_cache[ i ] =
+        api_values[ i ] ^ GetApiCacheKey( api_cache_key, i );
+  }
+
+  // Written last so a reader never sees a key without the apis
+  vm_code_section_data->api_cache_key = api_cache_key;
+
+#if ENABLE_STARTUP_BENCHMARK
+  vm_code_section_data->startup_benchmark.api_resolution_cycles =
+      __rdtsc() - begin_cycles;
+#endif
 
   return apis;
 }
 
+#if ENABLE_STARTUP_BENCHMARK
+// Records the time since the process was created for the stage
+void RecordStartupStage( VmCodeSectionData* vm_code_section_data,
+                         const VmStartupStage stage,
+                         const ApiAddresses& apis ) {
+  if ( !apis.GetSystemTimePreciseAsFileTime ) {
+    return;
+  }
+
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+
+  // The current process pseudo handle
+  if ( !apis.GetProcessTimes( reinterpret_cast<HANDLE>( -1 ), &creation_time,
+                              &exit_time, &kernel_time, &user_time ) ) {
+    return;
+  }
+
+  FILETIME current_time;
+  apis.GetSystemTimePreciseAsFileTime( &current_time );
+
+  ULARGE_INTEGER creation, current;
+  creation.LowPart = creation_time.dwLowDateTime;
+  creation.HighPart = creation_time.dwHighDateTime;
+  current.LowPart = current_time.dwLowDateTime;
+  current.HighPart = current_time.dwHighDateTime;
+
+  auto& startup_benchmark = vm_code_section_data->startup_benchmark;
+
+  startup_benchmark.stage_count =
+      static_cast<uint32_t>( VmStartupStage::COUNT );
+  startup_benchmark.stage_times[ static_cast<uint32_t>( stage ) ] =
+      current.QuadPart - creation.QuadPart;
+}
+#endif
+
 // Returns true if this file's integrity is okay, false otherwise
-bool CheckFileIntegrity( const ApiAddresses& apis ) {
-  return true;
+bool CheckFileIntegrity( const PVOID dll_base,
+                         const VmCodeSectionData* vm_code_section_data,
+                         const ApiAddresses& apis ) {
+  const auto module_ldr_entry = GetModuleLdrEntry( dll_base );
 
-  const auto main_module_ldr_entry = GetMainModule();
+  if ( !module_ldr_entry ) {
+    return false;
+  }
 
   // NOTE: This assumes the ldr entry FullDllName.Buffer is null-terminated
-  const auto file_handle =
-      apis.CreateFileW( ( wchar_t* )main_module_ldr_entry->FullDllName.Buffer,
-                        GENERIC_READ, FILE_SHARE_WRITE | FILE_SHARE_READ, NULL,
-                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+  const auto file_handle = apis.CreateFileW(
+      ( wchar_t* )module_ldr_entry->FullDllName.Buffer, GENERIC_READ,
+      FILE_SHARE_WRITE | FILE_SHARE_READ, NULL, OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
 
   if ( file_handle == INVALID_HANDLE_VALUE ) {
     return false;
@@ -532,7 +1076,7 @@ bool CheckFileIntegrity( const ApiAddresses& apis ) {
       apis.SetFilePointer( file_handle, NULL, NULL, FILE_END );
 
   if ( file_size == INVALID_SET_FILE_POINTER ) {
-    CloseHandle( file_handle );
+    apis.CloseHandle( file_handle );
     return false;
   }
 
@@ -540,87 +1084,769 @@ bool CheckFileIntegrity( const ApiAddresses& apis ) {
       apis.CreateFileMappingA( file_handle, NULL, PAGE_READONLY, 0, 0, NULL );
 
   if ( mapped_file_handle == NULL ) {
-    CloseHandle( file_handle );
+    apis.CloseHandle( file_handle );
     return false;
   }
 
-  const auto mapped_file_addr =
-      apis.MapViewOfFile( mapped_file_handle, FILE_MAP_READ, 0, 0, 0 );
+  const auto mapped_file_addr = reinterpret_cast<const uint8_t*>(
+      apis.MapViewOfFile( mapped_file_handle, FILE_MAP_READ, 0, 0, 0 ) );
 
   if ( mapped_file_addr == NULL ) {
-    CloseHandle( mapped_file_handle );
-    CloseHandle( file_handle );
+    apis.CloseHandle( mapped_file_handle );
+    apis.CloseHandle( file_handle );
     return false;
   }
 
-  // calulate the checksum here
+  bool integrity_ok = true;
+
+  // Each section is hashed sequentially from the view and the check stops
+  // at the first section that does not match
+  for ( uint32_t i = 0; i < vm_code_section_data->integrity_section_count;
+        ++i ) {
+    const auto& section_digest = vm_code_section_data->integrity_sections[ i ];
+
+    if ( section_digest.file_offset + section_digest.size > file_size ) {
+      integrity_ok = false;
+      break;
+    }
+
+    uint32_t digest_low = 0;
+    uint32_t digest_high = 0;
+
+    VmHashData( mapped_file_addr + section_digest.file_offset,
+                section_digest.size, &digest_low, &digest_high );
+
+    if ( digest_low != section_digest.digest_low ||
+         digest_high != section_digest.digest_high ) {
+      integrity_ok = false;
+      break;
+    }
+  }
 
   apis.UnmapViewOfFile( mapped_file_addr );
 
-  CloseHandle( mapped_file_handle );
-  CloseHandle( file_handle );
+  apis.CloseHandle( mapped_file_handle );
+  apis.CloseHandle( file_handle );
 
-  return true;
+  return integrity_ok;
 }
 
-__declspec( dllexport ) void NTAPI
-    FirstTlsCallback( PVOID dll_base, DWORD reason, PVOID reserved ) {
-  // TODO: use fiber to execute the all the code
+struct FileIntegrityCheckParameters {
+  PVOID dll_base;
+  const VmCodeSectionData* vm_code_section_data;
+  ApiAddresses apis;
+};
 
-  /*
-    Remove the TLS callback immediately after they are called, in themselves
-    That means, if we e.g. fix imports in the TLS callbacks, are they are removed once someone dumps them, means invalid PE?
+DWORD WINAPI FileIntegrityCheckThread( LPVOID parameter ) {
+  const auto parameters =
+      reinterpret_cast<FileIntegrityCheckParameters*>( parameter );
 
-    1. Check the integrity of the image
-    2. 
-  */
+  if ( !CheckFileIntegrity( parameters->dll_base,
+                            parameters->vm_code_section_data,
+                            parameters->apis ) ) {
+    // The current process pseudo handle
+    parameters->apis.TerminateProcess( reinterpret_cast<HANDLE>( -1 ), 0 );
+  }
 
-  /*
-    Limitations:
-      We cannot use direct winapi calls
-      We cannot use strings because they are compiled into the .rdata section
-      No direct exception handling
-      Cannot use arrays due to VS Debug mode variable auto initialization, it calls a memcpy from another section..
-  */
+  return 0;
+}
 
-  switch ( reason ) {
-    case DLL_PROCESS_ATTACH: {
-      const auto modules = GetModules();
-      const auto apis = InitializeApis( modules );
+// Hashes the file on another thread, returns false if it could not be started
+bool StartFileIntegrityCheckThread(
+    const PVOID dll_base,
+    const VmCodeSectionData* vm_code_section_data,
+    const ApiAddresses& apis ) {
+  // The parameters have to outlive this function, they're never freed
+  // because the check only runs once
+  const auto parameters = reinterpret_cast<FileIntegrityCheckParameters*>(
+      apis.VirtualAlloc( NULL, sizeof( FileIntegrityCheckParameters ),
+                         MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE ) );
+
+  if ( !parameters ) {
+    return false;
+  }
 
-      AntiAttachDebugger( modules, apis );
+  parameters->dll_base = dll_base;
+  parameters->vm_code_section_data = vm_code_section_data;
+  parameters->apis = apis;
 
-      auto vm_code_section_data = GetVmCodeSectionData( dll_base );
+  const auto thread_handle = apis.CreateThread(
+      NULL, 0, FileIntegrityCheckThread, parameters, 0, NULL );
 
-#if ENABLE_TLS_CALLBACKS
-      FixNextCorruptedTlsCallback( dll_base, *vm_code_section_data );
-#endif
+  if ( !thread_handle ) {
+    return false;
+  }
 
-      const auto dll_base_ptr = reinterpret_cast<uint8_t*>( dll_base );
+  apis.CloseHandle( thread_handle );
 
-      const auto import_data_directory =
-          vm_code_section_data->import_data_directory;
+  return true;
+}
 
-      if ( import_data_directory.Size > 0 ) {
-        FixImports( dll_base_ptr, vm_code_section_data, import_data_directory,
-                    apis );
+#if ENABLE_ANTI_DEBUG_WATCHDOG
+// Only a few of the information classes are in the headers
+constexpr ULONG kProcessDebugPort = 7;
+constexpr ULONG kThreadHideFromDebugger = 0x11;
 
-        // Remove it info in case someone dumps the PE
-        vm_code_section_data->import_data_directory.Size = 0;
-        vm_code_section_data->import_data_directory.VirtualAddress = 0;
-      }
-    } break;
-    default:
-      break;
+#if ENABLE_ANTI_DEBUG_NT_GLOBAL_FLAG_CHECK
+// FLG_HEAP_ENABLE_TAIL_CHECK, FLG_HEAP_ENABLE_FREE_CHECK and
+// FLG_HEAP_VALIDATE_PARAMETERS, a process started by a debugger has them
+constexpr ULONG kDebuggerNtGlobalFlags = 0x70;
+
+#ifdef _WIN64
+constexpr uintptr_t kPebNtGlobalFlagOffset = 0xBC;
+#else
+constexpr uintptr_t kPebNtGlobalFlagOffset = 0x68;
+#endif
+#endif
+
+// Every check of the watchdog, one wakeup pays for all of them. Returns true
+// if any of them found a debugger.
+bool IsDebuggerFound( const ApiAddresses& apis ) {
+  const auto peb = GetCurrentPeb();
+
+  if ( peb->BeingDebugged ) {
+    return true;
   }
 
-  // Read here to ruin the imports: https://github.com/namreeb/dumpwow/blob/master/dll/dumper.cpp
+#if ENABLE_ANTI_DEBUG_NT_GLOBAL_FLAG_CHECK
+  const auto nt_global_flag = *reinterpret_cast<const ULONG*>(
+      reinterpret_cast<const uint8_t*>( peb ) + kPebNtGlobalFlagOffset );
 
-  // 1. Decrypt all strings
-  // 2. Fix all imports
-  // 3. Remap
+  if ( ( nt_global_flag & kDebuggerNtGlobalFlags ) ==
+       kDebuggerNtGlobalFlags ) {
+    return true;
+  }
+#endif
 
-  // Integrity check ONLY sections that does NOT have the writeable flags
+  uintptr_t debug_port = 0;
+
+  // The current process pseudo handle
+  if ( apis.NtQueryInformationProcess(
+           reinterpret_cast<HANDLE>( -1 ), kProcessDebugPort, &debug_port,
+           sizeof( debug_port ), NULL ) >= 0 &&
+       debug_port != 0 ) {
+    return true;
+  }
+
+  // The TLS callback made them return right away, a debugger that wants to
+  // attach has to restore them first
+  constexpr uint8_t kRet = 0xC3;
+
+  return *reinterpret_cast<volatile uint8_t*>( apis.DbgUiRemoteBreakin ) !=
+             kRet ||
+         *reinterpret_cast<volatile uint8_t*>( apis.DbgBreakPoint ) != kRet;
+}
+
+struct AntiDebugWatchdogParameters {
+  const VmCodeSectionData* vm_code_section_data;
+  ApiAddresses apis;
+};
+
+DWORD WINAPI AntiDebugWatchdogThread( LPVOID parameter ) {
+  const auto parameters =
+      reinterpret_cast<AntiDebugWatchdogParameters*>( parameter );
+
+  const auto& apis = parameters->apis;
+
+  // The debugger gets no events of this thread anymore and can't suspend or
+  // break in it without the process going down, the current thread pseudo
+  // handle
+  apis.NtSetInformationThread( reinterpret_cast<HANDLE>( -2 ),
+                               kThreadHideFromDebugger, NULL, 0 );
+
+  const auto interval =
+      parameters->vm_code_section_data->anti_debug_poll_interval_ms;
+  const auto jitter =
+      parameters->vm_code_section_data->anti_debug_poll_jitter_ms;
+
+  // xorshift32, 32 bits so x86 has no 64 bit division helper to call
+  auto jitter_state = static_cast<uint32_t>( __rdtsc() ) | 1;
+
+  for ( ;; ) {
+    if ( IsDebuggerFound( apis ) ) {
+      // The current process pseudo handle
+      apis.TerminateProcess( reinterpret_cast<HANDLE>( -1 ), 0 );
+    }
+
+    jitter_state ^= jitter_state << 13;
+    jitter_state ^= jitter_state >> 17;
+    jitter_state ^= jitter_state << 5;
+
+    apis.Sleep( interval + ( jitter ? jitter_state % jitter : 0 ) );
+  }
+
+  return 0;
+}
+
+// Returns false if the thread could not be started
+bool StartAntiDebugWatchdogThread(
+    const PVOID dll_base,
+    const VmCodeSectionData* vm_code_section_data,
+    const ApiAddresses& apis ) {
+  // The thread runs until the process exits, a dll must never be unloaded
+  // under it
+  HMODULE pinned_module = NULL;
+
+  if ( !apis.GetModuleHandleExW( GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                                     GET_MODULE_HANDLE_EX_FLAG_PIN,
+                                 reinterpret_cast<LPCWSTR>( dll_base ),
+                                 &pinned_module ) ) {
+    return false;
+  }
+
+  // Never freed either
+  const auto parameters = reinterpret_cast<AntiDebugWatchdogParameters*>(
+      apis.VirtualAlloc( NULL, sizeof( AntiDebugWatchdogParameters ),
+                         MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE ) );
+
+  if ( !parameters ) {
+    return false;
+  }
+
+  parameters->vm_code_section_data = vm_code_section_data;
+  parameters->apis = apis;
+
+  const auto thread_handle = apis.CreateThread(
+      NULL, 0, AntiDebugWatchdogThread, parameters, 0, NULL );
+
+  if ( !thread_handle ) {
+    return false;
+  }
+
+  apis.CloseHandle( thread_handle );
+
+  return true;
+}
+#endif
+
+#if ENABLE_ADAPTIVE_DEVIRTUALIZATION
+// The jump to the loader of a site
+constexpr uint8_t kVmSiteJmpSize = 5;
+
+// The stored code of a site is xored with its key
+void XorAdaptiveSiteCode( VmAdaptiveSite* adaptive_site ) {
+  for ( uint8_t i = 0; i < adaptive_site->size; ++i ) {
+    adaptive_site->code[ i ] ^=
+        static_cast<uint8_t>( adaptive_site->code_key >> ( ( i % 8 ) * 8 ) );
+  }
+}
+
+// Writes the first bytes of a site with a single locked write for the threads
+// that execute it at the same time, they're always within one aligned qword
+// because the protector only keeps those sites
+void WriteSiteJmpBytes( uint8_t* site_code, const uint8_t* code ) {
+  const auto shift = reinterpret_cast<uintptr_t>( site_code ) & 7;
+
+  const auto qword = reinterpret_cast<volatile LONG64*>(
+      reinterpret_cast<uintptr_t>( site_code ) - shift );
+
+  LONG64 old_value = *qword;
+
+  for ( ;; ) {
+    auto new_value = old_value;
+
+    for ( uint8_t i = 0; i < kVmSiteJmpSize; ++i ) {
+      reinterpret_cast<uint8_t*>( &new_value )[ shift + i ] = code[ i ];
+    }
+
+    const auto value =
+        InterlockedCompareExchange64( qword, new_value, old_value );
+
+    if ( value == old_value ) {
+      break;
+    }
+
+    old_value = value;
+  }
+}
+
+// The rest of the instruction is written while the jump is still there when
+// a site is devirtualized and after the jump is back when it's protected
+// again, nothing executes it in the meantime
+void WriteSiteCode( uint8_t* site_code,
+                    const uint8_t* code,
+                    const uint8_t size,
+                    const bool jmp_bytes_first,
+                    const ApiAddresses& apis ) {
+  DWORD old_protection;
+
+  if ( !apis.VirtualProtect( site_code, size, PAGE_EXECUTE_READWRITE,
+                             &old_protection ) ) {
+    return;
+  }
+
+  if ( jmp_bytes_first ) {
+    WriteSiteJmpBytes( site_code, code );
+  }
+
+  for ( uint8_t i = kVmSiteJmpSize; i < size; ++i ) {
+    site_code[ i ] = code[ i ];
+  }
+
+  if ( !jmp_bytes_first ) {
+    WriteSiteJmpBytes( site_code, code );
+  }
+
+  apis.VirtualProtect( site_code, size, old_protection, &old_protection );
+
+  // The current process pseudo handle
+  apis.FlushInstructionCache( reinterpret_cast<HANDLE>( -1 ), site_code,
+                              size );
+}
+
+void DevirtualizeSite( uint8_t* dll_base_addr,
+                       VmAdaptiveSite* adaptive_site,
+                       const ApiAddresses& apis ) {
+  const auto site_code = dll_base_addr + adaptive_site->rva;
+
+  MemoryCopy( site_code, adaptive_site->protected_code, adaptive_site->size );
+
+  // Only decrypted while it's written
+  XorAdaptiveSiteCode( adaptive_site );
+
+  WriteSiteCode( site_code, adaptive_site->code, adaptive_site->size, false,
+                 apis );
+
+  XorAdaptiveSiteCode( adaptive_site );
+
+  adaptive_site->devirtualized = true;
+}
+
+void ProtectSite( uint8_t* dll_base_addr,
+                  VmAdaptiveSite* adaptive_site,
+                  const ApiAddresses& apis ) {
+  WriteSiteCode( dll_base_addr + adaptive_site->rva,
+                 adaptive_site->protected_code, adaptive_site->size, true,
+                 apis );
+
+  adaptive_site->devirtualized = false;
+}
+
+struct AdaptiveDevirtualizationParameters {
+  uint8_t* dll_base_addr;
+  const VmCodeSectionData* vm_code_section_data;
+  ApiAddresses apis;
+};
+
+// Devirtualizes the sites that executed more than the threshold since they
+// were last protected, everything is protected again on every reprotect
+// interval and for as long as a debugger is attached
+DWORD WINAPI AdaptiveDevirtualizationThread( LPVOID parameter ) {
+  const auto parameters =
+      reinterpret_cast<AdaptiveDevirtualizationParameters*>( parameter );
+
+  const auto dll_base_addr = parameters->dll_base_addr;
+  const auto vm_code_section_data = parameters->vm_code_section_data;
+  const auto& apis = parameters->apis;
+
+  const auto adaptive_sites = reinterpret_cast<VmAdaptiveSite*>(
+      dll_base_addr + vm_code_section_data->adaptive_site_rva );
+
+  const auto profile_sites = reinterpret_cast<VmProfileSite*>(
+      dll_base_addr + vm_code_section_data->profile_section_rva );
+
+  const auto threshold =
+      static_cast<uintptr_t>( vm_code_section_data->adaptive_site_threshold );
+
+  uint32_t time_since_reprotect = 0;
+
+  for ( ;; ) {
+    apis.Sleep( VM_ADAPTIVE_SCAN_INTERVAL_MS );
+
+    time_since_reprotect += VM_ADAPTIVE_SCAN_INTERVAL_MS;
+
+    const bool being_debugged = GetCurrentPeb()->BeingDebugged;
+
+    const bool reprotect =
+        being_debugged ||
+        time_since_reprotect >= VM_ADAPTIVE_REPROTECT_INTERVAL_MS;
+
+    if ( reprotect ) {
+      time_since_reprotect = 0;
+    }
+
+    for ( uint32_t i = 0; i < vm_code_section_data->adaptive_site_count;
+          ++i ) {
+      const auto adaptive_site = &adaptive_sites[ i ];
+
+      // The x86 thunks only increment the low half of the counter
+      const auto execution_count = *reinterpret_cast<volatile uintptr_t*>(
+          &profile_sites[ adaptive_site->profile_site_index ]
+               .execution_count );
+
+      if ( reprotect ) {
+        if ( adaptive_site->devirtualized ) {
+          ProtectSite( dll_base_addr, adaptive_site, apis );
+        }
+
+        adaptive_site->execution_count_baseline = execution_count;
+      } else if ( !adaptive_site->devirtualized &&
+                  execution_count - adaptive_site->execution_count_baseline >
+                      threshold ) {
+        DevirtualizeSite( dll_base_addr, adaptive_site, apis );
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Returns false if the thread could not be started, the sites are left
+// virtualized then
+bool StartAdaptiveDevirtualizationThread(
+    uint8_t* dll_base_addr,
+    const VmCodeSectionData* vm_code_section_data,
+    const ApiAddresses& apis ) {
+  // The thread runs until the process exits, the parameters are never freed
+  const auto parameters =
+      reinterpret_cast<AdaptiveDevirtualizationParameters*>( apis.VirtualAlloc(
+          NULL, sizeof( AdaptiveDevirtualizationParameters ),
+          MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE ) );
+
+  if ( !parameters ) {
+    return false;
+  }
+
+  parameters->dll_base_addr = dll_base_addr;
+  parameters->vm_code_section_data = vm_code_section_data;
+  parameters->apis = apis;
+
+  const auto thread_handle = apis.CreateThread(
+      NULL, 0, AdaptiveDevirtualizationThread, parameters, 0, NULL );
+
+  if ( !thread_handle ) {
+    return false;
+  }
+
+  apis.CloseHandle( thread_handle );
+
+  return true;
+}
+#endif
+
+// Writes the counters of an instrumented build to <module path>.vmprofile
+// Allocates the path of the module with room for an extension of
+// extension_length characters including the null terminator, the
+// extension is written by the caller to where extension_out points
+wchar_t* AllocateModuleSidecarPath( uint8_t* dll_base_addr,
+                                    const int extension_length,
+                                    wchar_t** extension_out,
+                                    const ApiAddresses& apis ) {
+  const auto module_ldr_entry = GetModuleLdrEntry( dll_base_addr );
+
+  if ( !module_ldr_entry ) {
+    return nullptr;
+  }
+
+  const auto path_length =
+      module_ldr_entry->FullDllName.Length / sizeof( wchar_t );
+
+  const auto path = reinterpret_cast<wchar_t*>( apis.VirtualAlloc(
+      NULL, ( path_length + extension_length ) * sizeof( wchar_t ),
+      MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE ) );
+
+  if ( !path ) {
+    return nullptr;
+  }
+
+  MemoryCopy( reinterpret_cast<uint8_t*>( module_ldr_entry->FullDllName.Buffer ),
+              reinterpret_cast<uint8_t*>( path ),
+              path_length * sizeof( wchar_t ) );
+
+  *extension_out = path + path_length;
+
+  return path;
+}
+
+void WriteSidecarFile( const wchar_t* path,
+                       const void* data,
+                       const DWORD size,
+                       const ApiAddresses& apis ) {
+  const auto file_handle =
+      apis.CreateFileW( path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL, NULL );
+
+  if ( file_handle == INVALID_HANDLE_VALUE ) {
+    return;
+  }
+
+  DWORD bytes_written = 0;
+  apis.WriteFile( file_handle, data, size, &bytes_written, NULL );
+
+  apis.CloseHandle( file_handle );
+}
+
+void WriteVirtualizationProfile( uint8_t* dll_base_addr,
+                                 const VmCodeSectionData* vm_code_section_data,
+                                 const ApiAddresses& apis ) {
+  // The length of ".vmprofile" including the null terminator
+  constexpr auto kProfileExtensionLength = 11;
+
+  wchar_t* extension = nullptr;
+
+  const auto profile_path = AllocateModuleSidecarPath(
+      dll_base_addr, kProfileExtensionLength, &extension, apis );
+
+  if ( !profile_path ) {
+    return;
+  }
+
+  // Written one character at a time, a string would be put in .rdata
+  *extension++ = '.';
+  *extension++ = 'v';
+  *extension++ = 'm';
+  *extension++ = 'p';
+  *extension++ = 'r';
+  *extension++ = 'o';
+  *extension++ = 'f';
+  *extension++ = 'i';
+  *extension++ = 'l';
+  *extension++ = 'e';
+  *extension = 0;
+
+  const auto profile_sites =
+      dll_base_addr + vm_code_section_data->profile_section_rva;
+
+  WriteSidecarFile(
+      profile_path, profile_sites,
+      vm_code_section_data->profile_site_count * sizeof( VmProfileSite ),
+      apis );
+}
+
+#if ENABLE_STARTUP_BENCHMARK
+void WriteStartupBenchmark( uint8_t* dll_base_addr,
+                            const VmCodeSectionData* vm_code_section_data,
+                            const ApiAddresses& apis ) {
+  // The length of ".vmstartup" including the null terminator
+  constexpr auto kStartupExtensionLength = 11;
+
+  wchar_t* extension = nullptr;
+
+  const auto startup_path = AllocateModuleSidecarPath(
+      dll_base_addr, kStartupExtensionLength, &extension, apis );
+
+  if ( !startup_path ) {
+    return;
+  }
+
+  *extension++ = '.';
+  *extension++ = 'v';
+  *extension++ = 'm';
+  *extension++ = 's';
+  *extension++ = 't';
+  *extension++ = 'a';
+  *extension++ = 'r';
+  *extension++ = 't';
+  *extension++ = 'u';
+  *extension++ = 'p';
+  *extension = 0;
+
+  WriteSidecarFile( startup_path, &vm_code_section_data->startup_benchmark,
+                    sizeof( vm_code_section_data->startup_benchmark ), apis );
+}
+#endif
+
+#if ENABLE_VM_TELEMETRY
+// Creates the shared memory that the interpreter writes the telemetry to
+void CreateVmTelemetry( VmCodeSectionData* vm_code_section_data,
+                        const ApiAddresses& apis ) {
+#ifdef _WIN64
+  const auto process_id = static_cast<uint32_t>( __readgsqword( 0x40 ) );
+#else
+  const auto process_id = static_cast<uint32_t>( __readfsdword( 0x20 ) );
+#endif
+
+  // Local\GreyMVmTelemetry + 8 hex digits + null terminator
+  constexpr auto kTelemetryNameLength = 32;
+
+  const auto telemetry_name = reinterpret_cast<char*>(
+      apis.VirtualAlloc( NULL, kTelemetryNameLength, MEM_COMMIT | MEM_RESERVE,
+                         PAGE_READWRITE ) );
+
+  if ( !telemetry_name ) {
+    return;
+  }
+
+  // Written one character at a time, a string would be put in .rdata
+  auto name = telemetry_name;
+  *name++ = 'L';
+  *name++ = 'o';
+  *name++ = 'c';
+  *name++ = 'a';
+  *name++ = 'l';
+  *name++ = '\\';
+  *name++ = 'G';
+  *name++ = 'r';
+  *name++ = 'e';
+  *name++ = 'y';
+  *name++ = 'M';
+  *name++ = 'V';
+  *name++ = 'm';
+  *name++ = 'T';
+  *name++ = 'e';
+  *name++ = 'l';
+  *name++ = 'e';
+  *name++ = 'm';
+  *name++ = 'e';
+  *name++ = 't';
+  *name++ = 'r';
+  *name++ = 'y';
+
+  for ( int shift = 28; shift >= 0; shift -= 4 ) {
+    const auto digit = ( process_id >> shift ) & 0xF;
+    *name++ = static_cast<char>( digit < 10 ? '0' + digit : 'A' + digit - 10 );
+  }
+
+  *name = 0;
+
+  const auto site_count = vm_code_section_data->telemetry_site_count;
+
+  const auto telemetry_size = static_cast<uint32_t>(
+      sizeof( VmTelemetry ) + site_count * sizeof( uint64_t ) );
+
+  const auto mapping_handle =
+      apis.CreateFileMappingA( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                               telemetry_size, telemetry_name );
+
+  if ( !mapping_handle ) {
+    return;
+  }
+
+  // The mapping is kept open until the process exits to let tools read it
+  const auto telemetry = reinterpret_cast<VmTelemetry*>( apis.MapViewOfFile(
+      mapping_handle, FILE_MAP_WRITE, 0, 0, telemetry_size ) );
+
+  if ( !telemetry ) {
+    apis.CloseHandle( mapping_handle );
+    return;
+  }
+
+  telemetry->site_count = site_count;
+  telemetry->handler_count = VM_HANDLER_COUNT;
+
+  vm_code_section_data->telemetry = telemetry;
+}
+
+VmTelemetry* GetVmTelemetry( const uintptr_t image_base_address ) {
+  const auto dos_header =
+      reinterpret_cast<const IMAGE_DOS_HEADER*>( image_base_address );
+
+  const auto vm_code_section_data_rva =
+      *reinterpret_cast<const uint32_t*>( dos_header->e_res2 );
+
+  const auto vm_code_section_data = reinterpret_cast<VmCodeSectionData*>(
+      image_base_address + vm_code_section_data_rva );
+
+  return vm_code_section_data->telemetry;
+}
+
+void RecordVmExit( VmTelemetry* telemetry, const uint64_t entry_cycles ) {
+  if ( telemetry ) {
+    InterlockedExchangeAdd64(
+        reinterpret_cast<volatile LONG64*>( &telemetry->vm_cycles ),
+        static_cast<LONG64>( __rdtsc() - entry_cycles ) );
+  }
+}
+#endif
+
+// Thread pools create and retire threads all the time, the TLS callbacks
+// return for them before anything is looked up. Whatever gets added to the
+// callbacks goes after that check.
+bool IsThreadNotification( const DWORD reason ) {
+  return reason == DLL_THREAD_ATTACH || reason == DLL_THREAD_DETACH;
+}
+
+__declspec( dllexport ) void NTAPI
+    FirstTlsCallback( PVOID dll_base, DWORD reason, PVOID reserved ) {
+  // TODO: use fiber to execute the all the code
+
+  /*
+    Remove the TLS callback immediately after they are called, in themselves
+    That means, if we e.g. fix imports in the TLS callbacks, are they are removed once someone dumps them, means invalid PE?
+
+    1. Check the integrity of the image
+    2. 
+  */
+
+  /*
+    Limitations:
+      We cannot use direct winapi calls
+      We cannot use strings because they are compiled into the .rdata section
+      No direct exception handling
+      Cannot use arrays due to VS Debug mode variable auto initialization, it calls a memcpy from another section..
+  */
+
+  if ( IsThreadNotification( reason ) ) {
+    return;
+  }
+
+  switch ( reason ) {
+    case DLL_PROCESS_ATTACH: {
+      auto vm_code_section_data = GetVmCodeSectionData( dll_base );
+
+      const auto apis = GetApis( vm_code_section_data );
+
+#if ENABLE_STARTUP_BENCHMARK
+      RecordStartupStage( vm_code_section_data,
+                          VmStartupStage::FIRST_TLS_CALLBACK, apis );
+#endif
+
+      // Before any thread of the program exists, the watchdog only checks
+      // that it stays patched
+      AntiAttachDebugger( apis );
+
+#if ENABLE_ANTI_DEBUG_WATCHDOG
+      StartAntiDebugWatchdogThread( dll_base, vm_code_section_data, apis );
+#endif
+
+#if ENABLE_TLS_CALLBACKS
+      FixNextCorruptedTlsCallback( dll_base, *vm_code_section_data );
+#endif
+
+#if ENABLE_VM_TELEMETRY
+      CreateVmTelemetry( vm_code_section_data, apis );
+#endif
+
+      const auto dll_base_ptr = reinterpret_cast<uint8_t*>( dll_base );
+
+      const auto import_data_directory =
+          vm_code_section_data->import_data_directory;
+
+      if ( import_data_directory.Size > 0 ) {
+        FixImports( dll_base_ptr, vm_code_section_data, import_data_directory,
+                    apis );
+
+        // Remove it info in case someone dumps the PE
+        vm_code_section_data->import_data_directory.Size = 0;
+        vm_code_section_data->import_data_directory.VirtualAddress = 0;
+      }
+
+#if ENABLE_STARTUP_BENCHMARK
+      RecordStartupStage( vm_code_section_data, VmStartupStage::IMPORTS_FIXED,
+                          apis );
+#endif
+    } break;
+    case DLL_PROCESS_DETACH: {
+      auto vm_code_section_data = GetVmCodeSectionData( dll_base );
+
+      if ( vm_code_section_data->write_virtualization_profile ) {
+        const auto apis = GetApis( vm_code_section_data );
+
+        WriteVirtualizationProfile( reinterpret_cast<uint8_t*>( dll_base ),
+                                    vm_code_section_data, apis );
+      }
+    } break;
+    default:
+      break;
+  }
+
+  // Read here to ruin the imports: https://github.com/namreeb/dumpwow/blob/master/dll/dumper.cpp
+
+  // 1. Decrypt all strings
+  // 2. Fix all imports
+  // 3. Remap
+
+  // Integrity check ONLY sections that does NOT have the writeable flags
 
   // Flow:
   // 1. Decrypt the sections, extra layer to waste time
@@ -636,7 +1862,19 @@ __declspec( dllexport ) void NTAPI
   // reference the new TLS callback by address to ensure someone cannot
   // simply find it by decompiling the code in IDA
 
-  auto nt_headers = GetNtHeaders( dll_base );
+  if ( IsThreadNotification( reason ) ) {
+    return;
+  }
+
+#if ENABLE_STARTUP_BENCHMARK
+  if ( reason == DLL_PROCESS_ATTACH ) {
+    const auto vm_code_section_data = GetVmCodeSectionData( dll_base );
+
+    RecordStartupStage( vm_code_section_data,
+                        VmStartupStage::TLS_CALLBACKS_DONE,
+                        GetApis( vm_code_section_data ) );
+  }
+#endif
 }
 
 #ifdef _WIN64
@@ -650,47 +1888,96 @@ __declspec( dllexport ) uintptr_t
   const auto vm_code_section_data =
       GetVmCodeSectionData( reinterpret_cast<PVOID>( dll_base ) );
 
-  const auto modules = GetModules();
-  const auto apis = InitializeApis( modules );
+  const auto apis = GetApis( vm_code_section_data );
+
+#if ENABLE_STARTUP_BENCHMARK
+  RecordStartupStage( vm_code_section_data, VmStartupStage::BEFORE_ENTRYPOINT,
+                      apis );
+#endif
 
 #if ENABLE_FILE_INTEGRITY_CHECKS
-  if ( !CheckFileIntegrity( apis ) ) {
+#if ENABLE_BACKGROUND_FILE_INTEGRITY_CHECKS
+  if ( !StartFileIntegrityCheckThread( reinterpret_cast<PVOID>( dll_base ),
+                                       vm_code_section_data, apis ) ) {
+#else
+  if ( !CheckFileIntegrity( reinterpret_cast<PVOID>( dll_base ),
+                            vm_code_section_data, apis ) ) {
+#endif
     // TODO: Think of something better to return to make
     // it obfuscated, or mayybe something even smarter?
     return 0;
   }
 #endif
 
+#if ENABLE_ADAPTIVE_DEVIRTUALIZATION
+  if ( vm_code_section_data->adaptive_site_count > 0 ) {
+    StartAdaptiveDevirtualizationThread( reinterpret_cast<uint8_t*>( dll_base ),
+                                         vm_code_section_data, apis );
+  }
+#endif
+
+#if ENABLE_STARTUP_BENCHMARK
+  RecordStartupStage( vm_code_section_data, VmStartupStage::INTEGRITY_CHECKED,
+                      apis );
+
+  // The last stage is written right before returning to the entrypoint
+  // shellcode, the file write itself is not part of it
+  RecordStartupStage( vm_code_section_data, VmStartupStage::REAL_ENTRYPOINT,
+                      apis );
+
+  WriteStartupBenchmark( reinterpret_cast<uint8_t*>( dll_base ),
+                         vm_code_section_data, apis );
+#endif
+
   // Return the real entrypoint address for the entrypoint shellcode to call
   return dll_base + vm_code_section_data->real_entrypoint;
 }
 
-void PushValueToRealStack( VmContext* vm_context, uintptr_t value ) {
-  const auto current_registers_address =
-      reinterpret_cast<uintptr_t>( vm_context->registers );
+// The handlers only record their pushes, the frame is moved once when the
+// interpreter exits instead of copying VmRegisters for every push
+void PushValueToRealStack( VmVirtualPushes* virtual_pushes, uintptr_t value ) {
+  virtual_pushes->values[ virtual_pushes->count++ ] = value;
+}
 
-  auto current_register_last_value_address =
-      current_registers_address + sizeof( VmRegisters ) - sizeof( uintptr_t );
+// Moves the saved registers down into the space the loader allocated below
+// them and places the pushed values between the registers and the old top of
+// the stack, the loader pops the registers and the values are left pushed
+void MaterializeVirtualPushes( VmContext* vm_context,
+                               const VmVirtualPushes& virtual_pushes ) {
+  if ( virtual_pushes.count == 0 ) {
+    return;
+  }
 
-  // Make a copy of the registers
-  const auto registers_copy = *vm_context->registers;
+  const auto current_registers =
+      reinterpret_cast<uintptr_t*>( vm_context->registers );
 
-  // Get the new registers address on the stack (subtracted by sizeof(ptr))
-  auto new_registers = reinterpret_cast<VmRegisters*>(
-      current_registers_address - sizeof( uintptr_t ) );
+  const auto new_registers = current_registers - virtual_pushes.count;
 
-  // Copy the registers to the new location
-  *new_registers = *vm_context->registers;
+  // rep movs copies forward which is fine for the overlapping copy to a lower
+  // address, it also keeps the compiler from using the sse registers
+#ifdef _WIN64
+  __movsq( reinterpret_cast<unsigned long long*>( new_registers ),
+           reinterpret_cast<const unsigned long long*>( current_registers ),
+           sizeof( VmRegisters ) / sizeof( uintptr_t ) );
+#else
+  __movsd( reinterpret_cast<unsigned long*>( new_registers ),
+           reinterpret_cast<const unsigned long*>( current_registers ),
+           sizeof( VmRegisters ) / sizeof( uintptr_t ) );
+#endif
 
-  // Modify the vm_context->registers variable to the new stack address
-  vm_context->registers = new_registers;
+  // The first pushed value ends up at the highest address, like a real push
+  const auto stack_top =
+      new_registers + sizeof( VmRegisters ) / sizeof( uintptr_t );
 
-  // Set the push value
-  *reinterpret_cast<uintptr_t*>( current_register_last_value_address ) = value;
+  for ( uint32_t i = 0; i < virtual_pushes.count; ++i ) {
+    stack_top[ virtual_pushes.count - 1 - i ] = virtual_pushes.values[ i ];
+  }
+
+  vm_context->registers = reinterpret_cast<VmRegisters*>( new_registers );
 
   // Modify esp appropriately in order to return to the correct esp so the
   // pushed arguments show on top of stack
-  vm_context->esp -= sizeof( uintptr_t );
+  vm_context->esp -= virtual_pushes.count * sizeof( uintptr_t );
 }
 
 uintptr_t* GetPointerToRegister( const VmContext* vm_context,
@@ -708,6 +1995,43 @@ T ReadValue( uint8_t** code ) {
   return value;
 }
 
+VmRegister ReadVmRegister( uint8_t** code ) {
+#if ENABLE_COMPACT_BYTECODE
+  const auto packed_register = ReadValue<uint8_t>( code );
+
+  VmRegister vm_reg;
+  vm_reg.register_offset =
+      ( packed_register & VM_PACKED_REGISTER_SLOT_MASK ) * sizeof( uintptr_t );
+  vm_reg.register_size = 1
+                         << ( packed_register >> VM_PACKED_REGISTER_SIZE_SHIFT );
+
+  return vm_reg;
+#else
+  return ReadValue<VmRegister>( code );
+#endif
+}
+
+// Reads a displacement or an immediate, zigzag LEB128 encoded in the
+// compact bytecode
+uintptr_t ReadVmValue( uint8_t** code ) {
+#if ENABLE_COMPACT_BYTECODE
+  uintptr_t zigzag = 0;
+  uint32_t shift = 0;
+  uint8_t byte;
+
+  do {
+    byte = ReadValue<uint8_t>( code );
+
+    zigzag |= static_cast<uintptr_t>( byte & 0x7F ) << shift;
+    shift += 7;
+  } while ( byte & 0x80 );
+
+  return ( zigzag >> 1 ) ^ ( 0 - ( zigzag & 1 ) );
+#else
+  return ReadValue<uintptr_t>( code );
+#endif
+}
+
 void WriteSizedValue( const uint32_t size,
                       const uintptr_t* write_dest,
                       const uintptr_t value ) {
@@ -733,24 +2057,257 @@ void WriteSizedValue( const uint32_t size,
   }
 }
 
+template <typename T>
+__forceinline void WriteRegisterValue( uintptr_t* reg, const uintptr_t value ) {
+  static_assert( sizeof( T ) <= sizeof( uintptr_t ),
+                 "The value does not fit into a register" );
+
+  *reinterpret_cast<T*>( reg ) = static_cast<T>( value );
+}
+
+// Writing a 32 bit register zero extends it on x64
+template <>
+__forceinline void WriteRegisterValue<uint32_t>( uintptr_t* reg,
+                                                 const uintptr_t value ) {
+  *reg = static_cast<uint32_t>( value );
+}
+
 void WriteSizedValueToRegister( const VmContext* vm_context,
                                 const VmRegister& vm_reg,
                                 const uintptr_t value ) {
   const auto write_dest_ptr =
       GetPointerToRegister( vm_context, vm_reg.register_offset );
 
-  if ( vm_reg.register_size == 4 ) {
-    // https://docs.microsoft.com/en-us/windows-hardware/drivers/debugger/x64-architecture
-    // Operations that output to a 32-bit subregister are automatically zero-extended
-    // to the entire 64-bit register. Operations that output to 8-bit or 16-bit
-    // subregisters are not zero-extended (this is compatible x86 behavior).
+  // Operations that output to a 32-bit subregister are automatically
+  // zero-extended to the entire 64-bit register, 8-bit and 16-bit ones are not
+  switch ( vm_reg.register_size ) {
+    case 1:
+      WriteRegisterValue<uint8_t>( write_dest_ptr, value );
+      break;
+    case 2:
+      WriteRegisterValue<uint16_t>( write_dest_ptr, value );
+      break;
+    case 4:
+      WriteRegisterValue<uint32_t>( write_dest_ptr, value );
+      break;
+    default:
+      WriteRegisterValue<uintptr_t>( write_dest_ptr, value );
+      break;
+  }
+}
+
+uintptr_t ReadSizedValue( const uint32_t size, const uintptr_t* read_src ) {
+  switch ( size ) {
+    case 1:
+      return *( uint8_t* )( read_src );
+    case 2:
+      return *( uint16_t* )( read_src );
+    case 4:
+      return *( uint32_t* )( read_src );
+    default:
+      return *read_src;
+  }
+}
+
+// The sized handlers, the protector picks the one for the operand size and
+// the relocation of the displacement. The register size that is still in
+// the virtualized code is not looked at.
+template <bool kRelocatedDisp>
+__forceinline uintptr_t ReadVmDisp( uint8_t** code,
+                                    const uintptr_t image_base_address ) {
+  const auto disp = ReadVmValue( code );
+  return kRelocatedDisp ? disp + image_base_address : disp;
+}
+
+// mov reg, [reg + disp]
+template <typename T, bool kRelocatedDisp>
+__forceinline void ExecuteMovRegisterMemoryRegOffset(
+    const VmContext* vm_context,
+    uint8_t** code,
+    const uintptr_t image_base_address ) {
+  const auto vm_reg_dest = ReadVmRegister( code );
+  const auto vm_reg_src = ReadVmRegister( code );
+
+  const auto disp = ReadVmDisp<kRelocatedDisp>( code, image_base_address );
+
+  const auto src_addr =
+      *GetPointerToRegister( vm_context, vm_reg_src.register_offset ) + disp;
+
+  WriteRegisterValue<T>(
+      GetPointerToRegister( vm_context, vm_reg_dest.register_offset ),
+      *reinterpret_cast<const T*>( src_addr ) );
+}
+
+// mov [reg + disp], reg
+template <typename T, bool kRelocatedDisp>
+__forceinline void ExecuteMovMemoryRegOffsetReg(
+    const VmContext* vm_context,
+    uint8_t** code,
+    const uintptr_t image_base_address ) {
+  const auto vm_reg_dest = ReadVmRegister( code );
+  const auto vm_reg_src = ReadVmRegister( code );
+
+  const auto disp = ReadVmDisp<kRelocatedDisp>( code, image_base_address );
+
+  const auto dest_addr =
+      *GetPointerToRegister( vm_context, vm_reg_dest.register_offset ) + disp;
+
+  static_assert( sizeof( T ) <= sizeof( uintptr_t ),
+                 "The register is smaller than the value" );
+
+  *reinterpret_cast<T*>( dest_addr ) = static_cast<T>(
+      *GetPointerToRegister( vm_context, vm_reg_src.register_offset ) );
+}
+
+uintptr_t GetSizedValueMask( const uint32_t size ) {
+  if ( size >= sizeof( uintptr_t ) ) {
+    return ~static_cast<uintptr_t>( 0 );
+  }
+
+  return ( static_cast<uintptr_t>( 1 ) << ( size * 8 ) ) - 1;
+}
+
+bool DoesAluOperationWriteResult( const VmAluOperation alu_operation ) {
+  return alu_operation != VmAluOperation::CMP &&
+         alu_operation != VmAluOperation::TEST;
+}
+
+// Executes the operation with the operand size and writes the resulting flags
+// the same way the cpu would into the saved eflags of the loader
+uintptr_t ExecuteAluOperation( const VmContext* vm_context,
+                               const VmAluOperation alu_operation,
+                               const uint32_t size,
+                               uintptr_t dest_value,
+                               uintptr_t src_value ) {
+  const auto mask = GetSizedValueMask( size );
+  const auto sign_bit = ( mask >> 1 ) + 1;
+
+  dest_value &= mask;
+  src_value &= mask;
+
+  uintptr_t result = 0;
+  uintptr_t eflags = 0;
+
+  switch ( alu_operation ) {
+    case VmAluOperation::ADD: {
+      result = ( dest_value + src_value ) & mask;
+
+      if ( result < dest_value ) {
+        eflags |= VM_EFLAGS_CF;
+      }
+
+      if ( ~( dest_value ^ src_value ) & ( dest_value ^ result ) & sign_bit ) {
+        eflags |= VM_EFLAGS_OF;
+      }
+
+      if ( ( dest_value ^ src_value ^ result ) & 0x10 ) {
+        eflags |= VM_EFLAGS_AF;
+      }
+    } break;
+
+    case VmAluOperation::SUB:
+    case VmAluOperation::CMP: {
+      result = ( dest_value - src_value ) & mask;
+
+      if ( dest_value < src_value ) {
+        eflags |= VM_EFLAGS_CF;
+      }
+
+      if ( ( dest_value ^ src_value ) & ( dest_value ^ result ) & sign_bit ) {
+        eflags |= VM_EFLAGS_OF;
+      }
+
+      if ( ( dest_value ^ src_value ^ result ) & 0x10 ) {
+        eflags |= VM_EFLAGS_AF;
+      }
+    } break;
+
+    // The logical operations clear CF and OF, AF is undefined
+    case VmAluOperation::AND:
+    case VmAluOperation::TEST:
+      result = dest_value & src_value;
+      break;
+
+    case VmAluOperation::OR:
+      result = dest_value | src_value;
+      break;
+
+    case VmAluOperation::XOR:
+      result = dest_value ^ src_value;
+      break;
+
+    default:
+      break;
+  }
+
+  if ( result == 0 ) {
+    eflags |= VM_EFLAGS_ZF;
+  }
+
+  if ( result & sign_bit ) {
+    eflags |= VM_EFLAGS_SF;
+  }
+
+  // PF is set when the lowest byte has an even amount of bits set
+  auto parity = static_cast<uint8_t>( result );
+  parity ^= parity >> 4;
+  parity ^= parity >> 2;
+  parity ^= parity >> 1;
+
+  if ( ( parity & 1 ) == 0 ) {
+    eflags |= VM_EFLAGS_PF;
+  }
+
+  constexpr uintptr_t kAluEflags = VM_EFLAGS_CF | VM_EFLAGS_PF | VM_EFLAGS_AF |
+                                   VM_EFLAGS_ZF | VM_EFLAGS_SF | VM_EFLAGS_OF;
+
+  auto& saved_eflags = vm_context->registers->pushfd;
+  saved_eflags = ( saved_eflags & ~kAluEflags ) | eflags;
+
+  return result;
+}
+
+// The condition_code is the low nibble of the jcc opcode, every even
+// condition is followed by its negation
+bool IsConditionMet( const uintptr_t eflags, const uint8_t condition_code ) {
+  const bool cf = ( eflags & VM_EFLAGS_CF ) != 0;
+  const bool pf = ( eflags & VM_EFLAGS_PF ) != 0;
+  const bool zf = ( eflags & VM_EFLAGS_ZF ) != 0;
+  const bool sf = ( eflags & VM_EFLAGS_SF ) != 0;
+  const bool of = ( eflags & VM_EFLAGS_OF ) != 0;
+
+  bool condition = false;
 
-    // If my understand of the statement above is correct, then the follwing line should
-    // zero-extend the whole 64 register on x64 and the whole x86 register on x86, but on x86 it does not matter
-    *( uintptr_t* )( write_dest_ptr ) = 0;
+  switch ( condition_code >> 1 ) {
+    case 0:  // jo
+      condition = of;
+      break;
+    case 1:  // jb
+      condition = cf;
+      break;
+    case 2:  // je
+      condition = zf;
+      break;
+    case 3:  // jbe
+      condition = cf || zf;
+      break;
+    case 4:  // js
+      condition = sf;
+      break;
+    case 5:  // jp
+      condition = pf;
+      break;
+    case 6:  // jl
+      condition = sf != of;
+      break;
+    case 7:  // jle
+      condition = zf || sf != of;
+      break;
+    default:
+      break;
   }
 
-  WriteSizedValue( vm_reg.register_size, write_dest_ptr, value );
+  return ( condition_code & 1 ) ? !condition : condition;
 }
 
 /*
@@ -787,257 +2344,529 @@ __declspec( dllexport ) int32_t
 #endif
 
   // A value that describes the amount of stack we allocate before we call this interpreter in the loader shellcode
-  // It is based on the sub esp, 0x100
-  //                    add esp, 0x100
-  // This is not required for x86, but I am still doing it for consistency on both x86 and x64
-  const auto interpreter_call_stack_allocation_space = 0x100;
+  // It is based on the sub esp, VM_INTERPRETER_CALL_STACK_SIZE_BYTES
+  //                    add esp, VM_INTERPRETER_CALL_STACK_SIZE_BYTES
+  const auto interpreter_call_stack_allocation_space =
+      VM_INTERPRETER_CALL_STACK_SIZE_BYTES;
 
   // Read whole struct from stack in one read
   VmContext* vm_context =
       ( VmContext* )( allocated_stack_addr + kTotalParametersBeforeEspPush +
                       interpreter_call_stack_allocation_space );
 
-  // Initialize the pointer to the pushed registers
-  vm_context->registers =
-      ( VmRegisters* )( ( uintptr_t )( vm_context ) +
-                        VM_INTERPRETER_STACK_ALLOCATION_SIZE_BYTES +
-                        sizeof( vm_context->esp ) -
-                        offsetof( VmContext, registers ) +
-                        sizeof( vm_context->registers ) );
+  // Initialize the pointer to the pushed registers, the loader pushed the esp
+  // of the frame so it does not depend on the size of the stack allocation
+  vm_context->registers = ( VmRegisters* )( vm_context->esp );
 
   code += image_base_address;
 
-  const auto vm_opcode = ReadValue<uint32_t>( &code ) ^ vm_opcode_encyption_key;
+  VmVirtualPushes virtual_pushes;
+  virtual_pushes.count = 0;
 
-  const auto relocated_disp = ReadValue<uint8_t>( &code );
-  const auto relocated_imm = ReadValue<uint8_t>( &code );
+#if ENABLE_VM_TELEMETRY
+  const auto entry_cycles = __rdtsc();
 
-  switch ( static_cast<VmOpcodes>( vm_opcode ) ) {
-    case VmOpcodes::MOV_REGISTER_MEMORY_REG_OFFSET: {
-      const auto vm_reg_dest = ReadValue<VmRegister>( &code );
-      const auto vm_reg_src = ReadValue<VmRegister>( &code );
+  const auto telemetry = GetVmTelemetry( image_base_address );
 
-      auto reg_src_disp = ReadValue<uintptr_t>( &code );
+  if ( telemetry ) {
+    InterlockedIncrement64(
+        reinterpret_cast<volatile LONG64*>( &telemetry->vm_entries ) );
+  }
+#endif
 
-      if ( relocated_disp ) {
-        reg_src_disp = reg_src_disp + image_base_address;
+  // Execute the virtualized instructions one after another until the
+  // terminator, a whole block of instructions runs within a single vm entry
+  for ( ;; ) {
+#if ENABLE_COMPACT_BYTECODE
+    const auto compact_opcode = static_cast<uint8_t>(
+        ReadValue<uint8_t>( &code ) ^
+        static_cast<uint8_t>( vm_opcode_encyption_key ) );
+
+    const auto vm_opcode = static_cast<VmDispatchValue>(
+        compact_opcode & VM_COMPACT_OPCODE_HANDLER_MASK );
+#else
+    const auto vm_opcode = static_cast<VmDispatchValue>(
+        ReadValue<uint32_t>( &code ) ^ vm_opcode_encyption_key );
+#endif
+
+    if ( vm_opcode == VmDispatchValue::VM_EXIT ) {
+      break;
+    }
+
+#if ENABLE_VM_TELEMETRY
+    const auto site_index = ReadValue<uint32_t>( &code );
+
+    if ( telemetry ) {
+      InterlockedIncrement64( reinterpret_cast<volatile LONG64*>(
+          &telemetry->handler_executions[ static_cast<uint32_t>(
+              vm_opcode ) ] ) );
+
+      if ( site_index < telemetry->site_count ) {
+        InterlockedIncrement64( reinterpret_cast<volatile LONG64*>(
+            &telemetry->site_executions[ site_index ] ) );
       }
+    }
+#endif
 
-      const auto reg_src_value =
-          *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
+#if ENABLE_COMPACT_BYTECODE
+    const bool relocated_disp =
+        ( compact_opcode & VM_COMPACT_OPCODE_RELOCATED_DISP ) != 0;
+    const bool relocated_imm =
+        ( compact_opcode & VM_COMPACT_OPCODE_RELOCATED_IMM ) != 0;
+#else
+    const auto relocated_disp = ReadValue<uint8_t>( &code );
+    const auto relocated_imm = ReadValue<uint8_t>( &code );
+#endif
 
-      const auto reg_src_value_with_disp = reg_src_value + reg_src_disp;
+    switch ( vm_opcode ) {
+      case VmDispatchValue::MOV_REGISTER_MEMORY_REG_OFFSET_8:
+        ExecuteMovRegisterMemoryRegOffset<uint8_t, false>(
+            vm_context, &code, image_base_address );
+        break;
+      case VmDispatchValue::MOV_REGISTER_MEMORY_REG_OFFSET_16:
+        ExecuteMovRegisterMemoryRegOffset<uint16_t, false>(
+            vm_context, &code, image_base_address );
+        break;
+      case VmDispatchValue::MOV_REGISTER_MEMORY_REG_OFFSET_32:
+        ExecuteMovRegisterMemoryRegOffset<uint32_t, false>(
+            vm_context, &code, image_base_address );
+        break;
+#ifdef _WIN64
+      case VmDispatchValue::MOV_REGISTER_MEMORY_REG_OFFSET_64:
+        ExecuteMovRegisterMemoryRegOffset<uint64_t, false>(
+            vm_context, &code, image_base_address );
+        break;
+#endif
+      case VmDispatchValue::MOV_REGISTER_MEMORY_REG_OFFSET_8_RELOCATED:
+        ExecuteMovRegisterMemoryRegOffset<uint8_t, true>(
+            vm_context, &code, image_base_address );
+        break;
+      case VmDispatchValue::MOV_REGISTER_MEMORY_REG_OFFSET_16_RELOCATED:
+        ExecuteMovRegisterMemoryRegOffset<uint16_t, true>(
+            vm_context, &code, image_base_address );
+        break;
+      case VmDispatchValue::MOV_REGISTER_MEMORY_REG_OFFSET_32_RELOCATED:
+        ExecuteMovRegisterMemoryRegOffset<uint32_t, true>(
+            vm_context, &code, image_base_address );
+        break;
+#ifdef _WIN64
+      case VmDispatchValue::MOV_REGISTER_MEMORY_REG_OFFSET_64_RELOCATED:
+        ExecuteMovRegisterMemoryRegOffset<uint64_t, true>(
+            vm_context, &code, image_base_address );
+        break;
+#endif
 
-      const auto mov_value = *( uintptr_t* )reg_src_value_with_disp;
+      case VmDispatchValue::MOV_REGISTER_MEMORY_IMMEDIATE: {
+        const auto vm_reg_dest = ReadVmRegister( &code );
+        auto value_src_addr = ReadVmValue( &code );
 
-      WriteSizedValueToRegister( vm_context, vm_reg_dest, mov_value );
-    } break;
+        if ( relocated_disp ) {
+          value_src_addr = value_src_addr + image_base_address;
+        }
 
-    case VmOpcodes::MOV_REGISTER_MEMORY_IMMEDIATE: {
-      const auto vm_reg_dest = ReadValue<VmRegister>( &code );
-      auto value_src_addr = ReadValue<uintptr_t>( &code );
+        const auto value = *( uintptr_t* )( value_src_addr );
 
-      if ( relocated_disp ) {
-        value_src_addr = value_src_addr + image_base_address;
-      }
+        WriteSizedValueToRegister( vm_context, vm_reg_dest, value );
+      } break;
 
-      const auto value = *( uintptr_t* )( value_src_addr );
+      case VmDispatchValue::MOV_REGISTER_REGISTER: {
+        const auto vm_reg_dest = ReadVmRegister( &code );
+        const auto vm_reg_src = ReadVmRegister( &code );
 
-      WriteSizedValueToRegister( vm_context, vm_reg_dest, value );
-    } break;
+        const auto value =
+            *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
 
-    case VmOpcodes::MOV_REGISTER_REGISTER: {
-      const auto vm_reg_dest = ReadValue<VmRegister>( &code );
-      const auto vm_reg_src = ReadValue<VmRegister>( &code );
+        WriteSizedValueToRegister( vm_context, vm_reg_dest, value );
+      } break;
 
-      const auto value =
-          *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
+      case VmDispatchValue::MOV_REGISTER_IMMEDIATE: {
+        // Read the next 4 bytes as uint32_t
+        const auto vm_reg_dest = ReadVmRegister( &code );
 
-      WriteSizedValueToRegister( vm_context, vm_reg_dest, value );
-    } break;
+        auto value = ReadVmValue( &code );
 
-    case VmOpcodes::MOV_REGISTER_IMMEDIATE: {
-      // Read the next 4 bytes as uint32_t
-      const auto vm_reg_dest = ReadValue<VmRegister>( &code );
+        if ( relocated_imm ) {
+          value = value + image_base_address;
+        }
 
-      auto value = ReadValue<uintptr_t>( &code );
+        WriteSizedValueToRegister( vm_context, vm_reg_dest, value );
+      } break;
 
-      if ( relocated_imm ) {
-        value = value + image_base_address;
-      }
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_REG_8:
+        ExecuteMovMemoryRegOffsetReg<uint8_t, false>( vm_context, &code,
+                                                      image_base_address );
+        break;
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_REG_16:
+        ExecuteMovMemoryRegOffsetReg<uint16_t, false>( vm_context, &code,
+                                                       image_base_address );
+        break;
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_REG_32:
+        ExecuteMovMemoryRegOffsetReg<uint32_t, false>( vm_context, &code,
+                                                       image_base_address );
+        break;
+#ifdef _WIN64
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_REG_64:
+        ExecuteMovMemoryRegOffsetReg<uint64_t, false>( vm_context, &code,
+                                                       image_base_address );
+        break;
+#endif
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_REG_8_RELOCATED:
+        ExecuteMovMemoryRegOffsetReg<uint8_t, true>( vm_context, &code,
+                                                     image_base_address );
+        break;
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_REG_16_RELOCATED:
+        ExecuteMovMemoryRegOffsetReg<uint16_t, true>( vm_context, &code,
+                                                      image_base_address );
+        break;
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_REG_32_RELOCATED:
+        ExecuteMovMemoryRegOffsetReg<uint32_t, true>( vm_context, &code,
+                                                      image_base_address );
+        break;
+#ifdef _WIN64
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_REG_64_RELOCATED:
+        ExecuteMovMemoryRegOffsetReg<uint64_t, true>( vm_context, &code,
+                                                      image_base_address );
+        break;
+#endif
 
-      WriteSizedValueToRegister( vm_context, vm_reg_dest, value );
-    } break;
+      case VmDispatchValue::MOV_MEMORY_REG_OFFSET_IMM: {
+        // Example 1: mov dword ptr [eax + 0x7d765c], 2
+        // Example 2: mov dword ptr [ebp - 0x20], 0x7d7268
 
-    case VmOpcodes::MOV_MEMORY_REG_OFFSET_REG: {
-      const auto vm_reg_dest = ReadValue<VmRegister>( &code );
-      const auto vm_reg_src = ReadValue<VmRegister>( &code );
+        // mov [reg + 0x0], imm
 
-      auto reg_dest_disp = ReadValue<uintptr_t>( &code );
+        const auto vm_reg_dest = ReadVmRegister( &code );
 
-      if ( relocated_disp ) {
-        reg_dest_disp = reg_dest_disp + image_base_address;
-      }
+        auto source_value = ReadVmValue( &code );
+        auto reg_dest_disp = ReadVmValue( &code );
 
-      // NOTE: Might be issues within this handling due to the different sizes of the read/writes of registers
+        if ( relocated_disp ) {
+          reg_dest_disp = reg_dest_disp + image_base_address;
+        } else if ( relocated_imm ) {
+          source_value = source_value + image_base_address;
+        }
 
-      // Read the src register value
-      const auto reg_src_value =
-          *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
+        // NOTE: Might be issues within this handling due to the different sizes of the read/writes of registers
 
-      const auto reg_dest_value =
-          *GetPointerToRegister( vm_context, vm_reg_dest.register_offset );
+        const auto reg_dest_value =
+            *GetPointerToRegister( vm_context, vm_reg_dest.register_offset );
 
-      auto reg_dest_value_with_disp =
-          ( uintptr_t* )( reg_dest_value + reg_dest_disp );
+        const auto dest_ptr = ( uintptr_t* )( reg_dest_value + reg_dest_disp );
 
-      WriteSizedValue( vm_reg_dest.register_size, reg_dest_value_with_disp,
-                       reg_src_value );
-    } break;
+        WriteSizedValue( vm_reg_dest.register_size, dest_ptr, source_value );
+      } break;
 
-    case VmOpcodes::MOV_MEMORY_REG_OFFSET_IMM: {
-      // Example 1: mov dword ptr [eax + 0x7d765c], 2
-      // Example 2: mov dword ptr [ebp - 0x20], 0x7d7268
+      case VmDispatchValue::LEA_REG_MEMORY_IMMEDIATE_RIP_RELATIVE: {
+        const auto vm_reg_dest = ReadVmRegister( &code );
 
-      // mov [reg + 0x0], imm
+        const auto relative_data_addr = ReadVmValue( &code );
 
-      const auto vm_reg_dest = ReadValue<VmRegister>( &code );
+        const auto absolute_addr_to_data =
+            relative_data_addr + image_base_address;
 
-      auto source_value = ReadValue<uintptr_t>( &code );
-      auto reg_dest_disp = ReadValue<uintptr_t>( &code );
+        WriteSizedValueToRegister( vm_context, vm_reg_dest,
+                                   absolute_addr_to_data );
+      } break;
 
-      if ( relocated_disp ) {
-        reg_dest_disp = reg_dest_disp + image_base_address;
-      } else if ( relocated_imm ) {
-        source_value = source_value + image_base_address;
-      }
+      case VmDispatchValue::CALL_MEMORY_RIP_RELATIVE: {
+        const auto destination_addr = ReadVmValue( &code );
 
-      // NOTE: Might be issues within this handling due to the different sizes of the read/writes of registers
+        const auto absolute_addr_to_call = *reinterpret_cast<uintptr_t*>(
+            destination_addr + image_base_address );
 
-      const auto reg_dest_value =
-          *GetPointerToRegister( vm_context, vm_reg_dest.register_offset );
+        // Push a value that the loader prolog will use
+        PushValueToRealStack( &virtual_pushes, 0 );
 
-      const auto dest_ptr = ( uintptr_t* )( reg_dest_value + reg_dest_disp );
+        PushValueToRealStack( &virtual_pushes, absolute_addr_to_call );
+      } break;
 
-      WriteSizedValue( vm_reg_dest.register_size, dest_ptr, source_value );
-    } break;
+      case VmDispatchValue::CALL_IMPORT: {
+        const auto import_slot_addr = ReadVmValue( &code );
 
-    case VmOpcodes::LEA_REG_MEMORY_IMMEDIATE_RIP_RELATIVE: {
-      const auto vm_reg_dest = ReadValue<VmRegister>( &code );
+        const auto redirect_shellcode = *reinterpret_cast<uint8_t**>(
+            import_slot_addr + image_base_address );
 
-      const auto relative_data_addr = ReadValue<uintptr_t>( &code );
+        // Decrypt the address the same way as the redirect shellcode,
+        // it stays encrypted in its slot
+        const auto encrypted_call_target_addr =
+            *GetImportRedirectTargetSlot( redirect_shellcode );
 
-      const auto absolute_addr_to_data =
-          relative_data_addr + image_base_address;
+        const auto xor_key = GetImportRedirectXorKey( redirect_shellcode );
 
-      WriteSizedValueToRegister( vm_context, vm_reg_dest,
-                                 absolute_addr_to_data );
-    } break;
+        const auto absolute_call_target_addr =
+            encrypted_call_target_addr ^ xor_key;
 
-    case VmOpcodes::CALL_MEMORY_RIP_RELATIVE: {
-      const auto destination_addr = ReadValue<uintptr_t>( &code );
+#if ENABLE_VM_TELEMETRY
+        if ( telemetry ) {
+          InterlockedIncrement64( reinterpret_cast<volatile LONG64*>(
+              &telemetry->import_redirect_hits ) );
+        }
+#endif
 
-      const auto absolute_addr_to_call = *reinterpret_cast<uintptr_t*>(
-          destination_addr + image_base_address );
+        // Push a value that the loader prolog will use
+        PushValueToRealStack( &virtual_pushes, 0 );
 
-      // Push a value that the loader prolog will use
-      PushValueToRealStack( vm_context, 0 );
+        PushValueToRealStack( &virtual_pushes, absolute_call_target_addr );
+      } break;
 
-      PushValueToRealStack( vm_context, absolute_addr_to_call );
-    } break;
+      case VmDispatchValue::CALL_MEMORY: {
+        // push the call address to the stack
 
-    case VmOpcodes::CALL_MEMORY: {
-      // push the call address to the stack
+        // TODO: add size as with all other instructions
 
-      // TODO: add size as with all other instructions
+        auto absolute_call_target_addr_addr = ReadVmValue( &code );
 
-      auto absolute_call_target_addr_addr = ReadValue<uintptr_t>( &code );
+        if ( relocated_disp ) {
+          absolute_call_target_addr_addr =
+              absolute_call_target_addr_addr + image_base_address;
+        }
 
-      if ( relocated_disp ) {
-        absolute_call_target_addr_addr =
-            absolute_call_target_addr_addr + image_base_address;
-      }
+        uintptr_t absolute_call_target_addr =
+            *( uintptr_t* )absolute_call_target_addr_addr;
 
-      uintptr_t absolute_call_target_addr =
-          *( uintptr_t* )absolute_call_target_addr_addr;
+        // Push a value that the loader prolog will use
+        PushValueToRealStack( &virtual_pushes, 0 );
 
-      // Push a value that the loader prolog will use
-      PushValueToRealStack( vm_context, 0 );
+        PushValueToRealStack( &virtual_pushes, absolute_call_target_addr );
 
-      PushValueToRealStack( vm_context, absolute_call_target_addr );
+        // when exiting the vm (before jmp back), push return address
+        // then jmp to
+      } break;
 
-      // when exiting the vm (before jmp back), push return address
-      // then jmp to
-    } break;
+      case VmDispatchValue::CALL_IMMEDIATE: {
+        // push the call address to the stack
 
-    case VmOpcodes::CALL_IMMEDIATE: {
-      // push the call address to the stack
+        auto absolute_call_target_addr = ReadVmValue( &code );
 
-      auto absolute_call_target_addr = ReadValue<uintptr_t>( &code );
+        // add the image base
+        absolute_call_target_addr += image_base_address;
 
-      // add the image base
-      absolute_call_target_addr += image_base_address;
+        // Push a value that the loader prolog will use
+        PushValueToRealStack( &virtual_pushes, 0 );
 
-      // Push a value that the loader prolog will use
-      PushValueToRealStack( vm_context, 0 );
+        PushValueToRealStack( &virtual_pushes, absolute_call_target_addr );
 
-      PushValueToRealStack( vm_context, absolute_call_target_addr );
+        // when exiting the vm (before jmp back), push return address
+        // then jmp to
+      } break;
 
-      // when exiting the vm (before jmp back), push return address
-      // then jmp to
-    } break;
+      case VmDispatchValue::PUSH_IMM: {
+        auto pushed_addr = ReadVmValue( &code );
 
-    case VmOpcodes::PUSH_IMM: {
-      auto pushed_addr = ReadValue<uintptr_t>( &code );
+        if ( relocated_imm ) {
+          pushed_addr = pushed_addr + image_base_address;
+        }
 
-      if ( relocated_imm ) {
-        pushed_addr = pushed_addr + image_base_address;
-      }
+        PushValueToRealStack( &virtual_pushes, pushed_addr );
+      } break;
 
-      PushValueToRealStack( vm_context, pushed_addr );
-    } break;
+      case VmDispatchValue::PUSH_REGISTER_MEMORY_REG_OFFSET: {
+        // TODO: Consider handling different sizes of push, at the moment
+        // I prevent it from handling any other sizes of push
 
-    case VmOpcodes::PUSH_REGISTER_MEMORY_REG_OFFSET: {
-      // TODO: Consider handling different sizes of push, at the moment
-      // I prevent it from handling any other sizes of push
+        const auto vm_reg_src = ReadVmRegister( &code );
+        auto reg_src_disp = ReadVmValue( &code );
 
-      const auto vm_reg_src = ReadValue<VmRegister>( &code );
-      auto reg_src_disp = ReadValue<uintptr_t>( &code );
+        if ( relocated_disp ) {
+          reg_src_disp = reg_src_disp + image_base_address;
+        }
 
-      if ( relocated_disp ) {
-        reg_src_disp = reg_src_disp + image_base_address;
-      }
+        // read the register value
+        const auto reg_src_value =
+            *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
 
-      // read the register value
-      const auto reg_src_value =
-          *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
+        // read the stack value at the register + disp offset
+        const auto value_to_push =
+            *( uintptr_t* )( reg_src_value + reg_src_disp );
 
-      // read the stack value at the register + disp offset
-      const auto value_to_push =
-          *( uintptr_t* )( reg_src_value + reg_src_disp );
+        PushValueToRealStack( &virtual_pushes, value_to_push );
+      } break;
 
-      PushValueToRealStack( vm_context, value_to_push );
-    } break;
+      case VmDispatchValue::JMP_IMM: {
+        // NOTE: I do not think this can be relocated
 
-    case VmOpcodes::JMP_IMM: {
-      // NOTE: I do not think this can be relocated
+        auto absolute_jmp_target_addr = ReadVmValue( &code );
 
-      auto absolute_jmp_target_addr = ReadValue<uintptr_t>( &code );
+        // add the image base
+        absolute_jmp_target_addr += image_base_address;
 
-      // add the image base
-      absolute_jmp_target_addr += image_base_address;
+        PushValueToRealStack( &virtual_pushes, absolute_jmp_target_addr );
 
-      PushValueToRealStack( vm_context, absolute_jmp_target_addr );
+        // when exiting the vm (before jmp back), push return address
+        // then jmp to
+      } break;
 
-      // when exiting the vm (before jmp back), push return address
-      // then jmp to
-    } break;
+      case VmDispatchValue::ALU_REGISTER_IMMEDIATE: {
+        const auto alu_operation = ReadValue<VmAluOperation>( &code );
+        const auto vm_reg_dest = ReadVmRegister( &code );
 
-    default:
-      break;
+        auto source_value = ReadVmValue( &code );
+
+        if ( relocated_imm ) {
+          source_value = source_value + image_base_address;
+        }
+
+        const auto dest_value =
+            *GetPointerToRegister( vm_context, vm_reg_dest.register_offset );
+
+        const auto result =
+            ExecuteAluOperation( vm_context, alu_operation,
+                                 vm_reg_dest.register_size, dest_value,
+                                 source_value );
+
+        if ( DoesAluOperationWriteResult( alu_operation ) ) {
+          WriteSizedValueToRegister( vm_context, vm_reg_dest, result );
+        }
+      } break;
+
+      case VmDispatchValue::ALU_REGISTER_REGISTER: {
+        const auto alu_operation = ReadValue<VmAluOperation>( &code );
+        const auto vm_reg_dest = ReadVmRegister( &code );
+        const auto vm_reg_src = ReadVmRegister( &code );
+
+        const auto dest_value =
+            *GetPointerToRegister( vm_context, vm_reg_dest.register_offset );
+        const auto source_value =
+            *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
+
+        const auto result =
+            ExecuteAluOperation( vm_context, alu_operation,
+                                 vm_reg_dest.register_size, dest_value,
+                                 source_value );
+
+        if ( DoesAluOperationWriteResult( alu_operation ) ) {
+          WriteSizedValueToRegister( vm_context, vm_reg_dest, result );
+        }
+      } break;
+
+      case VmDispatchValue::ALU_REGISTER_MEMORY_REG_OFFSET: {
+        const auto alu_operation = ReadValue<VmAluOperation>( &code );
+        const auto vm_reg_dest = ReadVmRegister( &code );
+        const auto vm_reg_src = ReadVmRegister( &code );
+
+        auto reg_src_disp = ReadVmValue( &code );
+
+        if ( relocated_disp ) {
+          reg_src_disp = reg_src_disp + image_base_address;
+        }
+
+        const auto reg_src_value =
+            *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
+
+        const auto source_value =
+            ReadSizedValue( vm_reg_dest.register_size,
+                            ( uintptr_t* )( reg_src_value + reg_src_disp ) );
+
+        const auto dest_value =
+            *GetPointerToRegister( vm_context, vm_reg_dest.register_offset );
+
+        const auto result =
+            ExecuteAluOperation( vm_context, alu_operation,
+                                 vm_reg_dest.register_size, dest_value,
+                                 source_value );
+
+        if ( DoesAluOperationWriteResult( alu_operation ) ) {
+          WriteSizedValueToRegister( vm_context, vm_reg_dest, result );
+        }
+      } break;
+
+      case VmDispatchValue::ALU_MEMORY_REG_OFFSET_REG: {
+        const auto alu_operation = ReadValue<VmAluOperation>( &code );
+        const auto vm_reg_dest = ReadVmRegister( &code );
+        const auto vm_reg_src = ReadVmRegister( &code );
+
+        auto reg_dest_disp = ReadVmValue( &code );
+
+        if ( relocated_disp ) {
+          reg_dest_disp = reg_dest_disp + image_base_address;
+        }
+
+        const auto reg_dest_value =
+            *GetPointerToRegister( vm_context, vm_reg_dest.register_offset );
+
+        const auto dest_ptr = ( uintptr_t* )( reg_dest_value + reg_dest_disp );
+
+        const auto reg_src_value =
+            *GetPointerToRegister( vm_context, vm_reg_src.register_offset );
+
+        const auto result = ExecuteAluOperation(
+            vm_context, alu_operation, vm_reg_dest.register_size,
+            ReadSizedValue( vm_reg_dest.register_size, dest_ptr ),
+            reg_src_value );
+
+        if ( DoesAluOperationWriteResult( alu_operation ) ) {
+          WriteSizedValue( vm_reg_dest.register_size, dest_ptr, result );
+        }
+      } break;
+
+      case VmDispatchValue::ALU_MEMORY_REG_OFFSET_IMM: {
+        const auto alu_operation = ReadValue<VmAluOperation>( &code );
+        const auto vm_reg_dest = ReadVmRegister( &code );
+
+        auto source_value = ReadVmValue( &code );
+        auto reg_dest_disp = ReadVmValue( &code );
+
+        if ( relocated_disp ) {
+          reg_dest_disp = reg_dest_disp + image_base_address;
+        } else if ( relocated_imm ) {
+          source_value = source_value + image_base_address;
+        }
+
+        const auto reg_dest_value =
+            *GetPointerToRegister( vm_context, vm_reg_dest.register_offset );
+
+        const auto dest_ptr = ( uintptr_t* )( reg_dest_value + reg_dest_disp );
+
+        const auto result = ExecuteAluOperation(
+            vm_context, alu_operation, vm_reg_dest.register_size,
+            ReadSizedValue( vm_reg_dest.register_size, dest_ptr ),
+            source_value );
+
+        if ( DoesAluOperationWriteResult( alu_operation ) ) {
+          WriteSizedValue( vm_reg_dest.register_size, dest_ptr, result );
+        }
+      } break;
+
+      case VmDispatchValue::JCC_IMM: {
+        const auto condition_code = ReadValue<uint8_t>( &code );
+
+        auto absolute_jmp_target_addr = ReadVmValue( &code );
+
+        if ( IsConditionMet( vm_context->registers->pushfd, condition_code ) ) {
+          absolute_jmp_target_addr += image_base_address;
+
+          // Leave the block at the branch target, the loader rets to it
+          PushValueToRealStack( &virtual_pushes, absolute_jmp_target_addr );
+
+          MaterializeVirtualPushes( vm_context, virtual_pushes );
+
+#if ENABLE_VM_TELEMETRY
+          RecordVmExit( telemetry, entry_cycles );
+#endif
+
+          return 0;
+        }
+
+        // Otherwise continue with the next instruction of the block
+      } break;
+
+      default:
+#if ENABLE_DENSE_VM_DISPATCH
+        // The protector only emits valid indices, anything else is corrupted
+        // or tampered bytecode. The jump table stays, it only costs the
+        // range check in front of it.
+        __fastfail( FAST_FAIL_FATAL_APP_EXIT );
+#else
+        break;
+#endif
+    }
   }
 
-  // TODO: When returning, push all the values on the vm_stack to the real stack
+  MaterializeVirtualPushes( vm_context, virtual_pushes );
+
+#if ENABLE_VM_TELEMETRY
+  RecordVmExit( telemetry, entry_cycles );
+#endif
 
   // Return 0 indicating that we should exit the handler and everything is good.
   return 0;
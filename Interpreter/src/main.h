@@ -2,14 +2,297 @@
 #include <cstdint>
 
 #define VM_LOADER_SECTION_NAME ( ".dick" )
+
+// The VmCodeSectionData and the rest of the state the interpreter writes at
+// runtime, nothing in it is executed
 #define VM_CODE_SECTION_NAME ".dick2"
 
+// The virtualized code on its own read only section, the pages of it are
+// shared between the processes that load the protected image
+#define VM_BYTECODE_SECTION_NAME ".dickb"
+
+// Holds the VmProfileSite counters of an instrumented build
+#define VM_PROFILE_SECTION_NAME ".dickp"
+
+// The exception directory of an x64 image with the unwind data of the vm
+// loader section, it replaces the original one
+#define VM_UNWIND_SECTION_NAME ".dicku"
+
 #define VM_FUNCTIONS_SECTION_NAME "vmfun"
 #define VM_INTERPRETER_STACK_ALLOCATION_SIZE_BYTES 200
 
 #define ENABLE_TLS_CALLBACKS TRUE
 #define ENABLE_FILE_INTEGRITY_CHECKS TRUE
 
+// The file integrity check runs on its own thread instead of delaying the
+// entrypoint, the process is terminated if it fails
+#define ENABLE_BACKGROUND_FILE_INTEGRITY_CHECKS TRUE
+
+// The anti debug checks run as one batch on a thread that is hidden from the
+// debugger instead of inline in the TLS callbacks, the process is terminated
+// once one of them finds a debugger. The module is pinned because the thread
+// never exits. The protector picks the interval.
+#define ENABLE_ANTI_DEBUG_WATCHDOG TRUE
+
+// Also treats the heap checking NtGlobalFlag of a process started by a
+// debugger as one. Off by default, gflags sets the same flags system wide.
+#define ENABLE_ANTI_DEBUG_NT_GLOBAL_FLAG_CHECK FALSE
+
+// The maximum amount of non writable sections that the protector stores a
+// digest of for the file integrity check
+#define VM_MAX_INTEGRITY_SECTIONS 16
+
+// Packs consecutive virtualizable instructions of a basic block into one
+// bytecode sequence that is executed with a single VM entry and exit
+#define ENABLE_BLOCK_VIRTUALIZATION TRUE
+
+// The loaders only save the registers that the virtualized code uses and the
+// ones the interpreter call clobbers instead of every register
+#define ENABLE_PARTIAL_REGISTER_FRAME TRUE
+
+// The loaders only reserve the stack that the pushes of the virtualized code
+// and the interpreter call need instead of a fixed allocation, so that deep
+// recursion and the small stacks of fibers and coroutines survive it
+#define ENABLE_COMPACT_VM_FRAME TRUE
+
+// The stack below the interpreter call arguments, on x64 it is the home space
+// of the four register arguments
+#if ENABLE_COMPACT_VM_FRAME
+#ifdef _WIN64
+#define VM_INTERPRETER_CALL_STACK_SIZE_BYTES 0x20
+#else
+#define VM_INTERPRETER_CALL_STACK_SIZE_BYTES 0
+#endif
+#else
+#define VM_INTERPRETER_CALL_STACK_SIZE_BYTES 0x100
+#endif
+
+// Every virtualized site only gets a small thunk in the loader section that
+// calls one of a few shared vm entry trampolines, one for each register usage,
+// instead of its own copy of the whole loader
+#define ENABLE_SHARED_VM_ENTRY TRUE
+
+// The x64 trampolines, thunks and the interpreter get RUNTIME_FUNCTION
+// entries so that profilers and exceptions can walk the stack through a vm
+// entry. A site stands in for the function it was virtualized from.
+#define ENABLE_VM_UNWIND_DATA TRUE
+
+// The virtualized code and the loaders are emitted function by function
+// instead of in the order the disassembler found them, the hottest functions
+// of a profile first, so a function only touches a few pages of each section
+#define ENABLE_VM_FUNCTION_LAYOUT TRUE
+
+// The protector emits a dense VmHandlerIndex instead of the sparse VmOpcodes
+// value so the interpreter switch is compiled into a jump table
+#define ENABLE_DENSE_VM_DISPATCH TRUE
+
+// The virtualized code uses a one byte opcode with the relocation flags
+// folded in, one byte registers and variable length values instead of the
+// full width ones, see ReadVmRegister and ReadVmValue in the interpreter
+#define ENABLE_COMPACT_BYTECODE TRUE
+
+#if ENABLE_COMPACT_BYTECODE && !ENABLE_DENSE_VM_DISPATCH
+#error "The compact opcode only has room for a VmHandlerIndex"
+#endif
+
+#if ENABLE_COMPACT_BYTECODE
+#define VM_OPCODE_SIZE 1
+#else
+#define VM_OPCODE_SIZE 4
+#endif
+
+// The compact opcode byte, the VmHandlerIndex is in the low bits
+#define VM_COMPACT_OPCODE_HANDLER_MASK 0x3F
+#define VM_COMPACT_OPCODE_RELOCATED_DISP 0x40
+#define VM_COMPACT_OPCODE_RELOCATED_IMM 0x80
+
+// The compact register byte, the VmRegisters slot index in the low bits and
+// the log2 of the register size in the high bits
+#define VM_PACKED_REGISTER_SLOT_MASK 0x1F
+#define VM_PACKED_REGISTER_SIZE_SHIFT 5
+
+// Opt-in, the interpreter counts the executed handlers, sites, import calls
+// and the cycles spent in the vm in a named shared memory section
+// Local\GreyMVmTelemetry<process id in hex> that is described by VmTelemetry
+#define ENABLE_VM_TELEMETRY FALSE
+
+#if ENABLE_VM_TELEMETRY && !ENABLE_DENSE_VM_DISPATCH
+#error "The telemetry counts the handlers by their VmHandlerIndex"
+#endif
+
+// The redirected imports are resolved by the first call to them instead of
+// in the first TLS callback, modules are loaded on first use as well
+#define ENABLE_LAZY_IMPORTS TRUE
+
+// The distance between the import redirect shellcodes, the table of them is
+// cache line aligned so none of them crosses a cache line
+#define VM_IMPORT_REDIRECT_SHELLCODE_STRIDE 32
+#define VM_IMPORT_REDIRECT_TABLE_ALIGNMENT 64
+
+// Where FixImports writes the import index and the resolver in the
+// lazy_import_entry_shellcode
+#define VM_LAZY_IMPORT_ENTRY_INDEX_OFFSET 1
+#define VM_LAZY_IMPORT_ENTRY_RESOLVER_OFFSET 6
+
+// Where FixImports writes the LazyImportContext and the LazyResolveImport
+// address in the lazy_import_resolver_shellcode
+#ifdef _WIN64
+#define VM_LAZY_IMPORT_RESOLVER_CONTEXT_OFFSET 44
+#define VM_LAZY_IMPORT_RESOLVER_FUNCTION_OFFSET 54
+#else
+#define VM_LAZY_IMPORT_RESOLVER_CONTEXT_OFFSET 7
+#define VM_LAZY_IMPORT_RESOLVER_FUNCTION_OFFSET 12
+#endif
+
+// The room for the encrypted ApiAddresses that the first resolution caches
+// in VmCodeSectionData for the later callbacks, in pointers
+#define VM_API_CACHE_SIZE 24
+
+// Opt-in, the interpreter timestamps each startup stage relative to the
+// process creation and writes a VmStartupBenchmark to <module>.vmstartup
+// before calling the real entrypoint
+#define ENABLE_STARTUP_BENCHMARK FALSE
+
+// Opt-in, every site of the text section counts its executions like in an
+// instrumented build and a thread of the interpreter writes the original
+// instruction back over the jump of the sites that cross the threshold of
+// the protector. They're protected again on a timer and when a debugger is
+// found. The thread runs until the process exits, don't use it for a dll
+// that gets unloaded.
+#define ENABLE_ADAPTIVE_DEVIRTUALIZATION FALSE
+
+// How often the thread looks at the counters and how long a devirtualized
+// site is left alone before it's protected again
+#define VM_ADAPTIVE_SCAN_INTERVAL_MS 250
+#define VM_ADAPTIVE_REPROTECT_INTERVAL_MS 30000
+
+// Room for the longest instruction in the stored code of a site
+#define VM_MAX_INSTRUCTION_SIZE 16
+
+// Where the import redirect shellcode has the reference to the slot of its
+// encrypted import address and its xor key, a rip relative displacement on
+// x64 and an absolute address on x86. FixImports writes the slot and the
+// CALL_IMPORT handler reads both.
+#ifdef _WIN64
+#define VM_IMPORT_REDIRECT_TARGET_SLOT_OFFSET 6
+#define VM_IMPORT_REDIRECT_XOR_KEY_OFFSET 12
+#else
+#define VM_IMPORT_REDIRECT_TARGET_SLOT_OFFSET 4
+#define VM_IMPORT_REDIRECT_XOR_KEY_OFFSET 9
+#endif
+
+enum class VmStartupStage : uint32_t {
+  // Recorded once the apis are resolved in the first TLS callback
+  FIRST_TLS_CALLBACK,
+  IMPORTS_FIXED,
+
+  // Recorded by the second TLS callback
+  TLS_CALLBACKS_DONE,
+  BEFORE_ENTRYPOINT,
+  INTEGRITY_CHECKED,
+  REAL_ENTRYPOINT,
+  COUNT
+};
+
+// The stage times are in 100 nanoseconds since the process was created
+struct VmStartupBenchmark {
+  uint32_t stage_count;
+  uint32_t reserved;
+  uint64_t stage_times[ static_cast<uint32_t>( VmStartupStage::COUNT ) ];
+
+  // The rdtsc cycles spent resolving the apis the first time and the last
+  // time they were read from the cache
+  uint64_t api_resolution_cycles;
+  uint64_t api_cache_cycles;
+};
+
+// The digest of the raw data of a section in the protected file
+struct VmSectionDigest {
+  uint32_t file_offset;
+  uint32_t size;
+  uint32_t digest_low;
+  uint32_t digest_high;
+};
+
+// The hash used for the file integrity check, shared by the protector and the
+// interpreter. The 8 independent lanes can be vectorized and it only uses 32 bit
+// arithmetic to avoid CRT helpers on x86. It is forceinlined to end up in the
+// vmfun section of the callers in the interpreter.
+#define VM_HASH_PRIME1 0x9E3779B1u
+#define VM_HASH_PRIME2 0x85EBCA77u
+#define VM_HASH_PRIME3 0xC2B2AE3Du
+#define VM_HASH_PRIME5 0x165667B1u
+
+__forceinline uint32_t VmHashRotateLeft( const uint32_t value,
+                                         const uint32_t count ) {
+  return ( value << count ) | ( value >> ( 32 - count ) );
+}
+
+__forceinline uint32_t VmHashRound( uint32_t lane, const uint32_t value ) {
+  lane += value * VM_HASH_PRIME2;
+  lane = VmHashRotateLeft( lane, 13 );
+  return lane * VM_HASH_PRIME1;
+}
+
+__forceinline uint32_t VmHashAvalanche( uint32_t hash ) {
+  hash ^= hash >> 15;
+  hash *= VM_HASH_PRIME2;
+  hash ^= hash >> 13;
+  hash *= VM_HASH_PRIME3;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+__forceinline void VmHashData( const uint8_t* data,
+                               const uint32_t size,
+                               uint32_t* digest_low,
+                               uint32_t* digest_high ) {
+  uint32_t lane0 = VM_HASH_PRIME1 + VM_HASH_PRIME2;
+  uint32_t lane1 = VM_HASH_PRIME2;
+  uint32_t lane2 = 0;
+  uint32_t lane3 = 0 - VM_HASH_PRIME1;
+  uint32_t lane4 = VM_HASH_PRIME3 + VM_HASH_PRIME2;
+  uint32_t lane5 = VM_HASH_PRIME3;
+  uint32_t lane6 = VM_HASH_PRIME5;
+  uint32_t lane7 = 0 - VM_HASH_PRIME3;
+
+  const auto words = reinterpret_cast<const uint32_t*>( data );
+
+  const uint32_t block_count = size / 32;
+
+  for ( uint32_t i = 0; i < block_count; ++i ) {
+    const auto block = words + i * 8;
+
+    lane0 = VmHashRound( lane0, block[ 0 ] );
+    lane1 = VmHashRound( lane1, block[ 1 ] );
+    lane2 = VmHashRound( lane2, block[ 2 ] );
+    lane3 = VmHashRound( lane3, block[ 3 ] );
+    lane4 = VmHashRound( lane4, block[ 4 ] );
+    lane5 = VmHashRound( lane5, block[ 5 ] );
+    lane6 = VmHashRound( lane6, block[ 6 ] );
+    lane7 = VmHashRound( lane7, block[ 7 ] );
+  }
+
+  // The bytes that do not fill a whole block
+  for ( uint32_t i = block_count * 32; i < size; ++i ) {
+    lane0 = VmHashRotateLeft( lane0 ^ ( data[ i ] * VM_HASH_PRIME5 ), 11 ) *
+            VM_HASH_PRIME1;
+  }
+
+  const auto low = VmHashRotateLeft( lane0, 1 ) + VmHashRotateLeft( lane1, 7 ) +
+                   VmHashRotateLeft( lane2, 12 ) + VmHashRotateLeft( lane3, 18 );
+
+  const auto high = VmHashRotateLeft( lane4, 1 ) +
+                    VmHashRotateLeft( lane5, 7 ) +
+                    VmHashRotateLeft( lane6, 12 ) +
+                    VmHashRotateLeft( lane7, 18 );
+
+  *digest_low = VmHashAvalanche( low ^ size );
+  *digest_high = VmHashAvalanche( high ^ size ^ *digest_low );
+}
+
+struct VmTelemetry;
+
 // The data at the beginning of the vm code section
 struct VmCodeSectionData {
   // A bunch of zeroed data for the import data directory to point to
@@ -30,86 +313,168 @@ struct VmCodeSectionData {
   uint32_t import_count;
   bool redirect_imports;
 
+  // The import redirect shellcodes that the protector emitted, one each
+  // VM_IMPORT_REDIRECT_SHELLCODE_STRIDE bytes in the order of the imports
+  uint32_t import_redirect_rva = 0;
+
+  // Only set in an instrumented build, the counters are written to
+  // a .vmprofile file next to the module when the process exits
+  uint32_t profile_section_rva = 0;
+  uint32_t profile_site_count = 0;
+
+  // The counters are used by the adaptive devirtualization as well, the
+  // profile is only written when the build was asked to be instrumented
+  bool write_virtualization_profile = false;
+
+  // Only set in an adaptive devirtualization build, a VmAdaptiveSite for each
+  // site that can be written back, see ENABLE_ADAPTIVE_DEVIRTUALIZATION
+  uint32_t adaptive_site_rva = 0;
+  uint32_t adaptive_site_count = 0;
+  uint64_t adaptive_site_threshold = 0;
+
+  // Only used by ENABLE_ANTI_DEBUG_WATCHDOG, it sleeps the interval and up to
+  // the jitter more between two batches of checks
+  uint32_t anti_debug_poll_interval_ms = 500;
+  uint32_t anti_debug_poll_jitter_ms = 250;
+
+  // Only used in a telemetry build, the interpreter finds this struct through
+  // the e_res2 field of the dos header which holds the rva of it
+  uint32_t telemetry_site_count = 0;
+  VmTelemetry* telemetry = nullptr;
+
+  // The ApiAddresses xored with api_cache_key, resolved once by the first
+  // TLS callback, the key is 0 until the cache is written
+  uintptr_t api_cache_key = 0;
+  uintptr_t api_cache[ VM_API_CACHE_SIZE ] = {};
+
+  // Only written in a startup benchmark build
+  VmStartupBenchmark startup_benchmark = {};
+
+  // The non writable sections of the protected file, written by the protector
+  // once the file is finished
+  uint32_t integrity_section_count = 0;
+  VmSectionDigest integrity_sections[ VM_MAX_INTEGRITY_SECTIONS ];
+
+  // The initial target of every lazy redirect shellcode, tells the resolver
+  // which import it is
+  uint8_t lazy_import_entry_shellcode[ 10 ] = {
+    // push import index
+    0x68, 0x00, 0x00, 0x00, 0x00,
+
+    // jmp lazy_import_resolver_shellcode
+    0xE9, 0x00, 0x00, 0x00, 0x00
+  };
+
 #ifdef _WIN64
-  uint8_t import_redirect_shellcode[ 27 ] = {
-    // push rax
-    0x50,
+  // Saves the argument registers, resolves the import and replaces the
+  // pushed import index with the import address to return into it
+  uint8_t lazy_import_resolver_shellcode[ 103 ] = {
+    // push rcx
+    0x51,
+
+    // push rdx
+    0x52,
+
+    // push r8
+    0x41, 0x50,
+
+    // push r9
+    0x41, 0x51,
+
+    // sub rsp, 0x60 (shadow space and xmm0 to xmm3)
+    0x48, 0x83, 0xEC, 0x60,
+
+    // movdqu [rsp + 0x20], xmm0
+    0xF3, 0x0F, 0x7F, 0x44, 0x24, 0x20,
+
+    // movdqu [rsp + 0x30], xmm1
+    0xF3, 0x0F, 0x7F, 0x4C, 0x24, 0x30,
 
-    // pushfq
-    0x9C,
+    // movdqu [rsp + 0x40], xmm2
+    0xF3, 0x0F, 0x7F, 0x54, 0x24, 0x40,
 
-    // push rax
-    0x50,
+    // movdqu [rsp + 0x50], xmm3
+    0xF3, 0x0F, 0x7F, 0x5C, 0x24, 0x50,
 
-    // movabs rax, 64 bit value
+    // mov rdx, [rsp + 0x80] (the import index)
+    0x48, 0x8B, 0x94, 0x24, 0x80, 0x00, 0x00, 0x00,
+
+    // movabs rcx, LazyImportContext
+    0x48, 0xB9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+    // movabs rax, LazyResolveImport
     0x48, 0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 
-    // xor rax, 0
-    0x48, 0x35, 0x00, 0x00, 0x00, 0x00,
+    // call rax
+    0xFF, 0xD0,
+
+    // movdqu xmm0, [rsp + 0x20]
+    0xF3, 0x0F, 0x6F, 0x44, 0x24, 0x20,
+
+    // movdqu xmm1, [rsp + 0x30]
+    0xF3, 0x0F, 0x6F, 0x4C, 0x24, 0x30,
+
+    // movdqu xmm2, [rsp + 0x40]
+    0xF3, 0x0F, 0x6F, 0x54, 0x24, 0x40,
+
+    // movdqu xmm3, [rsp + 0x50]
+    0xF3, 0x0F, 0x6F, 0x5C, 0x24, 0x50,
+
+    // add rsp, 0x60
+    0x48, 0x83, 0xC4, 0x60,
+
+    // pop r9
+    0x41, 0x59,
 
-    // mov [rsp + 0x10], rax
-    0x48, 0x89, 0x44, 0x24, 0x10,
+    // pop r8
+    0x41, 0x58,
 
-    // pop rax
-    0x58,
+    // pop rdx
+    0x5A,
+
+    // pop rcx
+    0x59,
+
+    // mov [rsp], rax
+    0x48, 0x89, 0x04, 0x24,
 
-    // popfq
-    0x9D,
     // ret
     0xC3
   };
 #else
-  /*
-    // Allocate space for call destination
-	  // Why push eax? Because we cannot use sub because it changes eflags before we saved them
-	  push eax
-
-	  // Save eflags because we change them due to usage of xor
-	  pushfd
-
-	  // Save eax to use it
-	  push eax
-	
-	  mov eax, 0x1337 (encrypted addr)
-	
-	  xor eax, 0xDEAD (xor with key)
-	
-	  // Set the allocated stack to the call destination
-	  mov [esp + (8 or 16)], eax
-	
-	  // Restore the saved eax
-	  pop eax
-	
-	  // Restore the saved eflags
-	  popfd
-	
-	  // Jump to call destination
-	  ret
-  */
-  uint8_t import_redirect_shellcode[ 20 ] = {
-    // push eax
-    0x50,
-
-    // pushfd
-    0x9C,
-
-    // push eax
-    0x50,
-
-    // mov eax, 0x1337
-    0xB8, 0x37, 0x13, 0x00, 0x00,
-
-    // xor eax, 0
-    0x35, 0x00, 0x00, 0x00, 0x00,
-
-    // mov [esp + 8], eax
-    0x89, 0x44, 0x24, 0x08,
-
-    // pop eax
-    0x58,
-
-    // popfd
-    0x9D,
+  // Saves ecx and edx for thiscall and fastcall imports, resolves the import
+  // and replaces the pushed import index with the import address
+  uint8_t lazy_import_resolver_shellcode[ 27 ] = {
+    // push ecx
+    0x51,
+
+    // push edx
+    0x52,
+
+    // push dword ptr [esp + 8] (the import index)
+    0xFF, 0x74, 0x24, 0x08,
+
+    // push LazyImportContext
+    0x68, 0x00, 0x00, 0x00, 0x00,
+
+    // mov eax, LazyResolveImport
+    0xB8, 0x00, 0x00, 0x00, 0x00,
+
+    // call eax
+    0xFF, 0xD0,
+
+    // add esp, 8
+    0x83, 0xC4, 0x08,
+
+    // pop edx
+    0x5A,
+
+    // pop ecx
+    0x59,
+
+    // mov [esp], eax
+    0x89, 0x04, 0x24,
+
     // ret
     0xC3
   };
@@ -141,6 +506,10 @@ enum class VmOpcodes : uint32_t {
   // call qword ptr [rip + 0x25bec] (default on x64 call for a winapi call)
   CALL_MEMORY_RIP_RELATIVE = 0xCBBB223A,
 
+  // call qword ptr [rip + 0x25bec] where the slot is a redirected import,
+  // decodes the redirect shellcode instead of calling it
+  CALL_IMPORT = 0x7C1E93D2,
+
   // lea r8, ds:[0x00007FF757401AE8]
   LEA_REG_MEMORY_IMMEDIATE_RIP_RELATIVE = 0xAD5F1BB1,
 
@@ -150,9 +519,187 @@ enum class VmOpcodes : uint32_t {
   // jmp imm
   JMP_IMM = 0xCA38B49B,
 
+  // The flag writing arithmetic, the VmAluOperation selects which one
+  // add eax, 0x1000
+  ALU_REGISTER_IMMEDIATE = 0x8E21C4D6,
+
+  // test eax, eax
+  ALU_REGISTER_REGISTER = 0x4F92D0A7,
+
+  // cmp ecx, dword ptr [ebp - 0x100]
+  ALU_REGISTER_MEMORY_REG_OFFSET = 0x2D7A90F3,
+
+  // sub dword ptr [ebx + 0x84], eax
+  ALU_MEMORY_REG_OFFSET_REG = 0xD405E1B8,
+
+  // cmp dword ptr [ebp - 0x100], 0
+  ALU_MEMORY_REG_OFFSET_IMM = 0x63B8F04E,
+
+  // je imm, evaluates the saved eflags
+  JCC_IMM = 0x9A4C2E75,
+
+  // The handlers that MOV_REGISTER_MEMORY_REG_OFFSET and
+  // MOV_MEMORY_REG_OFFSET_REG are emitted as, one for each operand size and
+  // whether the displacement is relocated, see GetSizedVmOpcode. There is
+  // no 64 bit mov on x86, those only exist on x64.
+  MOV_REGISTER_MEMORY_REG_OFFSET_8 = 0x3E6A0C91,
+  MOV_REGISTER_MEMORY_REG_OFFSET_16 = 0xA1D4F27B,
+  MOV_REGISTER_MEMORY_REG_OFFSET_32 = 0x5C83B6E4,
+#ifdef _WIN64
+  MOV_REGISTER_MEMORY_REG_OFFSET_64 = 0xE7092A5D,
+#endif
+  MOV_REGISTER_MEMORY_REG_OFFSET_8_RELOCATED = 0x94B1E3C6,
+  MOV_REGISTER_MEMORY_REG_OFFSET_16_RELOCATED = 0x2F5D7A18,
+  MOV_REGISTER_MEMORY_REG_OFFSET_32_RELOCATED = 0xC8E64B02,
+#ifdef _WIN64
+  MOV_REGISTER_MEMORY_REG_OFFSET_64_RELOCATED = 0x6B1F9D37,
+#endif
+  MOV_MEMORY_REG_OFFSET_REG_8 = 0x1DA7C54E,
+  MOV_MEMORY_REG_OFFSET_REG_16 = 0xB63E0F89,
+  MOV_MEMORY_REG_OFFSET_REG_32 = 0x7209D1B3,
+#ifdef _WIN64
+  MOV_MEMORY_REG_OFFSET_REG_64 = 0xF4C8662A,
+#endif
+  MOV_MEMORY_REG_OFFSET_REG_8_RELOCATED = 0x0E5B93F7,
+  MOV_MEMORY_REG_OFFSET_REG_16_RELOCATED = 0x89F2471C,
+  MOV_MEMORY_REG_OFFSET_REG_32_RELOCATED = 0x43A6E8D5,
+#ifdef _WIN64
+  MOV_MEMORY_REG_OFFSET_REG_64_RELOCATED = 0xDA1C3B60,
+#endif
+
+  // Terminates a sequence of virtualized instructions, returns to the loader
+  VM_EXIT = 0x5E1D07C3,
+
   NO_OPCODE = 0x0
 };
 
+// The same handlers as VmOpcodes, numbered without gaps. Keep the names
+// identical to VmOpcodes because the interpreter uses either one of them.
+// MOV_REGISTER_MEMORY_REG_OFFSET and MOV_MEMORY_REG_OFFSET_REG only have
+// their sized handlers.
+enum class VmHandlerIndex : uint32_t {
+  MOV_REGISTER_IMMEDIATE,
+  MOV_REGISTER_REGISTER,
+  MOV_REGISTER_MEMORY_IMMEDIATE,
+  MOV_MEMORY_REG_OFFSET_IMM,
+  CALL_IMMEDIATE,
+  CALL_MEMORY,
+  CALL_MEMORY_RIP_RELATIVE,
+  CALL_IMPORT,
+  LEA_REG_MEMORY_IMMEDIATE_RIP_RELATIVE,
+  PUSH_IMM,
+  PUSH_REGISTER_MEMORY_REG_OFFSET,
+  JMP_IMM,
+  ALU_REGISTER_IMMEDIATE,
+  ALU_REGISTER_REGISTER,
+  ALU_REGISTER_MEMORY_REG_OFFSET,
+  ALU_MEMORY_REG_OFFSET_REG,
+  ALU_MEMORY_REG_OFFSET_IMM,
+  JCC_IMM,
+  MOV_REGISTER_MEMORY_REG_OFFSET_8,
+  MOV_REGISTER_MEMORY_REG_OFFSET_16,
+  MOV_REGISTER_MEMORY_REG_OFFSET_32,
+#ifdef _WIN64
+  MOV_REGISTER_MEMORY_REG_OFFSET_64,
+#endif
+  MOV_REGISTER_MEMORY_REG_OFFSET_8_RELOCATED,
+  MOV_REGISTER_MEMORY_REG_OFFSET_16_RELOCATED,
+  MOV_REGISTER_MEMORY_REG_OFFSET_32_RELOCATED,
+#ifdef _WIN64
+  MOV_REGISTER_MEMORY_REG_OFFSET_64_RELOCATED,
+#endif
+  MOV_MEMORY_REG_OFFSET_REG_8,
+  MOV_MEMORY_REG_OFFSET_REG_16,
+  MOV_MEMORY_REG_OFFSET_REG_32,
+#ifdef _WIN64
+  MOV_MEMORY_REG_OFFSET_REG_64,
+#endif
+  MOV_MEMORY_REG_OFFSET_REG_8_RELOCATED,
+  MOV_MEMORY_REG_OFFSET_REG_16_RELOCATED,
+  MOV_MEMORY_REG_OFFSET_REG_32_RELOCATED,
+#ifdef _WIN64
+  MOV_MEMORY_REG_OFFSET_REG_64_RELOCATED,
+#endif
+  VM_EXIT,
+};
+
+// The operation of an ALU_* handler. All of them update the saved eflags,
+// CMP and TEST do not write the result back.
+enum class VmAluOperation : uint8_t { ADD, SUB, AND, OR, XOR, CMP, TEST };
+
+// The eflags that the ALU_* handlers update and the JCC_IMM handler reads
+#define VM_EFLAGS_CF 0x0001
+#define VM_EFLAGS_PF 0x0004
+#define VM_EFLAGS_AF 0x0010
+#define VM_EFLAGS_ZF 0x0040
+#define VM_EFLAGS_SF 0x0080
+#define VM_EFLAGS_OF 0x0800
+
+// The value that is encrypted in the virtualized code to select a handler
+#if ENABLE_DENSE_VM_DISPATCH
+using VmDispatchValue = VmHandlerIndex;
+#else
+using VmDispatchValue = VmOpcodes;
+#endif
+
+#define VM_HANDLER_COUNT ( static_cast<uint32_t>( VmHandlerIndex::VM_EXIT ) + 1 )
+
+#if ENABLE_COMPACT_BYTECODE
+static_assert( VM_HANDLER_COUNT <= VM_COMPACT_OPCODE_HANDLER_MASK + 1,
+               "The handler index does not fit in the compact opcode" );
+#endif
+
+// The layout of the telemetry shared memory. Every virtualized instruction has
+// a site index in its virtualized code, the protector writes the site table
+// that maps them back to the original rva and mnemonic. Site 0 is reserved for
+// the instructions that the protector adds itself.
+struct VmTelemetry {
+  uint32_t site_count;
+  uint32_t handler_count;
+
+  uint64_t vm_entries;
+
+  // Measured with rdtsc from the interpreter entry until its exit
+  uint64_t vm_cycles;
+
+  // The calls that went through CALL_IMPORT to a redirected import
+  uint64_t import_redirect_hits;
+
+  uint64_t handler_executions[ VM_HANDLER_COUNT ];
+
+  // Followed by site_count counters
+  uint64_t site_executions[ 1 ];
+};
+
+// An execution counter for one virtualized instruction, an instrumented
+// build dumps an array of these as the virtualization profile
+struct VmProfileSite {
+  // The rva of the virtualized instruction in the original PE, 0 is reserved
+  uint32_t rva;
+  uint32_t reserved;
+
+  uint64_t execution_count;
+};
+
+// A site of an adaptive devirtualization build that the interpreter may write
+// the original instruction back to, lives in the virtualized code section
+struct VmAdaptiveSite {
+  uint32_t rva;
+  uint32_t profile_site_index;
+
+  // The original instruction xored with the key, the relocated ones are
+  // never written back because their relocations were removed
+  uint64_t code_key;
+  uint8_t code[ VM_MAX_INSTRUCTION_SIZE ];
+  uint8_t size;
+
+  // Written by the interpreter, the jump and the random bytes that were there
+  // before the site was devirtualized and the counter at that time
+  bool devirtualized;
+  uint8_t protected_code[ VM_MAX_INSTRUCTION_SIZE ];
+  uintptr_t execution_count_baseline;
+};
+
 struct VmRegister {
   uint32_t register_offset;
   uint32_t register_size;
@@ -160,7 +707,16 @@ struct VmRegister {
 
 using XMM = uint64_t[ 2 ];
 
+// The loader always allocates the whole struct, but with a partial register
+// frame only the slots of the registers that the virtualized code uses are
+// initialized. The rest contains garbage and must never be read.
 struct VmRegisters {
+#if ENABLE_SHARED_VM_ENTRY && _WIN64
+  // Keeps the stack 16 byte aligned for the interpreter call with the
+  // return_address slot at the top of the frame
+  uintptr_t alignment_padding;
+#endif
+
 #if _WIN64
   uintptr_t r15;
   uintptr_t r14;
@@ -189,7 +745,26 @@ struct VmRegisters {
   uintptr_t ebx;
   uintptr_t eax;
 
+  // Restored by the loader, the ALU_* handlers update the flags in here
   uintptr_t pushfd;
+
+#if ENABLE_SHARED_VM_ENTRY
+  // Pushed by the call in the vm entry thunk, it is part of the frame so the
+  // interpreter moves it together with the registers when pushing to the real
+  // stack and the trampoline can return to the thunk epilog afterwards
+  uintptr_t return_address;
+#endif
+};
+
+// Room for 4 pushes per vm exit. Only the last handler of a block pushes,
+// at most the 2 of a call, the rest is headroom. The static_assert below and
+// GetFullVmRegisterUsage size the stack for all 4.
+#define VM_MAX_VIRTUAL_PUSHES 4
+
+// The pushes of the handlers that are written to the real stack on vm exit
+struct VmVirtualPushes {
+  uintptr_t values[ VM_MAX_VIRTUAL_PUSHES ];
+  uint32_t count;
 };
 
 struct VmContext {
@@ -202,6 +777,19 @@ struct VmContext {
   VmRegisters* registers;
 };
 
+#if ENABLE_COMPACT_BYTECODE
+static_assert( offsetof( VmRegisters, eax ) / sizeof( uintptr_t ) <=
+                   VM_PACKED_REGISTER_SLOT_MASK,
+               "A VmRegisters slot does not fit in the packed register" );
+#endif
+
+// The registers are moved down into the stack allocation by the pushes, a
+// compact frame sizes it for the pushes of the virtualized code instead
+static_assert( sizeof( VmContext ) +
+                       VM_MAX_VIRTUAL_PUSHES * sizeof( uintptr_t ) <=
+                   VM_INTERPRETER_STACK_ALLOCATION_SIZE_BYTES,
+               "The vm stack allocation is too small for the pushes" );
+
 typedef struct _UNICODE_STRING {
   WORD Length;
   WORD MaximumLength;
@@ -18,6 +18,17 @@ NOINLINE int SumValues( int val1, int val2 ) {
   return val1 + val2;
 }
 
+#ifdef _WIN64
+volatile uint64_t g_dirty_upper_half = 0xDEADBEEF00001337;
+
+// The add eax is done on a register with a dirty upper half, writing the
+// 32 bit result has to zero extend it
+NOINLINE uint64_t AddToLowerHalf() {
+  const uint64_t value = g_dirty_upper_half;
+  return static_cast<uint32_t>( value ) + 0x10000000u;
+}
+#endif
+
 NOINLINE void main3() {
   while ( true ) {
     // EnterCriticalSection(&crit_section);
@@ -303,6 +314,17 @@ int main() {
     return -1;
   }
 
+#ifdef _WIN64
+  if ( AddToLowerHalf() != 0x10001337 ) {
+    MessageBox( 0,
+                TEXT( "A 32 bit register write did not zero extend the "
+                      "upper half" ),
+                TEXT( "ds" ), 0 );
+
+    return -1;
+  }
+#endif
+
   for ( auto lol : test_static_tls_data_temp_var ) {
     std::cout << lol << std::endl;
   }